@@ -5,403 +5,5872 @@
 #include "cpptempl.h"
 
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#if defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#define CPPTEMPL_TO_CHARS
+#endif
+#endif
+#endif
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPPTEMPL_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 namespace cpptempl
 {
 	//////////////////////////////////////////////////////////////////////////
-	// Data classes
+	// Engine statistics
+	// Each thread bumps its own counter block; stats() sums the blocks.
+	// The owning thread is the only writer, so increments are plain
+	// relaxed load/store pairs rather than locked read-modify-writes.
 	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		typedef enum
+		{
+			STAT_RENDERS,
+			STAT_COMPILES,
+			STAT_MISSING_KEYS,
+			STAT_BYTES_WRITTEN,
+			STAT_ALLOCATIONS,
+			STAT_CACHE_HITS,
+			STAT_CACHE_MISSES,
+			STAT_FRAGMENT_HITS,
+			STAT_FRAGMENT_MISSES,
+			STAT_LATENCY,
+			STAT_COUNT = STAT_LATENCY + STATS_LATENCY_BUCKETS,
+		} StatId;
 
-	// data_map
-	data_ptr& data_map::operator [](const std::string& key) {
-		return data[key];
-	}
-	bool data_map::empty() {
-		return data.empty();
-	}
-	bool data_map::has(const std::string& key) {
-		return data.find(key) != data.end();
-	}
+		struct StatsBlock
+		{
+			StatsBlock()
+			{
+				for (size_t i = 0 ; i < STAT_COUNT ; ++i)
+				{
+					counters[i].store(0, std::memory_order_relaxed) ;
+				}
+			}
+			std::atomic<unsigned long long> counters[STAT_COUNT] ;
+		};
 
-	// data_ptr
-	template<>
-	inline void data_ptr::operator = (const data_ptr& data) {
-		ptr = data.ptr;
+		class StatsRegistry
+		{
+		public:
+			StatsRegistry() : m_start(std::chrono::steady_clock::now()){}
+			void add(StatsBlock *block)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex) ;
+				m_blocks.push_back(block) ;
+			}
+			// folds a finished thread's counts into the retired totals
+			void remove(StatsBlock *block)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex) ;
+				for (size_t i = 0 ; i < STAT_COUNT ; ++i)
+				{
+					m_retired[i] += block->counters[i].load(std::memory_order_relaxed) ;
+				}
+				m_blocks.erase(std::remove(m_blocks.begin(), m_blocks.end(), block), m_blocks.end()) ;
+			}
+			void sum(unsigned long long *totals)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex) ;
+				std::copy(m_retired, m_retired + STAT_COUNT, totals) ;
+				for (size_t b = 0 ; b < m_blocks.size() ; ++b)
+				{
+					for (size_t i = 0 ; i < STAT_COUNT ; ++i)
+					{
+						totals[i] += m_blocks[b]->counters[i].load(std::memory_order_relaxed) ;
+					}
+				}
+			}
+			std::chrono::steady_clock::time_point m_start ;
+		private:
+			std::mutex m_mutex ;
+			std::vector<StatsBlock*> m_blocks ;
+			unsigned long long m_retired[STAT_COUNT] = {} ;
+		};
+
+		StatsRegistry& stats_registry()
+		{
+			static StatsRegistry registry ;
+			return registry ;
+		}
+
+		struct ThreadStats
+		{
+			ThreadStats()
+			{
+				stats_registry().add(&block) ;
+			}
+			~ThreadStats()
+			{
+				stats_registry().remove(&block) ;
+			}
+			StatsBlock block ;
+		};
+
+		void count(StatId id, unsigned long long amount = 1)
+		{
+			thread_local ThreadStats local ;
+			std::atomic<unsigned long long> &counter = local.block.counters[id] ;
+			counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed) ;
+		}
+
+		void count_render(std::chrono::steady_clock::time_point start, size_t bytes)
+		{
+			const unsigned long long micros = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count() ;
+			size_t bucket = 0 ;
+			while (bucket + 1 < STATS_LATENCY_BUCKETS && (1ull << bucket) <= micros)
+			{
+				++bucket ;
+			}
+			count(STAT_RENDERS) ;
+			count(STAT_BYTES_WRITTEN, bytes) ;
+			count(StatId(STAT_LATENCY + bucket)) ;
+		}
 	}
 
-	template<>
-	void data_ptr::operator = (const std::string& data) {
-		ptr.reset(new DataValue(data));
+	EngineStats stats()
+	{
+		unsigned long long totals[STAT_COUNT] ;
+		stats_registry().sum(totals) ;
+
+		EngineStats result ;
+		result.uptime_seconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - stats_registry().m_start).count() ;
+		result.renders = totals[STAT_RENDERS] ;
+		result.compiles = totals[STAT_COMPILES] ;
+		result.missing_keys = totals[STAT_MISSING_KEYS] ;
+		result.bytes_written = totals[STAT_BYTES_WRITTEN] ;
+		result.allocations = totals[STAT_ALLOCATIONS] ;
+		result.cache_hits = totals[STAT_CACHE_HITS] ;
+		result.cache_misses = totals[STAT_CACHE_MISSES] ;
+		result.fragment_hits = totals[STAT_FRAGMENT_HITS] ;
+		result.fragment_misses = totals[STAT_FRAGMENT_MISSES] ;
+		std::copy(totals + STAT_LATENCY, totals + STAT_LATENCY + STATS_LATENCY_BUCKETS, result.render_latency) ;
+		return result ;
 	}
 
-	template<>
-	void data_ptr::operator = (const data_map& data) {
-		ptr.reset(new DataMap(data));
+	void dump_stats(std::ostream &stream)
+	{
+		EngineStats current = stats() ;
+		stream << "cpptempl_uptime_seconds " << current.uptime_seconds << "\n"
+			<< "cpptempl_renders_total " << current.renders << "\n"
+			<< "cpptempl_compiles_total " << current.compiles << "\n"
+			<< "cpptempl_missing_keys_total " << current.missing_keys << "\n"
+			<< "cpptempl_bytes_written_total " << current.bytes_written << "\n"
+			<< "cpptempl_allocations_total " << current.allocations << "\n"
+			<< "cpptempl_cache_hits_total " << current.cache_hits << "\n"
+			<< "cpptempl_cache_misses_total " << current.cache_misses << "\n"
+			<< "cpptempl_fragment_hits_total " << current.fragment_hits << "\n"
+			<< "cpptempl_fragment_misses_total " << current.fragment_misses << "\n" ;
+		// cumulative buckets, as histogram scrapers expect
+		unsigned long long cumulative = 0 ;
+		for (size_t i = 0 ; i < STATS_LATENCY_BUCKETS ; ++i)
+		{
+			cumulative += current.render_latency[i] ;
+			stream << "cpptempl_render_latency_us_bucket{le=\"" ;
+			if (i + 1 < STATS_LATENCY_BUCKETS)
+			{
+				stream << (1ull << i) ;
+			}
+			else
+			{
+				stream << "+Inf" ;
+			}
+			stream << "\"} " << cumulative << "\n" ;
+		}
+		stream << "cpptempl_render_latency_us_count " << cumulative << "\n" ;
 	}
 
-	void data_ptr::push_back(const data_ptr& data) {
-		if (!ptr) {
-			ptr.reset(new DataList(data_list()));
+	void write_stats(std::string filename)
+	{
+		const std::string temp_name = filename + ".tmp" ;
+		{
+			std::ofstream out(temp_name.c_str()) ;
+			if (! out)
+			{
+				throw TemplateException("Cannot open stats file: " + temp_name) ;
+			}
+			dump_stats(out) ;
+		}
+		if (std::rename(temp_name.c_str(), filename.c_str()) != 0)
+		{
+			std::remove(temp_name.c_str()) ;
+			throw TemplateException("Cannot replace stats file: " + filename) ;
 		}
-		data_list& list = ptr->getlist();
-		list.push_back(data);
 	}
 
-	// base data
-    std::string Data::getvalue()
+	//////////////////////////////////////////////////////////////////////////
+	// Number formatting
+	// Integers use std::to_chars when <charconv> is there, floating point
+	// only when the library also has the floating point overloads
+	// (__cpp_lib_to_chars); otherwise digits are written by hand and
+	// doubles by snprintf at the fewest digits that round-trip.
+	//////////////////////////////////////////////////////////////////////////
+	namespace
 	{
-		throw TemplateException("Data item is not a value") ;
+		// enough for any 64-bit integer or shortest double, with sign
+		const size_t NUMBER_BUFFER_SIZE = 32 ;
+
+#ifndef CPPTEMPL_TO_CHARS
+		std::string format_integer(unsigned long long value, bool negative)
+		{
+			char buffer[NUMBER_BUFFER_SIZE] ;
+			char *end = buffer + NUMBER_BUFFER_SIZE ;
+			char *p = end ;
+			do
+			{
+				*--p = char('0' + value % 10) ;
+				value /= 10 ;
+			} while (value) ;
+			if (negative)
+			{
+				*--p = '-' ;
+			}
+			return std::string(p, end) ;
+		}
+#endif
+
+		template<typename T> std::string format_signed(T value)
+		{
+#ifdef CPPTEMPL_TO_CHARS
+			char buffer[NUMBER_BUFFER_SIZE] ;
+			return std::string(buffer, std::to_chars(buffer, buffer + NUMBER_BUFFER_SIZE, value).ptr) ;
+#else
+			const unsigned long long magnitude = value < 0 
+				? 0ull - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value) ;
+			return format_integer(magnitude, value < 0) ;
+#endif
+		}
+
+		template<typename T> std::string format_unsigned(T value)
+		{
+#ifdef CPPTEMPL_TO_CHARS
+			char buffer[NUMBER_BUFFER_SIZE] ;
+			return std::string(buffer, std::to_chars(buffer, buffer + NUMBER_BUFFER_SIZE, value).ptr) ;
+#else
+			return format_integer(value, false) ;
+#endif
+		}
+
+		template<typename T> std::string format_floating(T value)
+		{
+#if defined(CPPTEMPL_TO_CHARS) && defined(__cpp_lib_to_chars)
+			char buffer[NUMBER_BUFFER_SIZE * 2] ;
+			return std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr) ;
+#else
+			char buffer[NUMBER_BUFFER_SIZE * 2] ;
+			const int digits = std::numeric_limits<T>::digits10 ;
+			for (int precision = digits ; ; ++precision)
+			{
+				std::snprintf(buffer, sizeof(buffer), "%.*Lg", precision, static_cast<long double>(value)) ;
+				if (precision >= std::numeric_limits<T>::max_digits10 || value != value 
+					|| static_cast<T>(std::strtold(buffer, NULL)) == value)
+				{
+					return buffer ;
+				}
+			}
+#endif
+		}
 	}
 
-	data_list& Data::getlist()
+	std::string format_number(int value)
 	{
-		throw TemplateException("Data item is not a list") ;
+		return format_signed(value) ;
 	}
-	data_map& Data::getmap()
+	std::string format_number(long value)
 	{
-		throw TemplateException("Data item is not a dictionary") ;
+		return format_signed(value) ;
 	}
-	// data value
-    std::string DataValue::getvalue()
+	std::string format_number(long long value)
 	{
-		return m_value ;
+		return format_signed(value) ;
 	}
-	bool DataValue::empty()
+	std::string format_number(unsigned value)
 	{
-		return m_value.empty();
+		return format_unsigned(value) ;
 	}
-	// data list
-	data_list& DataList::getlist()
+	std::string format_number(unsigned long value)
 	{
-		return m_items ;
+		return format_unsigned(value) ;
 	}
-
-	bool DataList::empty()
+	std::string format_number(unsigned long long value)
 	{
-		return m_items.empty();
+		return format_unsigned(value) ;
 	}
-	// data map
-	data_map& DataMap:: getmap()
+	std::string format_number(float value)
 	{
-		return m_items ;
+		return format_floating(value) ;
 	}
-	bool DataMap::empty()
+	std::string format_number(double value)
 	{
-		return m_items.empty();
+		return format_floating(value) ;
+	}
+	std::string format_number(long double value)
+	{
+		return format_floating(value) ;
+	}
+
+	std::string format_fixed(double value, int precision)
+	{
+		precision = std::max(0, std::min(precision, 60)) ;
+#if defined(CPPTEMPL_TO_CHARS) && defined(__cpp_lib_to_chars)
+		char buffer[384] ;
+		std::to_chars_result result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, precision) ;
+		if (result.ec == std::errc())
+		{
+			return std::string(buffer, result.ptr) ;
+		}
+#endif
+		// room for the 309 integer digits of the largest double
+		char fallback[384] ;
+		std::snprintf(fallback, sizeof(fallback), "%.*f", precision, value) ;
+		return fallback ;
 	}
+
 	//////////////////////////////////////////////////////////////////////////
-	// parse_val
+	// Output buffers
+	// Renders that end up in a string write into a buffer borrowed from a
+	// small per-thread pool instead of a fresh ostringstream, so a worker
+	// thread reuses the same few buffers render after render. A buffer
+	// that grew past POOLED_BUFFER_LIMIT is freed instead of kept.
 	//////////////////////////////////////////////////////////////////////////
-	data_ptr parse_val(std::string key, data_map &data)
+	namespace
 	{
-		// quoted string
-		if (key[0] == '\"')
+		// a std::streambuf that appends to a string, so the result can be
+		// moved out rather than copied as ostringstream::str() would
+		template<typename CharT>
+		class basic_StringBuffer : public std::basic_streambuf<CharT>
 		{
-			return make_data(boost::trim_copy_if(key, boost::is_any_of("\""))) ;
-		}
-		// check for dotted notation, i.e [foo.bar]
-		size_t index = key.find(".") ;
-		if (index == std::string::npos)
+			typedef typename std::basic_streambuf<CharT>::int_type int_type ;
+			typedef typename std::basic_streambuf<CharT>::traits_type traits_type ;
+			std::basic_string<CharT> &m_out ;
+		public:
+			basic_StringBuffer(std::basic_string<CharT> &out) : m_out(out){}
+		protected:
+			int_type overflow(int_type ch)
+			{
+				if (! traits_type::eq_int_type(ch, traits_type::eof()))
+				{
+					m_out += traits_type::to_char_type(ch) ;
+				}
+				return traits_type::not_eof(ch) ;
+			}
+			std::streamsize xsputn(const CharT *text, std::streamsize size)
+			{
+				m_out.append(text, size_t(size)) ;
+				return size ;
+			}
+		};
+		typedef basic_StringBuffer<char> StringBuffer ;
+
+		// in bytes
+		const size_t POOLED_BUFFER_LIMIT = 64 * 1024 ;
+		// enough for a render nested in a filter nested in a render
+		const size_t POOLED_BUFFERS = 4 ;
+
+		template<typename CharT>
+		std::vector<std::basic_string<CharT> > & buffer_pool()
 		{
-			if (!data.has(key))
+			thread_local std::vector<std::basic_string<CharT> > pool ;
+			if (pool.capacity() < POOLED_BUFFERS)
 			{
-				return make_data("{$" + key + "}") ;
+				pool.reserve(POOLED_BUFFERS) ;
 			}
-			return data[key] ;
+			return pool ;
 		}
 
-        std::string sub_key = key.substr(0, index) ;
-		if (!data.has(sub_key))
+		// an empty string buffer from the pool, with a stream over it; it
+		// goes back to the pool when done with
+		template<typename CharT>
+		class basic_PooledBuffer
 		{
-			return make_data("{$" + key + "}") ;
-		}
-		data_ptr item = data[sub_key] ;
-		return parse_val(key.substr(index+1), item->getmap()) ;
+			std::basic_string<CharT> m_text ;
+			basic_StringBuffer<CharT> m_buffer ;
+			std::basic_ostream<CharT> m_stream ;
+		public:
+			basic_PooledBuffer() : m_buffer(m_text), m_stream(&m_buffer)
+			{
+				std::vector<std::basic_string<CharT> > &pool = buffer_pool<CharT>() ;
+				if (! pool.empty())
+				{
+					m_text.swap(pool.back()) ;
+					pool.pop_back() ;
+				}
+			}
+			~basic_PooledBuffer()
+			{
+				std::vector<std::basic_string<CharT> > &pool = buffer_pool<CharT>() ;
+				if (pool.size() < POOLED_BUFFERS && m_text.capacity() * sizeof(CharT) <= POOLED_BUFFER_LIMIT)
+				{
+					// the pool's capacity was set up front, so this never allocates
+					m_text.clear() ;
+					pool.push_back(std::move(m_text)) ;
+				}
+			}
+			std::basic_ostream<CharT> & stream()
+			{
+				return m_stream ;
+			}
+			std::basic_string<CharT> & str()
+			{
+				return m_text ;
+			}
+		private:
+			basic_PooledBuffer(const basic_PooledBuffer &) ;
+			basic_PooledBuffer & operator=(const basic_PooledBuffer &) ;
+		};
+		typedef basic_PooledBuffer<char> PooledBuffer ;
 	}
 
 	//////////////////////////////////////////////////////////////////////////
-	// Token classes
+	// Data classes
 	//////////////////////////////////////////////////////////////////////////
 
-	// defaults, overridden by subclasses with children
-	void Token::set_children( token_vector & )
-	{
-		throw TemplateException("This token type cannot have children") ;
+	// data_map
+	template<typename CharT>
+	basic_data_ptr<CharT>& basic_data_map<CharT>::operator [](const string_type& key) {
+		return data[key];
+	}
+	template<typename CharT>
+	bool basic_data_map<CharT>::empty() {
+		return data.empty();
+	}
+	template<typename CharT>
+	bool basic_data_map<CharT>::has(const string_type& key) {
+		return data.find(key) != data.end();
 	}
 
-	token_vector & Token::get_children()
-	{
-		throw TemplateException("This token type cannot have children") ;
+	// data_ptr
+	template<typename CharT>
+	void basic_data_ptr<CharT>::operator = (const string_type& data) {
+		ptr.reset(new basic_DataValue<CharT>(data));
 	}
 
-	// TokenText
-	TokenType TokenText::gettype()
-	{
-		return TOKEN_TYPE_TEXT ;
+	template<typename CharT>
+	void basic_data_ptr<CharT>::operator = (const basic_data_map<CharT>& data) {
+		ptr.reset(new basic_DataMap<CharT>(data));
 	}
 
-	void TokenText::gettext( std::ostream &stream, data_map & )
-	{
-		stream << m_text ;
+	template<typename CharT>
+	void basic_data_ptr<CharT>::push_back(const basic_data_ptr& data) {
+		if (!ptr) {
+			ptr.reset(new basic_DataList<CharT>(basic_data_list<CharT>()));
+		}
+		basic_data_list<CharT>& list = ptr->getlist();
+		list.push_back(data);
 	}
 
-	// TokenVar
-	TokenType TokenVar::gettype()
+	// base data
+	template<typename CharT>
+	basic_Data<CharT>::basic_Data()
 	{
-		return TOKEN_TYPE_VAR ;
+		count(STAT_ALLOCATIONS) ;
 	}
 
-	void TokenVar::gettext( std::ostream &stream, data_map &data )
+	template<typename CharT>
+    typename basic_Data<CharT>::string_type basic_Data<CharT>::getvalue()
 	{
-		stream << parse_val(m_key, data)->getvalue() ;
+		throw TemplateException("Data item is not a value") ;
 	}
-
-	// TokenFor
-	TokenFor::TokenFor(std::string expr)
+	template<typename CharT>
+	const typename basic_Data<CharT>::string_type *basic_Data<CharT>::peekvalue()
 	{
-		std::vector<std::string> elements ;
-		boost::split(elements, expr, boost::is_space()) ;
-		if (elements.size() != 4u)
-		{
-			throw TemplateException("Invalid syntax in for statement") ;
-		}
-		m_val = elements[1] ;
-		m_key = elements[3] ;
+		return NULL ;
 	}
 
-	TokenType TokenFor::gettype()
+	template<typename CharT>
+	basic_data_list<CharT>& basic_Data<CharT>::getlist()
 	{
-		return TOKEN_TYPE_FOR ;
+		throw TemplateException("Data item is not a list") ;
 	}
-
-	void TokenFor::gettext( std::ostream &stream, data_map &data )
+	template<typename CharT>
+	basic_data_map<CharT>& basic_Data<CharT>::getmap()
+	{
+		throw TemplateException("Data item is not a dictionary") ;
+	}
+	template<typename CharT>
+	bool basic_Data<CharT>::getmember(const string_type &key, basic_data_ptr<CharT> &value)
 	{
-		data_ptr value = parse_val(m_key, data) ;
-		data_list &items = value->getlist() ;
-		for (size_t i = 0 ; i < items.size() ; ++i)
+		basic_data_map<CharT> &items = getmap() ;
+		if (! items.has(key))
 		{
-			data_map loop ;
-			loop["index"] = make_data(boost::lexical_cast<std::string>(i+1)) ;
-			loop["index0"] = make_data(boost::lexical_cast<std::string>(i)) ;
-			data["loop"] = make_data(loop);
-			data[m_val] = items[i] ;
-			for(size_t j = 0 ; j < m_children.size() ; ++j)
-			{
-				m_children[j]->gettext(stream, data) ;
-			}
+			return false ;
 		}
+		value = items[key] ;
+		return true ;
 	}
-
-	void TokenFor::set_children( token_vector &children )
+	template<typename CharT>
+	size_t basic_Data<CharT>::getsize()
 	{
-		m_children.assign(children.begin(), children.end()) ;
+		return getlist().size() ;
 	}
-
-	token_vector & TokenFor::get_children()
+	template<typename CharT>
+	basic_data_ptr<CharT> basic_Data<CharT>::getitem(size_t index)
 	{
-		return m_children;
+		return getlist()[index] ;
 	}
-
-	// TokenIf
-	TokenType TokenIf::gettype()
+	// data value
+	template<typename CharT>
+    typename basic_DataValue<CharT>::string_type basic_DataValue<CharT>::getvalue()
 	{
-		return TOKEN_TYPE_IF ;
+		return m_value ;
 	}
-
-	void TokenIf::gettext( std::ostream &stream, data_map &data )
+	template<typename CharT>
+	const typename basic_DataValue<CharT>::string_type *basic_DataValue<CharT>::peekvalue()
 	{
-		if (is_true(m_expr, data))
-		{
-			for(size_t j = 0 ; j < m_children.size() ; ++j)
-			{
-				m_children[j]->gettext(stream, data) ;
-			}
-		}
+		return &m_value ;
 	}
-
-	bool TokenIf::is_true( std::string expr, data_map &data )
+	template<typename CharT>
+	bool basic_DataValue<CharT>::empty()
 	{
-		std::vector<std::string> elements ;
-		boost::split(elements, expr, boost::is_space()) ;
+		return m_value.empty();
+	}
+	// data list
+	template<typename CharT>
+	basic_data_list<CharT>& basic_DataList<CharT>::getlist()
+	{
+		return m_items ;
+	}
 
-		if (elements[1] == "not")
-		{
-			return parse_val(elements[2], data)->empty() ;
-		}
-		if (elements.size() == 2)
+	template<typename CharT>
+	bool basic_DataList<CharT>::empty()
+	{
+		return m_items.empty();
+	}
+	// data map
+	template<typename CharT>
+	basic_data_map<CharT>& basic_DataMap<CharT>:: getmap()
+	{
+		return m_items ;
+	}
+	template<typename CharT>
+	bool basic_DataMap<CharT>::empty()
+	{
+		return m_items.empty();
+	}
+	// lazy data
+	template<typename CharT>
+	basic_Data<CharT>* basic_DataLazy<CharT>::resolve()
+	{
+		if (! m_resolved)
 		{
-			return ! parse_val(elements[1], data)->empty() ;
+			m_value = m_callback() ;
+			m_resolved = true ;
 		}
-		data_ptr lhs = parse_val(elements[1], data) ;
-		data_ptr rhs = parse_val(elements[3], data) ;
-		if (elements[2] == "==")
+		return value() ;
+	}
+	template<typename CharT>
+	basic_Data<CharT>* basic_DataLazy<CharT>::value()
+	{
+		basic_Data<CharT> *value = m_value.operator->() ;
+		if (! value)
 		{
-			return lhs->getvalue() == rhs->getvalue() ;
+			throw TemplateException("Lazy data callback returned no data") ;
 		}
-		return lhs->getvalue() != rhs->getvalue() ;
+		return value ;
 	}
-
-	void TokenIf::set_children( token_vector &children )
+	template<typename CharT>
+	bool basic_DataLazy<CharT>::empty()
 	{
-		m_children.assign(children.begin(), children.end()) ;
+		return resolve()->empty() ;
 	}
-
-	token_vector & TokenIf::get_children()
+	template<typename CharT>
+	typename basic_DataLazy<CharT>::string_type basic_DataLazy<CharT>::getvalue()
 	{
-		return m_children;
+		return resolve()->getvalue() ;
 	}
-
-	// TokenEnd
-	TokenType TokenEnd::gettype()
+	template<typename CharT>
+	const typename basic_DataLazy<CharT>::string_type *basic_DataLazy<CharT>::peekvalue()
 	{
-		return m_type == "endfor" ? TOKEN_TYPE_ENDFOR : TOKEN_TYPE_ENDIF ;
+		return resolve()->peekvalue() ;
 	}
-
-	void TokenEnd::gettext( std::ostream &, data_map &)
+	template<typename CharT>
+	basic_data_list<CharT>& basic_DataLazy<CharT>::getlist()
 	{
-		throw TemplateException("End-of-control statements have no associated text") ;
+		return resolve()->getlist() ;
+	}
+	template<typename CharT>
+	basic_data_map<CharT>& basic_DataLazy<CharT>::getmap()
+	{
+		return resolve()->getmap() ;
+	}
+	template<typename CharT>
+	bool basic_DataLazy<CharT>::getmember(const string_type &key, basic_data_ptr<CharT> &value)
+	{
+		return resolve()->getmember(key, value) ;
+	}
+	template<typename CharT>
+	size_t basic_DataLazy<CharT>::getsize()
+	{
+		return resolve()->getsize() ;
+	}
+	template<typename CharT>
+	basic_data_ptr<CharT> basic_DataLazy<CharT>::getitem(size_t index)
+	{
+		return resolve()->getitem(index) ;
 	}
 
-	// gettext
-	// generic helper for getting text from tokens.
-
-    std::string gettext(token_ptr token, data_map &data)
+	template<typename CharT>
+	basic_Data<CharT>* basic_DataLazyShared<CharT>::resolve()
 	{
-		std::ostringstream stream ;
-		token->gettext(stream, data) ;
-		return stream.str() ;
+		std::call_once(m_once, [this]() {
+			this->m_value = this->m_callback() ;
+			this->m_resolved = true ;
+		}) ;
+		return this->value() ;
 	}
 	//////////////////////////////////////////////////////////////////////////
-	// parse_tree
-	// recursively parses list of tokens into a tree
+	// Text of any character type
+	// Statements and keys are matched against ASCII, so none of this
+	// needs a locale or a ctype facet for the character type.
 	//////////////////////////////////////////////////////////////////////////
-	void parse_tree(token_vector &tokens, token_vector &tree, TokenType until)
+	namespace
 	{
-		while(! tokens.empty())
+		template<typename CharT>
+		bool is_space(CharT ch)
 		{
-			// 'pops' first item off list
-			token_ptr token = tokens[0] ;
-			tokens.erase(tokens.begin()) ;
+			return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\v' || ch == '\f' ;
+		}
 
-			if (token->gettype() == TOKEN_TYPE_FOR)
+		template<typename CharT>
+		bool is_digits(const std::basic_string<CharT> &text)
+		{
+			for (size_t i = 0 ; i < text.size() ; ++i)
 			{
+				if (text[i] < '0' || text[i] > '9')
+				{
+					return false ;
+				}
+			}
+			return true ;
+		}
+
+		template<typename CharT>
+		std::basic_string<CharT> trim_spaces(const std::basic_string<CharT> &text)
+		{
+			size_t first = 0 ;
+			size_t last = text.size() ;
+			while (first < last && is_space(text[first]))
+			{
+				++first ;
+			}
+			while (last > first && is_space(text[last - 1]))
+			{
+				--last ;
+			}
+			return text.substr(first, last - first) ;
+		}
+
+		// splits at each space, like boost::split with is_space()
+		template<typename CharT>
+		std::vector<std::basic_string<CharT> > split_spaces(const std::basic_string<CharT> &text)
+		{
+			std::vector<std::basic_string<CharT> > parts(1) ;
+			for (size_t i = 0 ; i < text.size() ; ++i)
+			{
+				if (is_space(text[i]))
+				{
+					parts.push_back(std::basic_string<CharT>()) ;
+				}
+				else
+				{
+					parts.back() += text[i] ;
+				}
+			}
+			return parts ;
+		}
+
+		template<typename CharT>
+		bool starts_with(const std::basic_string<CharT> &text, const char *prefix)
+		{
+			for (size_t i = 0 ; prefix[i] ; ++i)
+			{
+				if (i == text.size() || text[i] != CharT(prefix[i]))
+				{
+					return false ;
+				}
+			}
+			return true ;
+		}
+
+		template<typename CharT>
+		bool equals(const std::basic_string<CharT> &text, const char *ascii)
+		{
+			return starts_with(text, ascii) && text.size() == std::strlen(ascii) ;
+		}
+
+		// for messages, profiles and filter names; anything beyond ASCII
+		// is written as \uXXXX
+		inline const std::string &narrow_text(const std::string &text)
+		{
+			return text ;
+		}
+		template<typename CharT>
+		std::string narrow_text(const std::basic_string<CharT> &text)
+		{
+			std::string narrow ;
+			narrow.reserve(text.size()) ;
+			for (size_t i = 0 ; i < text.size() ; ++i)
+			{
+				const unsigned long code = static_cast<unsigned long>(text[i]) ;
+				if (code < 0x80)
+				{
+					narrow += char(code) ;
+					continue ;
+				}
+				char escaped[16] ;
+				std::snprintf(escaped, sizeof(escaped), code > 0xFFFF ? "\\U%08lX" : "\\u%04lX", code) ;
+				narrow += escaped ;
+			}
+			return narrow ;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// parse_val
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// one step of a path: its first part, then each member after it.
+		// The one place missing keys are counted.
+		template<typename CharT>
+		bool find_root(const std::basic_string<CharT> &part, basic_data_map<CharT> &data, basic_data_ptr<CharT> &value)
+		{
+			if (! data.has(part))
+			{
+				count(STAT_MISSING_KEYS) ;
+				return false ;
+			}
+			value = data[part] ;
+			return true ;
+		}
+		template<typename CharT>
+		bool find_member(const std::basic_string<CharT> &part, basic_data_ptr<CharT> &value)
+		{
+			basic_data_ptr<CharT> member ;
+			if (! value->getmember(part, member))
+			{
+				count(STAT_MISSING_KEYS) ;
+				return false ;
+			}
+			value = member ;
+			return true ;
+		}
+
+		// walks the dotted path without building intermediate placeholders;
+		// on a miss, missing is where the part that was not found starts
+		template<typename CharT>
+		bool find_path(const std::basic_string<CharT> &key, basic_data_map<CharT> &data, 
+			basic_data_ptr<CharT> &value, size_t &missing)
+		{
+			typedef std::basic_string<CharT> string_type ;
+			size_t index = key.find(CharT('.')) ;
+			string_type part(key, 0, index) ;
+			missing = 0 ;
+			if (! find_root(part, data, value))
+			{
+				return false ;
+			}
+			while (index != string_type::npos)
+			{
+				const size_t start = index + 1 ;
+				index = key.find(CharT('.'), start) ;
+				part.assign(key, start, index == string_type::npos ? string_type::npos : index - start) ;
+				missing = start ;
+				if (! find_member(part, value))
+				{
+					return false ;
+				}
+			}
+			return true ;
+		}
+
+		// the text of a quoted string, e.g. "foo"
+		template<typename CharT>
+		std::basic_string<CharT> unquote(const std::basic_string<CharT> &key)
+		{
+			const size_t first = key.find_first_not_of(CharT('"')) ;
+			if (first == std::basic_string<CharT>::npos)
+			{
+				return std::basic_string<CharT>() ;
+			}
+			return key.substr(first, key.find_last_not_of(CharT('"')) + 1 - first) ;
+		}
+	}
+
+	template<typename CharT>
+	basic_data_ptr<CharT> parse_val(typename type_identity<std::basic_string<CharT> >::type key, basic_data_map<CharT> &data)
+	{
+		// quoted string
+		if (key[0] == '\"')
+		{
+			return make_data(unquote(key)) ;
+		}
+		// check for dotted notation, i.e [foo.bar]; a miss echoes the
+		// path from the part that was not found, e.g. {$missing} for
+		// foo.missing
+		basic_data_ptr<CharT> value ;
+		size_t missing = 0 ;
+		if (! find_path(key, data, value, missing))
+		{
+			return make_data(widen_ascii<CharT>("{$") + key.substr(missing) + CharT('}')) ;
+		}
+		return value ;
+	}
+
+	template<typename CharT>
+	bool find_val(const typename type_identity<std::basic_string<CharT> >::type &key, 
+		basic_data_map<CharT> &data, basic_data_ptr<CharT> &value)
+	{
+		if (key[0] == '\"')
+		{
+			value = parse_val<CharT>(key, data) ;
+			return true ;
+		}
+		size_t missing = 0 ;
+		return find_path(key, data, value, missing) ;
+	}
+
+	template<typename CharT>
+	bool find_val(const std::basic_string<CharT> *path, size_t parts, basic_data_map<CharT> &data, basic_data_ptr<CharT> &value)
+	{
+		if (path[0][0] == '\"')
+		{
+			value = parse_val<CharT>(path[0], data) ;
+			return true ;
+		}
+		if (! find_root(path[0], data, value))
+		{
+			return false ;
+		}
+		for (size_t i = 1 ; i < parts ; ++i)
+		{
+			if (! find_member(path[i], value))
+			{
+				return false ;
+			}
+		}
+		return true ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Filters
+	//
+	// The escapers scan for the next byte that needs escaping, copying the
+	// run of safe bytes before it in a single write. With SSE2 the scan
+	// tests 16 bytes at a time.
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+#ifdef CPPTEMPL_SSE2
+		inline size_t lowest_bit(int mask)
+		{
+#ifdef _MSC_VER
+			unsigned long index ;
+			_BitScanForward(&index, mask) ;
+			return index ;
+#else
+			return __builtin_ctz(mask) ;
+#endif
+		}
+		// bytes equal to ch
+		inline __m128i bytes_equal(__m128i chunk, char ch)
+		{
+			return _mm_cmpeq_epi8(chunk, _mm_set1_epi8(ch)) ;
+		}
+		// bytes in [lo, hi], compared unsigned
+		inline __m128i bytes_between(__m128i chunk, unsigned char lo, unsigned char hi)
+		{
+			__m128i offset = _mm_sub_epi8(chunk, _mm_set1_epi8(char(lo))) ;
+			return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(char(hi - lo))), offset) ;
+		}
+#endif
+
+		// returns the first byte in [p, end) that Escaper needs to escape
+		template<typename Escaper>
+		const char* skip_safe(const char *p, const char *end)
+		{
+#ifdef CPPTEMPL_SSE2
+			while (end - p >= 16)
+			{
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)) ;
+				const int mask = _mm_movemask_epi8(Escaper::special(chunk)) ;
+				if (mask)
+				{
+					return p + lowest_bit(mask) ;
+				}
+				p += 16 ;
+			}
+#endif
+			while (p < end && ! Escaper::special(static_cast<unsigned char>(*p)))
+			{
+				++p ;
+			}
+			return p ;
+		}
+
+		template<typename Escaper>
+		class EscapeFilter : public Filter
+		{
+		public:
+			void apply(const std::string &value, std::ostream &stream, RenderContext &context)
+			{
+				const char *p = value.data() ;
+				const char *end = p + value.size() ;
+				while (p < end)
+				{
+					const char *special = skip_safe<Escaper>(p, end) ;
+					if (special != p)
+					{
+						context.write(stream, p, special - p) ;
+					}
+					if (special == end)
+					{
+						break ;
+					}
+					Escaper::escape(static_cast<unsigned char>(*special), stream, context) ;
+					p = special + 1 ;
+				}
+			}
+		};
+
+		const char hex_digits[] = "0123456789ABCDEF" ;
+
+		// ASCII text such as an escape sequence, in the stream's characters
+		inline void write_ascii(std::ostream &stream, const char *text, size_t size, RenderContext &context)
+		{
+			context.write(stream, text, size) ;
+		}
+		template<typename CharT>
+		void write_ascii(std::basic_ostream<CharT> &stream, const char *text, size_t size, RenderContext &context)
+		{
+			CharT wide[8] ;
+			std::copy(text, text + size, wide) ;
+			context.write(stream, wide, size) ;
+		}
+
+		// & < > " '
+		struct HtmlEscaper
+		{
+			static bool special(unsigned char ch)
+			{
+				return ch == '&' || ch == '<' || ch == '>' || ch == '"' || ch == '\'' ;
+			}
+#ifdef CPPTEMPL_SSE2
+			static __m128i special(__m128i chunk)
+			{
+				return _mm_or_si128(_mm_or_si128(bytes_equal(chunk, '&'), bytes_equal(chunk, '<')),
+					_mm_or_si128(_mm_or_si128(bytes_equal(chunk, '>'), bytes_equal(chunk, '"')),
+						bytes_equal(chunk, '\''))) ;
+			}
+#endif
+			template<typename CharT>
+			static void escape(unsigned char ch, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				switch (ch)
+				{
+				case '&': write_ascii(stream, "&amp;", 5, context) ; break ;
+				case '<': write_ascii(stream, "&lt;", 4, context) ; break ;
+				case '>': write_ascii(stream, "&gt;", 4, context) ; break ;
+				case '"': write_ascii(stream, "&quot;", 6, context) ; break ;
+				default: write_ascii(stream, "&#39;", 5, context) ; break ;
+				}
+			}
+		};
+
+		// everything but the RFC 3986 unreserved characters
+		struct UrlEscaper
+		{
+			static bool special(unsigned char ch)
+			{
+				return ! ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+					|| ch == '-' || ch == '_' || ch == '.' || ch == '~') ;
+			}
+#ifdef CPPTEMPL_SSE2
+			static __m128i special(__m128i chunk)
+			{
+				__m128i safe = _mm_or_si128(
+					_mm_or_si128(bytes_between(chunk, 'a', 'z'), bytes_between(chunk, 'A', 'Z')),
+					_mm_or_si128(bytes_between(chunk, '0', '9'), 
+						_mm_or_si128(_mm_or_si128(bytes_equal(chunk, '-'), bytes_equal(chunk, '_')),
+							_mm_or_si128(bytes_equal(chunk, '.'), bytes_equal(chunk, '~'))))) ;
+				return _mm_xor_si128(safe, _mm_set1_epi8(char(0xFF))) ;
+			}
+#endif
+			template<typename CharT>
+			static void escape(unsigned char ch, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				const char encoded[3] = { '%', hex_digits[ch >> 4], hex_digits[ch & 0xF] } ;
+				write_ascii(stream, encoded, 3, context) ;
+			}
+		};
+
+		// contents of a JSON string: quote, backslash and control characters
+		struct JsonEscaper
+		{
+			static bool special(unsigned char ch)
+			{
+				return ch < 0x20 || ch == '"' || ch == '\\' ;
+			}
+#ifdef CPPTEMPL_SSE2
+			static __m128i special(__m128i chunk)
+			{
+				return _mm_or_si128(bytes_between(chunk, 0, 0x1F),
+					_mm_or_si128(bytes_equal(chunk, '"'), bytes_equal(chunk, '\\'))) ;
+			}
+#endif
+			template<typename CharT>
+			static void escape(unsigned char ch, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				switch (ch)
+				{
+				case '"': write_ascii(stream, "\\\"", 2, context) ; break ;
+				case '\\': write_ascii(stream, "\\\\", 2, context) ; break ;
+				case '\n': write_ascii(stream, "\\n", 2, context) ; break ;
+				case '\r': write_ascii(stream, "\\r", 2, context) ; break ;
+				case '\t': write_ascii(stream, "\\t", 2, context) ; break ;
+				case '\b': write_ascii(stream, "\\b", 2, context) ; break ;
+				case '\f': write_ascii(stream, "\\f", 2, context) ; break ;
+				default:
+					{
+						const char encoded[6] = { '\\', 'u', '0', '0', hex_digits[ch >> 4], hex_digits[ch & 0xF] } ;
+						write_ascii(stream, encoded, 6, context) ;
+					}
+				}
+			}
+		};
+
+		// the code point at p for the escapers of wider characters,
+		// moving p past it; a surrogate pair makes one
+		template<typename CharT>
+		unsigned long next_code_point(const CharT *&p, const CharT *end)
+		{
+			const unsigned long code = static_cast<unsigned long>(*p++) ;
+			if (sizeof(CharT) == 2 && code >= 0xD800 && code <= 0xDBFF && p < end)
+			{
+				const unsigned long low = static_cast<unsigned long>(*p) ;
+				if (low >= 0xDC00 && low <= 0xDFFF)
+				{
+					++p ;
+					return 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00) ;
+				}
+			}
+			return code ;
+		}
+
+		// EscapeFilter for wider characters, a character at a time. ASCII
+		// is escaped as for char; other characters pass through, unless
+		// the escaper escapes bytes beyond ASCII (url), in which case each
+		// byte of the character's UTF-8 form is escaped.
+		template<typename CharT, typename Escaper>
+		class WideEscapeFilter : public basic_Filter<CharT>
+		{
+		public:
+			void apply(const std::basic_string<CharT> &value, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				const bool escape_wide = Escaper::special(0x80) ;
+				const CharT *p = value.data() ;
+				const CharT *end = p + value.size() ;
+				while (p < end)
+				{
+					const CharT *special = p ;
+					while (special < end && ! special_unit(*special, escape_wide))
+					{
+						++special ;
+					}
+					if (special != p)
+					{
+						context.write(stream, p, special - p) ;
+					}
+					if (special == end)
+					{
+						break ;
+					}
+					p = special ;
+					const unsigned long code = next_code_point(p, end) ;
+					if (code < 0x80)
+					{
+						Escaper::escape(static_cast<unsigned char>(code), stream, context) ;
+						continue ;
+					}
+					unsigned char bytes[4] ;
+					const size_t size = utf8_bytes(code, bytes) ;
+					for (size_t i = 0 ; i < size ; ++i)
+					{
+						Escaper::escape(bytes[i], stream, context) ;
+					}
+				}
+			}
+		private:
+			static bool special_unit(CharT ch, bool escape_wide)
+			{
+				const unsigned long code = static_cast<unsigned long>(ch) ;
+				return code < 0x80 ? Escaper::special(static_cast<unsigned char>(code)) : escape_wide ;
+			}
+			static size_t utf8_bytes(unsigned long code, unsigned char *bytes)
+			{
+				if (code > 0x10FFFF)
+				{
+					code = 0xFFFD ;
+				}
+				if (code < 0x800)
+				{
+					bytes[0] = static_cast<unsigned char>(0xC0 | (code >> 6)) ;
+					bytes[1] = static_cast<unsigned char>(0x80 | (code & 0x3F)) ;
+					return 2 ;
+				}
+				if (code < 0x10000)
+				{
+					bytes[0] = static_cast<unsigned char>(0xE0 | (code >> 12)) ;
+					bytes[1] = static_cast<unsigned char>(0x80 | ((code >> 6) & 0x3F)) ;
+					bytes[2] = static_cast<unsigned char>(0x80 | (code & 0x3F)) ;
+					return 3 ;
+				}
+				bytes[0] = static_cast<unsigned char>(0xF0 | (code >> 18)) ;
+				bytes[1] = static_cast<unsigned char>(0x80 | ((code >> 12) & 0x3F)) ;
+				bytes[2] = static_cast<unsigned char>(0x80 | ((code >> 6) & 0x3F)) ;
+				bytes[3] = static_cast<unsigned char>(0x80 | (code & 0x3F)) ;
+				return 4 ;
+			}
+		};
+
+		template<typename CharT>
+		class RawFilter : public basic_Filter<CharT>
+		{
+		public:
+			void apply(const std::basic_string<CharT> &value, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				context.write(stream, value) ;
+			}
+		};
+
+		class FunctionFilter : public Filter
+		{
+			filter_function m_function ;
+		public:
+			FunctionFilter(filter_function function) : m_function(function){}
+			void apply(const std::string &value, std::ostream &stream, RenderContext &context)
+			{
+				context.write(stream, m_function(value)) ;
+			}
+		};
+
+		// true if value is a whole decimal number, with optional sign,
+		// fraction and exponent; the number filters leave anything else alone
+		bool is_number(const std::string &value)
+		{
+			if (value.empty())
+			{
+				return false ;
+			}
+			char *end = NULL ;
+			std::strtod(value.c_str(), &end) ;
+			return end == value.c_str() + value.size() 
+				&& value.find_first_of("xXnN") == std::string::npos ;
+		}
+
+		// {$price|fixed:2}; numbers are ASCII, so wide text is narrowed
+		// to test and format it
+		template<typename CharT>
+		class FixedFilter : public basic_Filter<CharT>
+		{
+			int m_precision ;
+		public:
+			FixedFilter(int precision) : m_precision(precision){}
+			void apply(const std::basic_string<CharT> &value, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				const std::string &number = narrow_text(value) ;
+				if (! is_number(number))
+				{
+					context.write(stream, value) ;
+					return ;
+				}
+				context.write(stream, widen_ascii<CharT>(format_fixed(std::strtod(number.c_str(), NULL), m_precision))) ;
+			}
+		};
+
+		// {$count|thousands} -> 1,234,567.89
+		template<typename CharT>
+		class ThousandsFilter : public basic_Filter<CharT>
+		{
+			std::string m_separator ;
+		public:
+			ThousandsFilter(const std::string &separator) : m_separator(separator){}
+			void apply(const std::basic_string<CharT> &value, std::basic_ostream<CharT> &stream, RenderContext &context)
+			{
+				const std::string &number = narrow_text(value) ;
+				if (! is_number(number))
+				{
+					context.write(stream, value) ;
+					return ;
+				}
+				const size_t first = number.find_first_not_of("+-") ;
+				const size_t last = number.find_first_not_of("0123456789", first) ;
+				const size_t digits = (last == std::string::npos ? number.size() : last) - first ;
+				std::string grouped(number, 0, first) ;
+				grouped.reserve(number.size() + digits / 3 * m_separator.size()) ;
+				for (size_t i = 0 ; i < digits ; ++i)
+				{
+					if (i && (digits - i) % 3 == 0)
+					{
+						grouped += m_separator ;
+					}
+					grouped += number[first + i] ;
+				}
+				if (last != std::string::npos)
+				{
+					grouped.append(number, last, std::string::npos) ;
+				}
+				context.write(stream, widen_ascii<CharT>(grouped)) ;
+			}
+		};
+
+		template<typename CharT>
+		basic_filter_ptr<CharT> make_fixed_filter(const std::string &argument)
+		{
+			if (argument.empty())
+			{
+				return basic_filter_ptr<CharT>(new FixedFilter<CharT>(2)) ;
+			}
+			if (! boost::all(argument, boost::is_digit()) || argument.size() > 2)
+			{
+				throw TemplateException("Invalid precision for fixed filter: " + argument) ;
+			}
+			return basic_filter_ptr<CharT>(new FixedFilter<CharT>(std::atoi(argument.c_str()))) ;
+		}
+
+		template<typename CharT>
+		basic_filter_ptr<CharT> make_thousands_filter(const std::string &argument)
+		{
+			return basic_filter_ptr<CharT>(new ThousandsFilter<CharT>(argument.empty() ? "," : argument)) ;
+		}
+
+		template<typename CharT>
+		class FilterRegistry
+		{
+		public:
+			typedef std::function<basic_filter_ptr<CharT> (const std::string &argument)> factory_type ;
+			FilterRegistry() ;
+			void add(const std::string &name, basic_filter_ptr<CharT> filter)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex) ;
+				m_filters[name] = filter ;
+			}
+			void add(const std::string &name, factory_type factory)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex) ;
+				m_factories[name] = factory ;
+			}
+			// a plain filter by its full name, otherwise name:argument
+			// through a factory; a bare factory name gets an empty argument
+			basic_filter_ptr<CharT> get(const std::string &name)
+			{
+				factory_type made_by ;
+				const size_t colon = name.find(':') ;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex) ;
+					typename std::map<std::string, basic_filter_ptr<CharT> >::iterator it = m_filters.find(name) ;
+					if (it != m_filters.end())
+					{
+						return it->second ;
+					}
+					typename std::map<std::string, factory_type>::iterator made = m_factories.find(name.substr(0, colon)) ;
+					if (made == m_factories.end())
+					{
+						throw TemplateException("Unknown filter: " + name) ;
+					}
+					made_by = made->second ;
+				}
+				return made_by(colon == std::string::npos ? std::string() : name.substr(colon + 1)) ;
+			}
+		private:
+			std::mutex m_mutex ;
+			std::map<std::string, basic_filter_ptr<CharT> > m_filters ;
+			std::map<std::string, factory_type> m_factories ;
+		};
+
+		void add_builtin_filters(FilterRegistry<char> &registry)
+		{
+			registry.add("html", filter_ptr(new EscapeFilter<HtmlEscaper>)) ;
+			registry.add("url", filter_ptr(new EscapeFilter<UrlEscaper>)) ;
+			registry.add("json", filter_ptr(new EscapeFilter<JsonEscaper>)) ;
+			registry.add("raw", filter_ptr(new RawFilter<char>)) ;
+			registry.add("fixed", make_fixed_filter<char>) ;
+			registry.add("thousands", make_thousands_filter<char>) ;
+		}
+		template<typename CharT>
+		void add_builtin_filters(FilterRegistry<CharT> &registry)
+		{
+			registry.add("html", basic_filter_ptr<CharT>(new WideEscapeFilter<CharT, HtmlEscaper>)) ;
+			registry.add("url", basic_filter_ptr<CharT>(new WideEscapeFilter<CharT, UrlEscaper>)) ;
+			registry.add("json", basic_filter_ptr<CharT>(new WideEscapeFilter<CharT, JsonEscaper>)) ;
+			registry.add("raw", basic_filter_ptr<CharT>(new RawFilter<CharT>)) ;
+			registry.add("fixed", make_fixed_filter<CharT>) ;
+			registry.add("thousands", make_thousands_filter<CharT>) ;
+		}
+
+		template<typename CharT>
+		FilterRegistry<CharT>::FilterRegistry()
+		{
+			add_builtin_filters(*this) ;
+		}
+
+		template<typename CharT>
+		FilterRegistry<CharT>& filter_registry()
+		{
+			static FilterRegistry<CharT> registry ;
+			return registry ;
+		}
+	}
+
+	void register_filter(std::string name, filter_ptr filter)
+	{
+		filter_registry<char>().add(name, filter) ;
+	}
+	void register_filter(std::string name, wfilter_ptr filter)
+	{
+		filter_registry<wchar_t>().add(name, filter) ;
+	}
+	void register_filter(std::string name, u16filter_ptr filter)
+	{
+		filter_registry<char16_t>().add(name, filter) ;
+	}
+	void register_filter(std::string name, filter_function filter)
+	{
+		filter_registry<char>().add(name, filter_ptr(new FunctionFilter(filter))) ;
+	}
+	void register_filter_factory(std::string name, filter_factory factory)
+	{
+		filter_registry<char>().add(name, factory) ;
+	}
+	filter_ptr get_filter(std::string name)
+	{
+		return filter_registry<char>().get(name) ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Token classes
+	//////////////////////////////////////////////////////////////////////////
+
+	// defaults, overridden by subclasses with children
+	template<typename CharT>
+	void basic_Token<CharT>::set_children( basic_token_vector<CharT> & )
+	{
+		throw TemplateException("This token type cannot have children") ;
+	}
+
+	template<typename CharT>
+	basic_token_vector<CharT> & basic_Token<CharT>::get_children()
+	{
+		throw TemplateException("This token type cannot have children") ;
+	}
+
+	template<typename CharT>
+	void basic_Token<CharT>::set_position( size_t line, size_t column )
+	{
+		m_line = line ;
+		m_column = column ;
+	}
+	template<typename CharT>
+	size_t basic_Token<CharT>::getline()
+	{
+		return m_line ;
+	}
+	template<typename CharT>
+	size_t basic_Token<CharT>::getcolumn()
+	{
+		return m_column ;
+	}
+
+	// TokenText
+	template<typename CharT>
+	TokenType basic_TokenText<CharT>::gettype()
+	{
+		return TOKEN_TYPE_TEXT ;
+	}
+
+	template<typename CharT>
+	void basic_TokenText<CharT>::gettext( std::basic_ostream<CharT> &stream, basic_data_map<CharT> &, RenderContext &context )
+	{
+		context.write_static(stream, m_text) ;
+	}
+
+	template<typename CharT>
+	std::string basic_TokenText<CharT>::describe()
+	{
+		return "text" ;
+	}
+
+	template<typename CharT>
+	typename basic_TokenText<CharT>::string_type basic_TokenText<CharT>::getvalue()
+	{
+		return m_text ;
+	}
+
+	// TokenVar
+	namespace
+	{
+		// the missing-key callback for a template's character type
+		template<typename CharT>
+		const basic_missing_key_callback<CharT> &missing_key_handler(const CompileOptions &options) ;
+		template<>
+		const missing_key_callback &missing_key_handler<char>(const CompileOptions &options)
+		{
+			return options.on_missing_key ;
+		}
+		template<>
+		const wmissing_key_callback &missing_key_handler<wchar_t>(const CompileOptions &options)
+		{
+			return options.on_missing_wkey ;
+		}
+		template<>
+		const u16missing_key_callback &missing_key_handler<char16_t>(const CompileOptions &options)
+		{
+			return options.on_missing_u16key ;
+		}
+	}
+
+	template<typename CharT>
+	basic_TokenVar<CharT>::basic_TokenVar(string_type expr, const CompileOptions &options) : 
+		m_placeholder(widen_ascii<CharT>("{$") + expr + CharT('}')), 
+		m_missing_key(options.missing_key), 
+		m_on_missing_key(missing_key_handler<CharT>(options))
+	{
+		std::vector<string_type> names ;
+		boost::split(names, expr, [](CharT ch) { return ch == '|' ; }) ;
+		m_key = trim_spaces(names[0]) ;
+		bool raw = false ;
+		bool escaped = false ;
+		for (size_t i = 1 ; i < names.size() ; ++i)
+		{
+			const std::string name = narrow_text(trim_spaces(names[i])) ;
+			raw = name == "raw" ;
+			escaped = escaped || name == options.autoescape ;
+			m_filter_names.push_back(name) ;
+		}
+		if (! options.autoescape.empty() && ! raw && ! escaped)
+		{
+			m_filter_names.push_back(options.autoescape) ;
+		}
+		set_filters(m_filter_names) ;
+	}
+
+	template<typename CharT>
+	basic_TokenVar<CharT>::basic_TokenVar(string_type expr, string_type key, const std::vector<std::string> &filters, 
+		const CompileOptions &options) : 
+		m_key(key), 
+		m_placeholder(widen_ascii<CharT>("{$") + expr + CharT('}')), 
+		m_missing_key(options.missing_key), 
+		m_on_missing_key(missing_key_handler<CharT>(options))
+	{
+		set_filters(filters) ;
+	}
+
+	template<typename CharT>
+	TokenType basic_TokenVar<CharT>::gettype()
+	{
+		return TOKEN_TYPE_VAR ;
+	}
+
+	template<typename CharT>
+	void basic_TokenVar<CharT>::gettext( std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context )
+	{
+		basic_data_ptr<CharT> value ;
+		if (find_val<CharT>(m_key, data, value))
+		{
+			if (const string_type *text = value->peekvalue())
+			{
+				write_filtered(stream, *text, context) ;
+			}
+			else
+			{
+				write_filtered(stream, value->getvalue(), context) ;
+			}
+			return ;
+		}
+		// what stands in for the value is filtered like the value, so that
+		// auto-escaping covers it too
+		switch (m_missing_key)
+		{
+		case MISSING_KEY_ECHO:
+			write_filtered(stream, m_placeholder, context) ;
+			break ;
+		case MISSING_KEY_EMPTY:
+			break ;
+		case MISSING_KEY_THROW:
+			throw TemplateException("Missing key: " + narrow_text(m_key)) ;
+		case MISSING_KEY_CALLBACK:
+			if (m_on_missing_key)
+			{
+				write_filtered(stream, m_on_missing_key(m_key), context) ;
+			}
+			break ;
+		}
+	}
+
+	template<typename CharT>
+	void basic_TokenVar<CharT>::write_filtered( std::basic_ostream<CharT> &stream, const string_type &value, RenderContext &context )
+	{
+		if (m_filters.empty())
+		{
+			context.write(stream, value) ;
+			return ;
+		}
+		string_type text = value ;
+		for (size_t i = 0 ; i + 1 < m_filters.size() ; ++i)
+		{
+			basic_PooledBuffer<CharT> filtered ;
+			RenderContext scratch ;
+			m_filters[i]->apply(text, filtered.stream(), scratch) ;
+			text.swap(filtered.str()) ;
+		}
+		m_filters.back()->apply(text, stream, context) ;
+	}
+
+	template<typename CharT>
+	std::string basic_TokenVar<CharT>::describe()
+	{
+		return narrow_text(m_placeholder) ;
+	}
+
+	template<typename CharT>
+	typename basic_TokenVar<CharT>::string_type basic_TokenVar<CharT>::getexpr()
+	{
+		return m_placeholder.substr(2, m_placeholder.size() - 3) ;
+	}
+
+	template<typename CharT>
+	typename basic_TokenVar<CharT>::string_type basic_TokenVar<CharT>::getkey()
+	{
+		return m_key ;
+	}
+
+	template<typename CharT>
+	MissingKeyPolicy basic_TokenVar<CharT>::get_missing_key()
+	{
+		return m_missing_key ;
+	}
+
+	template<typename CharT>
+	std::vector<std::string> basic_TokenVar<CharT>::getfilters()
+	{
+		return m_filter_names ;
+	}
+
+	template<typename CharT>
+	void basic_TokenVar<CharT>::set_filters( const std::vector<std::string> &names )
+	{
+		std::vector<basic_filter_ptr<CharT> > filters ;
+		for (size_t i = 0 ; i < names.size() ; ++i)
+		{
+			filters.push_back(filter_registry<CharT>().get(names[i])) ;
+		}
+		m_filters.swap(filters) ;
+		m_filter_names = names ;
+	}
+
+	// TokenFor
+	namespace
+	{
+		// the names a loop binds, as strings of the template's characters
+		template<typename CharT>
+		struct LoopNames
+		{
+			LoopNames() : loop(widen_ascii<CharT>("loop")), index(widen_ascii<CharT>("index")), 
+				index0(widen_ascii<CharT>("index0")){}
+			static const LoopNames &get()
+			{
+				static const LoopNames names ;
+				return names ;
+			}
+			const std::basic_string<CharT> loop ;
+			const std::basic_string<CharT> index ;
+			const std::basic_string<CharT> index0 ;
+		};
+
+		// loop.index and loop.index0 for one iteration
+		template<typename CharT>
+		class LoopData : public basic_Data<CharT>
+		{
+			basic_data_ptr<CharT> m_index ;
+			basic_data_ptr<CharT> m_index0 ;
+		public:
+			LoopData(basic_data_ptr<CharT> index, basic_data_ptr<CharT> index0) : m_index(index), m_index0(index0){}
+			bool empty()
+			{
+				return false ;
+			}
+			bool getmember(const std::basic_string<CharT> &key, basic_data_ptr<CharT> &value)
+			{
+				if (key == LoopNames<CharT>::get().index)
+				{
+					value = m_index ;
+					return true ;
+				}
+				if (key == LoopNames<CharT>::get().index0)
+				{
+					value = m_index0 ;
+					return true ;
+				}
+				return false ;
+			}
+		};
+	}
+
+	template<typename CharT>
+	basic_TokenFor<CharT>::basic_TokenFor(string_type expr, const CompileOptions &options) : 
+		m_missing_key(options.missing_key), m_reversed(false)
+	{
+		std::vector<string_type> elements = split_spaces(expr) ;
+		if (elements.size() < 4u)
+		{
+			throw TemplateException("Invalid syntax in for statement") ;
+		}
+		m_val = elements[1] ;
+		m_key = elements[3] ;
+		for (size_t i = 4 ; i < elements.size() ; ++i)
+		{
+			const string_type &option = elements[i] ;
+			if (option.empty())
+			{
+				continue ;
+			}
+			if (equals(option, "reversed"))
+			{
+				m_reversed = true ;
+				continue ;
+			}
+			const size_t colon = option.find(CharT(':')) ;
+			const string_type name = option.substr(0, colon) ;
+			string_type *operand = equals(name, "limit") ? &m_limit 
+				: equals(name, "offset") ? &m_offset 
+				: equals(name, "step") ? &m_step : NULL ;
+			if (! operand || colon == string_type::npos || colon + 1 == option.size())
+			{
+				throw TemplateException("Invalid option in for statement: " + narrow_text(option)) ;
+			}
+			*operand = option.substr(colon + 1) ;
+		}
+		if (equals(m_step, "0"))
+		{
+			throw TemplateException("Invalid option in for statement: step:0") ;
+		}
+	}
+
+	template<typename CharT>
+	basic_TokenFor<CharT>::basic_TokenFor(string_type val, string_type key, string_type limit, string_type offset, 
+		string_type step, bool reversed, const CompileOptions &options) : 
+		m_key(key), m_val(val), m_missing_key(options.missing_key), 
+		m_limit(limit), m_offset(offset), m_step(step), m_reversed(reversed)
+	{
+		if (equals(m_step, "0"))
+		{
+			throw TemplateException("Invalid option in for statement: step:0") ;
+		}
+	}
+
+	template<typename CharT>
+	TokenType basic_TokenFor<CharT>::gettype()
+	{
+		return TOKEN_TYPE_FOR ;
+	}
+
+	template<typename CharT>
+	void basic_TokenFor<CharT>::gettext( std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context )
+	{
+		basic_data_ptr<CharT> value ;
+		if (! find_val<CharT>(m_key, data, value))
+		{
+			// a missing list is an empty loop, unless asked to be strict
+			if (m_missing_key == MISSING_KEY_THROW)
+			{
+				throw TemplateException("Missing key: " + narrow_text(m_key)) ;
+			}
+			return ;
+		}
+		const size_t size = value->getsize() ;
+		const size_t first = std::min(bound(m_offset, data, 0), size) ;
+		const size_t end = first + std::min(bound(m_limit, data, size), size - first) ;
+		const size_t step = bound(m_step, data, 1) ;
+		if (step == 0)
+		{
+			throw TemplateException("Invalid option in for statement: step:0") ;
+		}
+		const size_t count = end > first ? (end - first - 1) / step + 1 : 0 ;
+		const string_type &loop = LoopNames<CharT>::get().loop ;
+		for (size_t i = 0 ; i < count ; ++i)
+		{
+			context.iteration() ;
+			const size_t item = first + (m_reversed ? count - 1 - i : i) * step ;
+			data[loop] = basic_data_ptr<CharT>(std::shared_ptr<basic_Data<CharT> >(std::make_shared<LoopData<CharT> >(
+				make_data(widen_ascii<CharT>(format_number(i+1))), 
+				make_data(widen_ascii<CharT>(format_number(i)))))) ;
+			data[m_val] = value->getitem(item) ;
+			render_tokens(m_children, stream, data, context) ;
+		}
+	}
+
+	// a loop option's value; fallback if the option is absent or its
+	// data path is missing
+	template<typename CharT>
+	size_t basic_TokenFor<CharT>::bound( const string_type &operand, basic_data_map<CharT> &data, size_t fallback )
+	{
+		if (operand.empty())
+		{
+			return fallback ;
+		}
+		string_type text = operand ;
+		if (! is_digits(operand))
+		{
+			basic_data_ptr<CharT> value ;
+			if (! find_val<CharT>(operand, data, value))
+			{
+				if (m_missing_key == MISSING_KEY_THROW)
+				{
+					throw TemplateException("Missing key: " + narrow_text(operand)) ;
+				}
+				return fallback ;
+			}
+			text = value->getvalue() ;
+		}
+		try
+		{
+			// lexical_cast would wrap a leading minus sign around
+			if (text.empty() || ! is_digits(text))
+			{
+				throw boost::bad_lexical_cast() ;
+			}
+			return boost::lexical_cast<size_t>(narrow_text(text)) ;
+		}
+		catch (boost::bad_lexical_cast &)
+		{
+			throw TemplateException("Invalid number in for statement: " + narrow_text(operand)) ;
+		}
+	}
+
+	template<typename CharT>
+	typename basic_TokenFor<CharT>::string_type basic_TokenFor<CharT>::getoptions()
+	{
+		string_type options ;
+		if (! m_limit.empty())
+		{
+			options += widen_ascii<CharT>(" limit:") + m_limit ;
+		}
+		if (! m_offset.empty())
+		{
+			options += widen_ascii<CharT>(" offset:") + m_offset ;
+		}
+		if (! m_step.empty())
+		{
+			options += widen_ascii<CharT>(" step:") + m_step ;
+		}
+		if (m_reversed)
+		{
+			options += widen_ascii<CharT>(" reversed") ;
+		}
+		return trim_spaces(options) ;
+	}
+
+	template<typename CharT>
+	void basic_TokenFor<CharT>::set_children( basic_token_vector<CharT> &children )
+	{
+		m_children.assign(children.begin(), children.end()) ;
+	}
+
+	template<typename CharT>
+	basic_token_vector<CharT> & basic_TokenFor<CharT>::get_children()
+	{
+		return m_children;
+	}
+
+	template<typename CharT>
+	std::string basic_TokenFor<CharT>::describe()
+	{
+		const std::string options = narrow_text(getoptions()) ;
+		return "{% for " + narrow_text(m_val) + " in " + narrow_text(m_key) + (options.empty() ? "" : " " + options) + " %}" ;
+	}
+
+	// TokenIf
+	namespace
+	{
+		// compares two values without copying those held as strings
+		template<typename CharT>
+		bool same_value(basic_data_ptr<CharT> &lhs, basic_data_ptr<CharT> &rhs)
+		{
+			const std::basic_string<CharT> *left = lhs->peekvalue() ;
+			const std::basic_string<CharT> *right = rhs->peekvalue() ;
+			if (left && right)
+			{
+				return *left == *right ;
+			}
+			if (left)
+			{
+				return *left == rhs->getvalue() ;
+			}
+			if (right)
+			{
+				return lhs->getvalue() == *right ;
+			}
+			return lhs->getvalue() == rhs->getvalue() ;
+		}
+	}
+
+	template<typename CharT>
+	basic_TokenIf<CharT>::basic_TokenIf(string_type expr, const CompileOptions &options) : 
+		m_expr(expr), 
+		m_test(IF_NOT_EMPTY), 
+		m_missing_key(options.missing_key), 
+		m_on_missing_key(missing_key_handler<CharT>(options))
+	{
+		std::vector<string_type> elements = split_spaces(expr) ;
+		if (elements.size() > 2 && equals(elements[1], "not"))
+		{
+			m_test = IF_EMPTY ;
+			m_lhs = elements[2] ;
+		}
+		else if (elements.size() == 2 && ! equals(elements[1], "not"))
+		{
+			m_lhs = elements[1] ;
+		}
+		else if (elements.size() > 3)
+		{
+			m_test = equals(elements[2], "==") ? IF_EQUAL : IF_NOT_EQUAL ;
+			m_lhs = elements[1] ;
+			m_rhs = elements[3] ;
+		}
+		else
+		{
+			throw TemplateException("Invalid syntax in if statement") ;
+		}
+		add_placeholder(m_lhs) ;
+		add_placeholder(m_rhs) ;
+	}
+
+	template<typename CharT>
+	basic_TokenIf<CharT>::basic_TokenIf(string_type expr, IfTest test, string_type lhs, string_type rhs, 
+		const CompileOptions &options) : 
+		m_expr(expr), 
+		m_test(test), 
+		m_lhs(lhs), 
+		m_rhs(rhs), 
+		m_missing_key(options.missing_key), 
+		m_on_missing_key(missing_key_handler<CharT>(options))
+	{
+		add_placeholder(m_lhs) ;
+		add_placeholder(m_rhs) ;
+	}
+
+	template<typename CharT>
+	void basic_TokenIf<CharT>::add_placeholder( const string_type &key )
+	{
+		if (m_missing_key == MISSING_KEY_ECHO && ! key.empty() && key[0] != '"')
+		{
+			m_placeholders.push_back(std::make_pair(key, make_data(widen_ascii<CharT>("{$") + key + CharT('}')))) ;
+		}
+	}
+
+	template<typename CharT>
+	TokenType basic_TokenIf<CharT>::gettype()
+	{
+		return TOKEN_TYPE_IF ;
+	}
+
+	template<typename CharT>
+	void basic_TokenIf<CharT>::gettext( std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context )
+	{
+		if (is_true(data))
+		{
+			render_tokens(m_children, stream, data, context) ;
+		}
+	}
+
+	template<typename CharT>
+	bool basic_TokenIf<CharT>::is_true( basic_data_map<CharT> &data )
+	{
+		if (m_test == IF_EMPTY)
+		{
+			return operand(m_lhs, data)->empty() ;
+		}
+		if (m_test == IF_NOT_EMPTY)
+		{
+			return ! operand(m_lhs, data)->empty() ;
+		}
+		basic_data_ptr<CharT> lhs = operand(m_lhs, data) ;
+		basic_data_ptr<CharT> rhs = operand(m_rhs, data) ;
+		return same_value(lhs, rhs) == (m_test == IF_EQUAL) ;
+	}
+
+	// looks up one side of the condition, applying the missing-key policy
+	template<typename CharT>
+	basic_data_ptr<CharT> basic_TokenIf<CharT>::operand( const string_type &key, basic_data_map<CharT> &data )
+	{
+		basic_data_ptr<CharT> value ;
+		if (find_val<CharT>(key, data, value))
+		{
+			return value ;
+		}
+		switch (m_missing_key)
+		{
+		case MISSING_KEY_ECHO:
+			for (size_t i = 0 ; i < m_placeholders.size() ; ++i)
+			{
+				if (m_placeholders[i].first == key)
+				{
+					return m_placeholders[i].second ;
+				}
+			}
+			// an expression other than the token's own
+			return make_data(widen_ascii<CharT>("{$") + key + CharT('}')) ;
+		case MISSING_KEY_THROW:
+			throw TemplateException("Missing key: " + narrow_text(key)) ;
+		case MISSING_KEY_CALLBACK:
+			if (m_on_missing_key)
+			{
+				// compared as the text {$key} would render
+				return make_data(m_on_missing_key(key)) ;
+			}
+			break ;
+		default:
+			break ;
+		}
+		static basic_data_ptr<CharT> empty_value = make_data(string_type()) ;
+		return empty_value ;
+	}
+
+	template<typename CharT>
+	void basic_TokenIf<CharT>::set_children( basic_token_vector<CharT> &children )
+	{
+		m_children.assign(children.begin(), children.end()) ;
+	}
+
+	template<typename CharT>
+	basic_token_vector<CharT> & basic_TokenIf<CharT>::get_children()
+	{
+		return m_children;
+	}
+
+	template<typename CharT>
+	std::string basic_TokenIf<CharT>::describe()
+	{
+		return "{% " + narrow_text(m_expr) + " %}" ;
+	}
+
+	namespace
+	{
+		// the quoted name in e.g. include "header.html"
+		std::string quoted_name(const std::string &expr, const std::string &statement)
+		{
+			const size_t open = expr.find('"') ;
+			const size_t close = expr.rfind('"') ;
+			if (open == std::string::npos || close <= open + 1)
+			{
+				throw TemplateException("Invalid syntax in " + statement + " statement") ;
+			}
+			return expr.substr(open + 1, close - open - 1) ;
+		}
+	}
+
+	// TokenInclude
+	TokenInclude::TokenInclude(std::string expr) : 
+		m_name(quoted_name(expr, "include"))
+	{
+	}
+
+	TokenType TokenInclude::gettype()
+	{
+		return TOKEN_TYPE_INCLUDE ;
+	}
+
+	void TokenInclude::gettext( std::ostream &stream, data_map &data, RenderContext &context )
+	{
+		if (! m_partial)
+		{
+			throw TemplateException("Include was not resolved: " + m_name) ;
+		}
+		render_tokens(*m_partial, stream, data, context) ;
+	}
+
+	std::string TokenInclude::describe()
+	{
+		return "{% include \"" + m_name + "\" %}" ;
+	}
+
+	std::string TokenInclude::getname()
+	{
+		return m_name ;
+	}
+
+	void TokenInclude::set_partial( std::shared_ptr<token_vector> partial )
+	{
+		m_partial = partial ;
+	}
+
+	std::shared_ptr<token_vector> TokenInclude::getpartial()
+	{
+		return m_partial ;
+	}
+
+	// TokenBlock
+	TokenBlock::TokenBlock(std::string expr)
+	{
+		std::vector<std::string> elements ;
+		boost::split(elements, expr, boost::is_space(), boost::token_compress_on) ;
+		if (elements.size() != 2u)
+		{
+			throw TemplateException("Invalid syntax in block statement") ;
+		}
+		m_name = elements[1] ;
+	}
+
+	TokenType TokenBlock::gettype()
+	{
+		return TOKEN_TYPE_BLOCK ;
+	}
+
+	void TokenBlock::gettext( std::ostream &stream, data_map &data, RenderContext &context )
+	{
+		render_tokens(m_children, stream, data, context) ;
+	}
+
+	void TokenBlock::set_children( token_vector &children )
+	{
+		m_children.assign(children.begin(), children.end()) ;
+	}
+
+	token_vector & TokenBlock::get_children()
+	{
+		return m_children ;
+	}
+
+	std::string TokenBlock::describe()
+	{
+		return "{% block " + m_name + " %}" ;
+	}
+
+	std::string TokenBlock::getname()
+	{
+		return m_name ;
+	}
+
+	// TokenExtends
+	TokenExtends::TokenExtends(std::string expr) : 
+		m_name(quoted_name(expr, "extends"))
+	{
+	}
+
+	TokenType TokenExtends::gettype()
+	{
+		return TOKEN_TYPE_EXTENDS ;
+	}
+
+	void TokenExtends::gettext( std::ostream &, data_map &, RenderContext & )
+	{
+		throw TemplateException("Template inheritance is resolved when compiling a Template") ;
+	}
+
+	std::string TokenExtends::describe()
+	{
+		return "{% extends \"" + m_name + "\" %}" ;
+	}
+
+	std::string TokenExtends::getname()
+	{
+		return m_name ;
+	}
+
+	// TokenCache
+	TokenCache::TokenCache(std::string expr, const CompileOptions &options) : 
+		m_expr(expr), m_ttl(-1), m_cache(options.fragment_cache)
+	{
+		static std::atomic<unsigned long long> next_id(0) ;
+		m_id = ++next_id ;
+
+		std::vector<std::string> elements ;
+		boost::split(elements, expr, boost::is_space(), boost::token_compress_on) ;
+		for (size_t i = 1 ; i < elements.size() ; ++i)
+		{
+			if (boost::starts_with(elements[i], "ttl="))
+			{
+				try
+				{
+					m_ttl = boost::lexical_cast<int>(elements[i].substr(4)) ;
+				}
+				catch (boost::bad_lexical_cast &)
+				{
+					throw TemplateException("Invalid ttl in cache statement") ;
+				}
+			}
+			else if (! elements[i].empty())
+			{
+				m_keys.push_back(elements[i]) ;
+			}
+		}
+	}
+
+	TokenType TokenCache::gettype()
+	{
+		return TOKEN_TYPE_CACHE ;
+	}
+
+	void TokenCache::gettext( std::ostream &stream, data_map &data, RenderContext &context )
+	{
+		if (! m_cache)
+		{
+			render_tokens(m_children, stream, data, context) ;
+			return ;
+		}
+		// each part is marked present or missing and carries its length,
+		// so that no two sets of values can make the same key
+		std::string key = format_number(m_id) ;
+		for (size_t i = 0 ; i < m_keys.size() ; ++i)
+		{
+			data_ptr value ;
+			if (! find_val(m_keys[i], data, value))
+			{
+				key += '-' ;
+				continue ;
+			}
+			const std::string text = value->getvalue() ;
+			key += '+' ;
+			key += format_number(text.size()) ;
+			key += ':' ;
+			key += text ;
+		}
+
+		std::shared_ptr<const std::string> fragment = m_cache->get(key) ;
+		if (fragment)
+		{
+			count(STAT_FRAGMENT_HITS) ;
+			context.write(stream, *fragment) ;
+			return ;
+		}
+		count(STAT_FRAGMENT_MISSES) ;
+		// static text has to land in the fragment too, not in gathered output
+		PooledBuffer rendered ;
+		const size_t bytes_before = context.m_bytes ;
+		GatherOutput *gather = context.m_gather ;
+		context.m_gather = NULL ;
+		try
+		{
+			render_tokens(m_children, rendered.stream(), data, context) ;
+		}
+		catch (...)
+		{
+			context.m_gather = gather ;
+			throw ;
+		}
+		context.m_gather = gather ;
+		context.m_bytes = bytes_before ;
+		fragment.reset(new std::string(rendered.str())) ;
+		m_cache->put(key, fragment, m_ttl) ;
+		context.write(stream, *fragment) ;
+	}
+
+	void TokenCache::set_children( token_vector &children )
+	{
+		m_children.assign(children.begin(), children.end()) ;
+	}
+
+	token_vector & TokenCache::get_children()
+	{
+		return m_children ;
+	}
+
+	std::string TokenCache::describe()
+	{
+		return "{% " + m_expr + " %}" ;
+	}
+
+	std::string TokenCache::getexpr()
+	{
+		return m_expr ;
+	}
+
+	std::vector<std::string> TokenCache::getkeys()
+	{
+		return m_keys ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// FragmentCache
+	//////////////////////////////////////////////////////////////////////////
+	FragmentCache::FragmentCache(size_t max_bytes, unsigned ttl_seconds) : 
+		m_max_bytes(max_bytes), m_ttl(ttl_seconds), m_bytes(0)
+	{
+	}
+
+	std::shared_ptr<const std::string> FragmentCache::get(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex) ;
+		std::unordered_map<std::string, entry_list::iterator>::iterator it = m_index.find(key) ;
+		if (it == m_index.end())
+		{
+			return std::shared_ptr<const std::string>() ;
+		}
+		entry_list::iterator entry = it->second ;
+		if (entry->expiring && entry->expires <= std::chrono::steady_clock::now())
+		{
+			erase(entry) ;
+			return std::shared_ptr<const std::string>() ;
+		}
+		m_entries.splice(m_entries.begin(), m_entries, entry) ;
+		return entry->fragment ;
+	}
+
+	void FragmentCache::put(const std::string &key, std::shared_ptr<const std::string> fragment, int ttl_seconds)
+	{
+		const size_t size = key.size() + fragment->size() ;
+		const unsigned ttl = ttl_seconds < 0 ? m_ttl : unsigned(ttl_seconds) ;
+		std::lock_guard<std::mutex> lock(m_mutex) ;
+		std::unordered_map<std::string, entry_list::iterator>::iterator it = m_index.find(key) ;
+		if (it != m_index.end())
+		{
+			erase(it->second) ;
+		}
+		if (size > m_max_bytes)
+		{
+			return ;
+		}
+		while (m_bytes + size > m_max_bytes)
+		{
+			erase(--m_entries.end()) ;
+		}
+		Entry entry ;
+		entry.key = key ;
+		entry.fragment = fragment ;
+		entry.expiring = ttl != 0 ;
+		entry.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttl) ;
+		m_entries.push_front(entry) ;
+		m_index[key] = m_entries.begin() ;
+		m_bytes += size ;
+	}
+
+	void FragmentCache::erase(entry_list::iterator entry)
+	{
+		m_bytes -= entry->key.size() + entry->fragment->size() ;
+		m_index.erase(entry->key) ;
+		m_entries.erase(entry) ;
+	}
+
+	void FragmentCache::clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex) ;
+		m_entries.clear() ;
+		m_index.clear() ;
+		m_bytes = 0 ;
+	}
+
+	size_t FragmentCache::bytes()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex) ;
+		return m_bytes ;
+	}
+
+	size_t FragmentCache::count()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex) ;
+		return m_entries.size() ;
+	}
+
+	// TokenEnd
+	template<typename CharT>
+	TokenType basic_TokenEnd<CharT>::gettype()
+	{
+		if (starts_with(m_type, "endblock"))
+		{
+			return TOKEN_TYPE_ENDBLOCK ;
+		}
+		if (equals(m_type, "endcache"))
+		{
+			return TOKEN_TYPE_ENDCACHE ;
+		}
+		return equals(m_type, "endfor") ? TOKEN_TYPE_ENDFOR : TOKEN_TYPE_ENDIF ;
+	}
+
+	template<typename CharT>
+	void basic_TokenEnd<CharT>::gettext( std::basic_ostream<CharT> &, basic_data_map<CharT> &, RenderContext &)
+	{
+		throw TemplateException("End-of-control statements have no associated text") ;
+	}
+
+	template<typename CharT>
+	std::string basic_TokenEnd<CharT>::describe()
+	{
+		return "{% " + narrow_text(m_type) + " %}" ;
+	}
+
+	// gettext
+	// generic helper for getting text from tokens.
+
+	template<typename CharT>
+    std::basic_string<CharT> gettext(basic_token_ptr<CharT> token, basic_data_map<CharT> &data)
+	{
+		basic_PooledBuffer<CharT> buffer ;
+		RenderContext context ;
+		token->gettext(buffer.stream(), data, context) ;
+		return buffer.str() ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Render limits
+	//////////////////////////////////////////////////////////////////////////
+	void RenderContext::exceeded( RenderLimit limit )
+	{
+		switch (limit)
+		{
+		case RENDER_LIMIT_DEADLINE:
+			throw RenderLimitException(limit, "Render deadline passed") ;
+		case RENDER_LIMIT_BYTES:
+			throw RenderLimitException(limit, "Render output limit of " + format_number(m_max_bytes) + " bytes reached") ;
+		default:
+			throw RenderLimitException(limit, "Render loop limit of " + format_number(m_max_iterations) + " iterations reached") ;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Profiler
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		unsigned long long elapsed_ns(std::chrono::steady_clock::time_point start)
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count() ;
+		}
+
+		// flame graph tools split frames on ';'
+		template<typename CharT>
+		std::string frame_name(basic_Token<CharT> *token)
+		{
+			std::string name = token->describe() ;
+			std::replace(name.begin(), name.end(), ';', ',') ;
+			return name + "@" + format_number(token->getline()) + ":" + format_number(token->getcolumn()) ;
+		}
+
+		struct NodeCost
+		{
+			NodeCost(ProfileSort sort_by) : m_sort_by(sort_by){}
+			unsigned long long cost(const Profiler::NodeStats &node) const
+			{
+				switch (m_sort_by)
+				{
+				case PROFILE_SORT_EXCLUSIVE:
+					return node.exclusive_ns ;
+				case PROFILE_SORT_CALLS:
+					return node.calls ;
+				case PROFILE_SORT_BYTES:
+					return node.bytes ;
+				default:
+					return node.inclusive_ns ;
+				}
+			}
+			bool operator()(const Profiler::NodeStats &lhs, const Profiler::NodeStats &rhs) const
+			{
+				return cost(lhs) > cost(rhs) ;
+			}
+			ProfileSort m_sort_by ;
+		};
+	}
+
+	const size_t Profiler::NO_PATH ;
+
+	template<typename CharT>
+	size_t Profiler::node_id( const basic_token_ptr<CharT> &token )
+	{
+		std::unordered_map<const void*, size_t>::iterator seen = m_token_nodes.find(token.get()) ;
+		if (seen != m_token_nodes.end())
+		{
+			return seen->second ;
+		}
+		const std::string name = frame_name(token.get()) ;
+		std::unordered_map<std::string, size_t>::iterator named = m_node_ids.find(name) ;
+		size_t id = 0 ;
+		if (named != m_node_ids.end())
+		{
+			id = named->second ;
+		}
+		else
+		{
+			id = m_nodes.size() ;
+			NodeStats node ;
+			node.label = token->describe() ;
+			node.line = token->getline() ;
+			node.column = token->getcolumn() ;
+			m_nodes.push_back(node) ;
+			m_names.push_back(name) ;
+			m_node_ids[name] = id ;
+		}
+		m_token_nodes[token.get()] = id ;
+		m_tokens.push_back(token) ;
+		return id ;
+	}
+
+	size_t Profiler::path_id( size_t parent, size_t node )
+	{
+		const unsigned long long key = (static_cast<unsigned long long>(parent + 1) << 32) | node ;
+		std::unordered_map<unsigned long long, size_t>::iterator found = m_path_ids.find(key) ;
+		if (found != m_path_ids.end())
+		{
+			return found->second ;
+		}
+		Path path ;
+		path.parent = parent ;
+		path.node = node ;
+		path.exclusive_ns = 0 ;
+		m_paths.push_back(path) ;
+		m_path_ids[key] = m_paths.size() - 1 ;
+		return m_paths.size() - 1 ;
+	}
+
+	std::string Profiler::path_name( size_t path )
+	{
+		std::string name = m_names[m_paths[path].node] ;
+		for (size_t parent = m_paths[path].parent ; parent != NO_PATH ; parent = m_paths[parent].parent)
+		{
+			name = m_names[m_paths[parent].node] + ";" + name ;
+		}
+		return name ;
+	}
+
+	template<typename CharT>
+	void Profiler::render( basic_token_ptr<CharT> &token, std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context )
+	{
+		// the parent's clock is running; what is spent here outside the
+		// node's own clock is taken back out of the parent's exclusive time
+		const std::chrono::steady_clock::time_point entered = std::chrono::steady_clock::now() ;
+		const size_t node = node_id(token) ;
+		Frame frame ;
+		frame.child_ns = 0 ;
+		frame.path = path_id(m_stack.empty() ? NO_PATH : m_stack.back().path, node) ;
+		m_stack.push_back(frame) ;
+
+		const size_t bytes_before = context.m_bytes ;
+		m_stack.back().start = std::chrono::steady_clock::now() ;
+		try
+		{
+			token->gettext(stream, data, context) ;
+		}
+		catch (...)
+		{
+			m_stack.pop_back() ;
+			throw ;
+		}
+		const unsigned long long inclusive = elapsed_ns(m_stack.back().start) ;
+		const unsigned long long exclusive = inclusive - std::min(inclusive, m_stack.back().child_ns) ;
+
+		NodeStats &stats = m_nodes[node] ;
+		++stats.calls ;
+		stats.inclusive_ns += inclusive ;
+		stats.exclusive_ns += exclusive ;
+		stats.bytes += context.m_bytes - bytes_before ;
+		m_paths[m_stack.back().path].exclusive_ns += exclusive ;
+
+		m_stack.pop_back() ;
+		if (! m_stack.empty())
+		{
+			m_stack.back().child_ns += elapsed_ns(entered) ;
+		}
+	}
+
+	std::vector<Profiler::NodeStats> Profiler::nodes()
+	{
+		// in frame name order
+		std::map<std::string, size_t> order ;
+		for (size_t i = 0 ; i < m_names.size() ; ++i)
+		{
+			order[m_names[i]] = i ;
+		}
+		std::vector<NodeStats> result ;
+		for (std::map<std::string, size_t>::iterator it = order.begin() ; it != order.end() ; ++it)
+		{
+			result.push_back(m_nodes[it->second]) ;
+		}
+		return result ;
+	}
+
+	void Profiler::report( std::ostream &stream, ProfileSort sort_by )
+	{
+		std::vector<NodeStats> rows = nodes() ;
+		std::stable_sort(rows.begin(), rows.end(), NodeCost(sort_by)) ;
+		stream << "calls\tincl_us\texcl_us\tbytes\tline:col\tnode\n" ;
+		for (size_t i = 0 ; i < rows.size() ; ++i)
+		{
+			stream << rows[i].calls << "\t"
+				<< rows[i].inclusive_ns / 1000 << "\t"
+				<< rows[i].exclusive_ns / 1000 << "\t"
+				<< rows[i].bytes << "\t"
+				<< rows[i].line << ":" << rows[i].column << "\t"
+				<< rows[i].label << "\n" ;
+		}
+	}
+
+	void Profiler::collapsed( std::ostream &stream )
+	{
+		std::map<std::string, unsigned long long> stacks ;
+		for (size_t i = 0 ; i < m_paths.size() ; ++i)
+		{
+			stacks[path_name(i)] = m_paths[i].exclusive_ns ;
+		}
+		typedef std::map<std::string, unsigned long long>::iterator iterator ;
+		for (iterator it = stacks.begin() ; it != stacks.end() ; ++it)
+		{
+			stream << it->first << " " << it->second / 1000 << "\n" ;
+		}
+	}
+
+	void Profiler::clear()
+	{
+		m_nodes.clear() ;
+		m_names.clear() ;
+		m_node_ids.clear() ;
+		m_token_nodes.clear() ;
+		m_tokens.clear() ;
+		m_paths.clear() ;
+		m_path_ids.clear() ;
+	}
+	//////////////////////////////////////////////////////////////////////////
+	// parse_tree
+	// recursively parses list of tokens into a tree
+	//////////////////////////////////////////////////////////////////////////
+	template<typename CharT>
+	void parse_tree(basic_token_vector<CharT> &tokens, basic_token_vector<CharT> &tree, TokenType until)
+	{
+		while(! tokens.empty())
+		{
+			// 'pops' first item off list
+			basic_token_ptr<CharT> token = tokens[0] ;
+			tokens.erase(tokens.begin()) ;
+
+			if (token->gettype() == TOKEN_TYPE_FOR)
+			{
+				basic_token_vector<CharT> children ;
+				parse_tree(tokens, children, TOKEN_TYPE_ENDFOR) ;
+				token->set_children(children) ;
+			}
+			else if (token->gettype() == TOKEN_TYPE_IF)
+			{
+				basic_token_vector<CharT> children ;
+				parse_tree(tokens, children, TOKEN_TYPE_ENDIF) ;
+				token->set_children(children) ;
+			}
+			else if (token->gettype() == TOKEN_TYPE_BLOCK)
+			{
+				basic_token_vector<CharT> children ;
+				parse_tree(tokens, children, TOKEN_TYPE_ENDBLOCK) ;
+				token->set_children(children) ;
+			}
+			else if (token->gettype() == TOKEN_TYPE_CACHE)
+			{
+				basic_token_vector<CharT> children ;
+				parse_tree(tokens, children, TOKEN_TYPE_ENDCACHE) ;
+				token->set_children(children) ;
+			}
+			else if (token->gettype() == until)
+			{
+				return ;
+			}
+			tree.push_back(token) ;
+		}
+	}
+	//////////////////////////////////////////////////////////////////////////
+	// tokenize
+	// parses a template into tokens (text, for, if, variable)
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// maps offsets into the template source to line/column,
+		// scanning forward only once over the whole tokenize() pass
+		template<typename CharT>
+		class SourcePosition
+		{
+			const std::basic_string<CharT> &m_source ;
+			size_t m_offset ;
+			size_t m_line ;
+			size_t m_column ;
+		public:
+			SourcePosition(const std::basic_string<CharT> &source) : 
+				m_source(source), m_offset(0), m_line(1), m_column(1){}
+			void mark(basic_token_vector<CharT> &tokens, size_t offset)
+			{
+				for ( ; m_offset < offset && m_offset < m_source.size() ; ++m_offset)
+				{
+					if (m_source[m_offset] == '\n')
+					{
+						++m_line ;
+						m_column = 1 ;
+					}
+					else
+					{
+						++m_column ;
+					}
+				}
+				tokens.back()->set_position(m_line, m_column) ;
+			}
+		};
+
+		// include, block, extends and cache name other templates, which
+		// only char templates have; null for any other statement
+		token_ptr named_template_token(const std::string &expression, const CompileOptions &options)
+		{
+			if (starts_with(expression, "include"))
+			{
+				return token_ptr (new TokenInclude(expression)) ;
+			}
+			if (starts_with(expression, "block"))
+			{
+				return token_ptr (new TokenBlock(expression)) ;
+			}
+			if (starts_with(expression, "extends"))
+			{
+				return token_ptr (new TokenExtends(expression)) ;
+			}
+			if (starts_with(expression, "cache"))
+			{
+				return token_ptr (new TokenCache(expression, options)) ;
+			}
+			return token_ptr() ;
+		}
+		template<typename CharT>
+		basic_token_ptr<CharT> named_template_token(const std::basic_string<CharT> &expression, const CompileOptions &)
+		{
+			if (starts_with(expression, "include") || starts_with(expression, "block") 
+				|| starts_with(expression, "extends") || starts_with(expression, "cache"))
+			{
+				throw TemplateException("{% " + narrow_text(expression) + " %} needs a char template") ;
+			}
+			return basic_token_ptr<CharT>() ;
+		}
+	}
+
+	template<typename CharT>
+	basic_token_vector<CharT> & tokenize(typename type_identity<std::basic_string<CharT> >::type text, 
+		basic_token_vector<CharT> &tokens, const CompileOptions &options)
+	{
+		typedef std::basic_string<CharT> string_type ;
+		typedef basic_token_ptr<CharT> token_ptr ;
+		count(STAT_COMPILES) ;
+		const string_type source(text) ;
+		SourcePosition<CharT> position(source) ;
+		while(! text.empty())
+		{
+			size_t pos = text.find(CharT('{')) ;
+			if (pos == string_type::npos)
+			{
+				if (! text.empty())
+				{
+					tokens.push_back(token_ptr(new basic_TokenText<CharT>(text))) ;
+					position.mark(tokens, source.size() - text.size()) ;
+				}
+				return tokens ;
+			}
+            string_type pre_text = text.substr(0, pos) ;
+			if (! pre_text.empty())
+			{
+				tokens.push_back(token_ptr(new basic_TokenText<CharT>(pre_text))) ;
+				position.mark(tokens, source.size() - text.size()) ;
+			}
+			text = text.substr(pos+1) ;
+			// offset of the opening brace
+			const size_t brace = source.size() - text.size() - 1 ;
+			if (text.empty())
+			{
+				tokens.push_back(token_ptr(new basic_TokenText<CharT>(string_type(1, CharT('{'))))) ;
+				position.mark(tokens, brace) ;
+				return tokens ;
+			}
+
+			// variable
+			if (text[0] == '$')
+			{
+				pos = text.find(CharT('}')) ;
+				if (pos != string_type::npos)
+				{
+					tokens.push_back(token_ptr (new basic_TokenVar<CharT>(text.substr(1, pos-1), options))) ;
+					position.mark(tokens, brace) ;
+					text = text.substr(pos+1) ;
+				}
+			}
+			// control statement
+			else if (text[0] == '%')
+			{
+				pos = text.find(CharT('}')) ;
+				if (pos != string_type::npos)
+				{
+                    string_type expression = trim_spaces(text.substr(1, pos-2)) ;
+					text = text.substr(pos+1) ;
+					token_ptr named ;
+					if (starts_with(expression, "for"))
+					{
+						tokens.push_back(token_ptr (new basic_TokenFor<CharT>(expression, options))) ;
+					}
+					else if ((named = named_template_token(expression, options)))
+					{
+						tokens.push_back(named) ;
+					}
+					else if (starts_with(expression, "if"))
+					{
+						tokens.push_back(token_ptr (new basic_TokenIf<CharT>(expression, options))) ;
+					}
+					else
+					{
+						tokens.push_back(token_ptr (new basic_TokenEnd<CharT>(expression))) ;
+					}
+					position.mark(tokens, brace) ;
+				}
+			}
+			else
+			{
+				tokens.push_back(token_ptr(new basic_TokenText<CharT>(string_type(1, CharT('{'))))) ;
+				position.mark(tokens, brace) ;
+			}
+		}
+		return tokens ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// TemplateLoader
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		template<typename CharT>
+		bool has_children(basic_token_ptr<CharT> &token)
+		{
+			const TokenType type = token->gettype() ;
+			return type == TOKEN_TYPE_FOR || type == TOKEN_TYPE_IF 
+				|| type == TOKEN_TYPE_BLOCK || type == TOKEN_TYPE_CACHE ;
+		}
+
+		size_t count_nodes(token_vector &tree)
+		{
+			size_t total = tree.size() ;
+			for (size_t i = 0 ; i < tree.size() ; ++i)
+			{
+				if (has_children(tree[i]))
+				{
+					total += count_nodes(tree[i]->get_children()) ;
+				}
+			}
+			return total ;
+		}
+
+		class ReadFile
+		{
+			std::string m_directory ;
+		public:
+			ReadFile(std::string directory) : m_directory(directory){}
+			std::string operator()(const std::string &name) const
+			{
+				const std::string path = m_directory.empty() ? name : m_directory + "/" + name ;
+				std::ifstream in(path.c_str(), std::ios::binary) ;
+				if (! in)
+				{
+					throw TemplateException("Cannot open template: " + path) ;
+				}
+				std::ostringstream text ;
+				text << in.rdbuf() ;
+				return text.str() ;
+			}
+		};
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Template inheritance
+	// Works on the flat token list, before parse_tree: the chain of
+	// parents is walked up to the root layout, collecting block bodies
+	// (nearest child first), then the root's token list is rewritten with
+	// those bodies in place of its blocks.
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		typedef std::map<std::string, token_vector> block_map ;
+
+		// index of the endblock matching the block at start
+		size_t block_end(token_vector &tokens, size_t start)
+		{
+			size_t depth = 0 ;
+			for (size_t i = start ; i < tokens.size() ; ++i)
+			{
+				const TokenType type = tokens[i]->gettype() ;
+				if (type == TOKEN_TYPE_BLOCK)
+				{
+					++depth ;
+				}
+				else if (type == TOKEN_TYPE_ENDBLOCK && --depth == 0)
+				{
+					return i ;
+				}
+			}
+			throw TemplateException("Missing endblock for " + tokens[start]->describe()) ;
+		}
+
+		// blocks already in overrides come from a child and win
+		void collect_blocks(token_vector &tokens, block_map &overrides)
+		{
+			for (size_t i = 0 ; i < tokens.size() ; ++i)
+			{
+				if (tokens[i]->gettype() == TOKEN_TYPE_BLOCK)
+				{
+					const std::string name = static_cast<TokenBlock*>(tokens[i].get())->getname() ;
+					if (overrides.find(name) == overrides.end())
+					{
+						const size_t end = block_end(tokens, i) ;
+						overrides[name].assign(tokens.begin() + i + 1, tokens.begin() + end) ;
+					}
+				}
+			}
+		}
+
+		// active holds the blocks being expanded, so that a block
+		// nested in its own override keeps its own body
+		void expand_blocks(token_vector &tokens, block_map &overrides, 
+			std::vector<std::string> &active, token_vector &out)
+		{
+			for (size_t i = 0 ; i < tokens.size() ; ++i)
+			{
+				const TokenType type = tokens[i]->gettype() ;
+				if (type == TOKEN_TYPE_EXTENDS)
+				{
+					continue ;
+				}
+				if (type != TOKEN_TYPE_BLOCK)
+				{
+					out.push_back(tokens[i]) ;
+					continue ;
+				}
+				const std::string name = static_cast<TokenBlock*>(tokens[i].get())->getname() ;
+				const size_t end = block_end(tokens, i) ;
+				token_vector body(tokens.begin() + i + 1, tokens.begin() + end) ;
+				block_map::iterator it = overrides.find(name) ;
+				if (it != overrides.end() && std::find(active.begin(), active.end(), name) == active.end())
+				{
+					body = it->second ;
+				}
+				active.push_back(name) ;
+				expand_blocks(body, overrides, active, out) ;
+				active.pop_back() ;
+				i = end ;
+			}
+		}
+
+		token_ptr find_extends(token_vector &tokens)
+		{
+			for (size_t i = 0 ; i < tokens.size() ; ++i)
+			{
+				if (tokens[i]->gettype() == TOKEN_TYPE_EXTENDS)
+				{
+					return tokens[i] ;
+				}
+			}
+			return token_ptr() ;
+		}
+
+		void inherit(token_vector &tokens, TemplateLoader *loader, const CompileOptions &options)
+		{
+			block_map overrides ;
+			std::vector<std::string> chain ;
+			token_vector current(tokens) ;
+			for (token_ptr extends = find_extends(current) ; extends ; extends = find_extends(current))
+			{
+				if (! loader)
+				{
+					throw TemplateException("extends needs CompileOptions::loader") ;
+				}
+				const std::string parent = static_cast<TokenExtends*>(extends.get())->getname() ;
+				if (std::find(chain.begin(), chain.end(), parent) != chain.end())
+				{
+					throw TemplateException("Inheritance cycle at " + parent) ;
+				}
+				chain.push_back(parent) ;
+				collect_blocks(current, overrides) ;
+				current.clear() ;
+				tokenize(loader->read(parent), current, options) ;
+			}
+			std::vector<std::string> active ;
+			tokens.clear() ;
+			expand_blocks(current, overrides, active, tokens) ;
+		}
+	}
+
+	template_reader directory_reader(std::string directory)
+	{
+		return ReadFile(directory) ;
+	}
+
+	TemplateLoader::TemplateLoader(template_reader reader, const CompileOptions &options, size_t inline_limit) : 
+		m_reader(reader), m_options(options), m_inline_limit(inline_limit)
+	{
+		// partials include through this loader, never another one
+		m_options.loader.reset() ;
+	}
+
+	std::shared_ptr<token_vector> TemplateLoader::get(std::string name)
+	{
+		std::vector<std::string> chain ;
+		return get(name, chain) ;
+	}
+
+	std::string TemplateLoader::read(std::string name)
+	{
+		return m_reader(name) ;
+	}
+
+	void TemplateLoader::resolve(token_vector &tree)
+	{
+		std::vector<std::string> chain ;
+		resolve(tree, chain) ;
+	}
+
+	std::shared_ptr<token_vector> TemplateLoader::get(const std::string &name, std::vector<std::string> &chain)
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex) ;
+		std::map<std::string, std::shared_ptr<token_vector> >::iterator it = m_partials.find(name) ;
+		if (it != m_partials.end())
+		{
+			count(STAT_CACHE_HITS) ;
+			return it->second ;
+		}
+		if (std::find(chain.begin(), chain.end(), name) != chain.end())
+		{
+			std::string cycle ;
+			for (size_t i = 0 ; i < chain.size() ; ++i)
+			{
+				cycle += chain[i] + " -> " ;
+			}
+			throw TemplateException("Include cycle: " + cycle + name) ;
+		}
+		count(STAT_CACHE_MISSES) ;
+
+		token_vector tokens ;
+		tokenize(m_reader(name), tokens, m_options) ;
+		inherit(tokens, this, m_options) ;
+		std::shared_ptr<token_vector> partial(new token_vector) ;
+		parse_tree(tokens, *partial) ;
+
+		chain.push_back(name) ;
+		resolve(*partial, chain) ;
+		chain.pop_back() ;
+
+		m_partials[name] = partial ;
+		return partial ;
+	}
+
+	void TemplateLoader::resolve(token_vector &tree, std::vector<std::string> &chain)
+	{
+		token_vector resolved ;
+		for (size_t i = 0 ; i < tree.size() ; ++i)
+		{
+			if (has_children(tree[i]))
+			{
+				resolve(tree[i]->get_children(), chain) ;
+			}
+			if (tree[i]->gettype() != TOKEN_TYPE_INCLUDE)
+			{
+				resolved.push_back(tree[i]) ;
+				continue ;
+			}
+			TokenInclude *include = static_cast<TokenInclude*>(tree[i].get()) ;
+			std::shared_ptr<token_vector> partial = get(include->getname(), chain) ;
+			if (count_nodes(*partial) <= m_inline_limit)
+			{
+				// compiled partials are never modified, so the nodes can be shared
+				resolved.insert(resolved.end(), partial->begin(), partial->end()) ;
+			}
+			else
+			{
+				include->set_partial(partial) ;
+				resolved.push_back(tree[i]) ;
+			}
+		}
+		tree.swap(resolved) ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Template
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// characters of template text, counting loop bodies once
+		template<typename CharT>
+		size_t static_size(basic_token_vector<CharT> &tree)
+		{
+			size_t size = 0 ;
+			for (size_t i = 0 ; i < tree.size() ; ++i)
+			{
+				if (tree[i]->gettype() == TOKEN_TYPE_TEXT)
+				{
+					size += static_cast<basic_TokenText<CharT>*>(tree[i].get())->getvalue().size() ;
+				}
+				else if (has_children(tree[i]))
+				{
+					size += static_size(tree[i]->get_children()) ;
+				}
+			}
+			return size ;
+		}
+
+		// tokens to tree; char templates also resolve inheritance and
+		// includes through the loader
+		void compile(token_vector &tokens, token_vector &tree, const CompileOptions &options)
+		{
+			inherit(tokens, options.loader.get(), options) ;
+			parse_tree(tokens, tree) ;
+			if (options.loader)
+			{
+				options.loader->resolve(tree) ;
+			}
+		}
+		template<typename CharT>
+		void compile(basic_token_vector<CharT> &tokens, basic_token_vector<CharT> &tree, const CompileOptions &)
+		{
+			parse_tree(tokens, tree) ;
+		}
+	}
+
+	void RenderSizeEstimate::update(size_t rendered)
+	{
+		const size_t current = get() ;
+		const size_t next = rendered >= current ? rendered : current - current / 8 + rendered / 8 ;
+		if (next != current)
+		{
+			m_bytes.store(next, std::memory_order_relaxed) ;
+		}
+	}
+
+	template<typename CharT>
+	basic_Template<CharT>::basic_Template(string_type templ_text, const CompileOptions &options)
+	{
+		basic_token_vector<CharT> tokens ;
+		tokenize(templ_text, tokens, options) ;
+		compile(tokens, m_tree, options) ;
+		m_size = RenderSizeEstimate(static_size(m_tree)) ;
+	}
+
+	template<typename CharT>
+	basic_Template<CharT>::basic_Template(const basic_token_vector<CharT> &tree) : 
+		m_tree(tree)
+	{
+		m_size = RenderSizeEstimate(static_size(m_tree)) ;
+	}
+
+	template<typename CharT>
+	void basic_Template<CharT>::render(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data)
+	{
+		RenderContext context ;
+		render(stream, data, context) ;
+	}
+
+	template<typename CharT>
+	void basic_Template<CharT>::render(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context)
+	{
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now() ;
+		// a render that waited too long to start need not start at all
+		if (context.m_deadline != std::chrono::steady_clock::time_point() && start >= context.m_deadline)
+		{
+			context.check_deadline() ;
+		}
+		const size_t bytes_before = context.m_bytes ;
+		for (size_t i = 0 ; i < m_tree.size() ; ++i)
+		{
+			// Recursively calls gettext on each node in the tree.
+			// gettext returns the appropriate text for that node.
+			// for text, itself;
+			// for variable, substitution;
+			// for control statement, recursively gets kids
+			render_token(m_tree[i], stream, data, context) ;
+		}
+		m_size.update(context.m_bytes - bytes_before) ;
+		count_render(start, context.m_bytes - bytes_before) ;
+	}
+
+	template<typename CharT>
+	typename basic_Template<CharT>::string_type basic_Template<CharT>::render(basic_data_map<CharT> &data)
+	{
+		string_type out ;
+		render(out, data) ;
+		return out ;
+	}
+
+	template<typename CharT>
+	void basic_Template<CharT>::render(string_type &out, basic_data_map<CharT> &data)
+	{
+		// a little headroom so a slightly larger render still fits
+		const size_t expected = size_estimate() ;
+		out.reserve(out.size() + expected + expected / 16) ;
+		basic_StringBuffer<CharT> buffer(out) ;
+		std::basic_ostream<CharT> stream(&buffer) ;
+		render(stream, data) ;
+	}
+
+	template<typename CharT>
+	void basic_Template<CharT>::render(GatherOutput &, basic_data_map<CharT> &)
+	{
+		throw TemplateException("Gathered output needs a char template") ;
+	}
+
+	template<>
+	void basic_Template<char>::render(GatherOutput &out, data_map &data)
+	{
+		out.clear() ;
+		StringBuffer buffer(out.buffer()) ;
+		std::ostream stream(&buffer) ;
+		RenderContext context ;
+		context.m_gather = &out ;
+		render(stream, data, context) ;
+		out.finish() ;
+	}
+
+	template<typename CharT>
+	size_t basic_Template<CharT>::size_estimate() const
+	{
+		return m_size.get() ;
+	}
+
+	template<typename CharT>
+	basic_token_vector<CharT> & basic_Template<CharT>::get_tree()
+	{
+		return m_tree ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// GatherOutput
+	//////////////////////////////////////////////////////////////////////////
+#ifndef _WIN32
+	static_assert(sizeof(OutputSegment) == sizeof(struct iovec) 
+		&& offsetof(OutputSegment, base) == offsetof(struct iovec, iov_base)
+		&& offsetof(OutputSegment, size) == offsetof(struct iovec, iov_len), 
+		"OutputSegment must match struct iovec") ;
+#endif
+
+	GatherOutput::GatherOutput(size_t min_reference) : 
+		m_min_reference(min_reference), m_mark(0), m_bytes(0)
+	{
+	}
+
+	const std::vector<OutputSegment> & GatherOutput::segments() const
+	{
+		return m_segments ;
+	}
+
+	size_t GatherOutput::bytes() const
+	{
+		return m_bytes ;
+	}
+
+	std::string GatherOutput::str() const
+	{
+		std::string text ;
+		text.reserve(m_bytes) ;
+		for (size_t i = 0 ; i < m_segments.size() ; ++i)
+		{
+			text.append(static_cast<const char*>(m_segments[i].base), m_segments[i].size) ;
+		}
+		return text ;
+	}
+
+	void GatherOutput::clear()
+	{
+		m_buffer.clear() ;
+		m_mark = 0 ;
+		m_bytes = 0 ;
+		m_pending.clear() ;
+		m_segments.clear() ;
+	}
+
+	size_t GatherOutput::min_reference() const
+	{
+		return m_min_reference ;
+	}
+
+	std::string & GatherOutput::buffer()
+	{
+		return m_buffer ;
+	}
+
+	void GatherOutput::close_buffered()
+	{
+		if (m_buffer.size() > m_mark)
+		{
+			Pending pending = { NULL, m_mark, m_buffer.size() - m_mark } ;
+			m_pending.push_back(pending) ;
+			m_mark = m_buffer.size() ;
+		}
+	}
+
+	void GatherOutput::add_static(const char *text, size_t size)
+	{
+		close_buffered() ;
+		Pending pending = { text, 0, size } ;
+		m_pending.push_back(pending) ;
+	}
+
+	void GatherOutput::finish()
+	{
+		// the buffer has stopped growing, so its ranges can become pointers
+		close_buffered() ;
+		m_segments.resize(m_pending.size()) ;
+		m_bytes = 0 ;
+		for (size_t i = 0 ; i < m_pending.size() ; ++i)
+		{
+			const Pending &pending = m_pending[i] ;
+			m_segments[i].base = pending.text ? pending.text : m_buffer.data() + pending.offset ;
+			m_segments[i].size = pending.size ;
+			m_bytes += pending.size ;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// TemplateRegistry
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// a thread's last view of one registry; ids are never reused,
+		// so a destroyed registry's slot cannot be mistaken for a new one
+		struct RegistrySlot
+		{
+			unsigned long long id ;
+			unsigned long long version ;
+			std::shared_ptr<const TemplateRegistry::template_table> table ;
+		};
+		const size_t REGISTRY_SLOTS = 8 ;
+
+		std::atomic<unsigned long long> next_registry_id(0) ;
+	}
+
+	TemplateRegistry::TemplateRegistry() : 
+		m_id(++next_registry_id), m_version(0), m_table(std::make_shared<const template_table>())
+	{
+	}
+
+	const TemplateRegistry::template_table &TemplateRegistry::snapshot() const
+	{
+		thread_local std::vector<RegistrySlot> slots ;
+		const unsigned long long version = m_version.load(std::memory_order_acquire) ;
+		size_t i = 0 ;
+		while (i < slots.size() && slots[i].id != m_id)
+		{
+			++i ;
+		}
+		if (i < slots.size() && slots[i].version == version)
+		{
+			return *slots[i].table ;
+		}
+		if (i == slots.size())
+		{
+			// least recently added slot goes first
+			if (slots.size() == REGISTRY_SLOTS)
+			{
+				slots.erase(slots.begin()) ;
+				--i ;
+			}
+			slots.push_back(RegistrySlot()) ;
+			slots[i].id = m_id ;
+		}
+		std::shared_ptr<const template_table> table ;
+		{
+			std::lock_guard<std::mutex> lock(m_table_mutex) ;
+			table = m_table ;
+		}
+		// the previous table may be freed here, outside the lock
+		slots[i].table.swap(table) ;
+		slots[i].version = version ;
+		return *slots[i].table ;
+	}
+
+	void TemplateRegistry::publish(std::shared_ptr<const template_table> table)
+	{
+		// the table goes out before the version, so a reader that sees the
+		// new version always loads a table at least as new
+		{
+			std::lock_guard<std::mutex> lock(m_table_mutex) ;
+			m_table.swap(table) ;
+		}
+		m_version.fetch_add(1, std::memory_order_release) ;
+	}
+
+	const std::shared_ptr<Template> &TemplateRegistry::get(const std::string &name) const
+	{
+		static const std::shared_ptr<Template> none ;
+		const template_table &table = snapshot() ;
+		template_table::const_iterator found = table.find(name) ;
+		if (found == table.end())
+		{
+			return none ;
+		}
+		return found->second ;
+	}
+
+	// writers hold m_write_mutex, so they read m_table without m_table_mutex
+	void TemplateRegistry::set(const std::string &name, std::shared_ptr<Template> templ)
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex) ;
+		std::shared_ptr<template_table> table = std::make_shared<template_table>(*m_table) ;
+		(*table)[name] = templ ;
+		publish(table) ;
+	}
+
+	void TemplateRegistry::set(const std::string &name, const std::string &templ_text, const CompileOptions &options)
+	{
+		// compile outside the lock; only the swap is serialized
+		set(name, std::make_shared<Template>(templ_text, options)) ;
+	}
+
+	bool TemplateRegistry::remove(const std::string &name)
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex) ;
+		if (m_table->find(name) == m_table->end())
+		{
+			return false ;
+		}
+		std::shared_ptr<template_table> table = std::make_shared<template_table>(*m_table) ;
+		table->erase(name) ;
+		publish(table) ;
+		return true ;
+	}
+
+	size_t TemplateRegistry::size() const
+	{
+		return snapshot().size() ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// IncrementalRender
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// true if changing one path can change what is read through the other
+		bool paths_overlap(const std::string &a, const std::string &b)
+		{
+			const std::string &shorter = a.size() < b.size() ? a : b ;
+			const std::string &longer = a.size() < b.size() ? b : a ;
+			if (! boost::starts_with(longer, shorter))
+			{
+				return false ;
+			}
+			return longer.size() == shorter.size() 
+				|| longer[shorter.size()] == '.' 
+				|| longer[shorter.size()] == '[' ;
+		}
+
+		// defined with the dependency analysis below
+		typedef std::map<std::string, std::string> loop_scope ;
+		void find_dependencies(token_vector &tree, const loop_scope &scope, TemplateDependencies &deps) ;
+		void find_bindings(token_vector &tree, loop_scope &scope) ;
+	}
+
+	IncrementalRender::IncrementalRender( Template &templ, data_map &data )
+	{
+		token_vector &tree = templ.get_tree() ;
+		// loops leave their variables bound, so a later segment reading
+		// one depends on the list it was taken from
+		loop_scope bound ;
+		for (size_t i = 0 ; i < tree.size() ; ++i)
+		{
+			Segment segment ;
+			segment.token = tree[i] ;
+			if (tree[i]->gettype() != TOKEN_TYPE_TEXT)
+			{
+				token_vector node(1, tree[i]) ;
+				TemplateDependencies deps ;
+				find_dependencies(node, bound, deps) ;
+				segment.paths = deps.paths ;
+				find_bindings(node, bound) ;
+			}
+			const std::string text = render_segment(segment, data) ;
+			segment.length = text.size() ;
+			m_document += text ;
+			m_segments.push_back(segment) ;
+		}
+	}
+
+	std::vector<SegmentPatch> IncrementalRender::update( data_map &data, const std::vector<std::string> &changed )
+	{
+		std::vector<SegmentPatch> patches ;
+		size_t offset = 0 ;
+		for (size_t i = 0 ; i < m_segments.size() ; ++i)
+		{
+			Segment &segment = m_segments[i] ;
+			bool affected = false ;
+			for (std::set<std::string>::iterator path = segment.paths.begin() ; 
+				path != segment.paths.end() && ! affected ; ++path)
+			{
+				for (size_t j = 0 ; j < changed.size() && ! affected ; ++j)
+				{
+					affected = paths_overlap(*path, changed[j]) ;
+				}
+			}
+			if (affected)
+			{
+				std::string text = render_segment(segment, data) ;
+				if (text.size() != segment.length || m_document.compare(offset, segment.length, text) != 0)
+				{
+					m_document.replace(offset, segment.length, text) ;
+					SegmentPatch patch ;
+					patch.offset = offset ;
+					patch.old_length = segment.length ;
+					patch.text.swap(text) ;
+					segment.length = patch.text.size() ;
+					patches.push_back(patch) ;
+				}
+			}
+			offset += segment.length ;
+		}
+		return patches ;
+	}
+
+	std::string IncrementalRender::render_segment( Segment &segment, data_map &data )
+	{
+		PooledBuffer buffer ;
+		RenderContext context ;
+		render_token(segment.token, buffer.stream(), data, context) ;
+		return buffer.str() ;
+	}
+
+	const std::string & IncrementalRender::document() const
+	{
+		return m_document ;
+	}
+
+	size_t IncrementalRender::segments() const
+	{
+		return m_segments.size() ;
+	}
+
+	/************************************************************************
+	* parse
+	*
+	*  1. tokenizes template
+	*  2. parses tokens into tree
+	*  3. resolves template
+	*  4. returns converted text
+	************************************************************************/
+	template<typename CharT>
+    std::basic_string<CharT> parse(typename type_identity<std::basic_string<CharT> >::type templ_text, 
+		basic_data_map<CharT> &data)
+	{
+		basic_PooledBuffer<CharT> buffer ;
+		parse(buffer.stream(), templ_text, data) ;
+		return buffer.str() ;
+	}
+	template<typename CharT>
+	void parse(std::basic_ostream<CharT> &stream, typename type_identity<std::basic_string<CharT> >::type templ_text, 
+		basic_data_map<CharT> &data)
+	{
+		RenderContext context ;
+		parse(stream, templ_text, data, context) ;
+	}
+	template<typename CharT>
+	void parse(std::basic_ostream<CharT> &stream, typename type_identity<std::basic_string<CharT> >::type templ_text, 
+		basic_data_map<CharT> &data, RenderContext &context)
+	{
+		basic_Template<CharT>(templ_text).render(stream, data, context) ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Dependency analysis
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// loop_scope maps a loop variable to the path of the list element
+		// it stands for
+
+		// maps key to a data path, or "" if it does not read the data map
+		std::string data_path(const std::string &key, const loop_scope &scope)
+		{
+			if (key.empty() || key[0] == '"')
+			{
+				return "" ;
+			}
+			const size_t dot = key.find('.') ;
+			const std::string head = key.substr(0, dot) ;
+			const std::string tail = dot == std::string::npos ? "" : key.substr(dot) ;
+			loop_scope::const_iterator it = scope.find(head) ;
+			if (it != scope.end())
+			{
+				return it->second + tail ;
+			}
+			if (head == "loop" && scope.find("loop") == scope.end() && ! scope.empty())
+			{
+				return "" ;
+			}
+			return key ;
+		}
+
+		void add_dependency(const std::string &key, const loop_scope &scope, TemplateDependencies &deps)
+		{
+			const std::string path = data_path(key, scope) ;
+			if (path.empty())
+			{
+				return ;
+			}
+			deps.paths.insert(path) ;
+			deps.roots.insert(path.substr(0, path.find_first_of(".[")) ) ;
+		}
+
+		void find_dependencies(token_vector &tree, const loop_scope &outer, TemplateDependencies &deps)
+		{
+			// loops leave their variables bound for the nodes after them;
+			// loop.index there is still not data
+			loop_scope scope(outer) ;
+			for (size_t i = 0 ; i < tree.size() ; ++i)
+			{
+				Token *token = tree[i].get() ;
+				if (i > 0 && (has_children(tree[i-1]) || tree[i-1]->gettype() == TOKEN_TYPE_INCLUDE))
+				{
+					loop_scope::const_iterator loop = scope.find("loop") ;
+					const bool had_loop = loop != scope.end() ;
+					const std::string list = had_loop ? loop->second : "" ;
+					token_vector previous(1, tree[i-1]) ;
+					find_bindings(previous, scope) ;
+					scope.erase("loop") ;
+					if (had_loop)
+					{
+						scope["loop"] = list ;
+					}
+				}
+				switch (token->gettype())
+				{
+				case TOKEN_TYPE_VAR:
+					add_dependency(static_cast<TokenVar*>(token)->getkey(), scope, deps) ;
+					break ;
+				case TOKEN_TYPE_FOR:
+					{
+						TokenFor *loop = static_cast<TokenFor*>(token) ;
+						add_dependency(loop->m_key, scope, deps) ;
+						const std::string bounds[] = { loop->m_limit, loop->m_offset, loop->m_step } ;
+						for (size_t b = 0 ; b < 3 ; ++b)
+						{
+							if (! bounds[b].empty() && ! boost::all(bounds[b], boost::is_digit()))
+							{
+								add_dependency(bounds[b], scope, deps) ;
+							}
+						}
+						loop_scope inner(scope) ;
+						const std::string list = data_path(loop->m_key, scope) ;
+						inner[loop->m_val] = list + "[]" ;
+						inner.erase("loop") ;
+						find_dependencies(loop->m_children, inner, deps) ;
+					}
+					break ;
+				case TOKEN_TYPE_IF:
+					{
+						TokenIf *cond = static_cast<TokenIf*>(token) ;
+						std::vector<std::string> elements ;
+						boost::split(elements, cond->m_expr, boost::is_space()) ;
+						for (size_t e = 1 ; e < elements.size() ; ++e)
+						{
+							if (elements[e] != "not" && elements[e] != "==" && elements[e] != "!=")
+							{
+								add_dependency(elements[e], scope, deps) ;
+							}
+						}
+						find_dependencies(cond->m_children, scope, deps) ;
+					}
+					break ;
+				case TOKEN_TYPE_INCLUDE:
+					{
+						// partials see the including scope, so they are walked
+						// again from every include
+						std::shared_ptr<token_vector> partial = static_cast<TokenInclude*>(token)->getpartial() ;
+						if (partial)
+						{
+							find_dependencies(*partial, scope, deps) ;
+						}
+					}
+					break ;
+				case TOKEN_TYPE_CACHE:
+					{
+						std::vector<std::string> keys = static_cast<TokenCache*>(token)->getkeys() ;
+						for (size_t k = 0 ; k < keys.size() ; ++k)
+						{
+							add_dependency(keys[k], scope, deps) ;
+						}
+						find_dependencies(token->get_children(), scope, deps) ;
+					}
+					break ;
+				case TOKEN_TYPE_BLOCK:
+					find_dependencies(token->get_children(), scope, deps) ;
+					break ;
+				default:
+					break ;
+				}
+			}
+		}
+	}
+
+	namespace
+	{
+		// the loop variables tree leaves bound after it renders, in scope;
+		// "loop" stands for the list itself, whose length loop.index ends at
+		void find_bindings(token_vector &tree, loop_scope &scope)
+		{
+			for (size_t i = 0 ; i < tree.size() ; ++i)
+			{
+				Token *token = tree[i].get() ;
+				if (token->gettype() == TOKEN_TYPE_FOR)
+				{
+					TokenFor *loop = static_cast<TokenFor*>(token) ;
+					const std::string list = data_path(loop->m_key, scope) ;
+					loop_scope inner(scope) ;
+					inner[loop->m_val] = list + "[]" ;
+					inner["loop"] = list ;
+					find_bindings(loop->m_children, inner) ;
+					scope.swap(inner) ;
+				}
+				else if (token->gettype() == TOKEN_TYPE_INCLUDE)
+				{
+					std::shared_ptr<token_vector> partial = static_cast<TokenInclude*>(token)->getpartial() ;
+					if (partial)
+					{
+						find_bindings(*partial, scope) ;
+					}
+				}
+				else if (has_children(tree[i]))
+				{
+					find_bindings(token->get_children(), scope) ;
+				}
+			}
+		}
+	}
+
+	TemplateDependencies dependencies(token_vector &tree)
+	{
+		TemplateDependencies deps ;
+		find_dependencies(tree, loop_scope(), deps) ;
+		return deps ;
+	}
+
+	TemplateDependencies dependencies(Template &templ)
+	{
+		return dependencies(templ.get_tree()) ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Partial evaluation
+	// Walks the tree in render order against a copy of the static data.
+	// Loops leave their variable and "loop" in the data map after they
+	// end, so a name bound by a loop that stays in the residual tree is
+	// treated as render-time data until another loop binds it; a static
+	// loop that is evaluated away binds its variable in the copy, just
+	// as it would have at render time.
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		std::string key_root(const std::string &key)
+		{
+			return key.substr(0, key.find('.')) ;
+		}
+
+		// the operands of an if expression
+		std::vector<std::string> condition_operands(const std::vector<std::string> &elements)
+		{
+			std::vector<std::string> operands ;
+			if (elements.size() > 2 && elements[1] == "not")
+			{
+				operands.push_back(elements[2]) ;
+			}
+			else if (elements.size() == 2)
+			{
+				operands.push_back(elements[1]) ;
+			}
+			else if (elements.size() > 3)
+			{
+				operands.push_back(elements[1]) ;
+				operands.push_back(elements[3]) ;
+			}
+			return operands ;
+		}
+
+		class Specializer
+		{
+			data_map m_static ;
+			std::set<std::string> m_dynamic ;		// bound at render time
+			const std::set<std::string> &m_keep ;	// loops binding these stay loops
+			int m_residual ;						// depth of kept ifs and loops
+		public:
+			std::set<std::string> m_hidden ;		// bound by loops evaluated in those
+
+			Specializer(data_map &static_data, const std::set<std::string> &keep) : 
+				m_static(static_data), m_keep(keep), m_residual(0){}
+
+			void tree(token_vector &in, token_vector &out)
+			{
+				for (size_t i = 0 ; i < in.size() ; ++i)
+				{
+					node(in[i], out) ;
+				}
+			}
+		private:
+			// a key whose value is known now; bound lists the loop
+			// variables of an enclosing static loop
+			bool known(const std::string &key, const std::set<std::string> &bound = std::set<std::string>())
+			{
+				if (! key.empty() && key[0] == '"')
+				{
+					return true ;
+				}
+				const std::string root = key_root(key) ;
+				if (bound.count(root))
+				{
+					return true ;
+				}
+				data_ptr value ;
+				return ! m_dynamic.count(root) && m_static.has(root) && find_val(key, m_static, value) ;
+			}
+
+			// whether the whole subtree can be rendered now
+			bool known_tree(token_vector &tree, const std::set<std::string> &bound)
+			{
+				for (size_t i = 0 ; i < tree.size() ; ++i)
+				{
+					Token *token = tree[i].get() ;
+					switch (token->gettype())
+					{
+					case TOKEN_TYPE_TEXT:
+						break ;
+					case TOKEN_TYPE_VAR:
+						{
+							// a missing-key callback is for render time
+							TokenVar *var = static_cast<TokenVar*>(token) ;
+							if (! known(var->getkey()) && (! known(var->getkey(), bound) 
+								|| var->get_missing_key() == MISSING_KEY_CALLBACK))
+							{
+								return false ;
+							}
+						}
+						break ;
+					case TOKEN_TYPE_IF:
+						{
+							TokenIf *branch = static_cast<TokenIf*>(token) ;
+							std::vector<std::string> elements ;
+							boost::split(elements, branch->m_expr, boost::is_space()) ;
+							const std::vector<std::string> operands = condition_operands(elements) ;
+							if (operands.empty())
+							{
+								return false ;
+							}
+							for (size_t o = 0 ; o < operands.size() ; ++o)
+							{
+								if (! known(operands[o]) && (! known(operands[o], bound) 
+									|| branch->m_missing_key == MISSING_KEY_CALLBACK))
+								{
+									return false ;
+								}
+							}
+							if (! known_tree(token->get_children(), bound))
+							{
+								return false ;
+							}
+						}
+						break ;
+					case TOKEN_TYPE_FOR:
+						{
+							TokenFor *loop = static_cast<TokenFor*>(token) ;
+							if (! known(loop->m_key, bound) || ! known_options(loop, bound))
+							{
+								return false ;
+							}
+							std::set<std::string> inner(bound) ;
+							inner.insert(loop->m_val) ;
+							inner.insert("loop") ;
+							if (! known_tree(loop->m_children, inner))
+							{
+								return false ;
+							}
+						}
+						break ;
+					case TOKEN_TYPE_INCLUDE:
+						{
+							std::shared_ptr<token_vector> partial = static_cast<TokenInclude*>(token)->getpartial() ;
+							if (! partial || ! known_tree(*partial, bound))
+							{
+								return false ;
+							}
+						}
+						break ;
+					case TOKEN_TYPE_BLOCK:
+						if (! known_tree(token->get_children(), bound))
+						{
+							return false ;
+						}
+						break ;
+					default:
+						return false ;
+					}
+				}
+				return true ;
+			}
+
+			bool known_options(TokenFor *loop, const std::set<std::string> &bound)
+			{
+				const std::string options[] = { loop->m_limit, loop->m_offset, loop->m_step } ;
+				for (size_t i = 0 ; i < 3 ; ++i)
+				{
+					if (! options[i].empty() && ! boost::all(options[i], boost::is_digit()) && ! known(options[i], bound))
+					{
+						return false ;
+					}
+				}
+				return true ;
+			}
+
+			void node(token_ptr &token, token_vector &out)
+			{
+				token_vector single(1, token) ;
+				switch (token->gettype())
+				{
+				case TOKEN_TYPE_TEXT:
+					append_text(out, static_cast<TokenText*>(token.get())->getvalue()) ;
+					break ;
+				case TOKEN_TYPE_VAR:
+					if (known_tree(single, std::set<std::string>()))
+					{
+						evaluate(token, out) ;
+					}
+					else
+					{
+						out.push_back(token) ;
+					}
+					break ;
+				case TOKEN_TYPE_IF:
+					if (known_tree(single, std::set<std::string>()))
+					{
+						evaluate(token, out) ;
+					}
+					else
+					{
+						condition(token, out) ;
+					}
+					break ;
+				case TOKEN_TYPE_FOR:
+					if (known_tree(single, std::set<std::string>()) && ! kept(static_cast<TokenFor*>(token.get())))
+					{
+						// once it has run, its variable and "loop" are static again
+						if (evaluate(token, out))
+						{
+							m_dynamic.erase(static_cast<TokenFor*>(token.get())->m_val) ;
+							m_dynamic.erase("loop") ;
+						}
+						if (m_residual)
+						{
+							// but only where this body runs
+							m_hidden.insert(static_cast<TokenFor*>(token.get())->m_val) ;
+							m_hidden.insert("loop") ;
+						}
+					}
+					else
+					{
+						loop(token, out) ;
+					}
+					break ;
+				case TOKEN_TYPE_INCLUDE:
+					{
+						// inlined, so that its static parts are evaluated too
+						std::shared_ptr<token_vector> partial = static_cast<TokenInclude*>(token.get())->getpartial() ;
+						if (partial)
+						{
+							tree(*partial, out) ;
+						}
+						else
+						{
+							out.push_back(token) ;
+						}
+					}
+					break ;
+				case TOKEN_TYPE_BLOCK:
+					tree(token->get_children(), out) ;
+					break ;
+				default:
+					// kept as it is; loops inside it bind at render time
+					bind(single) ;
+					out.push_back(token) ;
+					break ;
+				}
+			}
+
+			// a static loop inside a kept if or loop whose bindings are read
+			// after it: evaluated away, they would never be made
+			bool kept(TokenFor *loop)
+			{
+				return m_residual && (m_keep.count(loop->m_val) || m_keep.count("loop")) ;
+			}
+
+			// renders token now; true if it ran any loop iterations
+			bool evaluate(token_ptr &token, token_vector &out)
+			{
+				PooledBuffer rendered ;
+				RenderContext context ;
+				token->gettext(rendered.stream(), m_static, context) ;
+				append_text(out, rendered.str()) ;
+				return context.m_iterations > 0 ;
+			}
+
+			// a loop over render-time data, or with a render-time body
+			void loop(token_ptr &token, token_vector &out)
+			{
+				TokenFor *loop = static_cast<TokenFor*>(token.get()) ;
+				m_dynamic.insert(loop->m_val) ;
+				m_dynamic.insert("loop") ;
+				std::shared_ptr<TokenFor> residual(new TokenFor(*loop)) ;
 				token_vector children ;
-				parse_tree(tokens, children, TOKEN_TYPE_ENDFOR) ;
-				token->set_children(children) ;
+				++m_residual ;
+				tree(loop->m_children, children) ;
+				--m_residual ;
+				// the body may run any number of times
+				bind(loop->m_children) ;
+				residual->set_children(children) ;
+				out.push_back(residual) ;
+			}
+
+			// an if that cannot be decided now: a known condition keeps only
+			// the branch taken, otherwise known operands are written in as
+			// literals and the body is specialized for when it does run
+			void condition(token_ptr &token, token_vector &out)
+			{
+				TokenIf *cond = static_cast<TokenIf*>(token.get()) ;
+				std::vector<std::string> elements ;
+				boost::split(elements, cond->m_expr, boost::is_space()) ;
+				const std::vector<std::string> operands = condition_operands(elements) ;
+				bool decided = ! operands.empty() ;
+				for (size_t i = 0 ; i < operands.size() ; ++i)
+				{
+					decided = decided && known(operands[i]) ;
+				}
+				if (decided)
+				{
+					if (cond->is_true(m_static))
+					{
+						tree(cond->m_children, out) ;
+					}
+					return ;
+				}
+				std::shared_ptr<TokenIf> residual(new TokenIf(*cond)) ;
+				if (operands.size() == 2)
+				{
+					elements[1] = residual->m_lhs = literal(elements[1]) ;
+					elements[3] = residual->m_rhs = literal(elements[3]) ;
+					residual->m_expr = boost::join(elements, " ") ;
+				}
+				token_vector children ;
+				++m_residual ;
+				tree(cond->m_children, children) ;
+				--m_residual ;
+				// whether the body runs is only known at render time
+				bind(cond->m_children) ;
+				residual->set_children(children) ;
+				out.push_back(residual) ;
+			}
+
+			// a known operand as a quoted literal, if it can be written as one
+			std::string literal(const std::string &key)
+			{
+				data_ptr value ;
+				if (key.empty() || key[0] == '"' || ! known(key) || ! find_val(key, m_static, value))
+				{
+					return key ;
+				}
+				std::string text ;
+				try
+				{
+					text = value->getvalue() ;
+				}
+				catch (TemplateException &)
+				{
+					return key ;
+				}
+				if (std::find_if(text.begin(), text.end(), boost::is_space()) != text.end() 
+					|| (! text.empty() && (text[0] == '"' || text[text.size() - 1] == '"')))
+				{
+					return key ;
+				}
+				return "\"" + text + "\"" ;
+			}
+
+			// marks the loop variables in tree as render-time data
+			void bind(token_vector &tree)
+			{
+				for (size_t i = 0 ; i < tree.size() ; ++i)
+				{
+					if (tree[i]->gettype() == TOKEN_TYPE_FOR)
+					{
+						m_dynamic.insert(static_cast<TokenFor*>(tree[i].get())->m_val) ;
+						m_dynamic.insert("loop") ;
+					}
+					if (tree[i]->gettype() == TOKEN_TYPE_INCLUDE)
+					{
+						std::shared_ptr<token_vector> partial = static_cast<TokenInclude*>(tree[i].get())->getpartial() ;
+						if (partial)
+						{
+							bind(*partial) ;
+						}
+					}
+					else if (has_children(tree[i]))
+					{
+						bind(tree[i]->get_children()) ;
+					}
+				}
+			}
+
+			void append_text(token_vector &out, const std::string &text)
+			{
+				if (text.empty())
+				{
+					return ;
+				}
+				if (! out.empty() && out.back()->gettype() == TOKEN_TYPE_TEXT)
+				{
+					out.back() = token_ptr(new TokenText(static_cast<TokenText*>(out.back().get())->getvalue() + text)) ;
+					return ;
+				}
+				out.push_back(token_ptr(new TokenText(text))) ;
+			}
+		};
+	}
+
+	Template specialize(Template &templ, data_map &static_data)
+	{
+		// a second pass keeps the loops whose bindings the first left unmade
+		std::set<std::string> keep ;
+		for (;;)
+		{
+			Specializer specializer(static_data, keep) ;
+			token_vector residual ;
+			specializer.tree(templ.get_tree(), residual) ;
+			const std::set<std::string> roots = dependencies(residual).roots ;
+			const size_t kept = keep.size() ;
+			for (std::set<std::string>::iterator it = specializer.m_hidden.begin() ; it != specializer.m_hidden.end() ; ++it)
+			{
+				if (roots.count(*it))
+				{
+					keep.insert(*it) ;
+				}
+			}
+			if (keep.size() == kept)
+			{
+				return Template(residual) ;
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Compiled template files
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const char TEMPLATE_MAGIC[4] = { 'C', 'P', 'T', 'L' } ;
+		const size_t TEMPLATE_HEADER_SIZE = 24 ;
+		// deepest nesting of nodes accepted when loading
+		const size_t TEMPLATE_MAX_DEPTH = 256 ;
+
+		unsigned long long fnv1a(const char *data, size_t size)
+		{
+			unsigned long long hash = 14695981039346656037ull ;
+			for (size_t i = 0 ; i < size ; ++i)
+			{
+				hash ^= static_cast<unsigned char>(data[i]) ;
+				hash *= 1099511628211ull ;
+			}
+			return hash ;
+		}
+
+		class BinaryWriter
+		{
+		public:
+			void u8(unsigned int value)
+			{
+				m_out += char(value & 0xFF) ;
+			}
+			void u32(unsigned long long value)
+			{
+				for (int i = 0 ; i < 4 ; ++i)
+				{
+					u8(unsigned((value >> (8 * i)) & 0xFF)) ;
+				}
+			}
+			void u64(unsigned long long value)
+			{
+				u32(value & 0xFFFFFFFFull) ;
+				u32(value >> 32) ;
+			}
+			void str(const std::string &value)
+			{
+				u32(value.size()) ;
+				m_out += value ;
+			}
+			std::string m_out ;
+		};
+
+		class BinaryReader
+		{
+			const unsigned char *m_pos ;
+			const unsigned char *m_end ;
+			void need(size_t size)
+			{
+				if (size_t(m_end - m_pos) < size)
+				{
+					throw TemplateException("Compiled template is truncated") ;
+				}
+			}
+		public:
+			BinaryReader(const char *data, size_t size) : 
+				m_pos(reinterpret_cast<const unsigned char*>(data)), 
+				m_end(reinterpret_cast<const unsigned char*>(data) + size){}
+			unsigned int u8()
+			{
+				need(1) ;
+				return *m_pos++ ;
+			}
+			unsigned long long u32()
+			{
+				need(4) ;
+				unsigned long long value = 0 ;
+				for (int i = 0 ; i < 4 ; ++i)
+				{
+					value |= static_cast<unsigned long long>(*m_pos++) << (8 * i) ;
+				}
+				return value ;
+			}
+			unsigned long long u64()
+			{
+				const unsigned long long low = u32() ;
+				return low | (u32() << 32) ;
+			}
+			std::string str()
+			{
+				const size_t size = size_t(u32()) ;
+				need(size) ;
+				std::string value(reinterpret_cast<const char*>(m_pos), size) ;
+				m_pos += size ;
+				return value ;
+			}
+			// a number of items that each take at least min_size bytes
+			size_t count(size_t min_size)
+			{
+				const unsigned long long value = u32() ;
+				if (value > size_t(m_end - m_pos) / min_size)
+				{
+					throw TemplateException("Compiled template is truncated") ;
+				}
+				return size_t(value) ;
+			}
+			MissingKeyPolicy policy()
+			{
+				const unsigned int value = u8() ;
+				if (value > MISSING_KEY_CALLBACK)
+				{
+					throw TemplateException("Compiled template has a bad missing-key policy") ;
+				}
+				return MissingKeyPolicy(value) ;
+			}
+			IfTest test()
+			{
+				const unsigned int value = u8() ;
+				if (value > IF_NOT_EQUAL)
+				{
+					throw TemplateException("Compiled template has a bad if test") ;
+				}
+				return IfTest(value) ;
+			}
+			bool flag()
+			{
+				const unsigned int value = u8() ;
+				if (value > 1)
+				{
+					throw TemplateException("Compiled template has a bad flag") ;
+				}
+				return value == 1 ;
+			}
+			bool done()
+			{
+				return m_pos == m_end ;
+			}
+		};
+
+		typedef std::map<token_vector*, size_t> partial_index ;
+
+		// numbers shared partials so that each one follows the partials it includes
+		void collect_partials(token_vector &tree, partial_index &index, std::vector<token_vector*> &order)
+		{
+			for (size_t i = 0 ; i < tree.size() ; ++i)
+			{
+				if (tree[i]->gettype() == TOKEN_TYPE_INCLUDE)
+				{
+					std::shared_ptr<token_vector> partial = static_cast<TokenInclude*>(tree[i].get())->getpartial() ;
+					if (partial && index.find(partial.get()) == index.end())
+					{
+						collect_partials(*partial, index, order) ;
+						index[partial.get()] = order.size() ;
+						order.push_back(partial.get()) ;
+					}
+				}
+				else if (has_children(tree[i]))
+				{
+					collect_partials(tree[i]->get_children(), index, order) ;
+				}
+			}
+		}
+
+		void write_tree(BinaryWriter &out, token_vector &tree, partial_index &index)
+		{
+			out.u32(tree.size()) ;
+			for (size_t i = 0 ; i < tree.size() ; ++i)
+			{
+				Token *token = tree[i].get() ;
+				const TokenType type = token->gettype() ;
+				out.u8(type) ;
+				out.u32(token->getline()) ;
+				out.u32(token->getcolumn()) ;
+				switch (type)
+				{
+				case TOKEN_TYPE_TEXT:
+					out.str(static_cast<TokenText*>(token)->getvalue()) ;
+					break ;
+				case TOKEN_TYPE_VAR:
+					{
+						TokenVar *var = static_cast<TokenVar*>(token) ;
+						out.str(var->getexpr()) ;
+						out.str(var->getkey()) ;
+						out.u8(var->get_missing_key()) ;
+						std::vector<std::string> filters = var->getfilters() ;
+						out.u32(filters.size()) ;
+						for (size_t f = 0 ; f < filters.size() ; ++f)
+						{
+							out.str(filters[f]) ;
+						}
+					}
+					break ;
+				case TOKEN_TYPE_FOR:
+					{
+						TokenFor *loop = static_cast<TokenFor*>(token) ;
+						out.str(loop->m_val) ;
+						out.str(loop->m_key) ;
+						out.str(loop->m_limit) ;
+						out.str(loop->m_offset) ;
+						out.str(loop->m_step) ;
+						out.u8(loop->m_reversed) ;
+						out.u8(loop->m_missing_key) ;
+						write_tree(out, loop->m_children, index) ;
+					}
+					break ;
+				case TOKEN_TYPE_IF:
+					{
+						TokenIf *cond = static_cast<TokenIf*>(token) ;
+						out.str(cond->m_expr) ;
+						out.u8(cond->m_test) ;
+						out.str(cond->m_lhs) ;
+						out.str(cond->m_rhs) ;
+						out.u8(cond->m_missing_key) ;
+						write_tree(out, cond->m_children, index) ;
+					}
+					break ;
+				case TOKEN_TYPE_INCLUDE:
+					{
+						TokenInclude *include = static_cast<TokenInclude*>(token) ;
+						out.str(include->getname()) ;
+						std::shared_ptr<token_vector> partial = include->getpartial() ;
+						// 0 means unresolved, otherwise partial index + 1
+						out.u32(partial ? index[partial.get()] + 1 : 0) ;
+					}
+					break ;
+				case TOKEN_TYPE_BLOCK:
+					out.str(static_cast<TokenBlock*>(token)->getname()) ;
+					write_tree(out, token->get_children(), index) ;
+					break ;
+				case TOKEN_TYPE_EXTENDS:
+					out.str(static_cast<TokenExtends*>(token)->getname()) ;
+					break ;
+				case TOKEN_TYPE_CACHE:
+					out.str(static_cast<TokenCache*>(token)->getexpr()) ;
+					write_tree(out, token->get_children(), index) ;
+					break ;
+				default:
+					throw TemplateException("Cannot save node: " + token->describe()) ;
+				}
+			}
+		}
+
+		// partials up to available have been read; an include may only
+		// refer to those, so a partial cannot include itself
+		void read_tree(BinaryReader &in, token_vector &tree, 
+			std::vector<std::shared_ptr<token_vector> > &partials, size_t available, 
+			const CompileOptions &defaults, size_t depth = 0)
+		{
+			if (depth > TEMPLATE_MAX_DEPTH)
+			{
+				throw TemplateException("Compiled template is nested too deeply") ;
+			}
+			// a node takes at least its type and position
+			const size_t size = in.count(9) ;
+			for (size_t i = 0 ; i < size ; ++i)
+			{
+				const unsigned int type = in.u8() ;
+				const size_t line = size_t(in.u32()) ;
+				const size_t column = size_t(in.u32()) ;
+				CompileOptions options(defaults) ;
+				token_ptr token ;
+				switch (type)
+				{
+				case TOKEN_TYPE_TEXT:
+					token.reset(new TokenText(in.str())) ;
+					break ;
+				case TOKEN_TYPE_VAR:
+					{
+						const std::string expr = in.str() ;
+						const std::string key = in.str() ;
+						options.missing_key = in.policy() ;
+						std::vector<std::string> filters(in.count(4)) ;
+						for (size_t f = 0 ; f < filters.size() ; ++f)
+						{
+							filters[f] = in.str() ;
+						}
+						token.reset(new TokenVar(expr, key, filters, options)) ;
+					}
+					break ;
+				case TOKEN_TYPE_FOR:
+					{
+						const std::string val = in.str() ;
+						const std::string key = in.str() ;
+						const std::string limit = in.str() ;
+						const std::string offset = in.str() ;
+						const std::string step = in.str() ;
+						const bool reversed = in.flag() ;
+						options.missing_key = in.policy() ;
+						token.reset(new TokenFor(val, key, limit, offset, step, reversed, options)) ;
+						token_vector children ;
+						read_tree(in, children, partials, available, defaults, depth + 1) ;
+						token->set_children(children) ;
+					}
+					break ;
+				case TOKEN_TYPE_IF:
+					{
+						const std::string expr = in.str() ;
+						const IfTest test = in.test() ;
+						const std::string lhs = in.str() ;
+						const std::string rhs = in.str() ;
+						options.missing_key = in.policy() ;
+						token.reset(new TokenIf(expr, test, lhs, rhs, options)) ;
+						token_vector children ;
+						read_tree(in, children, partials, available, defaults, depth + 1) ;
+						token->set_children(children) ;
+					}
+					break ;
+				case TOKEN_TYPE_INCLUDE:
+					{
+						TokenInclude *include = new TokenInclude("include \"" + in.str() + "\"") ;
+						token.reset(include) ;
+						const size_t partial = size_t(in.u32()) ;
+						if (partial > available)
+						{
+							throw TemplateException("Compiled template has a bad partial reference") ;
+						}
+						if (partial)
+						{
+							include->set_partial(partials[partial - 1]) ;
+						}
+					}
+					break ;
+				case TOKEN_TYPE_BLOCK:
+					{
+						token.reset(new TokenBlock("block " + in.str())) ;
+						token_vector children ;
+						read_tree(in, children, partials, available, defaults, depth + 1) ;
+						token->set_children(children) ;
+					}
+					break ;
+				case TOKEN_TYPE_EXTENDS:
+					token.reset(new TokenExtends("extends \"" + in.str() + "\"")) ;
+					break ;
+				case TOKEN_TYPE_CACHE:
+					{
+						token.reset(new TokenCache(in.str(), options)) ;
+						token_vector children ;
+						read_tree(in, children, partials, available, defaults, depth + 1) ;
+						token->set_children(children) ;
+					}
+					break ;
+				default:
+					throw TemplateException("Compiled template has an unknown node type") ;
+				}
+				token->set_position(line, column) ;
+				tree.push_back(token) ;
+			}
+		}
+	}
+
+	void save_template(std::ostream &stream, Template &templ)
+	{
+		partial_index index ;
+		std::vector<token_vector*> order ;
+		collect_partials(templ.get_tree(), index, order) ;
+
+		BinaryWriter payload ;
+		payload.u32(order.size()) ;
+		for (size_t i = 0 ; i < order.size() ; ++i)
+		{
+			write_tree(payload, *order[i], index) ;
+		}
+		write_tree(payload, templ.get_tree(), index) ;
+
+		BinaryWriter header ;
+		header.m_out.append(TEMPLATE_MAGIC, 4) ;
+		header.u32(TEMPLATE_FORMAT_VERSION) ;
+		header.u64(payload.m_out.size()) ;
+		header.u64(fnv1a(payload.m_out.data(), payload.m_out.size())) ;
+		stream.write(header.m_out.data(), header.m_out.size()) ;
+		stream.write(payload.m_out.data(), payload.m_out.size()) ;
+	}
+
+	Template load_template(const char *image, size_t size, const CompileOptions &options)
+	{
+		if (size < TEMPLATE_HEADER_SIZE || ! std::equal(TEMPLATE_MAGIC, TEMPLATE_MAGIC + 4, image))
+		{
+			throw TemplateException("Not a compiled template") ;
+		}
+		BinaryReader header(image + 4, TEMPLATE_HEADER_SIZE - 4) ;
+		if (header.u32() != TEMPLATE_FORMAT_VERSION)
+		{
+			throw TemplateException("Unsupported compiled template version") ;
+		}
+		const unsigned long long payload_size = header.u64() ;
+		const unsigned long long checksum = header.u64() ;
+		const char *payload = image + TEMPLATE_HEADER_SIZE ;
+		if (payload_size != size - TEMPLATE_HEADER_SIZE || fnv1a(payload, size_t(payload_size)) != checksum)
+		{
+			throw TemplateException("Compiled template checksum mismatch") ;
+		}
+
+		BinaryReader in(payload, size_t(payload_size)) ;
+		std::vector<std::shared_ptr<token_vector> > partials(in.count(4)) ;
+		for (size_t i = 0 ; i < partials.size() ; ++i)
+		{
+			partials[i].reset(new token_vector) ;
+			read_tree(in, *partials[i], partials, i, options) ;
+		}
+		token_vector tree ;
+		read_tree(in, tree, partials, partials.size(), options) ;
+		if (! in.done())
+		{
+			throw TemplateException("Compiled template has trailing data") ;
+		}
+		return Template(tree) ;
+	}
+
+	Template load_template_file(std::string filename, const CompileOptions &options)
+	{
+#ifdef _WIN32
+		std::ifstream in(filename.c_str(), std::ios::binary) ;
+		if (! in)
+		{
+			throw TemplateException("Cannot open compiled template: " + filename) ;
+		}
+		std::ostringstream image ;
+		image << in.rdbuf() ;
+		const std::string bytes = image.str() ;
+		return load_template(bytes.data(), bytes.size(), options) ;
+#else
+		const int fd = ::open(filename.c_str(), O_RDONLY) ;
+		if (fd < 0)
+		{
+			throw TemplateException("Cannot open compiled template: " + filename) ;
+		}
+		struct stat info ;
+		if (::fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			::close(fd) ;
+			throw TemplateException("Cannot read compiled template: " + filename) ;
+		}
+		const size_t size = size_t(info.st_size) ;
+		void *image = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+		::close(fd) ;
+		if (image == MAP_FAILED)
+		{
+			throw TemplateException("Cannot map compiled template: " + filename) ;
+		}
+		try
+		{
+			Template result = load_template(static_cast<const char*>(image), size, options) ;
+			::munmap(image, size) ;
+			return result ;
+		}
+		catch (...)
+		{
+			::munmap(image, size) ;
+			throw ;
+		}
+#endif
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Ahead-of-time compilation
+	// The generated code keeps the interpreter's order of lookups and
+	// writes, so that output and exceptions match it exactly; the helpers
+	// in the prologue mirror TokenFor::bound, TokenIf::operand and the
+	// filter pipeline in TokenVar::gettext.
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const char *CPP_PROLOGUE = 
+			"#include \"cpptempl.h\"\n"
+			"\n"
+			"#include <algorithm>\n"
+			"#include <sstream>\n"
+			"\n"
+			"namespace\n"
+			"{\n"
+			"\tusing namespace cpptempl ;\n"
+			"\n"
+			"\t// loop.index and loop.index0 for one iteration\n"
+			"\tclass LoopData : public Data\n"
+			"\t{\n"
+			"\t\tdata_ptr m_index ;\n"
+			"\t\tdata_ptr m_index0 ;\n"
+			"\tpublic:\n"
+			"\t\tLoopData(data_ptr index, data_ptr index0) : m_index(index), m_index0(index0){}\n"
+			"\t\tbool empty()\n"
+			"\t\t{\n"
+			"\t\t\treturn false ;\n"
+			"\t\t}\n"
+			"\t\tbool getmember(const std::string &key, data_ptr &value)\n"
+			"\t\t{\n"
+			"\t\t\tif (key == \"index\")\n"
+			"\t\t\t{\n"
+			"\t\t\t\tvalue = m_index ;\n"
+			"\t\t\t\treturn true ;\n"
+			"\t\t\t}\n"
+			"\t\t\tif (key == \"index0\")\n"
+			"\t\t\t{\n"
+			"\t\t\t\tvalue = m_index0 ;\n"
+			"\t\t\t\treturn true ;\n"
+			"\t\t\t}\n"
+			"\t\t\treturn false ;\n"
+			"\t\t}\n"
+			"\t};\n"
+			"\n"
+			"\tinline void set_loop(data_map &data, size_t i)\n"
+			"\t{\n"
+			"\t\tdata[\"loop\"] = data_ptr(std::shared_ptr<Data>(std::make_shared<LoopData>(\n"
+			"\t\t\tmake_data(format_number(i+1)), make_data(format_number(i))))) ;\n"
+			"\t}\n"
+			"\n"
+			"\t// a loop option given as a data path\n"
+			"\tinline size_t loop_bound(const std::string *path, size_t parts, const char *operand, \n"
+			"\t\tdata_map &data, size_t fallback, MissingKeyPolicy missing_key)\n"
+			"\t{\n"
+			"\t\tdata_ptr value ;\n"
+			"\t\tif (! find_val(path, parts, data, value))\n"
+			"\t\t{\n"
+			"\t\t\tif (missing_key == MISSING_KEY_THROW)\n"
+			"\t\t\t{\n"
+			"\t\t\t\tthrow TemplateException(std::string(\"Missing key: \") + operand) ;\n"
+			"\t\t\t}\n"
+			"\t\t\treturn fallback ;\n"
+			"\t\t}\n"
+			"\t\tconst std::string text = value->getvalue() ;\n"
+			"\t\ttry\n"
+			"\t\t{\n"
+			"\t\t\t// lexical_cast would wrap a leading minus sign around\n"
+			"\t\t\tif (text.empty() || text.find_first_not_of(\"0123456789\") != std::string::npos)\n"
+			"\t\t\t{\n"
+			"\t\t\t\tthrow boost::bad_lexical_cast() ;\n"
+			"\t\t\t}\n"
+			"\t\t\treturn boost::lexical_cast<size_t>(text) ;\n"
+			"\t\t}\n"
+			"\t\tcatch (boost::bad_lexical_cast &)\n"
+			"\t\t{\n"
+			"\t\t\tthrow TemplateException(std::string(\"Invalid number in for statement: \") + operand) ;\n"
+			"\t\t}\n"
+			"\t}\n"
+			"\n"
+			"\t// one side of an if condition; placeholder is the {$key} text\n"
+			"\t// for MISSING_KEY_ECHO\n"
+			"\tinline data_ptr operand(const std::string *path, size_t parts, const char *key, \n"
+			"\t\tconst data_ptr &placeholder, data_map &data, MissingKeyPolicy missing_key)\n"
+			"\t{\n"
+			"\t\tdata_ptr value ;\n"
+			"\t\tif (find_val(path, parts, data, value))\n"
+			"\t\t{\n"
+			"\t\t\treturn value ;\n"
+			"\t\t}\n"
+			"\t\tswitch (missing_key)\n"
+			"\t\t{\n"
+			"\t\tcase MISSING_KEY_ECHO:\n"
+			"\t\t\treturn placeholder ;\n"
+			"\t\tcase MISSING_KEY_THROW:\n"
+			"\t\t\tthrow TemplateException(std::string(\"Missing key: \") + key) ;\n"
+			"\t\tdefault:\n"
+			"\t\t\t{\n"
+			"\t\t\t\tstatic data_ptr empty_value = make_data(\"\") ;\n"
+			"\t\t\t\treturn empty_value ;\n"
+			"\t\t\t}\n"
+			"\t\t}\n"
+			"\t}\n"
+			"\n"
+			"\t// the last filter writes to the output, the others to a scratch stream\n"
+			"\tinline void write_filtered(const filter_ptr *filters, size_t count, std::string text, \n"
+			"\t\tstd::ostream &stream, RenderContext &context)\n"
+			"\t{\n"
+			"\t\tfor (size_t i = 0 ; i + 1 < count ; ++i)\n"
+			"\t\t{\n"
+			"\t\t\tstd::ostringstream filtered ;\n"
+			"\t\t\tRenderContext scratch ;\n"
+			"\t\t\tfilters[i]->apply(text, filtered, scratch) ;\n"
+			"\t\t\ttext = filtered.str() ;\n"
+			"\t\t}\n"
+			"\t\tfilters[count - 1]->apply(text, stream, context) ;\n"
+			"\t}\n"
+			"}\n" ;
+
+		// text as a C++ string literal, continued on a new line after each
+		// newline in the text
+		std::string cpp_literal(const std::string &text, const std::string &indent)
+		{
+			std::string literal = "\"" ;
+			for (size_t i = 0 ; i < text.size() ; ++i)
+			{
+				const unsigned char c = static_cast<unsigned char>(text[i]) ;
+				switch (c)
+				{
+				case '\\': literal += "\\\\" ; break ;
+				case '"': literal += "\\\"" ; break ;
+				case '?': literal += "\\?" ; break ;		// no trigraphs
+				case '\t': literal += "\\t" ; break ;
+				case '\r': literal += "\\r" ; break ;
+				case '\n':
+					literal += "\\n" ;
+					if (i + 1 < text.size())
+					{
+						literal += "\"\n" + indent + "\"" ;
+					}
+					break ;
+				default:
+					if (c < 0x20 || c >= 0x7f)
+					{
+						// three octal digits, so a following digit is not taken in
+						char escape[5] ;
+						snprintf(escape, sizeof(escape), "\\%03o", c) ;
+						literal += escape ;
+					}
+					else
+					{
+						literal += char(c) ;
+					}
+				}
+			}
+			return literal + "\"" ;
+		}
+
+		const char *policy_name(MissingKeyPolicy policy)
+		{
+			switch (policy)
+			{
+			case MISSING_KEY_ECHO:
+				return "MISSING_KEY_ECHO" ;
+			case MISSING_KEY_EMPTY:
+				return "MISSING_KEY_EMPTY" ;
+			case MISSING_KEY_THROW:
+				return "MISSING_KEY_THROW" ;
+			default:
+				throw TemplateException("Missing-key callbacks cannot be compiled to C++") ;
+			}
+		}
+
+		bool identifier_char(char c)
+		{
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '_' ;
+		}
+
+		// whether generated code refers to name outside its literals
+		bool uses(const std::string &code, const std::string &name)
+		{
+			char quote = 0 ;
+			for (size_t i = 0 ; i < code.size() ; ++i)
+			{
+				const char c = code[i] ;
+				if (quote)
+				{
+					if (c == '\\')
+					{
+						++i ;
+					}
+					else if (c == quote)
+					{
+						quote = 0 ;
+					}
+				}
+				else if (c == '"' || c == '\'')
+				{
+					quote = c ;
+				}
+				else if (code.compare(i, name.size(), name) == 0 
+					&& (i == 0 || ! identifier_char(code[i-1]))
+					&& (i + name.size() == code.size() || ! identifier_char(code[i+name.size()])))
+				{
+					return true ;
+				}
+			}
+			return false ;
+		}
+
+		// the render parameters, unnamed where body does not use them
+		std::string render_parameters(const std::string &body, const std::string &ns)
+		{
+			return "(std::ostream &" + std::string(uses(body, "stream") ? "stream" : "") 
+				+ ", " + ns + "data_map &" + (uses(body, "data") ? "data" : "") 
+				+ ", " + ns + "RenderContext &" + (uses(body, "context") ? "context" : "") + ")" ;
+		}
+
+		// writes one function per tree: the main template and, ahead of it,
+		// each partial it includes
+		class CppGenerator
+		{
+			std::string m_function ;
+			std::map<token_vector*, std::string> m_partials ;
+			std::string m_helpers ;		// partial functions, dependencies first
+			size_t m_names ;
+		public:
+			CppGenerator(const std::string &function) : m_function(function), m_names(0){}
+
+			void generate(std::ostream &out, token_vector &tree)
+			{
+				std::ostringstream body ;
+				statements(body, tree, 1) ;
+				if (! m_helpers.empty())
+				{
+					out << "\nnamespace\n{\n" << m_helpers << "}\n" ;
+				}
+				out << "\nvoid " << m_function << render_parameters(body.str(), "cpptempl::") << "\n"
+					<< "{\n\tusing namespace cpptempl ;\n" << body.str() << "}\n"
+					<< "\nvoid " << m_function << "(std::ostream &stream, cpptempl::data_map &data)\n"
+					<< "{\n\tcpptempl::RenderContext context ;\n\t" << m_function << "(stream, data, context) ;\n}\n" ;
+			}
+		private:
+			std::string name(const std::string &prefix)
+			{
+				return prefix + "_" + format_number(++m_names) ;
+			}
+
+			// declares key split at its dots as a constant array and returns
+			// the array's name and size, to pass to find_val
+			std::string path(std::ostream &out, const std::string &key, const std::string &tabs)
+			{
+				std::vector<std::string> parts ;
+				if (! key.empty() && key[0] == '"')
+				{
+					parts.push_back(key) ;
+				}
+				else
+				{
+					boost::split(parts, key, boost::is_any_of(".")) ;
+				}
+				const std::string array = name("path") ;
+				out << tabs << "static const std::string " << array << "[] = {" ;
+				for (size_t i = 0 ; i < parts.size() ; ++i)
+				{
+					out << (i ? ", " : " ") << cpp_literal(parts[i], tabs + "\t") ;
+				}
+				out << " } ;\n" ;
+				return array + ", " + format_number(parts.size()) ;
+			}
+
+			std::string partial(token_vector &tree)
+			{
+				std::map<token_vector*, std::string>::iterator found = m_partials.find(&tree) ;
+				if (found != m_partials.end())
+				{
+					return found->second ;
+				}
+				const std::string function = m_function + "_" + name("partial") ;
+				m_partials[&tree] = function ;
+				std::ostringstream body ;
+				statements(body, tree, 2) ;
+				m_helpers += "\tvoid " + function + render_parameters(body.str(), "") + "\n"
+					"\t{\n" + body.str() + "\t}\n" ;
+				return function ;
+			}
+
+			void statements(std::ostream &out, token_vector &tree, size_t depth)
+			{
+				for (size_t i = 0 ; i < tree.size() ; ++i)
+				{
+					statement(out, tree[i].get(), depth) ;
+				}
+			}
+
+			void statement(std::ostream &out, Token *token, size_t depth)
+			{
+				const std::string tabs(depth, '\t') ;
+				switch (token->gettype())
+				{
+				case TOKEN_TYPE_TEXT:
+					{
+						const std::string text = static_cast<TokenText*>(token)->getvalue() ;
+						if (! text.empty())
+						{
+							out << tabs << "context.write(stream, " << cpp_literal(text, tabs + "\t") 
+								<< ", " << text.size() << ") ;\n" ;
+						}
+					}
+					break ;
+				case TOKEN_TYPE_VAR:
+					variable(out, static_cast<TokenVar*>(token), tabs) ;
+					break ;
+				case TOKEN_TYPE_FOR:
+					loop(out, static_cast<TokenFor*>(token), depth) ;
+					break ;
+				case TOKEN_TYPE_IF:
+					condition(out, static_cast<TokenIf*>(token), depth) ;
+					break ;
+				case TOKEN_TYPE_INCLUDE:
+					{
+						TokenInclude *include = static_cast<TokenInclude*>(token) ;
+						std::shared_ptr<token_vector> tree = include->getpartial() ;
+						if (! tree)
+						{
+							throw TemplateException("Include was not resolved: " + include->getname()) ;
+						}
+						out << tabs << partial(*tree) << "(stream, data, context) ;\n" ;
+					}
+					break ;
+				case TOKEN_TYPE_BLOCK:
+					statements(out, token->get_children(), depth) ;
+					break ;
+				default:
+					throw TemplateException("Cannot compile to C++: " + token->describe()) ;
+				}
+			}
+
+			void variable(std::ostream &out, TokenVar *var, const std::string &tabs)
+			{
+				const MissingKeyPolicy policy = var->get_missing_key() ;
+				policy_name(policy) ;		// throws for a callback
+				const std::vector<std::string> filters = var->getfilters() ;
+				out << tabs << "{\n" ;
+				if (! filters.empty())
+				{
+					out << tabs << "\tstatic const filter_ptr filters[] = {" ;
+					for (size_t i = 0 ; i < filters.size() ; ++i)
+					{
+						out << (i ? ", " : " ") << "get_filter(" << cpp_literal(filters[i], tabs + "\t\t") << ")" ;
+					}
+					out << " } ;\n" ;
+				}
+				const std::string key = path(out, var->getkey(), tabs + "\t") ;
+				out << tabs << "\tdata_ptr value ;\n"
+					<< tabs << "\tif (find_val(" << key << ", data, value))\n"
+					<< tabs << "\t{\n" ;
+				if (filters.empty())
+				{
+					out << tabs << "\t\tcontext.write(stream, value->getvalue()) ;\n" ;
+				}
+				else
+				{
+					out << tabs << "\t\twrite_filtered(filters, " << filters.size() << ", value->getvalue(), stream, context) ;\n" ;
+				}
+				out << tabs << "\t}\n" ;
+				if (policy == MISSING_KEY_ECHO)
+				{
+					// filtered like a value, as the interpreter does
+					const std::string placeholder = var->describe() ;
+					out << tabs << "\telse\n"
+						<< tabs << "\t{\n" ;
+					if (filters.empty())
+					{
+						out << tabs << "\t\tcontext.write(stream, " << cpp_literal(placeholder, tabs + "\t\t\t") 
+							<< ", " << placeholder.size() << ") ;\n" ;
+					}
+					else
+					{
+						out << tabs << "\t\twrite_filtered(filters, " << filters.size() << ", " 
+							<< cpp_literal(placeholder, tabs + "\t\t\t") << ", stream, context) ;\n" ;
+					}
+					out << tabs << "\t}\n" ;
+				}
+				else if (policy == MISSING_KEY_THROW)
+				{
+					out << tabs << "\telse\n"
+						<< tabs << "\t{\n"
+						<< tabs << "\t\tthrow TemplateException(" << cpp_literal("Missing key: " + var->getkey(), tabs + "\t\t\t") << ") ;\n"
+						<< tabs << "\t}\n" ;
+				}
+				out << tabs << "}\n" ;
+			}
+
+			// a loop option: a constant if written as a number, else a lookup
+			// whose path is declared in out
+			std::string bound(std::ostream &out, const std::string &operand, const std::string &fallback, 
+				MissingKeyPolicy policy, const std::string &tabs)
+			{
+				if (operand.empty())
+				{
+					return fallback ;
+				}
+				if (boost::all(operand, boost::is_digit()))
+				{
+					try
+					{
+						return "size_t(" + format_number(boost::lexical_cast<size_t>(operand)) + "u)" ;
+					}
+					catch (boost::bad_lexical_cast &)
+					{
+						throw TemplateException("Invalid number in for statement: " + operand) ;
+					}
+				}
+				const std::string key = path(out, operand, tabs) ;
+				return "loop_bound(" + key + ", " + cpp_literal(operand, tabs + "\t") + ", data, " 
+					+ fallback + ", " + policy_name(policy) + ")" ;
+			}
+
+			void loop(std::ostream &out, TokenFor *token, size_t depth)
+			{
+				const std::string tabs(depth, '\t') ;
+				const std::string n = format_number(++m_names) ;
+				const std::string list = "list_" + n, count = "count_" + n, i = "i_" + n ;
+				const MissingKeyPolicy policy = token->m_missing_key ;
+				out << tabs << "{\n" ;
+				const std::string key = path(out, token->m_key, tabs + "\t") ;
+				out << tabs << "\tdata_ptr " << list << " ;\n"
+					<< tabs << "\tif (find_val(" << key << ", data, " << list << "))\n"
+					<< tabs << "\t{\n" ;
+				if (token->getoptions().empty())
+				{
+					// every element in order
+					out << tabs << "\t\tconst size_t " << count << " = " << list << "->getsize() ;\n"
+						<< tabs << "\t\tfor (size_t " << i << " = 0 ; " << i << " < " << count << " ; ++" << i << ")\n"
+						<< tabs << "\t\t{\n"
+						<< tabs << "\t\t\tcontext.iteration() ;\n"
+						<< tabs << "\t\t\tset_loop(data, " << i << ") ;\n"
+						<< tabs << "\t\t\tdata[" << cpp_literal(token->m_val, tabs + "\t\t\t\t") << "] = " << list << "->getitem(" << i << ") ;\n" ;
+				}
+				else
+				{
+					loop_selection(out, token, n, tabs) ;
+				}
+				statements(out, token->m_children, depth + 3) ;
+				out << tabs << "\t\t}\n"
+					<< tabs << "\t}\n" ;
+				if (policy == MISSING_KEY_THROW)
+				{
+					out << tabs << "\telse\n"
+						<< tabs << "\t{\n"
+						<< tabs << "\t\tthrow TemplateException(" << cpp_literal("Missing key: " + token->m_key, tabs + "\t\t\t") << ") ;\n"
+						<< tabs << "\t}\n" ;
+				}
+				out << tabs << "}\n" ;
+			}
+
+			// the loop header for offset, limit, step and reversed
+			void loop_selection(std::ostream &out, TokenFor *token, const std::string &n, const std::string &tabs)
+			{
+				const std::string list = "list_" + n, size = "size_" + n, first = "first_" + n, 
+					end = "end_" + n, step = "step_" + n, count = "count_" + n, i = "i_" + n ;
+				const MissingKeyPolicy policy = token->m_missing_key ;
+				const std::string inner = tabs + "\t\t" ;
+				const std::string offset = bound(out, token->m_offset, "size_t(0)", policy, inner) ;
+				const std::string limit = bound(out, token->m_limit, size, policy, inner) ;
+				const std::string stride = bound(out, token->m_step, "size_t(1)", policy, inner) ;
+				out << inner << "const size_t " << size << " = " << list << "->getsize() ;\n"
+					<< inner << "const size_t " << first << " = std::min(" << offset << ", " << size << ") ;\n"
+					<< inner << "const size_t " << end << " = " << first << " + std::min(" 
+						<< limit << ", " << size << " - " << first << ") ;\n"
+					<< inner << "const size_t " << step << " = " << stride << " ;\n" ;
+				// only a data path or a written 0 can make the step 0
+				if (! token->m_step.empty() && (token->m_step.find_first_not_of('0') == std::string::npos 
+					|| ! boost::all(token->m_step, boost::is_digit())))
+				{
+					out << tabs << "\t\tif (" << step << " == 0)\n"
+						<< tabs << "\t\t{\n"
+						<< tabs << "\t\t\tthrow TemplateException(\"Invalid option in for statement: step:0\") ;\n"
+						<< tabs << "\t\t}\n" ;
+				}
+				out << tabs << "\t\tconst size_t " << count << " = " << end << " > " << first << " ? (" << end << " - " << first << " - 1) / " << step << " + 1 : 0 ;\n"
+					<< tabs << "\t\tfor (size_t " << i << " = 0 ; " << i << " < " << count << " ; ++" << i << ")\n"
+					<< tabs << "\t\t{\n"
+					<< tabs << "\t\t\tcontext.iteration() ;\n"
+					<< tabs << "\t\t\tset_loop(data, " << i << ") ;\n"
+					<< tabs << "\t\t\tdata[" << cpp_literal(token->m_val, tabs + "\t\t\t\t") << "] = " << list << "->getitem(" << first << " + " 
+						<< (token->m_reversed ? "(" + count + " - 1 - " + i + ")" : i) << " * " << step << ") ;\n" ;
+			}
+
+			void condition(std::ostream &out, TokenIf *token, size_t depth)
+			{
+				const std::string tabs(depth, '\t') ;
+				std::vector<std::string> elements ;
+				boost::split(elements, token->m_expr, boost::is_space()) ;
+				policy_name(token->m_missing_key) ;		// throws for a callback
+				if (elements.size() < 2 || (elements[1] == "not" ? elements.size() < 3 : elements.size() == 3))
+				{
+					throw TemplateException("Cannot compile to C++: " + token->describe()) ;
+				}
+				out << tabs << "{\n" ;
+				if (elements[1] == "not")
+				{
+					const std::string value = operand(out, elements[2], token->m_missing_key, tabs + "\t") ;
+					out << tabs << "\tif (" << value << "->empty())\n" ;
+				}
+				else if (elements.size() == 2)
+				{
+					const std::string value = operand(out, elements[1], token->m_missing_key, tabs + "\t") ;
+					out << tabs << "\tif (! " << value << "->empty())\n" ;
+				}
+				else
+				{
+					const std::string lhs = operand(out, elements[1], token->m_missing_key, tabs + "\t") ;
+					const std::string rhs = operand(out, elements[3], token->m_missing_key, tabs + "\t") ;
+					const std::string n = format_number(++m_names) ;
+					out << tabs << "\tdata_ptr lhs_" << n << " = " << lhs << " ;\n"
+						<< tabs << "\tdata_ptr rhs_" << n << " = " << rhs << " ;\n"
+						<< tabs << "\tif (lhs_" << n << "->getvalue() " << (elements[2] == "==" ? "==" : "!=") << " rhs_" << n << "->getvalue())\n" ;
+				}
+				out << tabs << "\t{\n" ;
+				statements(out, token->m_children, depth + 2) ;
+				out << tabs << "\t}\n"
+					<< tabs << "}\n" ;
+			}
+
+			// declares key's path, and for MISSING_KEY_ECHO its placeholder,
+			// and returns the call that looks it up
+			std::string operand(std::ostream &out, const std::string &key, MissingKeyPolicy policy, const std::string &tabs)
+			{
+				const std::string lookup = path(out, key, tabs) ;
+				std::string placeholder = "data_ptr()" ;
+				if (policy == MISSING_KEY_ECHO && ! key.empty() && key[0] != '"')
+				{
+					placeholder = name("placeholder") ;
+					out << tabs << "static const data_ptr " << placeholder << " = make_data(" 
+						<< cpp_literal("{$" + key + "}", tabs + "\t") << ") ;\n" ;
+				}
+				return "operand(" + lookup + ", " + cpp_literal(key, tabs + "\t") + ", " + placeholder 
+					+ ", data, " + policy_name(policy) + ")" ;
+			}
+		};
+	}
+
+	void generate_cpp_prologue( std::ostream &out )
+	{
+		out << CPP_PROLOGUE ;
+	}
+
+	void generate_cpp( std::ostream &out, const std::string &function, Template &templ )
+	{
+		if (function.empty() || isdigit(static_cast<unsigned char>(function[0])) 
+			|| ! boost::all(function, boost::is_alnum() || boost::is_any_of("_")))
+		{
+			throw TemplateException("Not a C++ function name: " + function) ;
+		}
+		CppGenerator generator(function) ;
+		generator.generate(out, templ.get_tree()) ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// JSON data
+	//
+	// One pass over the text builds every node into flat vectors: nodes,
+	// array elements and object members by node index. Containers gather
+	// their children on a scratch stack and copy them out contiguously
+	// when they close. String contents are scanned with skip_safe, which
+	// uses SSE2 when available.
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const size_t JSON_MAX_DEPTH = 512 ;
+
+		typedef enum
+		{
+			JSON_STRING,
+			JSON_NUMBER,
+			JSON_TRUE,
+			JSON_FALSE,
+			JSON_NULL,
+			JSON_ARRAY,
+			JSON_OBJECT,
+		} JsonKind;
+
+		struct JsonDocument ;
+
+		class JsonNode : public Data
+		{
+		public:
+			JsonNode(JsonDocument *document, JsonKind kind) : 
+				m_document(document), m_kind(kind), m_text(NULL), m_size(0), 
+				m_escaped(false), m_first(0), m_count(0){}
+			bool empty() ;
+			std::string getvalue() ;
+			bool getmember(const std::string &key, data_ptr &value) ;
+			size_t getsize() ;
+			data_ptr getitem(size_t index) ;
+
+			JsonDocument *m_document ;
+			JsonKind m_kind ;
+			// string contents or number text
+			const char *m_text ;
+			size_t m_size ;
+			bool m_escaped ;
+			// elements or members
+			size_t m_first ;
+			size_t m_count ;
+		};
+
+		struct JsonMember
+		{
+			const char *key ;
+			size_t key_size ;
+			size_t node ;
+		};
+
+		bool operator < (const JsonMember &lhs, const JsonMember &rhs)
+		{
+			const int order = std::memcmp(lhs.key, rhs.key, std::min(lhs.key_size, rhs.key_size)) ;
+			return order < 0 || (order == 0 && lhs.key_size < rhs.key_size) ;
+		}
+
+		struct JsonDocument : public std::enable_shared_from_this<JsonDocument>
+		{
+			std::string text ;
+			std::vector<JsonNode> nodes ;
+			std::vector<size_t> elements ;
+			std::vector<JsonMember> members ;		// sorted by key within each object
+			std::deque<std::string> keys ;			// keys that needed unescaping
+
+			data_ptr node(size_t index)
+			{
+				return data_ptr(std::shared_ptr<Data>(shared_from_this(), &nodes[index])) ;
+			}
+		};
+
+		void append_utf8(std::string &out, unsigned long code)
+		{
+			if (code < 0x80)
+			{
+				out += char(code) ;
 			}
-			else if (token->gettype() == TOKEN_TYPE_IF)
+			else if (code < 0x800)
 			{
-				token_vector children ;
-				parse_tree(tokens, children, TOKEN_TYPE_ENDIF) ;
-				token->set_children(children) ;
+				out += char(0xC0 | (code >> 6)) ;
+				out += char(0x80 | (code & 0x3F)) ;
 			}
-			else if (token->gettype() == until)
+			else if (code < 0x10000)
 			{
-				return ;
+				out += char(0xE0 | (code >> 12)) ;
+				out += char(0x80 | ((code >> 6) & 0x3F)) ;
+				out += char(0x80 | (code & 0x3F)) ;
+			}
+			else
+			{
+				out += char(0xF0 | (code >> 18)) ;
+				out += char(0x80 | ((code >> 12) & 0x3F)) ;
+				out += char(0x80 | ((code >> 6) & 0x3F)) ;
+				out += char(0x80 | (code & 0x3F)) ;
 			}
-			tree.push_back(token) ;
 		}
-	}
-	//////////////////////////////////////////////////////////////////////////
-	// tokenize
-	// parses a template into tokens (text, for, if, variable)
-	//////////////////////////////////////////////////////////////////////////
-	token_vector & tokenize(std::string text, token_vector &tokens)
-	{
-		while(! text.empty())
+
+		unsigned long read_hex4(const char *p)
 		{
-			size_t pos = text.find("{") ;
-			if (pos == std::string::npos)
+			unsigned long code = 0 ;
+			for (int i = 0 ; i < 4 ; ++i)
 			{
-				if (! text.empty())
+				const char ch = p[i] ;
+				code <<= 4 ;
+				if (ch >= '0' && ch <= '9')
 				{
-					tokens.push_back(token_ptr(new TokenText(text))) ;
+					code |= ch - '0' ;
+				}
+				else if (ch >= 'a' && ch <= 'f')
+				{
+					code |= ch - 'a' + 10 ;
+				}
+				else if (ch >= 'A' && ch <= 'F')
+				{
+					code |= ch - 'A' + 10 ;
+				}
+				else
+				{
+					throw TemplateException("Invalid JSON: bad \\u escape") ;
 				}
-				return tokens ;
 			}
-            std::string pre_text = text.substr(0, pos) ;
-			if (! pre_text.empty())
+			return code ;
+		}
+
+		// decodes string contents already checked by JsonParser
+		std::string json_unescape(const char *p, const char *end)
+		{
+			std::string out ;
+			out.reserve(end - p) ;
+			while (p < end)
+			{
+				const char *special = skip_safe<JsonEscaper>(p, end) ;
+				out.append(p, special) ;
+				if (special == end)
+				{
+					break ;
+				}
+				p = special + 2 ;
+				switch (special[1])
+				{
+				case 'b': out += '\b' ; break ;
+				case 'f': out += '\f' ; break ;
+				case 'n': out += '\n' ; break ;
+				case 'r': out += '\r' ; break ;
+				case 't': out += '\t' ; break ;
+				case 'u':
+					{
+						unsigned long code = read_hex4(p) ;
+						p += 4 ;
+						if (code >= 0xD800 && code < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+						{
+							const unsigned long low = read_hex4(p + 2) ;
+							if (low >= 0xDC00 && low < 0xE000)
+							{
+								code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00) ;
+								p += 6 ;
+							}
+						}
+						append_utf8(out, code) ;
+					}
+					break ;
+				default: out += special[1] ; break ;
+				}
+			}
+			return out ;
+		}
+
+		class JsonParser
+		{
+		public:
+			JsonParser(JsonDocument &document) : 
+				m_document(document), 
+				m_begin(document.text.data()), 
+				m_p(m_begin), 
+				m_end(m_begin + document.text.size()){}
+
+			size_t parse()
 			{
-				tokens.push_back(token_ptr(new TokenText(pre_text))) ;
+				const size_t root = value(0) ;
+				skip_space() ;
+				if (m_p != m_end)
+				{
+					fail("unexpected text after value") ;
+				}
+				return root ;
 			}
-			text = text.substr(pos+1) ;
-			if (text.empty())
+		private:
+			void fail(const std::string &reason)
 			{
-				tokens.push_back(token_ptr(new TokenText("{"))) ;
-				return tokens ;
+				throw TemplateException("Invalid JSON at offset " 
+					+ boost::lexical_cast<std::string>(m_p - m_begin) + ": " + reason) ;
 			}
 
-			// variable
-			if (text[0] == '$')
+			void skip_space()
 			{
-				pos = text.find("}") ;
-				if (pos != std::string::npos)
+				while (m_p < m_end && (*m_p == ' ' || *m_p == '\n' || *m_p == '\r' || *m_p == '\t'))
 				{
-					tokens.push_back(token_ptr (new TokenVar(text.substr(1, pos-1)))) ;
-					text = text.substr(pos+1) ;
+					++m_p ;
 				}
 			}
-			// control statement
-			else if (text[0] == '%')
+
+			void expect(const char *word, size_t size)
 			{
-				pos = text.find("}") ;
-				if (pos != std::string::npos)
+				if (size_t(m_end - m_p) < size || std::memcmp(m_p, word, size) != 0)
 				{
-                    std::string expression = boost::trim_copy(text.substr(1, pos-2)) ;
-					text = text.substr(pos+1) ;
-					if (boost::starts_with(expression, "for"))
+					fail("unexpected character") ;
+				}
+				m_p += size ;
+			}
+
+			size_t add(JsonKind kind)
+			{
+				m_document.nodes.push_back(JsonNode(&m_document, kind)) ;
+				return m_document.nodes.size() - 1 ;
+			}
+
+			size_t value(size_t depth)
+			{
+				skip_space() ;
+				if (m_p == m_end)
+				{
+					fail("unexpected end of input") ;
+				}
+				switch (*m_p)
+				{
+				case '{': return object(depth + 1) ;
+				case '[': return array(depth + 1) ;
+				case '"':
 					{
-						tokens.push_back(token_ptr (new TokenFor(expression))) ;
+						const size_t index = add(JSON_STRING) ;
+						bool escaped = false ;
+						const char *text = string(escaped) ;
+						JsonNode &node = m_document.nodes[index] ;
+						node.m_text = text ;
+						node.m_size = m_p - 1 - text ;
+						node.m_escaped = escaped ;
+						return index ;
 					}
-					else if (boost::starts_with(expression, "if"))
+				case 't': expect("true", 4) ; return add(JSON_TRUE) ;
+				case 'f': expect("false", 5) ; return add(JSON_FALSE) ;
+				case 'n': expect("null", 4) ; return add(JSON_NULL) ;
+				default: return number() ;
+				}
+			}
+
+			// leaves m_p after the closing quote; returns the contents
+			const char* string(bool &escaped)
+			{
+				const char *text = ++m_p ;
+				while (true)
+				{
+					m_p = skip_safe<JsonEscaper>(m_p, m_end) ;
+					if (m_p == m_end)
 					{
-						tokens.push_back(token_ptr (new TokenIf(expression))) ;
+						fail("unterminated string") ;
 					}
-					else
+					if (*m_p == '"')
+					{
+						++m_p ;
+						return text ;
+					}
+					if (*m_p != '\\')
 					{
-						tokens.push_back(token_ptr (new TokenEnd(boost::trim_copy(expression)))) ;
+						fail("control character in string") ;
 					}
+					escaped = true ;
+					if (m_end - m_p < 2 || m_p[1] == '\0' || ! std::strchr("\"\\/bfnrtu", m_p[1]))
+					{
+						fail("bad escape") ;
+					}
+					if (m_p[1] == 'u')
+					{
+						if (m_end - m_p < 6)
+						{
+							fail("bad escape") ;
+						}
+						read_hex4(m_p + 2) ;
+						m_p += 4 ;
+					}
+					m_p += 2 ;
 				}
 			}
-			else
+
+			size_t number()
+			{
+				const char *start = m_p ;
+				if (m_p < m_end && *m_p == '-')
+				{
+					++m_p ;
+				}
+				if (m_p < m_end && *m_p == '0')
+				{
+					++m_p ;
+				}
+				else if (! digits())
+				{
+					fail("unexpected character") ;
+				}
+				if (m_p < m_end && *m_p == '.')
+				{
+					++m_p ;
+					if (! digits())
+					{
+						fail("bad number") ;
+					}
+				}
+				if (m_p < m_end && (*m_p == 'e' || *m_p == 'E'))
+				{
+					++m_p ;
+					if (m_p < m_end && (*m_p == '+' || *m_p == '-'))
+					{
+						++m_p ;
+					}
+					if (! digits())
+					{
+						fail("bad number") ;
+					}
+				}
+				const size_t index = add(JSON_NUMBER) ;
+				m_document.nodes[index].m_text = start ;
+				m_document.nodes[index].m_size = m_p - start ;
+				return index ;
+			}
+
+			bool digits()
+			{
+				const char *start = m_p ;
+				while (m_p < m_end && *m_p >= '0' && *m_p <= '9')
+				{
+					++m_p ;
+				}
+				return m_p != start ;
+			}
+
+			size_t array(size_t depth)
+			{
+				if (depth > JSON_MAX_DEPTH)
+				{
+					fail("nested too deeply") ;
+				}
+				++m_p ;
+				const size_t index = add(JSON_ARRAY) ;
+				const size_t mark = m_elements.size() ;
+				skip_space() ;
+				if (m_p < m_end && *m_p == ']')
+				{
+					++m_p ;
+				}
+				else
+				{
+					while (true)
+					{
+						m_elements.push_back(value(depth)) ;
+						skip_space() ;
+						if (m_p < m_end && *m_p == ',')
+						{
+							++m_p ;
+							continue ;
+						}
+						if (m_p < m_end && *m_p == ']')
+						{
+							++m_p ;
+							break ;
+						}
+						fail("expected , or ]") ;
+					}
+				}
+				JsonNode &node = m_document.nodes[index] ;
+				node.m_first = m_document.elements.size() ;
+				node.m_count = m_elements.size() - mark ;
+				m_document.elements.insert(m_document.elements.end(), m_elements.begin() + mark, m_elements.end()) ;
+				m_elements.resize(mark) ;
+				return index ;
+			}
+
+			size_t object(size_t depth)
+			{
+				if (depth > JSON_MAX_DEPTH)
+				{
+					fail("nested too deeply") ;
+				}
+				++m_p ;
+				const size_t index = add(JSON_OBJECT) ;
+				const size_t mark = m_members.size() ;
+				skip_space() ;
+				if (m_p < m_end && *m_p == '}')
+				{
+					++m_p ;
+				}
+				else
+				{
+					while (true)
+					{
+						skip_space() ;
+						if (m_p == m_end || *m_p != '"')
+						{
+							fail("expected member name") ;
+						}
+						bool escaped = false ;
+						JsonMember member ;
+						member.key = string(escaped) ;
+						member.key_size = m_p - 1 - member.key ;
+						if (escaped)
+						{
+							m_document.keys.push_back(json_unescape(member.key, member.key + member.key_size)) ;
+							member.key = m_document.keys.back().data() ;
+							member.key_size = m_document.keys.back().size() ;
+						}
+						skip_space() ;
+						if (m_p == m_end || *m_p != ':')
+						{
+							fail("expected :") ;
+						}
+						++m_p ;
+						member.node = value(depth) ;
+						m_members.push_back(member) ;
+						skip_space() ;
+						if (m_p < m_end && *m_p == ',')
+						{
+							++m_p ;
+							continue ;
+						}
+						if (m_p < m_end && *m_p == '}')
+						{
+							++m_p ;
+							break ;
+						}
+						fail("expected , or }") ;
+					}
+				}
+				std::stable_sort(m_members.begin() + mark, m_members.end()) ;
+				JsonNode &node = m_document.nodes[index] ;
+				node.m_first = m_document.members.size() ;
+				node.m_count = m_members.size() - mark ;
+				m_document.members.insert(m_document.members.end(), m_members.begin() + mark, m_members.end()) ;
+				m_members.resize(mark) ;
+				return index ;
+			}
+
+			JsonDocument &m_document ;
+			const char *m_begin ;
+			const char *m_p ;
+			const char *m_end ;
+			std::vector<size_t> m_elements ;
+			std::vector<JsonMember> m_members ;
+		};
+
+		bool JsonNode::empty()
+		{
+			switch (m_kind)
 			{
-				tokens.push_back(token_ptr(new TokenText("{"))) ;
+			case JSON_STRING: return m_size == 0 ;
+			case JSON_FALSE:
+			case JSON_NULL: return true ;
+			case JSON_ARRAY:
+			case JSON_OBJECT: return m_count == 0 ;
+			default: return false ;
 			}
 		}
-		return tokens ;
+
+		std::string JsonNode::getvalue()
+		{
+			switch (m_kind)
+			{
+			case JSON_STRING:
+				if (m_escaped)
+				{
+					return json_unescape(m_text, m_text + m_size) ;
+				}
+				return std::string(m_text, m_size) ;
+			case JSON_NUMBER: return std::string(m_text, m_size) ;
+			case JSON_TRUE: return "true" ;
+			case JSON_FALSE: return "false" ;
+			case JSON_NULL: return std::string() ;
+			default: return Data::getvalue() ;
+			}
+		}
+
+		bool JsonNode::getmember(const std::string &key, data_ptr &value)
+		{
+			if (m_kind != JSON_OBJECT)
+			{
+				return Data::getmember(key, value) ;
+			}
+			JsonMember wanted ;
+			wanted.key = key.data() ;
+			wanted.key_size = key.size() ;
+			std::vector<JsonMember>::iterator first = m_document->members.begin() + m_first ;
+			std::vector<JsonMember>::iterator last = first + m_count ;
+			// the last of duplicate keys wins, as when loading into a data_map
+			std::vector<JsonMember>::iterator found = std::upper_bound(first, last, wanted) ;
+			if (found == first || *(found - 1) < wanted)
+			{
+				return false ;
+			}
+			value = m_document->node((found - 1)->node) ;
+			return true ;
+		}
+
+		size_t JsonNode::getsize()
+		{
+			if (m_kind != JSON_ARRAY)
+			{
+				return Data::getsize() ;
+			}
+			return m_count ;
+		}
+
+		data_ptr JsonNode::getitem(size_t index)
+		{
+			if (m_kind != JSON_ARRAY)
+			{
+				return Data::getitem(index) ;
+			}
+			return m_document->node(m_document->elements[m_first + index]) ;
+		}
+
+		std::shared_ptr<JsonDocument> parse_json_document(std::string &json, size_t &root)
+		{
+			std::shared_ptr<JsonDocument> document = std::make_shared<JsonDocument>() ;
+			document->text.swap(json) ;
+			// a rough guess: a node for every 8 bytes of JSON
+			document->nodes.reserve(document->text.size() / 8 + 1) ;
+			JsonParser parser(*document) ;
+			root = parser.parse() ;
+			return document ;
+		}
 	}
 
-	/************************************************************************
-	* parse
-	*
-	*  1. tokenizes template
-	*  2. parses tokens into tree
-	*  3. resolves template
-	*  4. returns converted text
-	************************************************************************/
-    std::string parse(std::string templ_text, data_map &data)
+	data_ptr parse_json(std::string json)
 	{
-		std::ostringstream stream ;
-		parse(stream, templ_text, data) ;
-		return stream.str() ;
+		size_t root = 0 ;
+		std::shared_ptr<JsonDocument> document = parse_json_document(json, root) ;
+		return document->node(root) ;
 	}
-	void parse(std::ostream &stream, std::string templ_text, data_map &data)
+
+	void load_json(std::string json, data_map &data)
 	{
-		token_vector tokens ;
-		tokenize(templ_text, tokens) ;
-		token_vector tree ;
-		parse_tree(tokens, tree) ;
+		size_t root = 0 ;
+		std::shared_ptr<JsonDocument> document = parse_json_document(json, root) ;
+		JsonNode &object = document->nodes[root] ;
+		if (object.m_kind != JSON_OBJECT)
+		{
+			throw TemplateException("Invalid JSON: expected an object") ;
+		}
+		for (size_t i = 0 ; i < object.m_count ; ++i)
+		{
+			const JsonMember &member = document->members[object.m_first + i] ;
+			data[std::string(member.key, member.key_size)] = document->node(member.node) ;
+		}
+	}
 
-		for (size_t i = 0 ; i < tree.size() ; ++i)
+	//////////////////////////////////////////////////////////////////////////
+	// FileSink
+	//////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const size_t FILE_SINK_ALIGNMENT = 4096 ;
+	}
+
+	FileSink::FileSink(std::string filename, size_t buffer_size, bool direct) : 
+		m_filename(filename), m_fd(-1), m_direct(false), m_current(0), 
+		m_full(NULL), m_full_size(0), m_stop(false), m_closed(false), m_written(0)
+	{
+		m_size = (std::max(buffer_size, FILE_SINK_ALIGNMENT) + FILE_SINK_ALIGNMENT - 1) 
+			/ FILE_SINK_ALIGNMENT * FILE_SINK_ALIGNMENT ;
+#ifdef _WIN32
+		m_fd = ::_open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE) ;
+#else
+#ifdef O_DIRECT
+		if (direct)
 		{
-			// Recursively calls gettext on each node in the tree.
-			// gettext returns the appropriate text for that node.
-			// for text, itself;
-			// for variable, substitution;
-			// for control statement, recursively gets kids
-			tree[i]->gettext(stream, data) ;
+			m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644) ;
+			m_direct = m_fd >= 0 ;
+		}
+#endif
+		if (m_fd < 0)
+		{
+			m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) ;
+		}
+#endif
+		if (m_fd < 0)
+		{
+			throw TemplateException("Cannot open output file: " + filename) ;
+		}
+		m_storage.resize(2 * m_size + FILE_SINK_ALIGNMENT) ;
+		const size_t misalignment = reinterpret_cast<size_t>(&m_storage[0]) % FILE_SINK_ALIGNMENT ;
+		m_buffers[0] = &m_storage[0] + (misalignment ? FILE_SINK_ALIGNMENT - misalignment : 0) ;
+		m_buffers[1] = m_buffers[0] + m_size ;
+		setp(m_buffers[0], m_buffers[0] + m_size) ;
+		m_thread = std::thread(&FileSink::run, this) ;
+	}
+
+	FileSink::~FileSink()
+	{
+		try
+		{
+			close() ;
+		}
+		catch (...)
+		{
+		}
+	}
+
+	void FileSink::close()
+	{
+		if (m_closed)
+		{
+			return ;
+		}
+		hand_off() ;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex) ;
+			m_stop = true ;
+		}
+		m_ready.notify_one() ;
+		m_thread.join() ;
+		m_closed = true ;
+		setp(NULL, NULL) ;
+#ifdef _WIN32
+		const bool closed = ::_close(m_fd) == 0 ;
+#else
+		const bool closed = ::close(m_fd) == 0 ;
+#endif
+		if (m_error.empty() && ! closed)
+		{
+			m_error = "Cannot close output file: " + m_filename ;
+		}
+		if (! m_error.empty())
+		{
+			throw TemplateException(m_error) ;
+		}
+	}
+
+	unsigned long long FileSink::bytes_written()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex) ;
+		return m_written ;
+	}
+
+	FileSink::int_type FileSink::overflow(int_type ch)
+	{
+		if (m_closed || ! hand_off())
+		{
+			return traits_type::eof() ;
+		}
+		if (! traits_type::eq_int_type(ch, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(ch) ;
+			pbump(1) ;
+		}
+		return traits_type::not_eof(ch) ;
+	}
+
+	int FileSink::sync()
+	{
+		return m_closed || hand_off() ? 0 : -1 ;
+	}
+
+	// gives the filled buffer to the writer and carries on in the other one
+	bool FileSink::hand_off()
+	{
+		const size_t size = pptr() - pbase() ;
+		std::unique_lock<std::mutex> lock(m_mutex) ;
+		m_done.wait(lock, [this]() { return m_full == NULL ; }) ;
+		if (! m_error.empty())
+		{
+			return false ;
+		}
+		if (size == 0)
+		{
+			return true ;
+		}
+		m_full = pbase() ;
+		m_full_size = size ;
+		lock.unlock() ;
+		m_ready.notify_one() ;
+		m_current ^= 1 ;
+		setp(m_buffers[m_current], m_buffers[m_current] + m_size) ;
+		return true ;
+	}
+
+	void FileSink::run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex) ;
+		while (true)
+		{
+			m_ready.wait(lock, [this]() { return m_full != NULL || m_stop ; }) ;
+			if (! m_full)
+			{
+				return ;
+			}
+			const char *data = m_full ;
+			const size_t size = m_full_size ;
+			lock.unlock() ;
+			const std::string error = write_file(data, size) ;
+			lock.lock() ;
+			if (error.empty())
+			{
+				m_written += size ;
+			}
+			else if (m_error.empty())
+			{
+				m_error = error ;
+			}
+			m_full = NULL ;
+			m_done.notify_all() ;
+		}
+	}
+
+	std::string FileSink::write_file(const char *data, size_t size)
+	{
+		while (size)
+		{
+#ifdef _WIN32
+			const int written = ::_write(m_fd, data, unsigned(std::min(size, size_t(1) << 30))) ;
+#else
+			const ssize_t written = ::write(m_fd, data, size) ;
+#endif
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue ;
+				}
+#ifdef O_DIRECT
+				// O_DIRECT refuses the unaligned tail of the file, among others
+				if (errno == EINVAL && m_direct)
+				{
+					::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) & ~O_DIRECT) ;
+					m_direct = false ;
+					continue ;
+				}
+#endif
+				return "Cannot write output file " + m_filename + ": " + std::strerror(errno) ;
+			}
+			data += written ;
+			size -= size_t(written) ;
 		}
+		return std::string() ;
 	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Instantiations
+	// the engine for each character type the header declares it for
+	//////////////////////////////////////////////////////////////////////////
+#define CPPTEMPL_INSTANTIATE_FUNCTIONS(CharT) \
+	template basic_data_ptr<CharT> parse_val<CharT>(type_identity<std::basic_string<CharT> >::type, \
+		basic_data_map<CharT> &) ; \
+	template bool find_val<CharT>(const type_identity<std::basic_string<CharT> >::type &, \
+		basic_data_map<CharT> &, basic_data_ptr<CharT> &) ; \
+	template bool find_val<CharT>(const std::basic_string<CharT> *, size_t, \
+		basic_data_map<CharT> &, basic_data_ptr<CharT> &) ; \
+	template std::basic_string<CharT> gettext<CharT>(basic_token_ptr<CharT>, basic_data_map<CharT> &) ; \
+	template void parse_tree<CharT>(basic_token_vector<CharT> &, basic_token_vector<CharT> &, TokenType) ; \
+	template basic_token_vector<CharT> & tokenize<CharT>(type_identity<std::basic_string<CharT> >::type, \
+		basic_token_vector<CharT> &, const CompileOptions &) ; \
+	template void Profiler::render<CharT>(basic_token_ptr<CharT> &, std::basic_ostream<CharT> &, \
+		basic_data_map<CharT> &, RenderContext &) ; \
+	template std::basic_string<CharT> parse<CharT>(type_identity<std::basic_string<CharT> >::type, \
+		basic_data_map<CharT> &) ; \
+	template void parse<CharT>(std::basic_ostream<CharT> &, type_identity<std::basic_string<CharT> >::type, \
+		basic_data_map<CharT> &) ; \
+	template void parse<CharT>(std::basic_ostream<CharT> &, type_identity<std::basic_string<CharT> >::type, \
+		basic_data_map<CharT> &, RenderContext &) ;
+
+	CPPTEMPL_INSTANTIATE_CLASSES(, char)
+	CPPTEMPL_INSTANTIATE_CLASSES(, wchar_t)
+	CPPTEMPL_INSTANTIATE_CLASSES(, char16_t)
+	CPPTEMPL_INSTANTIATE_FUNCTIONS(char)
+	CPPTEMPL_INSTANTIATE_FUNCTIONS(wchar_t)
+	CPPTEMPL_INSTANTIATE_FUNCTIONS(char16_t)
 }
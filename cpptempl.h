@@ -45,9 +45,20 @@ Example:
 
 #include <string>
 #include <vector>
+#include <list>
+#include <deque>
 #include <map>							
+#include <set>
 #include <memory>
 #include <unordered_map>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <streambuf>
 #include <boost/lexical_cast.hpp>
 
 #include <iostream>
@@ -56,58 +67,157 @@ namespace cpptempl
 {
 	// various typedefs
 
+	// the type itself; keeps a parameter out of template argument
+	// deduction, so that e.g. parse("...", data) takes its character
+	// type from data alone
+	template <typename T> struct type_identity
+	{
+		typedef T type ;
+	};
+
 	// data classes
-	class Data ;
-	class DataValue ;
-	class DataList ;
-	class DataMap ;
+	// The engine is written for any character type; the unprefixed names
+	// are its char versions, and the w and u16 names (wdata_map,
+	// u16data_map, ...) its wchar_t and char16_t versions.
+	template <typename CharT> class basic_Data ;
+	template <typename CharT> class basic_DataValue ;
+	template <typename CharT> class basic_DataList ;
+	template <typename CharT> class basic_DataMap ;
+	template <typename CharT> class basic_DataLazy ;
+	template <typename CharT> class basic_DataLazyShared ;
+	template <typename CharT> class basic_data_map ;
 
-	class data_ptr {
+	template <typename CharT>
+	class basic_data_ptr {
 	public:
-		data_ptr() {}
-		template<typename T> data_ptr(const T& data) {
+		typedef std::basic_string<CharT> string_type ;
+		basic_data_ptr() {}
+		template<typename T> basic_data_ptr(const T& data) {
 			this->operator =(data);
 		}
-		data_ptr(DataValue* data) : ptr(data) {}
-		data_ptr(DataList* data) : ptr(data) {}
-		data_ptr(DataMap* data) : ptr(data) {}
-		data_ptr(const data_ptr& data) {
+		basic_data_ptr(basic_DataValue<CharT>* data) : ptr(data) {}
+		basic_data_ptr(basic_DataList<CharT>* data) : ptr(data) {}
+		basic_data_ptr(basic_DataMap<CharT>* data) : ptr(data) {}
+		basic_data_ptr(basic_DataLazy<CharT>* data) : ptr(data) {}
+		basic_data_ptr(basic_DataLazyShared<CharT>* data) : ptr(data) {}
+		explicit basic_data_ptr(std::shared_ptr<basic_Data<CharT> > data) : ptr(data) {}
+		basic_data_ptr(const basic_data_ptr& data) {
+			ptr = data.ptr;
+		}
+		basic_data_ptr& operator = (const basic_data_ptr& data) {
 			ptr = data.ptr;
+			return *this;
 		}
+		void operator = (const string_type& data);
+		void operator = (const basic_data_map<CharT>& data);
 		template<typename T> void operator = (const T& data);
-		void push_back(const data_ptr& data);
-		virtual ~data_ptr() {}
-		Data* operator ->() {
+		void push_back(const basic_data_ptr& data);
+		virtual ~basic_data_ptr() {}
+		basic_Data<CharT>* operator ->() {
 			return ptr.get();
 		}
 	private:
-		std::shared_ptr<Data> ptr;
+		std::shared_ptr<basic_Data<CharT> > ptr;
 	};
-	typedef std::vector<data_ptr> data_list ;
+	template <typename CharT> using basic_data_list = std::vector<basic_data_ptr<CharT> > ;
 
-	class data_map {
+	template <typename CharT>
+	class basic_data_map {
 	public:
-		data_ptr& operator [](const std::string& key);
+		typedef std::basic_string<CharT> string_type ;
+		basic_data_ptr<CharT>& operator [](const string_type& key);
 		bool empty();
-		bool has(const std::string& key);
+		bool has(const string_type& key);
 	private:
-		std::unordered_map<std::string, data_ptr> data;
+		std::unordered_map<string_type, basic_data_ptr<CharT> > data;
 	};
 
-	template<> inline void data_ptr::operator = (const data_ptr& data);
-	template<> void data_ptr::operator = (const std::string& data);
-	template<> void data_ptr::operator = (const std::string& data);
-	template<> void data_ptr::operator = (const data_map& data);
-	template<typename T>
-	void data_ptr::operator = (const T& data) {
-		std::string data_str = boost::lexical_cast<std::string>(data);
-		this->operator =(data_str);
+	typedef basic_data_ptr<char> data_ptr ;
+	typedef basic_data_list<char> data_list ;
+	typedef basic_data_map<char> data_map ;
+	typedef basic_data_ptr<wchar_t> wdata_ptr ;
+	typedef basic_data_list<wchar_t> wdata_list ;
+	typedef basic_data_map<wchar_t> wdata_map ;
+	typedef basic_data_ptr<char16_t> u16data_ptr ;
+	typedef basic_data_list<char16_t> u16data_list ;
+	typedef basic_data_map<char16_t> u16data_map ;
+
+	// Numbers as text, through std::to_chars where the library has it
+	// instead of the stream machinery behind lexical_cast. Floating point
+	// values get the shortest text that reads back as the same value.
+	std::string format_number(int value) ;
+	std::string format_number(long value) ;
+	std::string format_number(long long value) ;
+	std::string format_number(unsigned value) ;
+	std::string format_number(unsigned long value) ;
+	std::string format_number(unsigned long long value) ;
+	std::string format_number(float value) ;
+	std::string format_number(double value) ;
+	std::string format_number(long double value) ;
+	// exactly precision digits after the point
+	std::string format_fixed(double value, int precision) ;
+
+	// ASCII text, such as a formatted number, in another character type
+	template <typename CharT> std::basic_string<CharT> widen_ascii(std::string text)
+	{
+		return std::basic_string<CharT>(text.begin(), text.end()) ;
+	}
+	template <> inline std::string widen_ascii<char>(std::string text)
+	{
+		return text ;
+	}
+
+	// text for a value assigned to a data_ptr; numbers take the fast path,
+	// anything else streamable goes through lexical_cast
+	template<typename T> std::string data_text(const T &value)
+	{
+		return boost::lexical_cast<std::string>(value) ;
+	}
+	inline std::string data_text(int value) { return format_number(value) ; }
+	inline std::string data_text(long value) { return format_number(value) ; }
+	inline std::string data_text(long long value) { return format_number(value) ; }
+	inline std::string data_text(unsigned value) { return format_number(value) ; }
+	inline std::string data_text(unsigned long value) { return format_number(value) ; }
+	inline std::string data_text(unsigned long long value) { return format_number(value) ; }
+	inline std::string data_text(float value) { return format_number(value) ; }
+	inline std::string data_text(double value) { return format_number(value) ; }
+	inline std::string data_text(long double value) { return format_number(value) ; }
+
+	// a string of the data's own character type is stored as it is;
+	// anything else as data_text gives it, which for wide data must be
+	// ASCII, as numbers are
+	template<typename CharT, typename T> 
+	std::basic_string<CharT> basic_data_text(const T &value, std::true_type)
+	{
+		return std::basic_string<CharT>(value) ;
+	}
+	template<typename CharT, typename T> 
+	std::basic_string<CharT> basic_data_text(const T &value, std::false_type)
+	{
+		return widen_ascii<CharT>(data_text(value)) ;
+	}
+
+	template<typename CharT> template<typename T>
+	void basic_data_ptr<CharT>::operator = (const T& data) {
+		this->operator =(basic_data_text<CharT>(data, 
+			std::integral_constant<bool, std::is_convertible<T, string_type>::value>()));
 	}
 
 	// token classes
-	class Token ;
-	typedef std::shared_ptr<Token> token_ptr ;
-	typedef std::vector<token_ptr> token_vector ;
+	template <typename CharT> class basic_Token ;
+	template <typename CharT> using basic_token_ptr = std::shared_ptr<basic_Token<CharT> > ;
+	template <typename CharT> using basic_token_vector = std::vector<basic_token_ptr<CharT> > ;
+	typedef basic_Token<char> Token ;
+	typedef basic_token_ptr<char> token_ptr ;
+	typedef basic_token_vector<char> token_vector ;
+	typedef basic_token_ptr<wchar_t> wtoken_ptr ;
+	typedef basic_token_vector<wchar_t> wtoken_vector ;
+	typedef basic_token_ptr<char16_t> u16token_ptr ;
+	typedef basic_token_vector<char16_t> u16token_vector ;
+	class RenderContext ;
+	class Profiler ;
+	class TemplateLoader ;
+	class FragmentCache ;
 
 	// Custom exception class for library errors
 	class TemplateException : public std::exception
@@ -123,58 +233,483 @@ namespace cpptempl
 	};
 
 	// Data types used in templates
-	class Data
+	template <typename CharT>
+	class basic_Data
 	{
 	public:
+		typedef CharT char_type ;
+		typedef std::basic_string<CharT> string_type ;
+		basic_Data() ;
 		virtual bool empty() = 0 ;
-		virtual std::string getvalue();
-		virtual data_list& getlist();
-		virtual data_map& getmap() ;
+		virtual string_type getvalue();
+		// the value where the node already holds it as a string, so it
+		// can be written without a copy; NULL to use getvalue()
+		virtual const string_type *peekvalue() ;
+		virtual basic_data_list<CharT>& getlist();
+		virtual basic_data_map<CharT>& getmap() ;
+		// member and element access; the defaults go through getmap()
+		// and getlist(), bound objects read their members in place
+		virtual bool getmember(const string_type &key, basic_data_ptr<CharT> &value) ;
+		virtual size_t getsize() ;
+		virtual basic_data_ptr<CharT> getitem(size_t index) ;
 	};
 
-	class DataValue : public Data
+	template <typename CharT>
+	class basic_DataValue : public basic_Data<CharT>
 	{
-        std::string m_value ;
+		typedef std::basic_string<CharT> string_type ;
+        string_type m_value ;
 	public:
-		DataValue(std::string value) : m_value(value){}
-        std::string getvalue();
+		basic_DataValue(string_type value) : m_value(value){}
+        string_type getvalue();
+		const string_type *peekvalue() ;
 		bool empty();
 	};
 
-	class DataList : public Data
+	template <typename CharT>
+	class basic_DataList : public basic_Data<CharT>
 	{
-		data_list m_items ;
+		basic_data_list<CharT> m_items ;
 	public:
-		DataList(const data_list &items) : m_items(items){}
-		data_list& getlist() ;
+		basic_DataList(const basic_data_list<CharT> &items) : m_items(items){}
+		basic_data_list<CharT>& getlist() ;
 		bool empty();
 	};
 
-	class DataMap : public Data
+	template <typename CharT>
+	class basic_DataMap : public basic_Data<CharT>
 	{
-		data_map m_items ;
+		basic_data_map<CharT> m_items ;
 	public:
-		DataMap(const data_map &items) : m_items(items){}
-		data_map& getmap();
+		basic_DataMap(const basic_data_map<CharT> &items) : m_items(items){}
+		basic_data_map<CharT>& getmap();
 		bool empty();
 	};
 
+	template <typename CharT> using basic_data_callback = std::function<basic_data_ptr<CharT> ()> ;
+	typedef basic_data_callback<char> data_callback ;
+
+	// A value computed by a callback the first time a template reads it,
+	// then kept for the life of the node (normally one render's data map).
+	// Not safe to read from concurrent renders; see DataLazyShared.
+	template <typename CharT>
+	class basic_DataLazy : public basic_Data<CharT>
+	{
+		typedef std::basic_string<CharT> string_type ;
+	public:
+		basic_DataLazy(basic_data_callback<CharT> callback) : m_callback(callback), m_resolved(false){}
+		bool empty() ;
+		string_type getvalue() ;
+		const string_type *peekvalue() ;
+		basic_data_list<CharT>& getlist() ;
+		basic_data_map<CharT>& getmap() ;
+		bool getmember(const string_type &key, basic_data_ptr<CharT> &value) ;
+		size_t getsize() ;
+		basic_data_ptr<CharT> getitem(size_t index) ;
+	protected:
+		virtual basic_Data<CharT>* resolve() ;
+		basic_Data<CharT>* value() ;
+		basic_data_callback<CharT> m_callback ;
+		basic_data_ptr<CharT> m_value ;
+		bool m_resolved ;
+	};
+
+	// DataLazy for data maps shared by concurrent renders: the callback
+	// runs once, and other readers wait for its result.
+	template <typename CharT>
+	class basic_DataLazyShared : public basic_DataLazy<CharT>
+	{
+		std::once_flag m_once ;
+	public:
+		basic_DataLazyShared(basic_data_callback<CharT> callback) : basic_DataLazy<CharT>(callback){}
+	protected:
+		basic_Data<CharT>* resolve() ;
+	};
+
+	typedef basic_Data<char> Data ;
+	typedef basic_DataValue<char> DataValue ;
+	typedef basic_DataList<char> DataList ;
+	typedef basic_DataMap<char> DataMap ;
+	typedef basic_DataLazy<char> DataLazy ;
+	typedef basic_DataLazyShared<char> DataLazyShared ;
+
 	// convenience functions for making data objects
-	inline data_ptr make_data(std::string val)
+	template <typename CharT>
+	basic_data_ptr<CharT> make_data(std::basic_string<CharT> val)
+	{
+		return basic_data_ptr<CharT>(new basic_DataValue<CharT>(val)) ;
+	}
+	template <typename CharT>
+	basic_data_ptr<CharT> make_data(const CharT *val)
 	{
-		return data_ptr(new DataValue(val)) ;
+		return basic_data_ptr<CharT>(new basic_DataValue<CharT>(val)) ;
 	}
-	inline data_ptr make_data(data_list &val)
+	template <typename CharT>
+	basic_data_ptr<CharT> make_data(basic_data_list<CharT> &val)
 	{
-		return data_ptr(new DataList(val)) ;
+		return basic_data_ptr<CharT>(new basic_DataList<CharT>(val)) ;
 	}
-	inline data_ptr make_data(data_map &val)
+	template <typename CharT>
+	basic_data_ptr<CharT> make_data(basic_data_map<CharT> &val)
 	{
-		return data_ptr(new DataMap(val)) ;
+		return basic_data_ptr<CharT>(new basic_DataMap<CharT>(val)) ;
 	}
+	inline data_ptr make_lazy(data_callback callback)
+	{
+		return data_ptr(new DataLazy(callback)) ;
+	}
+	inline data_ptr make_shared_lazy(data_callback callback)
+	{
+		return data_ptr(new DataLazyShared(callback)) ;
+	}
+	//////////////////////////////////////////////////////////////////////////
+	// Binding C++ objects
+	//
+	// bind_data() wraps an object so templates read it in place instead of
+	// copying it into data maps. Strings and arithmetic types are values
+	// (false is empty, other numbers never are); vectors, lists and deques
+	// are lists; maps with string keys are dictionaries. Any other type
+	// needs a fields<T> specialization naming its members:
+	//
+	//	template<> struct cpptempl::fields<Person>
+	//	{
+	//		template <typename Visitor> static void visit(Visitor &visit)
+	//		{
+	//			visit("name", &Person::name) ;
+	//			visit("age", &Person::age) ;
+	//		}
+	//	};
+	//
+	// fields<T> is walked once per type, the first time an object of the
+	// type is read, into a table of member numbers by name. A bound object
+	// makes each member's node the first time it is read and keeps it, so
+	// reading a member again costs one hash lookup and no allocation.
+	// String members are written in place. Bound objects are referenced,
+	// not copied, so they must outlive every render that reads them.
+	//////////////////////////////////////////////////////////////////////////
+	template <typename T> struct fields ;
+
+	template <typename T> data_ptr bind_data(const T &object) ;
+	inline data_ptr bind_data(const std::string &value) ;
+	inline data_ptr bind_data(const data_ptr &value) ;
+	template <typename T, typename A> data_ptr bind_data(const std::vector<T, A> &items) ;
+	template <typename T, typename A> data_ptr bind_data(const std::list<T, A> &items) ;
+	template <typename T, typename A> data_ptr bind_data(const std::deque<T, A> &items) ;
+	template <typename V, typename C, typename A> 
+	data_ptr bind_data(const std::map<std::string, V, C, A> &items) ;
+	template <typename V, typename H, typename E, typename A> 
+	data_ptr bind_data(const std::unordered_map<std::string, V, H, E, A> &items) ;
+
+	inline bool bound_empty(const std::string &value)
+	{
+		return value.empty() ;
+	}
+	inline bool bound_empty(bool value)
+	{
+		return ! value ;
+	}
+	template <typename T> bool bound_empty(const T &)
+	{
+		return false ;
+	}
+	inline const std::string *bound_text(const std::string &value)
+	{
+		return &value ;
+	}
+	template <typename T> const std::string *bound_text(const T &)
+	{
+		return NULL ;
+	}
+
+	// a string or number
+	template <typename T>
+	class DataValueRef : public Data
+	{
+		const T *m_value ;
+	public:
+		DataValueRef(const T *value) : m_value(value){}
+		std::string getvalue()
+		{
+			return data_text(*m_value) ;
+		}
+		const std::string *peekvalue()
+		{
+			return bound_text(*m_value) ;
+		}
+		bool empty()
+		{
+			return bound_empty(*m_value) ;
+		}
+	};
+
+	// a struct described by fields<T>
+	template <typename T>
+	class DataObject : public Data
+	{
+		const T *m_object ;
+		// by member number; bound the first time each is read
+		std::vector<data_ptr> m_members ;
+		// member numbers by name and a binder for each, built from
+		// fields<T> the first time any object of the type is read
+		struct Members
+		{
+			typedef std::function<data_ptr (const T &)> binder ;
+			std::unordered_map<std::string, size_t> numbers ;
+			std::vector<binder> binders ;
+			Members()
+			{
+				fields<T>::visit(*this) ;
+			}
+			template <typename M> void operator()(const char *name, M T::*member)
+			{
+				if (numbers.insert(std::make_pair(std::string(name), binders.size())).second)
+				{
+					binders.push_back(binder([member](const T &object) {
+						return bind_data(object.*member) ;
+					})) ;
+				}
+			}
+		};
+		static const Members &members()
+		{
+			static const Members instance ;
+			return instance ;
+		}
+	public:
+		DataObject(const T *object) : m_object(object){}
+		bool empty()
+		{
+			return false ;
+		}
+		bool getmember(const std::string &key, data_ptr &value)
+		{
+			const Members &table = members() ;
+			std::unordered_map<std::string, size_t>::const_iterator number = table.numbers.find(key) ;
+			if (number == table.numbers.end())
+			{
+				return false ;
+			}
+			if (m_members.empty())
+			{
+				m_members.resize(table.binders.size()) ;
+			}
+			data_ptr &member = m_members[number->second] ;
+			if (! member.operator->())
+			{
+				member = table.binders[number->second](*m_object) ;
+			}
+			value = member ;
+			return true ;
+		}
+	};
+
+	// a sequence container; walks from the last element read, or from
+	// whichever end is nearer, so loops over lists stay linear in either
+	// direction. Like DataLazy, not for concurrent renders: bind per
+	// render instead.
+	template <typename Container>
+	class DataSequence : public Data
+	{
+		const Container *m_items ;
+		typename Container::const_iterator m_cursor ;
+		size_t m_cursor_index ;
+	public:
+		DataSequence(const Container *items) : 
+			m_items(items), m_cursor(items->begin()), m_cursor_index(0){}
+		bool empty()
+		{
+			return m_items->empty() ;
+		}
+		size_t getsize()
+		{
+			return m_items->size() ;
+		}
+		data_ptr getitem(size_t index)
+		{
+			if (index < m_cursor_index && index < m_cursor_index - index)
+			{
+				m_cursor = m_items->begin() ;
+				m_cursor_index = 0 ;
+			}
+			else if (index > m_cursor_index && m_items->size() - index < index - m_cursor_index)
+			{
+				m_cursor = m_items->end() ;
+				m_cursor_index = m_items->size() ;
+			}
+			std::advance(m_cursor, std::ptrdiff_t(index) - std::ptrdiff_t(m_cursor_index)) ;
+			m_cursor_index = index ;
+			return bind_data(*m_cursor) ;
+		}
+	};
+
+	// a map with string keys
+	template <typename Map>
+	class DataDictionary : public Data
+	{
+		const Map *m_items ;
+	public:
+		DataDictionary(const Map *items) : m_items(items){}
+		bool empty()
+		{
+			return m_items->empty() ;
+		}
+		bool getmember(const std::string &key, data_ptr &value)
+		{
+			typename Map::const_iterator item = m_items->find(key) ;
+			if (item == m_items->end())
+			{
+				return false ;
+			}
+			value = bind_data(item->second) ;
+			return true ;
+		}
+	};
+
+	template <typename T> data_ptr bind_object(const T &object, std::true_type)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataValueRef<T>(&object))) ;
+	}
+	template <typename T> data_ptr bind_object(const T &object, std::false_type)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataObject<T>(&object))) ;
+	}
+	template <typename T> data_ptr bind_data(const T &object)
+	{
+		return bind_object(object, std::integral_constant<bool, std::is_arithmetic<T>::value>()) ;
+	}
+	inline data_ptr bind_data(const std::string &value)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataValueRef<std::string>(&value))) ;
+	}
+	inline data_ptr bind_data(const data_ptr &value)
+	{
+		return value ;
+	}
+	template <typename T, typename A> data_ptr bind_data(const std::vector<T, A> &items)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataSequence<std::vector<T, A> >(&items))) ;
+	}
+	template <typename T, typename A> data_ptr bind_data(const std::list<T, A> &items)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataSequence<std::list<T, A> >(&items))) ;
+	}
+	template <typename T, typename A> data_ptr bind_data(const std::deque<T, A> &items)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataSequence<std::deque<T, A> >(&items))) ;
+	}
+	template <typename V, typename C, typename A> 
+	data_ptr bind_data(const std::map<std::string, V, C, A> &items)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataDictionary<std::map<std::string, V, C, A> >(&items))) ;
+	}
+	template <typename V, typename H, typename E, typename A> 
+	data_ptr bind_data(const std::unordered_map<std::string, V, H, E, A> &items)
+	{
+		return data_ptr(std::shared_ptr<Data>(new DataDictionary<std::unordered_map<std::string, V, H, E, A> >(&items))) ;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// JSON data
+	//
+	// Parses JSON straight into data nodes. The nodes and the JSON text
+	// live in one shared document that stays alive while any node from it
+	// is referenced. Strings without escapes are read from the text in
+	// place. Numbers render as written; true and false render as "true"
+	// and "false", and null as nothing. false, null, "" and empty arrays
+	// and objects are empty in {% if %}. Throws TemplateException on
+	// malformed input.
+	//////////////////////////////////////////////////////////////////////////
+	data_ptr parse_json(std::string json) ;
+	// adds the members of a JSON object to data
+	void load_json(std::string json, data_map &data) ;
+
 	// get a data value from a data map
 	// e.g. foo.bar => data["foo"]["bar"]
-	data_ptr parse_val(std::string key, data_map &data) ;
+	template <typename CharT>
+	basic_data_ptr<CharT> parse_val(typename type_identity<std::basic_string<CharT> >::type key, 
+		basic_data_map<CharT> &data) ;
+	// like parse_val, but reports a missing key by returning false
+	// instead of building a placeholder value
+	template <typename CharT>
+	bool find_val(const typename type_identity<std::basic_string<CharT> >::type &key, 
+		basic_data_map<CharT> &data, basic_data_ptr<CharT> &value) ;
+	// find_val for a key already split at its dots, e.g. { "foo", "bar" };
+	// a quoted string is one part. Generated code passes constant arrays.
+	template <typename CharT>
+	bool find_val(const std::basic_string<CharT> *path, size_t parts, 
+		basic_data_map<CharT> &data, basic_data_ptr<CharT> &value) ;
+
+	// What to render for a key that is not in the data map
+	typedef enum
+	{
+		MISSING_KEY_ECHO,		// the tag itself, e.g. {$name} (default)
+		MISSING_KEY_EMPTY,		// nothing
+		MISSING_KEY_THROW,		// throw TemplateException
+		MISSING_KEY_CALLBACK,	// whatever the CompileOptions callback for the template's characters returns
+	} MissingKeyPolicy;
+
+	template <typename CharT> using basic_missing_key_callback = 
+		std::function<std::basic_string<CharT> (const std::basic_string<CharT> &key)> ;
+	typedef basic_missing_key_callback<char> missing_key_callback ;
+	typedef basic_missing_key_callback<wchar_t> wmissing_key_callback ;
+	typedef basic_missing_key_callback<char16_t> u16missing_key_callback ;
+
+	// Settings fixed when a template is compiled
+	struct CompileOptions
+	{
+		CompileOptions() : missing_key(MISSING_KEY_ECHO){}
+		MissingKeyPolicy missing_key ;
+		// one per character type; a template calls the one for its own
+		missing_key_callback on_missing_key ;
+		wmissing_key_callback on_missing_wkey ;
+		u16missing_key_callback on_missing_u16key ;
+		// filter applied to every {$var} that does not already use it
+		// or end in |raw, e.g. "html"; empty for no auto-escaping
+		std::string autoescape ;
+		// resolves {% include "name" %}; required if the template includes
+		std::shared_ptr<TemplateLoader> loader ;
+		// stores {% cache %} output; without one, cache blocks just render
+		std::shared_ptr<FragmentCache> fragment_cache ;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Filters: {$var|name|name}
+	// Filters are looked up when a template is compiled; the last filter
+	// in a pipeline writes straight to the output stream.
+	// Built in: html, url, json (string contents, without quotes), raw.
+	// Each character type has its own filters; wide templates have the
+	// four built in, with url encoding the UTF-8 of other characters.
+	//////////////////////////////////////////////////////////////////////////
+	template <typename CharT>
+	class basic_Filter
+	{
+	public:
+		virtual ~basic_Filter() {}
+		virtual void apply(const std::basic_string<CharT> &value, std::basic_ostream<CharT> &stream, 
+			RenderContext &context) = 0 ;
+	};
+	template <typename CharT> using basic_filter_ptr = std::shared_ptr<basic_Filter<CharT> > ;
+	typedef basic_Filter<char> Filter ;
+	typedef basic_filter_ptr<char> filter_ptr ;
+	typedef basic_filter_ptr<wchar_t> wfilter_ptr ;
+	typedef basic_filter_ptr<char16_t> u16filter_ptr ;
+	typedef std::vector<filter_ptr> filter_vector ;
+	typedef std::function<std::string (const std::string &value)> filter_function ;
+
+	// registering under an existing name replaces that filter for
+	// templates compiled afterwards
+	void register_filter(std::string name, filter_ptr filter) ;
+	void register_filter(std::string name, wfilter_ptr filter) ;
+	void register_filter(std::string name, u16filter_ptr filter) ;
+	void register_filter(std::string name, filter_function filter) ;
+	// Filters with an argument, written {$var|name:argument}; the factory
+	// makes a filter for each argument when a template is compiled.
+	// Built in: fixed:N (N decimals, default 2) and thousands:S (groups
+	// the integer digits with S, default ","), for every character type.
+	typedef std::function<filter_ptr (const std::string &argument)> filter_factory ;
+	void register_filter_factory(std::string name, filter_factory factory) ;
+	// throws TemplateException for unknown names
+	filter_ptr get_filter(std::string name) ;
 
 	typedef enum 
 	{
@@ -185,85 +720,945 @@ namespace cpptempl
 		TOKEN_TYPE_FOR,
 		TOKEN_TYPE_ENDIF,
 		TOKEN_TYPE_ENDFOR,
+		TOKEN_TYPE_INCLUDE,
+		TOKEN_TYPE_BLOCK,
+		TOKEN_TYPE_ENDBLOCK,
+		TOKEN_TYPE_EXTENDS,
+		TOKEN_TYPE_CACHE,
+		TOKEN_TYPE_ENDCACHE,
 	} TokenType;
 
+	// what an {% if %} tests
+	typedef enum
+	{
+		IF_NOT_EMPTY,	// {% if a %}
+		IF_EMPTY,		// {% if not a %}
+		IF_EQUAL,		// {% if a == b %}
+		IF_NOT_EQUAL,	// {% if a != b %}
+	} IfTest;
+
 	// Template tokens
 	// base class for all token types
-	class Token
+	template <typename CharT>
+	class basic_Token
 	{
+		size_t m_line ;
+		size_t m_column ;
 	public:
+		typedef std::basic_string<CharT> string_type ;
+		basic_Token() : m_line(0), m_column(0){}
 		virtual TokenType gettype() = 0 ;
-		virtual void gettext(std::ostream &stream, data_map &data) = 0 ;
-		virtual void set_children(token_vector &children);
-		virtual token_vector & get_children();
+		virtual void gettext(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context) = 0 ;
+		virtual void set_children(basic_token_vector<CharT> &children);
+		virtual basic_token_vector<CharT> & get_children();
+		// short human-readable form of the node, used in profiles; other
+		// characters than ASCII are written as \uXXXX
+		virtual std::string describe() = 0 ;
+		// 1-based source position; 0 if the token was not tokenized from text
+		void set_position(size_t line, size_t column) ;
+		size_t getline() ;
+		size_t getcolumn() ;
 	};
 
 	// normal text
-	class TokenText : public Token
+	template <typename CharT>
+	class basic_TokenText : public basic_Token<CharT>
 	{
-        std::string m_text ;
+		typedef std::basic_string<CharT> string_type ;
+        string_type m_text ;
 	public:
-		TokenText(std::string text) : m_text(text){}
+		basic_TokenText(string_type text) : m_text(text){}
 		TokenType gettype();
-		void gettext(std::ostream &stream, data_map &data);
+		void gettext(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context);
+		std::string describe();
+		string_type getvalue() ;
 	};
 
 	// variable
-	class TokenVar : public Token
+	template <typename CharT>
+	class basic_TokenVar : public basic_Token<CharT>
 	{
-        std::string m_key ;
+		typedef std::basic_string<CharT> string_type ;
+        string_type m_key ;
+		string_type m_placeholder ;		// precomputed for MISSING_KEY_ECHO
+		MissingKeyPolicy m_missing_key ;
+		basic_missing_key_callback<CharT> m_on_missing_key ;
+		std::vector<basic_filter_ptr<CharT> > m_filters ;
+		std::vector<std::string> m_filter_names ;
 	public:
-		TokenVar(std::string key) : m_key(key){}
+		// expr is the key, optionally followed by |filter names
+		basic_TokenVar(string_type expr, const CompileOptions &options = CompileOptions()) ;
+		// expr already split: the filters are used as given, including
+		// any auto-escape filter
+		basic_TokenVar(string_type expr, string_type key, const std::vector<std::string> &filters, 
+			const CompileOptions &options) ;
 		TokenType gettype();
-		void gettext(std::ostream &stream, data_map &data);
+		void gettext(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context);
+		std::string describe();
+		// the expression as written, without the {$ }
+		string_type getexpr() ;
+		string_type getkey() ;
+		MissingKeyPolicy get_missing_key() ;
+		// filters actually applied, including any auto-escape filter
+		std::vector<std::string> getfilters() ;
+		void set_filters(const std::vector<std::string> &names) ;
+	private:
+		void write_filtered(std::basic_ostream<CharT> &stream, const string_type &value, RenderContext &context) ;
 	};
 
 	// for block
-	class TokenFor : public Token 
+	// {% for x in list limit:N offset:N step:N reversed %}
+	// The options pick which elements are visited, without copying the
+	// list: offset, limit and step select from the front, then reversed
+	// turns the selection around. N is a number or a data path.
+	template <typename CharT>
+	class basic_TokenFor : public basic_Token<CharT> 
+	{
+		typedef std::basic_string<CharT> string_type ;
+	public:
+        string_type m_key ;
+        string_type m_val ;
+		basic_token_vector<CharT> m_children ;
+		MissingKeyPolicy m_missing_key ;
+		string_type m_limit ;
+		string_type m_offset ;
+		string_type m_step ;
+		bool m_reversed ;
+		basic_TokenFor(string_type expr, const CompileOptions &options = CompileOptions());
+		// the statement already split; an empty option is absent
+		basic_TokenFor(string_type val, string_type key, string_type limit, string_type offset, 
+			string_type step, bool reversed, const CompileOptions &options) ;
+		TokenType gettype();
+		void gettext(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context);
+		void set_children(basic_token_vector<CharT> &children);
+		basic_token_vector<CharT> &get_children();
+		std::string describe();
+		// the options as written after the list, e.g. "limit:10 reversed"
+		string_type getoptions() ;
+	private:
+		size_t bound(const string_type &operand, basic_data_map<CharT> &data, size_t fallback) ;
+	};
+
+	// if block
+	template <typename CharT>
+	class basic_TokenIf : public basic_Token<CharT>
+	{
+		typedef std::basic_string<CharT> string_type ;
+	public:
+        string_type m_expr ;
+		// m_expr parsed; m_rhs is empty unless the test compares
+		IfTest m_test ;
+		string_type m_lhs ;
+		string_type m_rhs ;
+		basic_token_vector<CharT> m_children ;
+		MissingKeyPolicy m_missing_key ;
+		basic_missing_key_callback<CharT> m_on_missing_key ;
+		// throws TemplateException for an if without its operands
+		basic_TokenIf(string_type expr, const CompileOptions &options = CompileOptions()) ;
+		// expr already parsed into its test and operands
+		basic_TokenIf(string_type expr, IfTest test, string_type lhs, string_type rhs, 
+			const CompileOptions &options) ;
+		TokenType gettype();
+		void gettext(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context);
+		bool is_true(basic_data_map<CharT> &data);
+		basic_data_ptr<CharT> operand(const string_type &key, basic_data_map<CharT> &data);
+		void set_children(basic_token_vector<CharT> &children);
+		basic_token_vector<CharT> &get_children();
+		std::string describe();
+	private:
+		void add_placeholder(const string_type &key) ;
+		// precomputed for MISSING_KEY_ECHO, one per operand
+		std::vector<std::pair<string_type, basic_data_ptr<CharT> > > m_placeholders ;
+	};
+
+	// end of block
+	template <typename CharT>
+	class basic_TokenEnd : public basic_Token<CharT> // end of control block
+	{
+		typedef std::basic_string<CharT> string_type ;
+        string_type m_type ;
+	public:
+		basic_TokenEnd(string_type text) : m_type(text){}
+		TokenType gettype();
+		void gettext(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context);
+		std::string describe();
+	};
+
+	typedef basic_TokenText<char> TokenText ;
+	typedef basic_TokenVar<char> TokenVar ;
+	typedef basic_TokenFor<char> TokenFor ;
+	typedef basic_TokenIf<char> TokenIf ;
+	typedef basic_TokenEnd<char> TokenEnd ;
+
+	// The tokens below are for char templates only: partials, inheritance
+	// and fragment caching work on char text.
+
+	// {% include "name" %}
+	// Renders a partial compiled by a TemplateLoader, sharing the data map.
+	class TokenInclude : public Token
 	{
+		std::string m_name ;
+		std::shared_ptr<token_vector> m_partial ;
 	public:
-        std::string m_key ;
-        std::string m_val ;
+		TokenInclude(std::string expr) ;
+		TokenType gettype();
+		void gettext(std::ostream &stream, data_map &data, RenderContext &context);
+		std::string describe();
+		std::string getname() ;
+		void set_partial(std::shared_ptr<token_vector> partial) ;
+		std::shared_ptr<token_vector> getpartial() ;
+	};
+
+	// {% block name %}
+	// Compiled templates flatten blocks away (see Template); when a tree
+	// is built directly with parse_tree, a block just renders its children.
+	class TokenBlock : public Token
+	{
+		std::string m_name ;
 		token_vector m_children ;
-		TokenFor(std::string expr);
+	public:
+		TokenBlock(std::string expr) ;
 		TokenType gettype();
-		void gettext(std::ostream &stream, data_map &data);
+		void gettext(std::ostream &stream, data_map &data, RenderContext &context);
 		void set_children(token_vector &children);
 		token_vector &get_children();
+		std::string describe();
+		std::string getname() ;
 	};
 
-	// if block
-	class TokenIf : public Token
+	// {% extends "name" %}
+	class TokenExtends : public Token
 	{
+		std::string m_name ;
 	public:
-        std::string m_expr ;
+		TokenExtends(std::string expr) ;
+		TokenType gettype();
+		void gettext(std::ostream &stream, data_map &data, RenderContext &context);
+		std::string describe();
+		std::string getname() ;
+	};
+
+	// {% cache key key ttl=seconds %}
+	// Renders its children once per distinct key and replays the stored
+	// bytes afterwards. Keys are quoted literals or data paths; each block
+	// has its own key space. ttl= overrides the cache's default lifetime.
+	class TokenCache : public Token
+	{
+		std::string m_expr ;
+		std::vector<std::string> m_keys ;
+		int m_ttl ;
+		unsigned long long m_id ;
+		std::shared_ptr<FragmentCache> m_cache ;
 		token_vector m_children ;
-		TokenIf(std::string expr) : m_expr(expr){}
+	public:
+		TokenCache(std::string expr, const CompileOptions &options = CompileOptions()) ;
 		TokenType gettype();
-		void gettext(std::ostream &stream, data_map &data);
-		bool is_true(std::string expr, data_map &data);
+		void gettext(std::ostream &stream, data_map &data, RenderContext &context);
 		void set_children(token_vector &children);
 		token_vector &get_children();
+		std::string describe();
+		std::string getexpr() ;
+		std::vector<std::string> getkeys() ;
 	};
 
-	// end of block
-	class TokenEnd : public Token // end of control block
+	// Bounded, thread-safe store of rendered fragments.
+	// Evicts least recently used entries to stay under max_bytes;
+	// a ttl of 0 means entries only leave by eviction.
+	class FragmentCache
 	{
-        std::string m_type ;
 	public:
-		TokenEnd(std::string text) : m_type(text){}
-		TokenType gettype();
-		void gettext(std::ostream &stream, data_map &data);
+		FragmentCache(size_t max_bytes = 16 * 1024 * 1024, unsigned ttl_seconds = 0) ;
+		// the fragment, or an empty pointer if absent or expired
+		std::shared_ptr<const std::string> get(const std::string &key) ;
+		// ttl_seconds < 0 uses the cache's default
+		void put(const std::string &key, std::shared_ptr<const std::string> fragment, int ttl_seconds = -1) ;
+		void clear() ;
+		size_t bytes() ;
+		size_t count() ;
+	private:
+		struct Entry
+		{
+			std::string key ;
+			std::shared_ptr<const std::string> fragment ;
+			std::chrono::steady_clock::time_point expires ;
+			bool expiring ;
+		};
+		typedef std::list<Entry> entry_list ;
+		void erase(entry_list::iterator entry) ;
+
+		size_t m_max_bytes ;
+		unsigned m_ttl ;
+		size_t m_bytes ;
+		std::mutex m_mutex ;
+		entry_list m_entries ;		// most recently used first
+		std::unordered_map<std::string, entry_list::iterator> m_index ;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Rendering
+	//////////////////////////////////////////////////////////////////////////
+
+	// Per-render state, passed down the token tree.
+	// Tokens write their output through write() so that the number of
+	// bytes emitted is known without querying the stream.
+	// One piece of gathered output; laid out like struct iovec.
+	struct OutputSegment
+	{
+		const void *base ;
+		size_t size ;
+	};
+
+	// Output of Template::render(GatherOutput&, data), for writev().
+	// Static template text is referenced where it lives in the compiled
+	// template, which must outlive the segments; everything else is
+	// copied into a side buffer owned by this object. Static text shorter
+	// than min_reference is copied too, as a tiny segment costs more to
+	// send than to copy. Reusable; not copyable, since segments point
+	// into its buffer.
+	class GatherOutput
+	{
+	public:
+		GatherOutput(size_t min_reference = 64) ;
+		const std::vector<OutputSegment> &segments() const ;
+		// total bytes in all segments
+		size_t bytes() const ;
+		// the segments joined into one string
+		std::string str() const ;
+
+		// used while rendering
+		void clear() ;
+		size_t min_reference() const ;
+		std::string &buffer() ;
+		void add_static(const char *text, size_t size) ;
+		void finish() ;
+	private:
+		GatherOutput(const GatherOutput &) ;
+		GatherOutput &operator = (const GatherOutput &) ;
+		void close_buffered() ;
+
+		// text is NULL for a range of the buffer, which may still move
+		struct Pending
+		{
+			const char *text ;
+			size_t offset ;
+			size_t size ;
+		};
+		size_t m_min_reference ;
+		std::string m_buffer ;
+		size_t m_mark ;
+		size_t m_bytes ;
+		std::vector<Pending> m_pending ;
+		std::vector<OutputSegment> m_segments ;
 	};
 
-    std::string gettext(token_ptr token, data_map &data) ;
+	// The limit a render was stopped at
+	typedef enum
+	{
+		RENDER_LIMIT_DEADLINE,
+		RENDER_LIMIT_BYTES,
+		RENDER_LIMIT_ITERATIONS,
+	} RenderLimit ;
+
+	class RenderLimitException : public TemplateException
+	{
+	public:
+		RenderLimitException(RenderLimit limit, std::string reason) : 
+			TemplateException(reason), m_limit(limit){}
+		RenderLimit limit() const
+		{
+			return m_limit ;
+		}
+	private:
+		RenderLimit m_limit ;
+	};
+
+	class RenderContext
+	{
+	public:
+		RenderContext(Profiler *profiler = NULL) : m_profiler(profiler), m_gather(NULL), m_bytes(0), 
+			m_max_bytes(0), m_max_iterations(0), m_iterations(0), m_unchecked_bytes(0){}
+		// sizes are in characters of the stream, which for char are bytes
+		template <typename CharT>
+		void write(std::basic_ostream<CharT> &stream, const typename type_identity<std::basic_string<CharT> >::type &text)
+		{
+			count_bytes(text.size()) ;
+			stream.write(text.data(), std::streamsize(text.size())) ;
+		}
+		template <typename CharT>
+		void write(std::basic_ostream<CharT> &stream, const CharT *text, size_t size)
+		{
+			count_bytes(size) ;
+			stream.write(text, std::streamsize(size)) ;
+		}
+		// text owned by the compiled template; a gathering render
+		// references it instead of copying it
+		void write_static(std::ostream &stream, const std::string &text)
+		{
+			if (m_gather && text.size() >= m_gather->min_reference())
+			{
+				count_bytes(text.size()) ;
+				m_gather->add_static(text.data(), text.size()) ;
+				return ;
+			}
+			write(stream, text) ;
+		}
+		template <typename CharT>
+		void write_static(std::basic_ostream<CharT> &stream, const typename type_identity<std::basic_string<CharT> >::type &text)
+		{
+			write(stream, text) ;
+		}
+		// called by every loop iteration; looks at the clock only every
+		// 64 iterations
+		void iteration()
+		{
+			++m_iterations ;
+			if (m_max_iterations && m_iterations > m_max_iterations)
+			{
+				exceeded(RENDER_LIMIT_ITERATIONS) ;
+			}
+			if ((m_iterations & 63) == 0)
+			{
+				check_deadline() ;
+			}
+		}
+		// throws if the deadline has passed
+		void check_deadline()
+		{
+			if (m_deadline != std::chrono::steady_clock::time_point() 
+				&& std::chrono::steady_clock::now() >= m_deadline)
+			{
+				exceeded(RENDER_LIMIT_DEADLINE) ;
+			}
+		}
+		// sets the deadline that long from now
+		void set_timeout(std::chrono::steady_clock::duration timeout)
+		{
+			m_deadline = std::chrono::steady_clock::now() + timeout ;
+		}
+		Profiler *m_profiler ;
+		// set while rendering into a GatherOutput
+		GatherOutput *m_gather ;
+		// output so far, in characters of the template's type
+		size_t m_bytes ;
+		// Limits for renders with this context; 0, or no deadline, for
+		// none. Past one, the render throws RenderLimitException, leaving
+		// what was written so far. The byte limit counts from m_bytes and
+		// is never overrun; the iteration limit counts loop iterations in
+		// all loops, nested ones included. Both counts run on across
+		// renders with the same context, so the limits cover them all;
+		// zero m_bytes and m_iterations to start afresh.
+		std::chrono::steady_clock::time_point m_deadline ;
+		size_t m_max_bytes ;
+		size_t m_max_iterations ;
+		size_t m_iterations ;
+	private:
+		// output since the clock was last read
+		size_t m_unchecked_bytes ;
+		// looks at the clock every 64 KiB, for renders with few loops
+		void count_bytes(size_t size)
+		{
+			if (m_max_bytes && (m_bytes > m_max_bytes || size > m_max_bytes - m_bytes))
+			{
+				exceeded(RENDER_LIMIT_BYTES) ;
+			}
+			m_unchecked_bytes += size ;
+			if (m_unchecked_bytes >= 65536)
+			{
+				m_unchecked_bytes = 0 ;
+				check_deadline() ;
+			}
+			m_bytes += size ;
+		}
+		void exceeded(RenderLimit limit) ;
+	};
+
+	typedef enum
+	{
+		PROFILE_SORT_INCLUSIVE,
+		PROFILE_SORT_EXCLUSIVE,
+		PROFILE_SORT_CALLS,
+		PROFILE_SORT_BYTES,
+	} ProfileSort;
+
+	// Opt-in per-node render profiler.
+	// Pass one to parse() through a RenderContext; samples accumulate over
+	// every render it takes part in, keyed by node description and source
+	// position, so repeated renders of the same template add up.
+	// A node is named once, the first time it renders; after that its
+	// samples are found by address. Time the profiler spends on a node's
+	// bookkeeping is not charged to the node's parent.
+	class Profiler
+	{
+	public:
+		struct NodeStats
+		{
+			NodeStats() : line(0), column(0), calls(0), inclusive_ns(0), exclusive_ns(0), bytes(0){}
+			std::string label ;
+			size_t line ;
+			size_t column ;
+			size_t calls ;
+			unsigned long long inclusive_ns ;
+			unsigned long long exclusive_ns ;
+			size_t bytes ;
+		};
+		template <typename CharT>
+		void render(basic_token_ptr<CharT> &token, std::basic_ostream<CharT> &stream, 
+			basic_data_map<CharT> &data, RenderContext &context) ;
+		// per-node table, most expensive first
+		void report(std::ostream &stream, ProfileSort sort_by=PROFILE_SORT_INCLUSIVE) ;
+		// one "frame;frame;frame exclusive_us" line per stack,
+		// as consumed by flamegraph.pl and compatible tools
+		void collapsed(std::ostream &stream) ;
+		std::vector<NodeStats> nodes() ;
+		void clear() ;
+	private:
+		struct Frame
+		{
+			std::chrono::steady_clock::time_point start ;
+			unsigned long long child_ns ;
+			size_t path ;
+		};
+		// one call stack: the stack it extends (NO_PATH for none), its
+		// innermost node and the exclusive time spent there
+		struct Path
+		{
+			size_t parent ;
+			size_t node ;
+			unsigned long long exclusive_ns ;
+		};
+		static const size_t NO_PATH = size_t(-1) ;
+		template <typename CharT>
+		size_t node_id(const basic_token_ptr<CharT> &token) ;
+		size_t path_id(size_t parent, size_t node) ;
+		std::string path_name(size_t path) ;
 
-	void parse_tree(token_vector &tokens, token_vector &tree, TokenType until=TOKEN_TYPE_NONE) ;
-	token_vector & tokenize(std::string text, token_vector &tokens) ;
+		std::vector<Frame> m_stack ;
+		std::vector<NodeStats> m_nodes ;
+		std::vector<std::string> m_names ;		// flame graph frame per node
+		std::unordered_map<std::string, size_t> m_node_ids ;
+		// nodes already seen, by token; the tokens are kept so that their
+		// addresses are not reused until clear()
+		std::unordered_map<const void*, size_t> m_token_nodes ;
+		std::vector<std::shared_ptr<const void> > m_tokens ;
+		std::vector<Path> m_paths ;
+		std::unordered_map<unsigned long long, size_t> m_path_ids ;
+	};
+
+	// renders a single node, via the profiler when one is attached.
+	// Define CPPTEMPL_NO_PROFILER to compile the profiling hook out.
+	template <typename CharT>
+	inline void render_token(basic_token_ptr<CharT> &token, std::basic_ostream<CharT> &stream, 
+		basic_data_map<CharT> &data, RenderContext &context)
+	{
+#ifndef CPPTEMPL_NO_PROFILER
+		if (context.m_profiler)
+		{
+			context.m_profiler->render(token, stream, data, context) ;
+			return ;
+		}
+#endif
+		token->gettext(stream, data, context) ;
+	}
+	template <typename CharT>
+	inline void render_tokens(basic_token_vector<CharT> &tokens, std::basic_ostream<CharT> &stream, 
+		basic_data_map<CharT> &data, RenderContext &context)
+	{
+		for (size_t i = 0 ; i < tokens.size() ; ++i)
+		{
+			render_token(tokens[i], stream, data, context) ;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Engine statistics
+	//////////////////////////////////////////////////////////////////////////
+
+	// Bucket i of the latency histogram counts renders that finished in
+	// under 2^i microseconds; the last bucket also takes everything slower.
+	const size_t STATS_LATENCY_BUCKETS = 24 ;
+
+	// Point-in-time totals, summed over all threads.
+	// Counters are cumulative since process start; take two snapshots
+	// and divide by the uptime difference to get rates.
+	struct EngineStats
+	{
+		double uptime_seconds ;
+		unsigned long long renders ;
+		unsigned long long compiles ;
+		unsigned long long missing_keys ;		// lookups of keys not in the data
+		unsigned long long bytes_written ;
+		unsigned long long allocations ;		// data nodes created
+		unsigned long long cache_hits ;			// compiled partials reused
+		unsigned long long cache_misses ;		// partials loaded and compiled
+		unsigned long long fragment_hits ;		// {% cache %} blocks replayed
+		unsigned long long fragment_misses ;	// {% cache %} blocks rendered
+		unsigned long long render_latency[STATS_LATENCY_BUCKETS] ;
+	};
+
+	EngineStats stats() ;
+	// plain-text exposition, one "name value" pair per line
+	void dump_stats(std::ostream &stream) ;
+	// writes dump_stats() output to a file, replacing it atomically
+	void write_stats(std::string filename) ;
+
+	template <typename CharT>
+    std::basic_string<CharT> gettext(basic_token_ptr<CharT> token, basic_data_map<CharT> &data) ;
+
+	template <typename CharT>
+	void parse_tree(basic_token_vector<CharT> &tokens, basic_token_vector<CharT> &tree, TokenType until=TOKEN_TYPE_NONE) ;
+	// {% include %}, {% block %}, {% extends %} and {% cache %} need char
+	// text; in other templates they throw TemplateException
+	template <typename CharT>
+	basic_token_vector<CharT> & tokenize(typename type_identity<std::basic_string<CharT> >::type text, 
+		basic_token_vector<CharT> &tokens, const CompileOptions &options = CompileOptions()) ;
+
+	typedef std::function<std::string (const std::string &name)> template_reader ;
+	// reads name from a file under directory
+	template_reader directory_reader(std::string directory) ;
+
+	// Compiles each partial once and hands the same compiled tree to every
+	// template that includes it. Partials are compiled with the loader's
+	// own options. Partials with at most inline_limit nodes are copied
+	// into the including tree instead of being rendered through an include
+	// node. Include cycles are reported when the template is compiled.
+	class TemplateLoader
+	{
+	public:
+		TemplateLoader(template_reader reader, 
+			const CompileOptions &options = CompileOptions(), 
+			size_t inline_limit = 0) ;
+		// compiled tree for name, loading it on first use
+		std::shared_ptr<token_vector> get(std::string name) ;
+		// source text for name, as given by the reader
+		std::string read(std::string name) ;
+		// replaces the include nodes in tree with their partials
+		void resolve(token_vector &tree) ;
+	private:
+		std::shared_ptr<token_vector> get(const std::string &name, std::vector<std::string> &chain) ;
+		void resolve(token_vector &tree, std::vector<std::string> &chain) ;
+
+		template_reader m_reader ;
+		CompileOptions m_options ;
+		size_t m_inline_limit ;
+		std::recursive_mutex m_mutex ;
+		std::map<std::string, std::shared_ptr<token_vector> > m_partials ;
+	};
+
+	// Expected size of a template's output, in bytes; safe to read and
+	// update from concurrent renders.
+	class RenderSizeEstimate
+	{
+		std::atomic<size_t> m_bytes ;
+	public:
+		RenderSizeEstimate(size_t bytes = 0) : m_bytes(bytes){}
+		RenderSizeEstimate(const RenderSizeEstimate &other) : m_bytes(other.get()){}
+		RenderSizeEstimate &operator = (const RenderSizeEstimate &other)
+		{
+			m_bytes.store(other.get(), std::memory_order_relaxed) ;
+			return *this ;
+		}
+		size_t get() const
+		{
+			return m_bytes.load(std::memory_order_relaxed) ;
+		}
+		// grows at once to a larger render, shrinks slowly after smaller ones
+		void update(size_t rendered) ;
+	};
+
+	// A compiled template: tokenized and parsed once, rendered any number
+	// of times. Rendering does not modify the template.
+	//
+	// {% extends "layout" %} is resolved while compiling: the child's
+	// {% block name %} bodies replace the parent's, through any number of
+	// levels, and the result is a single flat tree with no block nodes.
+	// Parents are read through CompileOptions::loader.
+	//
+	// Each template keeps an estimate of its rendered size, starting from
+	// its static text and following the sizes it actually renders, which
+	// the string renders reserve up front.
+	//
+	// wTemplate and u16Template take wchar_t and char16_t text and data
+	// and render to streams and strings of the same type, without
+	// converting anything; only includes, inheritance, {% cache %} and
+	// gathered output need a char Template.
+	template <typename CharT>
+	class basic_Template
+	{
+		basic_token_vector<CharT> m_tree ;
+		RenderSizeEstimate m_size ;
+	public:
+		typedef std::basic_string<CharT> string_type ;
+		basic_Template(string_type templ_text, const CompileOptions &options = CompileOptions()) ;
+		// wraps an already compiled tree
+		explicit basic_Template(const basic_token_vector<CharT> &tree) ;
+		void render(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data) ;
+		void render(std::basic_ostream<CharT> &stream, basic_data_map<CharT> &data, RenderContext &context) ;
+		string_type render(basic_data_map<CharT> &data) ;
+		// appends to out; move the string out afterwards to avoid a copy
+		void render(string_type &out, basic_data_map<CharT> &data) ;
+		// replaces the contents of out; char templates only
+		void render(GatherOutput &out, basic_data_map<CharT> &data) ;
+		size_t size_estimate() const ;
+		basic_token_vector<CharT> & get_tree() ;
+	};
+	template <> void basic_Template<char>::render(GatherOutput &out, data_map &data) ;
+
+	typedef basic_Template<char> Template ;
+	typedef basic_Template<wchar_t> wTemplate ;
+	typedef basic_Template<char16_t> u16Template ;
+
+	// Compiled templates by name, for servers that look a template up on
+	// every request while others are added or reloaded.
+	// Writers copy the name table, change the copy and publish it. Each
+	// reading thread holds the last table it read in a thread-local slot,
+	// so get() normally costs one atomic load and a hash lookup, with no
+	// reference counting and no lock. Only the first read in a thread
+	// after a write takes a short lock to pick up the new table. A thread
+	// keeps its table, and every template in it, alive until it reads the
+	// registry again or exits; it keeps tables for up to 8 registries.
+	class TemplateRegistry
+	{
+	public:
+		typedef std::unordered_map<std::string, std::shared_ptr<Template> > template_table ;
+
+		TemplateRegistry() ;
+		// the template for name, or an empty pointer. The reference is
+		// valid until this thread next calls get() or size() on any
+		// registry; copy it to keep the template for longer.
+		const std::shared_ptr<Template> &get(const std::string &name) const ;
+		// adds or replaces the template for name
+		void set(const std::string &name, std::shared_ptr<Template> templ) ;
+		void set(const std::string &name, const std::string &templ_text, 
+			const CompileOptions &options = CompileOptions()) ;
+		// false if there was no template for name
+		bool remove(const std::string &name) ;
+		size_t size() const ;
+	private:
+		const template_table &snapshot() const ;
+		void publish(std::shared_ptr<const template_table> table) ;
+
+		const unsigned long long m_id ;
+		std::atomic<unsigned long long> m_version ;
+		// changed by writers holding both mutexes; readers take m_table_mutex
+		std::shared_ptr<const template_table> m_table ;
+		mutable std::mutex m_table_mutex ;
+		std::mutex m_write_mutex ;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Dependency analysis
+	//////////////////////////////////////////////////////////////////////////
+
+	// The data a template can read. Paths under a loop variable are given
+	// relative to the list being iterated, with [] standing for an element:
+	// {% for p in people %}{$p.name}{% endfor %} reads "people" and
+	// "people[].name", as is one read after its loop has ended, which
+	// leaves it bound to the last element. loop.index/loop.index0 are not
+	// data and are left out.
+	struct TemplateDependencies
+	{
+		std::set<std::string> roots ;	// top-level keys of the data map
+		std::set<std::string> paths ;	// every dotted path looked up
+	};
+
+	TemplateDependencies dependencies(Template &templ) ;
+	TemplateDependencies dependencies(token_vector &tree) ;
+
+	//////////////////////////////////////////////////////////////////////////
+	// Partial evaluation
+	//
+	// specialize() renders what it can of a template from data that is the
+	// same for every render (configuration, locale strings, feature flags)
+	// and returns the rest as a smaller template. Variables, conditions and
+	// loops that read only static data become text; a condition on static
+	// data keeps just the branch taken; includes are inlined. Known values
+	// compared with render-time data in a condition are written into it.
+	//
+	// Render the result with data that does not redefine the static keys.
+	// A loop over a static list whose body reads render-time data is kept,
+	// as is one inside a render-time condition whose variable is read after
+	// it. Such a loop still reads the static list: if dependencies() of the
+	// result name any static key, keep that key in the data map.
+	//////////////////////////////////////////////////////////////////////////
+	Template specialize(Template &templ, data_map &static_data) ;
+
+	//////////////////////////////////////////////////////////////////////////
+	// Incremental rendering
+	//
+	// Keeps a rendered document split into segments, one per top-level node,
+	// each with the data paths it reads. update() re-renders only the
+	// segments reading a changed path. A change to "user" affects segments
+	// reading "user.name" and the reverse; list contents are named with []
+	// as in dependencies(), so a change to "people" covers "people[].name".
+	// A loop variable still bound after its loop counts as its list element.
+	//////////////////////////////////////////////////////////////////////////
+
+	// Replace old_length bytes at offset with text. Patches from one update
+	// are in document order and each offset assumes earlier ones are applied.
+	struct SegmentPatch
+	{
+		size_t offset ;
+		size_t old_length ;
+		std::string text ;
+	};
+
+	class IncrementalRender
+	{
+	public:
+		IncrementalRender(Template &templ, data_map &data) ;
+		// re-renders segments reading any of changed; returns their patches
+		std::vector<SegmentPatch> update(data_map &data, const std::vector<std::string> &changed) ;
+		const std::string &document() const ;
+		size_t segments() const ;
+	private:
+		struct Segment
+		{
+			token_ptr token ;
+			std::set<std::string> paths ;
+			size_t length ;
+		};
+		std::string render_segment(Segment &segment, data_map &data) ;
+
+		std::vector<Segment> m_segments ;
+		std::string m_document ;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// Compiled template files
+	//
+	// A versioned binary image of a compiled tree, for producing in a build
+	// step and loading at startup without tokenizing or parsing: nodes are
+	// stored already split into their keys, options and operands. Layout:
+	//   "CPTL", u32 version, u64 payload size, u64 FNV-1a checksum of payload
+	//   payload: shared partials (dependencies first), then the main tree
+	// All integers are little-endian and all references are indices, so
+	// the image does not depend on where it is loaded.
+	// Filters are stored by name and looked up again when loading; any
+	// custom filters must be registered first. A missing-key callback
+	// cannot be stored and is taken from the options passed to load.
+	// Loading checks every count, enum and reference in the image and
+	// throws TemplateException for one it cannot trust, including nodes
+	// nested more than 256 deep.
+	//////////////////////////////////////////////////////////////////////////
+	const unsigned int TEMPLATE_FORMAT_VERSION = 3 ;
+
+	void save_template(std::ostream &stream, Template &templ) ;
+	Template load_template(const char *image, size_t size, const CompileOptions &options = CompileOptions()) ;
+	// maps the file and loads it
+	Template load_template_file(std::string filename, const CompileOptions &options = CompileOptions()) ;
+
+	//////////////////////////////////////////////////////////////////////////
+	// Ahead-of-time compilation
+	//
+	// C++ source for a compiled template, to build into a program instead
+	// of interpreting the tree. generate_cpp writes
+	//	void function(std::ostream &stream, cpptempl::data_map &data, 
+	//		cpptempl::RenderContext &context) ;
+	//	void function(std::ostream &stream, cpptempl::data_map &data) ;
+	// which render exactly what Template::render would. Static text is
+	// written from string literals, {% if %} and {% for %} become C++ if
+	// statements and loops, and each {$var} a lookup of its path, split
+	// into a constant array of keys when the code is generated; filters
+	// are looked up by name on first use. Included partials become helper
+	// functions. The render is not profiled or counted in stats().
+	//
+	// Write generate_cpp_prologue() once at the top of the file, then any
+	// number of functions. cpptempl_codegen.cpp is a command-line front end.
+	// Throws TemplateException for what has no generated form: {% cache %}
+	// blocks, unresolved includes and missing-key callbacks.
+	//////////////////////////////////////////////////////////////////////////
+	void generate_cpp_prologue(std::ostream &out) ;
+	void generate_cpp(std::ostream &out, const std::string &function, Template &templ) ;
+
+	//////////////////////////////////////////////////////////////////////////
+	// Large file output
+	//
+	// A stream buffer that writes a file from a background thread, for
+	// renders too large to stall on every flush. The render thread fills
+	// one buffer while the other is being written, and only waits if it
+	// fills its buffer before the previous write has finished.
+	//
+	//	cpptempl::FileSink sink("export.html") ;
+	//	std::ostream out(&sink) ;
+	//	page.render(out, data) ;
+	//	sink.close() ;
+	//
+	// direct asks for O_DIRECT where the platform has it, bypassing the
+	// page cache; writes fall back to buffered I/O if it is refused.
+	// Buffers are aligned to 4096 bytes and sized in multiples of that.
+	//////////////////////////////////////////////////////////////////////////
+	class FileSink : public std::streambuf
+	{
+	public:
+		FileSink(std::string filename, size_t buffer_size = 4 * 1024 * 1024, bool direct = false) ;
+		// closes the file; call close() first to find out about errors
+		~FileSink() ;
+		// writes out the rest and closes the file;
+		// throws TemplateException if any write failed
+		void close() ;
+		unsigned long long bytes_written() ;
+	protected:
+		int_type overflow(int_type ch) ;
+		// starts writing what is buffered, without waiting for it
+		int sync() ;
+	private:
+		FileSink(const FileSink &) ;
+		FileSink &operator = (const FileSink &) ;
+		bool hand_off() ;
+		void run() ;
+		std::string write_file(const char *data, size_t size) ;
+
+		std::string m_filename ;
+		int m_fd ;
+		bool m_direct ;
+		size_t m_size ;
+		std::vector<char> m_storage ;
+		char *m_buffers[2] ;
+		size_t m_current ;
+		std::mutex m_mutex ;
+		std::condition_variable m_ready ;		// a buffer is waiting to be written
+		std::condition_variable m_done ;		// the writer is idle again
+		const char *m_full ;
+		size_t m_full_size ;
+		bool m_stop ;
+		bool m_closed ;
+		std::string m_error ;
+		unsigned long long m_written ;
+		std::thread m_thread ;
+	};
 
 	// The big daddy. Pass in the template and data, 
 	// and get out a completed doc.
-	void parse(std::ostream &stream, std::string templ_text, data_map &data) ;
-    std::string parse(std::string templ_text, data_map &data);
-	std::string parse(std::string templ_text, data_map &data);
+	template <typename CharT>
+	void parse(std::basic_ostream<CharT> &stream, typename type_identity<std::basic_string<CharT> >::type templ_text, 
+		basic_data_map<CharT> &data) ;
+	template <typename CharT>
+	void parse(std::basic_ostream<CharT> &stream, typename type_identity<std::basic_string<CharT> >::type templ_text, 
+		basic_data_map<CharT> &data, RenderContext &context) ;
+	template <typename CharT>
+    std::basic_string<CharT> parse(typename type_identity<std::basic_string<CharT> >::type templ_text, 
+		basic_data_map<CharT> &data);
+
+	// The engine is compiled once, in cpptempl.cpp, for each character
+	// type it supports.
+#define CPPTEMPL_INSTANTIATE_CLASSES(linkage, CharT) \
+	linkage template class basic_data_ptr<CharT> ; \
+	linkage template class basic_data_map<CharT> ; \
+	linkage template class basic_Data<CharT> ; \
+	linkage template class basic_DataValue<CharT> ; \
+	linkage template class basic_DataList<CharT> ; \
+	linkage template class basic_DataMap<CharT> ; \
+	linkage template class basic_DataLazy<CharT> ; \
+	linkage template class basic_DataLazyShared<CharT> ; \
+	linkage template class basic_Token<CharT> ; \
+	linkage template class basic_TokenText<CharT> ; \
+	linkage template class basic_TokenVar<CharT> ; \
+	linkage template class basic_TokenFor<CharT> ; \
+	linkage template class basic_TokenIf<CharT> ; \
+	linkage template class basic_TokenEnd<CharT> ; \
+	linkage template class basic_Template<CharT> ;
+
+	CPPTEMPL_INSTANTIATE_CLASSES(extern, char)
+	CPPTEMPL_INSTANTIATE_CLASSES(extern, wchar_t)
+	CPPTEMPL_INSTANTIATE_CLASSES(extern, char16_t)
 }
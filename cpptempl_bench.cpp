@@ -0,0 +1,158 @@
+
+#include "cpptempl.h"
+
+#ifdef CPPTEMPL_BENCHMARK
+
+// Throughput benchmarks. Build with CPPTEMPL_BENCHMARK defined and run
+//	cpptempl_bench [name [arguments]]
+// with no name to run them all with their default arguments.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+
+using namespace std ;
+using namespace cpptempl ;
+
+namespace
+{
+	typedef void (*benchmark_function)(int argc, char **argv) ;
+
+	double seconds_since(chrono::steady_clock::time_point start)
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count() ;
+	}
+
+	void report(const string &name, unsigned long long bytes, double seconds)
+	{
+		cout << name << ": " << bytes / (1024 * 1024) << " MB in " << seconds << " s, "
+			<< bytes / (1024.0 * 1024.0) / seconds << " MB/s" << endl ;
+	}
+
+	// a table page; renders about 300 KB per pass
+	struct TablePage
+	{
+		TablePage() : page("{% for r in rows %}<tr><td>{$r.id}</td><td>{$r.name}</td>"
+			"<td class=\"amount\">{$r.amount}</td></tr>\n{% endfor %}")
+		{
+			data_list rows ;
+			for (int i = 0 ; i < 5000 ; ++i)
+			{
+				data_map row ;
+				row["id"] = make_data(boost::lexical_cast<string>(i)) ;
+				row["name"] = make_data("customer " + boost::lexical_cast<string>(i * 7919 % 10007)) ;
+				row["amount"] = make_data(boost::lexical_cast<string>(i * 13.25)) ;
+				rows.push_back(make_data(row)) ;
+			}
+			data["rows"] = make_data(rows) ;
+		}
+		// renders until at least bytes have been written to out
+		void render(ostream &out, unsigned long long bytes)
+		{
+			RenderContext context ;
+			while (context.m_bytes < bytes)
+			{
+				page.render(out, data, context) ;
+			}
+		}
+		Template page ;
+		data_map data ;
+	};
+
+	// file_sink [megabytes [directory]]
+	// a large render to disk through std::ofstream, FileSink and FileSink with O_DIRECT
+	void file_sink(int argc, char **argv)
+	{
+		const unsigned long long bytes = (argc > 0 ? atoi(argv[0]) : 512) * 1024ull * 1024ull ;
+		const string filename = string(argc > 1 ? argv[1] : ".") + "/cpptempl_bench.out" ;
+		TablePage table ;
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now() ;
+			ofstream out(filename.c_str(), ios::binary) ;
+			table.render(out, bytes) ;
+			out.close() ;
+			report("std::ofstream", bytes, seconds_since(start)) ;
+		}
+		for (int direct = 0 ; direct < 2 ; ++direct)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now() ;
+			FileSink sink(filename, 4 * 1024 * 1024, direct != 0) ;
+			ostream out(&sink) ;
+			table.render(out, bytes) ;
+			sink.close() ;
+			report(direct ? "FileSink, direct" : "FileSink", sink.bytes_written(), seconds_since(start)) ;
+		}
+		remove(filename.c_str()) ;
+	}
+
+	template<typename Format>
+	void time_format(const string &name, int count, Format format)
+	{
+		size_t total = 0 ;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now() ;
+		for (int i = 0 ; i < count ; ++i)
+		{
+			total += format(i).size() ;
+		}
+		const double seconds = seconds_since(start) ;
+		cout << name << ": " << seconds * 1e9 / count << " ns per number (" << total << " chars)" << endl ;
+	}
+
+	// number_format [count]
+	// numbers to text through boost::lexical_cast and format_number
+	void number_format(int argc, char **argv)
+	{
+		const int count = argc > 0 ? atoi(argv[0]) : 2000000 ;
+		time_format("lexical_cast<string>(int)", count, [](int i) { 
+			return boost::lexical_cast<string>(i * 997) ; 
+		}) ;
+		time_format("format_number(int)", count, [](int i) { 
+			return format_number(i * 997) ; 
+		}) ;
+		time_format("lexical_cast<string>(double)", count, [](int i) { 
+			return boost::lexical_cast<string>(i * 0.731) ; 
+		}) ;
+		time_format("format_number(double)", count, [](int i) { 
+			return format_number(i * 0.731) ; 
+		}) ;
+		time_format("format_fixed(double, 2)", count, [](int i) { 
+			return format_fixed(i * 0.731, 2) ; 
+		}) ;
+	}
+
+	struct Benchmark
+	{
+		const char *name ;
+		benchmark_function run ;
+	};
+
+	const Benchmark benchmarks[] = {
+		{ "file_sink", file_sink },
+		{ "number_format", number_format },
+	} ;
+}
+
+int main(int argc, char **argv)
+{
+	bool found = false ;
+	for (size_t i = 0 ; i < sizeof(benchmarks) / sizeof(benchmarks[0]) ; ++i)
+	{
+		if (argc < 2 || string(argv[1]) == benchmarks[i].name)
+		{
+			found = true ;
+			cout << "== " << benchmarks[i].name << endl ;
+			benchmarks[i].run(argc < 2 ? 0 : argc - 2, argv + 2) ;
+		}
+	}
+	if (! found)
+	{
+		cerr << "unknown benchmark: " << argv[1] << endl ;
+		return 1 ;
+	}
+	return 0 ;
+}
+
+#endif
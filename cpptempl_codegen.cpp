@@ -0,0 +1,149 @@
+#include "cpptempl.h"
+
+#ifdef CPPTEMPL_CODEGEN
+
+// Compiles templates to C++ render functions. Build with
+// CPPTEMPL_CODEGEN defined and run
+//	cpptempl_codegen [options] [function=]file ...
+// A function is named after its file unless given: people.html becomes
+// render_people.
+//	-o file		write to file instead of standard output
+//	-d dir		where includes and parent templates are read (default .)
+//	-e filter	auto-escape filter, as CompileOptions::autoescape
+//	-m policy	missing keys: echo (default), empty or throw
+//	-g macro	wrap the output in #ifdef macro
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std ;
+using namespace cpptempl ;
+
+namespace
+{
+	int usage()
+	{
+		cerr << "usage: cpptempl_codegen [-o file] [-d dir] [-e filter] [-m echo|empty|throw] [-g macro] [function=]file ..." << endl ;
+		return 2 ;
+	}
+
+	string read_file(const string &path)
+	{
+		ifstream in(path.c_str(), ios::binary) ;
+		if (! in)
+		{
+			throw TemplateException("Cannot open template: " + path) ;
+		}
+		ostringstream text ;
+		text << in.rdbuf() ;
+		return text.str() ;
+	}
+
+	// render_ and the file name up to its first dot, as an identifier
+	string function_name(const string &path)
+	{
+		const size_t slash = path.find_last_of("/\\") ;
+		string stem = path.substr(slash == string::npos ? 0 : slash + 1) ;
+		stem = stem.substr(0, stem.find('.')) ;
+		for (size_t i = 0 ; i < stem.size() ; ++i)
+		{
+			if (! isalnum(static_cast<unsigned char>(stem[i])))
+			{
+				stem[i] = '_' ;
+			}
+		}
+		return "render_" + stem ;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	string output ;
+	string directory = "." ;
+	string guard ;
+	CompileOptions options ;
+	vector<string> inputs ;
+	for (int i = 1 ; i < argc ; ++i)
+	{
+		const string arg = argv[i] ;
+		if (arg.size() == 2 && arg[0] == '-')
+		{
+			if (i + 1 == argc)
+			{
+				return usage() ;
+			}
+			const string value = argv[++i] ;
+			switch (arg[1])
+			{
+			case 'o': output = value ; break ;
+			case 'd': directory = value ; break ;
+			case 'e': options.autoescape = value ; break ;
+			case 'g': guard = value ; break ;
+			case 'm':
+				if (value == "echo") options.missing_key = MISSING_KEY_ECHO ;
+				else if (value == "empty") options.missing_key = MISSING_KEY_EMPTY ;
+				else if (value == "throw") options.missing_key = MISSING_KEY_THROW ;
+				else return usage() ;
+				break ;
+			default:
+				return usage() ;
+			}
+		}
+		else
+		{
+			inputs.push_back(arg) ;
+		}
+	}
+	if (inputs.empty())
+	{
+		return usage() ;
+	}
+	options.loader.reset(new TemplateLoader(directory_reader(directory), options)) ;
+
+	try
+	{
+		ostringstream code ;
+		code << "// Generated by cpptempl_codegen; do not edit.\n" ;
+		if (! guard.empty())
+		{
+			code << "\n#ifdef " << guard << "\n" ;
+		}
+		code << "\n" ;
+		generate_cpp_prologue(code) ;
+		for (size_t i = 0 ; i < inputs.size() ; ++i)
+		{
+			const size_t equals = inputs[i].find('=') ;
+			const string path = equals == string::npos ? inputs[i] : inputs[i].substr(equals + 1) ;
+			const string function = equals == string::npos ? function_name(path) : inputs[i].substr(0, equals) ;
+			Template templ(read_file(path), options) ;
+			generate_cpp(code, function, templ) ;
+		}
+		if (! guard.empty())
+		{
+			code << "\n#endif\n" ;
+		}
+
+		if (output.empty())
+		{
+			cout << code.str() ;
+			return 0 ;
+		}
+		ofstream out(output.c_str(), ios::binary) ;
+		out << code.str() ;
+		if (! out.flush())
+		{
+			cerr << "cpptempl_codegen: cannot write " << output << endl ;
+			return 1 ;
+		}
+	}
+	catch (TemplateException &e)
+	{
+		cerr << "cpptempl_codegen: " << e.what() << endl ;
+		return 1 ;
+	}
+	return 0 ;
+}
+
+#endif
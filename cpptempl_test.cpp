@@ -13,8 +13,26 @@
 
 #include "unit_testing.h"
 
+#include <cstdio>
+#include <limits>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include <boost/algorithm/string.hpp>
+#include <boost/mpl/list.hpp>
+
 using namespace std ;
 
+// The original suites below run on wide text, through the wchar_t engine
+typedef cpptempl::basic_DataValue<wchar_t> wDataValue ;
+typedef cpptempl::basic_DataList<wchar_t> wDataList ;
+typedef cpptempl::basic_DataMap<wchar_t> wDataMap ;
+typedef cpptempl::basic_TokenText<wchar_t> wTokenText ;
+typedef cpptempl::basic_TokenVar<wchar_t> wTokenVar ;
+typedef cpptempl::basic_TokenFor<wchar_t> wTokenFor ;
+typedef cpptempl::basic_TokenIf<wchar_t> wTokenIf ;
+typedef cpptempl::basic_TokenEnd<wchar_t> wTokenEnd ;
+
 BOOST_AUTO_TEST_SUITE( TestCppData )
 
 	using namespace cpptempl ;
@@ -22,64 +40,64 @@ BOOST_AUTO_TEST_SUITE( TestCppData )
 	// DataMap
 	BOOST_AUTO_TEST_CASE(test_DataMap_getvalue)
 	{
-		data_map items ;
-		data_ptr data(new DataMap(items)) ;
+		wdata_map items ;
+		wdata_ptr data(new wDataMap(items)) ;
 		BOOST_CHECK_THROW( data->getvalue(), TemplateException ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_DataMap_getlist_throws)
 	{
-		data_map items ;
-		data_ptr data(new DataMap(items)) ;
+		wdata_map items ;
+		wdata_ptr data(new wDataMap(items)) ;
 
 		BOOST_CHECK_THROW( data->getlist(), TemplateException ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_DataMap_getitem_throws)
 	{
-		data_map items ;
-		items[L"key"] = data_ptr(new DataValue(L"foo")) ;
-		data_ptr data(new DataMap(items)) ;
+		wdata_map items ;
+		items[L"key"] = wdata_ptr(new wDataValue(L"foo")) ;
+		wdata_ptr data(new wDataMap(items)) ;
 
 		BOOST_CHECK_EQUAL( data->getmap()[L"key"]->getvalue(), L"foo" ) ;
 	}
 	// DataList
 	BOOST_AUTO_TEST_CASE(test_DataList_getvalue)
 	{
-		data_list items ;
-		data_ptr data(new DataList(items)) ;
+		wdata_list items ;
+		wdata_ptr data(new wDataList(items)) ;
 
 		BOOST_CHECK_THROW( data->getvalue(), TemplateException ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_DataList_getlist_throws)
 	{
-		data_list items ;
+		wdata_list items ;
 		items.push_back(make_data(L"bar")) ;
-		data_ptr data(new DataList(items)) ;
+		wdata_ptr data(new wDataList(items)) ;
 
 		BOOST_CHECK_EQUAL( data->getlist().size(), 1u ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_DataList_getitem_throws)
 	{
-		data_list items ;
-		data_ptr data(new DataList(items)) ;
+		wdata_list items ;
+		wdata_ptr data(new wDataList(items)) ;
 
 		BOOST_CHECK_THROW( data->getmap(), TemplateException ) ;
 	}
 	// DataValue
 	BOOST_AUTO_TEST_CASE(test_DataValue_getvalue)
 	{
-		data_ptr data(new DataValue(L"foo")) ;
+		wdata_ptr data(new wDataValue(L"foo")) ;
 
 		BOOST_CHECK_EQUAL( data->getvalue(), L"foo" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_DataValue_getlist_throws)
 	{
-		data_ptr data(new DataValue(L"foo")) ;
+		wdata_ptr data(new wDataValue(L"foo")) ;
 
 		BOOST_CHECK_THROW( data->getlist(), TemplateException ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_DataValue_getitem_throws)
 	{
-		data_ptr data(new DataValue(L"foo")) ;
+		wdata_ptr data(new wDataValue(L"foo")) ;
 
 		BOOST_CHECK_THROW( data->getmap(), TemplateException ) ;
 	}
@@ -91,100 +109,100 @@ BOOST_AUTO_TEST_SUITE( TestCppParseVal )
 	using namespace cpptempl ;
 	BOOST_AUTO_TEST_CASE(test_quoted)
 	{
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
-		data_ptr value = parse_val(L"\"foo\"", data) ;
+		wdata_ptr value = parse_val(L"\"foo\"", data) ;
 
 		BOOST_CHECK_EQUAL( value->getvalue(), L"foo" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_value)
 	{
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
-		data_ptr value = parse_val(L"foo", data) ;
+		wdata_ptr value = parse_val(L"foo", data) ;
 
 		BOOST_CHECK_EQUAL( value->getvalue(), L"bar" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_not_found)
 	{
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
-		data_ptr value = parse_val(L"kettle", data) ;
+		wdata_ptr value = parse_val(L"kettle", data) ;
 
 		BOOST_CHECK_EQUAL( value->getvalue(), L"{$kettle}" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_not_found_dotted)
 	{
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
-		data_ptr value = parse_val(L"kettle.black", data) ;
+		wdata_ptr value = parse_val(L"kettle.black", data) ;
 
 		BOOST_CHECK_EQUAL( value->getvalue(), L"{$kettle.black}" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_my_ax)
 	{
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"my ax") ;
 		BOOST_CHECK_EQUAL( parse_val(L"item", data)->getvalue(), L"my ax" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_list)
 	{
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"bar")) ;
-		data[L"foo"] = data_ptr(new DataList(items)) ;
-		data_ptr value = parse_val(L"foo", data) ;
+		data[L"foo"] = wdata_ptr(new wDataList(items)) ;
+		wdata_ptr value = parse_val(L"foo", data) ;
 
 		BOOST_CHECK_EQUAL( value->getlist().size(), 1u ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_dotted)
 	{
-		data_map data ;
-		data_map subdata ;
-		subdata[L"b"] = data_ptr(new DataValue(L"c")) ;
-		data[L"a"] = data_ptr(new DataMap(subdata)) ;
-		data_ptr value = parse_val(L"a.b", data) ;
+		wdata_map data ;
+		wdata_map subdata ;
+		subdata[L"b"] = wdata_ptr(new wDataValue(L"c")) ;
+		data[L"a"] = wdata_ptr(new wDataMap(subdata)) ;
+		wdata_ptr value = parse_val(L"a.b", data) ;
 
 		BOOST_CHECK_EQUAL( value->getvalue(), L"c" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_double_dotted)
 	{
-		data_map data ;
-		data_map sub_data ;
-		data_map sub_sub_data ;
-		sub_sub_data[L"c"] = data_ptr(new DataValue(L"d")) ;
-		sub_data[L"b"] = data_ptr(new DataMap(sub_sub_data)) ;
-		data[L"a"] = data_ptr(new DataMap(sub_data)) ;
-		data_ptr value = parse_val(L"a.b.c", data) ;
+		wdata_map data ;
+		wdata_map sub_data ;
+		wdata_map sub_sub_data ;
+		sub_sub_data[L"c"] = wdata_ptr(new wDataValue(L"d")) ;
+		sub_data[L"b"] = wdata_ptr(new wDataMap(sub_sub_data)) ;
+		data[L"a"] = wdata_ptr(new wDataMap(sub_data)) ;
+		wdata_ptr value = parse_val(L"a.b.c", data) ;
 
 		BOOST_CHECK_EQUAL( value->getvalue(), L"d" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_dotted_to_list)
 	{
-		data_list friends ;
+		wdata_list friends ;
 		friends.push_back(make_data(L"Bob")) ;
-		data_map person ;
+		wdata_map person ;
 		person[L"friends"] = make_data(friends) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"person"] = make_data(person) ;
-		data_ptr value = parse_val(L"person.friends", data) ;
+		wdata_ptr value = parse_val(L"person.friends", data) ;
 
 		BOOST_CHECK_EQUAL( value->getlist().size(), 1u ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_dotted_to_dict_list)
 	{
-		data_map bob ;
+		wdata_map bob ;
 		bob[L"name"] = make_data(L"Bob") ;
-		data_map betty ;
+		wdata_map betty ;
 		betty[L"name"] = make_data(L"Betty") ;
-		data_list friends ;
+		wdata_list friends ;
 		friends.push_back(make_data(bob)) ;
 		friends.push_back(make_data(betty)) ;
-		data_map person ;
+		wdata_map person ;
 		person[L"friends"] = make_data(friends) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"person"] = make_data(person) ;
-		data_ptr value = parse_val(L"person.friends", data) ;
+		wdata_ptr value = parse_val(L"person.friends", data) ;
 
 		BOOST_CHECK_EQUAL( value->getlist()[0]->getmap()[L"name"]->getvalue(), L"Bob" ) ;
 	}
@@ -197,74 +215,74 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	// TokenVar
 	BOOST_AUTO_TEST_CASE(TestTokenVarType)
 	{
-		TokenVar token(L"foo") ;
+		wTokenVar token(L"foo") ;
 		BOOST_CHECK_EQUAL( token.gettype(), TOKEN_TYPE_VAR ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenVar)
 	{
-		token_ptr token(new TokenVar(L"foo")) ;
-		data_map data ;
+		wtoken_ptr token(new wTokenVar(L"foo")) ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"bar" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenVarCantHaveChildren)
 	{
-		TokenVar token(L"foo") ;
-		token_vector children ;
+		wTokenVar token(L"foo") ;
+		wtoken_vector children ;
 		BOOST_CHECK_THROW(token.set_children(children), TemplateException) ;
 	}
 	// TokenText
 	BOOST_AUTO_TEST_CASE(TestTokenTextType)
 	{
-		TokenText token(L"foo") ;
+		wTokenText token(L"foo") ;
 		BOOST_CHECK_EQUAL( token.gettype(), TOKEN_TYPE_TEXT ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenText)
 	{
-		token_ptr token(new TokenText(L"foo")) ;
-		data_map data ;
+		wtoken_ptr token(new wTokenText(L"foo")) ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"foo" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenTextCantHaveChildrenSet)
 	{
-		TokenText token(L"foo") ;
-		token_vector children ;
+		wTokenText token(L"foo") ;
+		wtoken_vector children ;
 		BOOST_CHECK_THROW(token.set_children(children), TemplateException) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenTextCantHaveChildrenGet)
 	{
-		TokenText token(L"foo") ;
-		token_vector children ;
+		wTokenText token(L"foo") ;
+		wtoken_vector children ;
 		BOOST_CHECK_THROW(token.get_children(), TemplateException) ;
 	}
 	// TokenFor
 	BOOST_AUTO_TEST_CASE(TestTokenForBadSyntax)
 	{
-		BOOST_CHECK_THROW(TokenFor token(L"foo"), TemplateException ) ;
+		BOOST_CHECK_THROW(wTokenFor token(L"foo"), TemplateException ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForType)
 	{
-		TokenFor token(L"for item in items") ;
+		wTokenFor token(L"for item in items") ;
 		BOOST_CHECK_EQUAL( token.gettype(), TOKEN_TYPE_FOR ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForTextEmpty)
 	{
-		token_ptr token(new TokenFor(L"for item in items")) ;
-		data_map data ;
-		data_list items ;
+		wtoken_ptr token(new wTokenFor(L"for item in items")) ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"first")); 
 		data[L"items"] = make_data(items) ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForTextOneVar)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenFor(L"for item in items")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenFor(L"for item in items")) ;
 		token->set_children(children) ;
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"first ")); 
 		items.push_back(make_data(L"second ")); 
 		data[L"items"] = make_data(items) ;
@@ -272,12 +290,12 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForTextOneVarLoop)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"loop.index"))) ;
-		token_ptr token(new TokenFor(L"for item in items")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"loop.index"))) ;
+		wtoken_ptr token(new wTokenFor(L"for item in items")) ;
 		token->set_children(children) ;
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"first ")); 
 		items.push_back(make_data(L"second ")); 
 		data[L"items"] = make_data(items) ;
@@ -285,15 +303,15 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	}	
 	BOOST_AUTO_TEST_CASE(TestTokenForLoopTextVar)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"loop.index"))) ;
-		children.push_back(token_ptr(new TokenText(L". "))) ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		children.push_back(token_ptr(new TokenText(L" "))) ;
-		token_ptr token(new TokenFor(L"for item in items")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"loop.index"))) ;
+		children.push_back(wtoken_ptr(new wTokenText(L". "))) ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		children.push_back(wtoken_ptr(new wTokenText(L" "))) ;
+		wtoken_ptr token(new wTokenFor(L"for item in items")) ;
 		token->set_children(children) ;
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"first")); 
 		items.push_back(make_data(L"second")); 
 		data[L"items"] = make_data(items) ;
@@ -301,42 +319,42 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForLoopTextVarDottedKeyAndVal)
 	{
-		TokenFor token(L"for friend in person.friends") ;
+		wTokenFor token(L"for friend in person.friends") ;
 		BOOST_CHECK_EQUAL( token.m_key, L"person.friends" ) ;
 		BOOST_CHECK_EQUAL( token.m_val, L"friend" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForLoopTextVarDotted)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"loop.index"))) ;
-		children.push_back(token_ptr(new TokenText(L". "))) ;
-		children.push_back(token_ptr(new TokenVar(L"friend.name"))) ;
-		children.push_back(token_ptr(new TokenText(L" "))) ;
-		token_ptr token(new TokenFor(L"for friend in person.friends")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"loop.index"))) ;
+		children.push_back(wtoken_ptr(new wTokenText(L". "))) ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"friend.name"))) ;
+		children.push_back(wtoken_ptr(new wTokenText(L" "))) ;
+		wtoken_ptr token(new wTokenFor(L"for friend in person.friends")) ;
 		token->set_children(children) ;
 
-		data_map bob ;
+		wdata_map bob ;
 		bob[L"name"] = make_data(L"Bob") ;
-		data_map betty ;
+		wdata_map betty ;
 		betty[L"name"] = make_data(L"Betty") ;
-		data_list friends ;
+		wdata_list friends ;
 		friends.push_back(make_data(bob)) ;
 		friends.push_back(make_data(betty)) ;
-		data_map person ;
+		wdata_map person ;
 		person[L"friends"] = make_data(friends) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"person"] = make_data(person) ;
 
 		BOOST_CHECK_EQUAL( gettext(token, data), L"1. Bob 2. Betty " ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenForTextOneText)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenText(L"{--}"))) ;
-		token_ptr token(new TokenFor(L"for item in items")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenText(L"{--}"))) ;
+		wtoken_ptr token(new wTokenFor(L"for item in items")) ;
 		token->set_children(children) ;
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"first ")); 
 		items.push_back(make_data(L"second ")); 
 		data[L"items"] = make_data(items) ;
@@ -349,71 +367,83 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 
 	BOOST_AUTO_TEST_CASE(TestTokenIfType)
 	{
-		TokenIf token(L"if items") ;
+		wTokenIf token(L"if items") ;
 		BOOST_CHECK_EQUAL( token.gettype(), TOKEN_TYPE_IF ) ;
 	}
 	// if not empty
 	BOOST_AUTO_TEST_CASE(TestTokenIfTrueText)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenText(L"{--}"))) ;
-		token_ptr token(new TokenIf(L"if item")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenText(L"{--}"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"{--}" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenIfTrueVar)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenIf(L"if item")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"foo" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenIfFalse)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenText(L"{--}"))) ;
-		token_ptr token(new TokenIf(L"if item")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenText(L"{--}"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"") ;
 	}
+	BOOST_AUTO_TEST_CASE(TestTokenIfParsed)
+	{
+		wTokenIf equal(L"if a == \"x\"") ;
+		BOOST_CHECK_EQUAL( equal.m_test, IF_EQUAL ) ;
+		BOOST_CHECK( equal.m_lhs == L"a" && equal.m_rhs == L"\"x\"" ) ;
+		wTokenIf negated(L"if not a") ;
+		BOOST_CHECK_EQUAL( negated.m_test, IF_EMPTY ) ;
+		BOOST_CHECK( negated.m_lhs == L"a" && negated.m_rhs.empty() ) ;
+		BOOST_CHECK_THROW( wTokenIf(L"if"), TemplateException ) ;
+		BOOST_CHECK_THROW( wTokenIf(L"if not"), TemplateException ) ;
+		BOOST_CHECK_THROW( wTokenIf(L"if a =="), TemplateException ) ;
+	}
 
 	
 
 	// ==
 	BOOST_AUTO_TEST_CASE(TestTokenIfEqualsTrue)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenIf(L"if item == \"foo\"")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item == \"foo\"")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"foo" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenIfEqualsFalse)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenIf(L"if item == \"bar\"")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item == \"bar\"")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenIfEqualsTwoVarsTrue)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenIf(L"if item == foo")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item == foo")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"x") ;
 		data[L"foo"] = make_data(L"x") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"x" ) ;
@@ -422,21 +452,21 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	// !=
 	BOOST_AUTO_TEST_CASE(TestTokenIfNotEqualsTrue)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenIf(L"if item != \"foo\"")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item != \"foo\"")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"" ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenIfNotEqualsFalse)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenVar(L"item"))) ;
-		token_ptr token(new TokenIf(L"if item != \"bar\"")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenVar(L"item"))) ;
+		wtoken_ptr token(new wTokenIf(L"if item != \"bar\"")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"foo" ) ;
 	}
@@ -444,22 +474,22 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	// not
 	BOOST_AUTO_TEST_CASE(TestTokenIfNotTrueText)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenText(L"{--}"))) ;
-		token_ptr token(new TokenIf(L"if not item")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenText(L"{--}"))) ;
+		wtoken_ptr token(new wTokenIf(L"if not item")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"") ;
 	}
 
 	BOOST_AUTO_TEST_CASE(TestTokenIfNotFalseText)
 	{
-		token_vector children ;
-		children.push_back(token_ptr(new TokenText(L"{--}"))) ;
-		token_ptr token(new TokenIf(L"if not item")) ;
+		wtoken_vector children ;
+		children.push_back(wtoken_ptr(new wTokenText(L"{--}"))) ;
+		wtoken_ptr token(new wTokenIf(L"if not item")) ;
 		token->set_children(children) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"") ;
 		BOOST_CHECK_EQUAL( gettext(token, data), L"{--}") ;
 	}
@@ -467,24 +497,24 @@ BOOST_AUTO_TEST_SUITE( TestCppToken )
 	// TokenEnd
 	BOOST_AUTO_TEST_CASE(TestTokenEndFor)
 	{
-		TokenEnd token(L"endfor") ;
+		wTokenEnd token(L"endfor") ;
 		BOOST_CHECK_EQUAL( token.gettype(), TOKEN_TYPE_ENDFOR ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenEndIf)
 	{
-		TokenEnd token(L"endif") ;
+		wTokenEnd token(L"endif") ;
 		BOOST_CHECK_EQUAL( token.gettype(), TOKEN_TYPE_ENDIF ) ;
 	}
 	BOOST_AUTO_TEST_CASE(TestTokenEndIfCantHaveChildren)
 	{
-		TokenEnd token(L"endif") ;
-		token_vector children ;
+		wTokenEnd token(L"endif") ;
+		wtoken_vector children ;
 		BOOST_CHECK_THROW(token.set_children(children), TemplateException) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_throws_on_gettext)
 	{
-		data_map data ;
-		token_ptr token(new TokenEnd(L"endif")) ;
+		wdata_map data ;
+		wtoken_ptr token(new wTokenEnd(L"endif")) ;
 
 		BOOST_CHECK_THROW(gettext(token, data), TemplateException) ;
 	}
@@ -497,7 +527,7 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_empty)
 	{
 		wstring text = L"" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
 
 		BOOST_CHECK_EQUAL( 0u, tokens.size() ) ;
@@ -505,9 +535,9 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_text_only)
 	{
 		wstring text = L"blah blah blah" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
-		data_map data ;
+		wdata_map data ;
 
 		BOOST_CHECK_EQUAL( 1u, tokens.size() ) ;
 		BOOST_CHECK_EQUAL( gettext(tokens[0], data), L"blah blah blah" ) ;
@@ -515,9 +545,9 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_brackets_no_var)
 	{
 		wstring text = L"{foo}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
-		data_map data ;
+		wdata_map data ;
 
 		BOOST_CHECK_EQUAL( 2u, tokens.size() ) ;
 		BOOST_CHECK_EQUAL( gettext(tokens[0], data), L"{" ) ;
@@ -526,9 +556,9 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_ends_with_bracket)
 	{
 		wstring text = L"blah blah blah{" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
-		data_map data ;
+		wdata_map data ;
 
 		BOOST_CHECK_EQUAL( 2u, tokens.size() ) ;
 		BOOST_CHECK_EQUAL( gettext(tokens[0], data), L"blah blah blah" ) ;
@@ -538,9 +568,9 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_var)
 	{
 		wstring text = L"{$foo}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
 
 		BOOST_CHECK_EQUAL( 1u, tokens.size() ) ;
@@ -550,7 +580,7 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_for)
 	{
 		wstring text = L"{% for item in items %}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
 
 		BOOST_CHECK_EQUAL( 1u, tokens.size() ) ;
@@ -559,7 +589,7 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_for_full)
 	{
 		wstring text = L"{% for item in items %}{$item}{% endfor %}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
 
 		BOOST_CHECK_EQUAL( 3u, tokens.size() ) ;
@@ -570,9 +600,9 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_for_full_with_text)
 	{
 		wstring text = L"{% for item in items %}*{$item}*{% endfor %}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"my ax") ;
 
 		BOOST_CHECK_EQUAL( 5u, tokens.size() ) ;
@@ -587,7 +617,7 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_if)
 	{
 		wstring text = L"{% if foo %}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
 
 		BOOST_CHECK_EQUAL( 1u, tokens.size() ) ;
@@ -596,7 +626,7 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_if_full)
 	{
 		wstring text = L"{% if item %}{$item}{% endif %}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
 
 		BOOST_CHECK_EQUAL( 3u, tokens.size() ) ;
@@ -607,9 +637,9 @@ BOOST_AUTO_TEST_SUITE( TestCppTokenize )
 	BOOST_AUTO_TEST_CASE(test_if_full_with_text)
 	{
 		wstring text = L"{% if item %}{{$item}}{% endif %}" ;
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokenize(text, tokens) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"my ax") ;
 
 		BOOST_CHECK_EQUAL( 5u, tokens.size() ) ;
@@ -628,59 +658,59 @@ BOOST_AUTO_TEST_SUITE( test_parse_tree )
 
 	using namespace cpptempl ;
 
-	token_ptr make_tt(wstring text)
+	wtoken_ptr make_tt(wstring text)
 	{
-		return token_ptr(new TokenText(text)) ;
+		return wtoken_ptr(new wTokenText(text)) ;
 	}
-	token_ptr make_for(wstring text)
+	wtoken_ptr make_for(wstring text)
 	{
-		return token_ptr(new TokenFor(text)) ;
+		return wtoken_ptr(new wTokenFor(text)) ;
 	}
-	token_ptr make_if(wstring text)
+	wtoken_ptr make_if(wstring text)
 	{
-		return token_ptr(new TokenIf(text)) ;
+		return wtoken_ptr(new wTokenIf(text)) ;
 	}
-	token_ptr make_endfor()
+	wtoken_ptr make_endfor()
 	{
-		return token_ptr(new TokenEnd(L"endfor")) ;
+		return wtoken_ptr(new wTokenEnd(L"endfor")) ;
 	}
-	token_ptr make_endif()
+	wtoken_ptr make_endif()
 	{
-		return token_ptr(new TokenEnd(L"endif")) ;
+		return wtoken_ptr(new wTokenEnd(L"endif")) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_empty)
 	{
-		token_vector tokens ;
-		token_vector tree ;
+		wtoken_vector tokens ;
+		wtoken_vector tree ;
 		parse_tree(tokens, tree) ;
 		BOOST_CHECK_EQUAL( 0u, tree.size() ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_one)
 	{
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokens.push_back(make_tt(L"foo")) ;
-		token_vector tree ;
+		wtoken_vector tree ;
 		parse_tree(tokens, tree) ;
 		BOOST_CHECK_EQUAL( 1u, tree.size() ) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_for)
 	{
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokens.push_back(make_for(L"for item in items")) ;
 		tokens.push_back(make_tt(L"foo")) ;
 		tokens.push_back(make_endfor()) ;
-		token_vector tree ;
+		wtoken_vector tree ;
 		parse_tree(tokens, tree) ;
 		BOOST_CHECK_EQUAL( 1u, tree.size() ) ;
 		BOOST_CHECK_EQUAL( 1u, tree[0]->get_children().size()) ;
 	}
 	BOOST_AUTO_TEST_CASE(test_if)
 	{
-		token_vector tokens ;
+		wtoken_vector tokens ;
 		tokens.push_back(make_if(L"if insane")) ;
 		tokens.push_back(make_tt(L"foo")) ;
 		tokens.push_back(make_endif()) ;
-		token_vector tree ;
+		wtoken_vector tree ;
 		parse_tree(tokens, tree) ;
 		BOOST_CHECK_EQUAL( 1u, tree.size() ) ;
 		BOOST_CHECK_EQUAL( 1u, tree[0]->get_children().size()) ;
@@ -694,7 +724,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_empty)
 	{
 		wstring text = L"" ;
-		data_map data ;
+		wdata_map data ;
 		wstring actual = parse(text, data) ;
 		wstring expected = L"" ;
 		BOOST_CHECK_EQUAL( expected, actual ) ;
@@ -702,7 +732,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_no_vars)
 	{
 		wstring text = L"foo" ;
-		data_map data ;
+		wdata_map data ;
 		wstring actual = parse(text, data) ;
 		wstring expected = L"foo" ;
 		BOOST_CHECK_EQUAL( expected, actual ) ;
@@ -710,7 +740,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_var)
 	{
 		wstring text = L"{$foo}" ;
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"bar") ;
 		wstring actual = parse(text, data) ;
 		wstring expected = L"bar" ;
@@ -719,7 +749,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_var_surrounded)
 	{
 		wstring text = L"aaa{$foo}bbb" ;
-		data_map data ;
+		wdata_map data ;
 		data[L"foo"] = make_data(L"---") ;
 		wstring actual = parse(text, data) ;
 		wstring expected = L"aaa---bbb" ;
@@ -728,8 +758,8 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_for)
 	{
 		wstring text = L"{% for item in items %}{$item}{% endfor %}" ;
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"0")) ;
 		items.push_back(make_data(L"1")) ;
 		data[L"items"] = make_data(items) ;
@@ -740,7 +770,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_if_false)
 	{
 		wstring text = L"{% if item %}{$item}{% endif %}" ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"") ;
 		wstring actual = parse(text, data) ;
 		wstring expected = L"" ;
@@ -749,7 +779,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_if_true)
 	{
 		wstring text = L"{% if item %}{$item}{% endif %}" ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"foo") ;
 		wstring actual = parse(text, data) ;
 		wstring expected = L"foo" ;
@@ -758,12 +788,12 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_nested_for)
 	{
 		wstring text = L"{% for item in items %}{% for thing in things %}{$item}{$thing}{% endfor %}{% endfor %}" ;
-		data_map data ;
-		data_list items ;
+		wdata_map data ;
+		wdata_list items ;
 		items.push_back(make_data(L"0")) ;
 		items.push_back(make_data(L"1")) ;
 		data[L"items"] = make_data(items) ;
-		data_list things ;
+		wdata_list things ;
 		things.push_back(make_data(L"a")) ;
 		things.push_back(make_data(L"b")) ;
 		data[L"things"] = make_data(things) ;
@@ -774,7 +804,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_nested_if_false)
 	{
 		wstring text = L"{% if item %}{% if thing %}{$item}{$thing}{% endif %}{% endif %}" ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"aaa") ;
 		data[L"thing"] = make_data(L"") ;
 		wstring actual = parse(text, data) ;
@@ -784,7 +814,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_nested_if_true)
 	{
 		wstring text = L"{% if item %}{% if thing %}{$item}{$thing}{% endif %}{% endif %}" ;
-		data_map data ;
+		wdata_map data ;
 		data[L"item"] = make_data(L"aaa") ;
 		data[L"thing"] = make_data(L"bbb") ;
 		wstring actual = parse(text, data) ;
@@ -795,7 +825,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	{
 		wstring text = L"{% if item %}{$item}{% endif %}\n"
 			L"{% if thing %}{$thing}{% endif %}" ;
-		cpptempl::data_map data ;
+		cpptempl::wdata_map data ;
 		data[L"item"] = cpptempl::make_data(L"aaa") ;
 		data[L"thing"] = cpptempl::make_data(L"bbb") ;
 
@@ -807,10 +837,10 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	BOOST_AUTO_TEST_CASE(test_syntax_if)
 	{
 		wstring text = L"{% if person.name == \"Bob\" %}Full name: Robert{% endif %}" ;
-		data_map person ;
+		wdata_map person ;
 		person[L"name"] = make_data(L"Bob") ;
 		person[L"occupation"] = make_data(L"Plumber") ;
-		data_map data ;
+		wdata_map data ;
 		data[L"person"] = make_data(person) ;
 
 		wstring result = cpptempl::parse(text, data) ;
@@ -824,16 +854,16 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 			L"{$loop.index}. {$friend.name} "
 			L"{% endfor %}" ;
 
-		data_map bob ;
+		wdata_map bob ;
 		bob[L"name"] = make_data(L"Bob") ;
-		data_map betty ;
+		wdata_map betty ;
 		betty[L"name"] = make_data(L"Betty") ;
-		data_list friends ;
+		wdata_list friends ;
 		friends.push_back(make_data(bob)) ;
 		friends.push_back(make_data(betty)) ;
-		data_map person ;
+		wdata_map person ;
 		person[L"friends"] = make_data(friends) ;
-		data_map data ;
+		wdata_map data ;
 		data[L"person"] = make_data(person) ;
 
 		wstring result = cpptempl::parse(text, data) ;
@@ -846,7 +876,7 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 		// The text template
 		wstring text = L"I heart {$place}!" ;
 		// Data to feed the template engine
-		cpptempl::data_map data ;
+		cpptempl::wdata_map data ;
 		// {$place} => Okinawa
 		data[L"place"] = cpptempl::make_data(L"Okinawa");
 		// parse the template with the supplied data dictionary
@@ -864,11 +894,11 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 			L"</ul>" ;
 
 		// Create the list of items
-		cpptempl::data_list places;
+		cpptempl::wdata_list places;
 		places.push_back(cpptempl::make_data(L"Okinawa"));
 		places.push_back(cpptempl::make_data(L"San Francisco"));
 		// Now set this in the data map
-		cpptempl::data_map data ;
+		cpptempl::wdata_map data ;
 		data[L"places"] = cpptempl::make_data(places);
 		// parse the template with the supplied data dictionary
 		wstring result = cpptempl::parse(text, data) ;
@@ -880,4 +910,2352 @@ BOOST_AUTO_TEST_SUITE(TestCppParse)
 	}
 BOOST_AUTO_TEST_SUITE_END()
 
-#endif
\ No newline at end of file
+BOOST_AUTO_TEST_SUITE( TestCppProfiler )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_token_positions)
+	{
+		string text = "ab\n  {$foo}\n{% if foo %}x{% endif %}" ;
+		token_vector tokens ;
+		tokenize(text, tokens) ;
+
+		BOOST_CHECK_EQUAL( 6u, tokens.size() ) ;
+		BOOST_CHECK_EQUAL( tokens[0]->getline(), 1u ) ;
+		BOOST_CHECK_EQUAL( tokens[0]->getcolumn(), 1u ) ;
+		BOOST_CHECK_EQUAL( tokens[1]->getline(), 2u ) ;
+		BOOST_CHECK_EQUAL( tokens[1]->getcolumn(), 3u ) ;
+		BOOST_CHECK_EQUAL( tokens[3]->getline(), 3u ) ;
+		BOOST_CHECK_EQUAL( tokens[3]->getcolumn(), 1u ) ;
+		BOOST_CHECK_EQUAL( tokens[4]->getcolumn(), 13u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_profile_counts)
+	{
+		string text = "<ul>{% for item in items %}<li>{$item}</li>{% endfor %}</ul>" ;
+		data_map data ;
+		data_list items ;
+		items.push_back(make_data("a")) ;
+		items.push_back(make_data("bb")) ;
+		data["items"] = make_data(items) ;
+
+		Profiler profiler ;
+		RenderContext context(&profiler) ;
+		ostringstream stream ;
+		parse(stream, text, data, context) ;
+
+		BOOST_CHECK_EQUAL( stream.str(), "<ul><li>a</li><li>bb</li></ul>" ) ;
+		BOOST_CHECK_EQUAL( context.m_bytes, stream.str().size() ) ;
+
+		vector<Profiler::NodeStats> nodes = profiler.nodes() ;
+		size_t found = 0 ;
+		for (size_t i = 0 ; i < nodes.size() ; ++i)
+		{
+			if (nodes[i].label == "{$item}")
+			{
+				++found ;
+				BOOST_CHECK_EQUAL( nodes[i].calls, 2u ) ;
+				BOOST_CHECK_EQUAL( nodes[i].bytes, 3u ) ;
+				BOOST_CHECK_EQUAL( nodes[i].column, 32u ) ;
+			}
+			if (nodes[i].label == "{% for item in items %}")
+			{
+				++found ;
+				BOOST_CHECK_EQUAL( nodes[i].calls, 1u ) ;
+				BOOST_CHECK_EQUAL( nodes[i].bytes, 21u ) ;
+				BOOST_CHECK( nodes[i].inclusive_ns >= nodes[i].exclusive_ns ) ;
+			}
+		}
+		BOOST_CHECK_EQUAL( found, 2u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_profile_collapsed)
+	{
+		string text = "{% for item in items %}{$item}{% endfor %}" ;
+		data_map data ;
+		data_list items ;
+		items.push_back(make_data("a")) ;
+		data["items"] = make_data(items) ;
+
+		Profiler profiler ;
+		RenderContext context(&profiler) ;
+		ostringstream stream ;
+		parse(stream, text, data, context) ;
+
+		ostringstream collapsed ;
+		profiler.collapsed(collapsed) ;
+		BOOST_CHECK( collapsed.str().find("{% for item in items %}@1:1;{$item}@1:24 ") != string::npos ) ;
+
+		ostringstream report ;
+		profiler.report(report, PROFILE_SORT_CALLS) ;
+		BOOST_CHECK( report.str().find("calls") == 0 ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_profile_adds_up_across_templates)
+	{
+		string text = "{% if items %}{% for item in items %}{$item}{% endfor %}{% endif %}" ;
+		data_map data ;
+		data_list items(3, make_data("x")) ;
+		data["items"] = make_data(items) ;
+
+		Profiler profiler ;
+		RenderContext context(&profiler) ;
+		Template page(text) ;
+		ostringstream stream ;
+		page.render(stream, data, context) ;
+		page.render(stream, data, context) ;
+		// another compile of the same text has other nodes, with the same names
+		parse(stream, text, data, context) ;
+
+		vector<Profiler::NodeStats> nodes = profiler.nodes() ;
+		BOOST_CHECK_EQUAL( nodes.size(), 3u ) ;
+		for (size_t i = 0 ; i < nodes.size() ; ++i)
+		{
+			BOOST_CHECK_EQUAL( nodes[i].calls, nodes[i].label == "{$item}" ? 9u : 3u ) ;
+		}
+		ostringstream collapsed ;
+		profiler.collapsed(collapsed) ;
+		const string stacks = collapsed.str() ;
+		BOOST_CHECK( stacks.find("{% if items %}@1:1;{% for item in items %}@1:15;{$item}@1:38 ") != string::npos ) ;
+		BOOST_CHECK_EQUAL( std::count(stacks.begin(), stacks.end(), '\n'), 3 ) ;
+
+		profiler.clear() ;
+		BOOST_CHECK( profiler.nodes().empty() ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppStats )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_stats_counts_render)
+	{
+		EngineStats before = stats() ;
+		data_map data ;
+		data["foo"] = make_data("bar") ;
+		string result = parse("{$foo} {$missing}", data) ;
+		EngineStats after = stats() ;
+
+		BOOST_CHECK_EQUAL( after.renders - before.renders, 1u ) ;
+		BOOST_CHECK_EQUAL( after.compiles - before.compiles, 1u ) ;
+		BOOST_CHECK_EQUAL( after.missing_keys - before.missing_keys, 1u ) ;
+		BOOST_CHECK_EQUAL( after.bytes_written - before.bytes_written, result.size() ) ;
+		BOOST_CHECK( after.allocations > before.allocations ) ;
+		unsigned long long latency_before = 0, latency_after = 0 ;
+		for (size_t i = 0 ; i < STATS_LATENCY_BUCKETS ; ++i)
+		{
+			latency_before += before.render_latency[i] ;
+			latency_after += after.render_latency[i] ;
+		}
+		BOOST_CHECK_EQUAL( latency_after - latency_before, 1u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_stats_from_finished_thread)
+	{
+		EngineStats before = stats() ;
+		std::thread worker([]{
+			data_map data ;
+			parse("abc", data) ;
+		}) ;
+		worker.join() ;
+		EngineStats after = stats() ;
+
+		BOOST_CHECK_EQUAL( after.renders - before.renders, 1u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_dump_stats)
+	{
+		ostringstream dump ;
+		dump_stats(dump) ;
+
+		BOOST_CHECK( dump.str().find("cpptempl_renders_total ") != string::npos ) ;
+		BOOST_CHECK( dump.str().find("cpptempl_render_latency_us_bucket{le=\"+Inf\"} ") != string::npos ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppMissingKey )
+
+	using namespace cpptempl ;
+
+	string render_with(MissingKeyPolicy policy, string text, data_map &data)
+	{
+		CompileOptions options ;
+		options.missing_key = policy ;
+		options.on_missing_key = [](const string &key) { return "<" + key + ">" ; } ;
+		return Template(text, options).render(data) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_echo_is_default)
+	{
+		data_map data ;
+		BOOST_CHECK_EQUAL( Template("a{$foo.bar}b").render(data), "a{$foo.bar}b" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_empty)
+	{
+		data_map data ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_EMPTY, "a{$foo}b", data), "ab" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_throw)
+	{
+		data_map data ;
+		BOOST_CHECK_THROW( render_with(MISSING_KEY_THROW, "a{$foo}b", data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_callback)
+	{
+		data_map data ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_CALLBACK, "a{$foo}b", data), "a<foo>b" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_missing_loop_is_empty)
+	{
+		data_map data ;
+		string text = "[{% for item in items %}{$item}{% endfor %}]" ;
+		BOOST_CHECK_EQUAL( Template(text).render(data), "[]" ) ;
+		BOOST_CHECK_THROW( render_with(MISSING_KEY_THROW, text, data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_missing_if_operand)
+	{
+		data_map data ;
+		string text = "{% if foo %}yes{% endif %}" ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_ECHO, text, data), "yes" ) ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_EMPTY, text, data), "" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_callback_in_if)
+	{
+		data_map data ;
+		data["tag"] = make_data("<foo>") ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_CALLBACK, "{% if foo %}yes{% endif %}", data), "yes" ) ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_CALLBACK, "{% if foo == tag %}same{% endif %}", data), "same" ) ;
+		CompileOptions options ;
+		options.missing_key = MISSING_KEY_CALLBACK ;
+		options.on_missing_key = [](const string &) { return string() ; } ;
+		BOOST_CHECK_EQUAL( Template("{% if not foo %}none{% endif %}", options).render(data), "none" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_missing_if_operand_allocation_free)
+	{
+		Template page("{% if foo.bar == baz %}same{% endif %}{% if foo %}echoed{% endif %}") ;
+		data_map data ;
+		EngineStats before = stats() ;
+		BOOST_CHECK_EQUAL( page.render(data), "echoed" ) ;
+		EngineStats after = stats() ;
+		BOOST_CHECK_EQUAL( after.allocations - before.allocations, 0u ) ;
+		BOOST_CHECK_EQUAL( after.missing_keys - before.missing_keys, 3u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_parse_val_echoes_missing_part)
+	{
+		data_map data ;
+		data_map foo ;
+		foo["bar"] = make_data("x") ;
+		data["foo"] = make_data(foo) ;
+		BOOST_CHECK_EQUAL( parse_val("foo.missing", data)->getvalue(), "{$missing}" ) ;
+		BOOST_CHECK_EQUAL( parse_val("foo.missing.deeper", data)->getvalue(), "{$missing.deeper}" ) ;
+		BOOST_CHECK_EQUAL( parse_val("kettle.black", data)->getvalue(), "{$kettle.black}" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_present_key_unaffected)
+	{
+		data_map data ;
+		data["foo"] = make_data("bar") ;
+		BOOST_CHECK_EQUAL( render_with(MISSING_KEY_THROW, "{$foo}", data), "bar" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppFilters )
+
+	using namespace cpptempl ;
+
+	string render_var(string text, string value, string autoescape = "")
+	{
+		CompileOptions options ;
+		options.autoescape = autoescape ;
+		data_map data ;
+		data["foo"] = make_data(value) ;
+		return Template(text, options).render(data) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_html)
+	{
+		BOOST_CHECK_EQUAL( render_var("{$foo|html}", "<a href=\"x\">Tom & Jerry's</a>"), 
+			"&lt;a href=&quot;x&quot;&gt;Tom &amp; Jerry&#39;s&lt;/a&gt;" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_html_long_runs)
+	{
+		string safe(40, 'x') ;
+		BOOST_CHECK_EQUAL( render_var("{$foo|html}", safe + "<" + safe + ">" + safe), 
+			safe + "&lt;" + safe + "&gt;" + safe ) ;
+		BOOST_CHECK_EQUAL( render_var("{$foo|html}", safe), safe ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_url)
+	{
+		BOOST_CHECK_EQUAL( render_var("{$foo|url}", "a b&c=d/\xC3\xA9-_.~Z9"), "a%20b%26c%3Dd%2F%C3%A9-_.~Z9" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_json)
+	{
+		BOOST_CHECK_EQUAL( render_var("{$foo|json}", "say \"hi\"\\\n\x01 and a long tail of text"), 
+			"say \\\"hi\\\"\\\\\\n\\u0001 and a long tail of text" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_autoescape)
+	{
+		BOOST_CHECK_EQUAL( render_var("{$foo}", "<b>", "html"), "&lt;b&gt;" ) ;
+		BOOST_CHECK_EQUAL( render_var("{$foo|raw}", "<b>", "html"), "<b>" ) ;
+		BOOST_CHECK_EQUAL( render_var("{$foo|html}", "<b>", "html"), "&lt;b&gt;" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_missing_key_output_filtered)
+	{
+		CompileOptions options ;
+		options.autoescape = "html" ;
+		options.missing_key = MISSING_KEY_CALLBACK ;
+		options.on_missing_key = [](const string &key) { return "<script>" + key + "</script>" ; } ;
+		data_map data ;
+		BOOST_CHECK_EQUAL( Template("{$x}", options).render(data), "&lt;script&gt;x&lt;/script&gt;" ) ;
+		BOOST_CHECK_EQUAL( Template("{$x|raw}", options).render(data), "<script>x</script>" ) ;
+		options.missing_key = MISSING_KEY_ECHO ;
+		BOOST_CHECK_EQUAL( Template("{$x|json}", options).render(data), "{$x|json}" ) ;
+		BOOST_CHECK_EQUAL( Template("{$a<b>}", options).render(data), "{$a&lt;b&gt;}" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_custom_chain)
+	{
+		register_filter("upper", [](const string &value) { return boost::to_upper_copy(value) ; }) ;
+		BOOST_CHECK_EQUAL( render_var("{$foo | upper | html}", "a<b"), "A&lt;B" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_unknown_filter_fails_compile)
+	{
+		BOOST_CHECK_THROW( Template("{$foo|nope}"), TemplateException ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppInclude )
+
+	using namespace cpptempl ;
+
+	std::shared_ptr<TemplateLoader> make_loader(map<string, string> files, size_t inline_limit = 0)
+	{
+		template_reader reader = [files](const string &name) {
+			map<string, string>::const_iterator it = files.find(name) ;
+			if (it == files.end())
+			{
+				throw TemplateException("no such template: " + name) ;
+			}
+			return it->second ;
+		} ;
+		return std::shared_ptr<TemplateLoader>(new TemplateLoader(reader, CompileOptions(), inline_limit)) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_include)
+	{
+		map<string, string> files ;
+		files["row"] = "<li>{$item}</li>" ;
+		CompileOptions options ;
+		options.loader = make_loader(files) ;
+		Template page("<ul>{% for item in items %}{% include \"row\" %}{% endfor %}</ul>", options) ;
+
+		data_map data ;
+		data_list items ;
+		items.push_back(make_data("a")) ;
+		items.push_back(make_data("b")) ;
+		data["items"] = make_data(items) ;
+		BOOST_CHECK_EQUAL( page.render(data), "<ul><li>a</li><li>b</li></ul>" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_partials_compiled_once)
+	{
+		map<string, string> files ;
+		files["header"] = "<h1>{$title}</h1>" ;
+		CompileOptions options ;
+		options.loader = make_loader(files) ;
+
+		EngineStats before = stats() ;
+		Template first("{% include \"header\" %}1", options) ;
+		Template second("{% include \"header\" %}2", options) ;
+		EngineStats after = stats() ;
+
+		BOOST_CHECK_EQUAL( after.cache_misses - before.cache_misses, 1u ) ;
+		BOOST_CHECK_EQUAL( after.cache_hits - before.cache_hits, 1u ) ;
+		BOOST_CHECK( options.loader->get("header") == options.loader->get("header") ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_small_partials_inlined)
+	{
+		map<string, string> files ;
+		files["name"] = "[{$name}]" ;
+		CompileOptions options ;
+		options.loader = make_loader(files, 4) ;
+		Template page("a{% include \"name\" %}b", options) ;
+
+		BOOST_CHECK_EQUAL( page.get_tree().size(), 5u ) ;
+		data_map data ;
+		data["name"] = make_data("x") ;
+		BOOST_CHECK_EQUAL( page.render(data), "a[x]b" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_include_cycle)
+	{
+		map<string, string> files ;
+		files["a"] = "{% include \"b\" %}" ;
+		files["b"] = "{% if x %}{% include \"a\" %}{% endif %}" ;
+		CompileOptions options ;
+		options.loader = make_loader(files) ;
+
+		BOOST_CHECK_THROW( Template("{% include \"a\" %}", options), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_include_bad_syntax)
+	{
+		BOOST_CHECK_THROW( TokenInclude token("include header"), TemplateException ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppInheritance )
+
+	using namespace cpptempl ;
+
+	CompileOptions loader_options(map<string, string> files)
+	{
+		template_reader reader = [files](const string &name) {
+			return files.find(name)->second ;
+		} ;
+		CompileOptions options ;
+		options.loader.reset(new TemplateLoader(reader)) ;
+		return options ;
+	}
+	map<string, string> layouts()
+	{
+		map<string, string> files ;
+		files["base"] = "<title>{% block title %}Default{% endblock %}</title>"
+			"<body>{% block body %}{% endblock %}</body>" ;
+		files["two_column"] = "{% extends \"base\" %}"
+			"{% block body %}<nav>{% block nav %}menu{% endblock %}</nav>"
+			"<main>{% block main %}{% endblock %}</main>{% endblock %}" ;
+		return files ;
+	}
+	BOOST_AUTO_TEST_CASE(test_extends)
+	{
+		Template page("{% extends \"base\" %}ignored{% block body %}Hi {$name}{% endblock %}", 
+			loader_options(layouts())) ;
+		data_map data ;
+		data["name"] = make_data("Bob") ;
+		BOOST_CHECK_EQUAL( page.render(data), "<title>Default</title><body>Hi Bob</body>" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_extends_multi_level)
+	{
+		Template page("{% extends \"two_column\" %}"
+			"{% block title %}Page{% endblock %}{% block main %}text{% endblock %}", 
+			loader_options(layouts())) ;
+		data_map data ;
+		BOOST_CHECK_EQUAL( page.render(data), 
+			"<title>Page</title><body><nav>menu</nav><main>text</main></body>" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_extends_is_flat)
+	{
+		Template page("{% extends \"base\" %}{% block body %}{% if x %}y{% endif %}{% endblock %}", 
+			loader_options(layouts())) ;
+		token_vector &tree = page.get_tree() ;
+		BOOST_CHECK_EQUAL( tree.size(), 5u ) ;
+		for (size_t i = 0 ; i < tree.size() ; ++i)
+		{
+			BOOST_CHECK( tree[i]->gettype() != TOKEN_TYPE_BLOCK ) ;
+		}
+	}
+	BOOST_AUTO_TEST_CASE(test_extends_cycle)
+	{
+		map<string, string> files ;
+		files["a"] = "{% extends \"b\" %}" ;
+		files["b"] = "{% extends \"a\" %}" ;
+		BOOST_CHECK_THROW( Template("{% extends \"a\" %}", loader_options(files)), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_extends_needs_loader)
+	{
+		BOOST_CHECK_THROW( Template("{% extends \"base\" %}"), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_block_without_extends)
+	{
+		data_map data ;
+		BOOST_CHECK_EQUAL( parse("a{% block b %}c{% endblock %}d", data), "acd" ) ;
+
+		token_vector tokens ;
+		tokenize("a{% block b %}c{% endblock %}d", tokens) ;
+		token_vector tree ;
+		parse_tree(tokens, tree) ;
+		BOOST_CHECK_EQUAL( tree.size(), 3u ) ;
+		BOOST_CHECK_EQUAL( gettext(tree[1], data), "c" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppCompiledFiles )
+
+	using namespace cpptempl ;
+
+	string save(Template &templ)
+	{
+		ostringstream image ;
+		save_template(image, templ) ;
+		return image.str() ;
+	}
+	data_map sample_data()
+	{
+		data_map data ;
+		data_list items ;
+		items.push_back(make_data("<a>")) ;
+		items.push_back(make_data("b")) ;
+		data["items"] = make_data(items) ;
+		data["title"] = make_data("T&C") ;
+		return data ;
+	}
+	BOOST_AUTO_TEST_CASE(test_round_trip)
+	{
+		map<string, string> files ;
+		files["row"] = "<li>{$item|html}</li>" ;
+		template_reader reader = [files](const string &name) { return files.find(name)->second ; } ;
+		CompileOptions options ;
+		options.autoescape = "html" ;
+		options.missing_key = MISSING_KEY_EMPTY ;
+		options.loader.reset(new TemplateLoader(reader)) ;
+		Template original("<h1>{$title}</h1>{$missing}\n{% for item in items %}"
+			"{% include \"row\" %}{% include \"row\" %}{% endfor %}"
+			"{% if title %}{$title|raw}{% endif %}", options) ;
+
+		string image = save(original) ;
+		Template loaded = load_template(image.data(), image.size()) ;
+
+		data_map data = sample_data() ;
+		BOOST_CHECK_EQUAL( loaded.render(data), original.render(data) ) ;
+		BOOST_CHECK_EQUAL( loaded.get_tree()[5]->getline(), 2u ) ;
+		BOOST_CHECK_EQUAL( save(loaded), image ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_file_round_trip)
+	{
+		Template original("{% for item in items %}[{$item}]{% endfor %}") ;
+		const string filename = "cpptempl_test_compiled.bin" ;
+		{
+			ofstream out(filename.c_str(), ios::binary) ;
+			save_template(out, original) ;
+		}
+		Template loaded = load_template_file(filename) ;
+		std::remove(filename.c_str()) ;
+
+		data_map data = sample_data() ;
+		BOOST_CHECK_EQUAL( loaded.render(data), "[<a>][b]" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_loads_parsed_nodes)
+	{
+		Template original("{% for item in items offset:1 step:n reversed %}{$item|html}{% endfor %}"
+			"{% if title != \"x\" %}!{% endif %}{% if not absent %}?{% endif %}") ;
+		string image = save(original) ;
+		Template loaded = load_template(image.data(), image.size()) ;
+
+		TokenFor *loop = static_cast<TokenFor*>(loaded.get_tree()[0].get()) ;
+		BOOST_CHECK_EQUAL( loop->m_offset, "1" ) ;
+		BOOST_CHECK_EQUAL( loop->m_step, "n" ) ;
+		BOOST_CHECK( loop->m_limit.empty() ) ;
+		BOOST_CHECK( loop->m_reversed ) ;
+		TokenVar *var = static_cast<TokenVar*>(loop->m_children[0].get()) ;
+		BOOST_CHECK_EQUAL( var->getkey(), "item" ) ;
+		BOOST_CHECK_EQUAL( var->getexpr(), "item|html" ) ;
+		TokenIf *cond = static_cast<TokenIf*>(loaded.get_tree()[1].get()) ;
+		BOOST_CHECK_EQUAL( cond->m_test, IF_NOT_EQUAL ) ;
+		BOOST_CHECK_EQUAL( cond->m_rhs, "\"x\"" ) ;
+
+		data_map data = sample_data() ;
+		data["n"] = make_data("1") ;
+		BOOST_CHECK_EQUAL( loaded.render(data), original.render(data) ) ;
+		// a missing operand echoes as {$absent}, which is not empty
+		BOOST_CHECK_EQUAL( loaded.render(data), "b!" ) ;
+		BOOST_CHECK_EQUAL( save(loaded), image ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_rejects_bad_images)
+	{
+		Template original("{$title}") ;
+		string image = save(original) ;
+
+		string corrupt = image ;
+		corrupt[corrupt.size() - 1] ^= 1 ;
+		BOOST_CHECK_THROW( load_template(corrupt.data(), corrupt.size()), TemplateException ) ;
+
+		string version = image ;
+		version[4] = char(TEMPLATE_FORMAT_VERSION + 1) ;
+		BOOST_CHECK_THROW( load_template(version.data(), version.size()), TemplateException ) ;
+
+		BOOST_CHECK_THROW( load_template(image.data(), image.size() - 1), TemplateException ) ;
+		BOOST_CHECK_THROW( load_template("{$title}", 8), TemplateException ) ;
+	}
+
+	// a compiled template image around a hand-written payload
+	struct ImageBuilder
+	{
+		string payload ;
+		void u8(unsigned int value)
+		{
+			payload += char(value) ;
+		}
+		void u32(unsigned long long value)
+		{
+			for (int i = 0 ; i < 4 ; ++i)
+			{
+				u8((value >> (8 * i)) & 0xFF) ;
+			}
+		}
+		void str(const string &value)
+		{
+			u32(value.size()) ;
+			payload += value ;
+		}
+		void node(TokenType type)
+		{
+			u8(type) ;
+			u32(1) ;
+			u32(1) ;
+		}
+		string image()
+		{
+			unsigned long long hash = 14695981039346656037ull ;
+			for (size_t i = 0 ; i < payload.size() ; ++i)
+			{
+				hash ^= static_cast<unsigned char>(payload[i]) ;
+				hash *= 1099511628211ull ;
+			}
+			ImageBuilder header ;
+			header.payload = "CPTL" ;
+			header.u32(TEMPLATE_FORMAT_VERSION) ;
+			header.u32(payload.size()) ;
+			header.u32(0) ;
+			header.u32(hash & 0xFFFFFFFFull) ;
+			header.u32(hash >> 32) ;
+			return header.payload + payload ;
+		}
+	};
+	BOOST_AUTO_TEST_CASE(test_rejects_crafted_images)
+	{
+		// a missing-key policy out of range
+		ImageBuilder policy ;
+		policy.u32(0) ;
+		policy.u32(1) ;
+		policy.node(TOKEN_TYPE_VAR) ;
+		policy.str("title") ;
+		policy.str("title") ;
+		policy.u8(MISSING_KEY_CALLBACK + 1) ;
+		policy.u32(0) ;
+		string image = policy.image() ;
+		BOOST_CHECK_THROW( load_template(image.data(), image.size()), TemplateException ) ;
+
+		// an if test out of range
+		ImageBuilder test ;
+		test.u32(0) ;
+		test.u32(1) ;
+		test.node(TOKEN_TYPE_IF) ;
+		test.str("if title") ;
+		test.u8(IF_NOT_EQUAL + 1) ;
+		test.str("title") ;
+		test.str("") ;
+		test.u8(MISSING_KEY_ECHO) ;
+		test.u32(0) ;
+		image = test.image() ;
+		BOOST_CHECK_THROW( load_template(image.data(), image.size()), TemplateException ) ;
+
+		// a partial that includes itself
+		ImageBuilder cycle ;
+		cycle.u32(1) ;
+		cycle.u32(1) ;
+		cycle.node(TOKEN_TYPE_INCLUDE) ;
+		cycle.str("self") ;
+		cycle.u32(1) ;
+		cycle.u32(0) ;
+		image = cycle.image() ;
+		BOOST_CHECK_THROW( load_template(image.data(), image.size()), TemplateException ) ;
+
+		// nesting deep enough to exhaust the stack if followed
+		ImageBuilder deep ;
+		deep.u32(0) ;
+		for (int i = 0 ; i < 100000 ; ++i)
+		{
+			deep.u32(1) ;
+			deep.node(TOKEN_TYPE_IF) ;
+			deep.str("if title") ;
+			deep.u8(IF_NOT_EMPTY) ;
+			deep.str("title") ;
+			deep.str("") ;
+			deep.u8(MISSING_KEY_ECHO) ;
+		}
+		deep.u32(0) ;
+		image = deep.image() ;
+		BOOST_CHECK_THROW( load_template(image.data(), image.size()), TemplateException ) ;
+
+		// more nodes than the payload could hold
+		ImageBuilder count ;
+		count.u32(0) ;
+		count.u32(0xFFFFFFFFull) ;
+		image = count.image() ;
+		BOOST_CHECK_THROW( load_template(image.data(), image.size()), TemplateException ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppDependencies )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_vars_and_conditions)
+	{
+		Template page("{$title|html} {$user.name}{% if user.admin == \"yes\" %}{$\"literal\"}{% endif %}"
+			"{% if not banner %}x{% endif %}") ;
+		TemplateDependencies deps = dependencies(page) ;
+
+		set<string> roots ;
+		roots.insert("title") ;
+		roots.insert("user") ;
+		roots.insert("banner") ;
+		BOOST_CHECK( deps.roots == roots ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("user.name"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("user.admin"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.size(), 4u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_loop_variables)
+	{
+		Template page("{% for p in people %}{$loop.index}{$p.name}"
+			"{% for c in p.children %}{$c.age}{$site}{% endfor %}{% endfor %}") ;
+		TemplateDependencies deps = dependencies(page) ;
+
+		BOOST_CHECK_EQUAL( deps.roots.size(), 2u ) ;
+		BOOST_CHECK_EQUAL( deps.roots.count("people"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.roots.count("site"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("people"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("people[].name"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("people[].children"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("people[].children[].age"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("loop.index"), 0u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_includes)
+	{
+		template_reader reader = [](const string &) { return string("{$row.id}") ; } ;
+		CompileOptions options ;
+		options.loader.reset(new TemplateLoader(reader)) ;
+		Template page("{% for row in rows %}{% include \"row\" %}{% endfor %}", options) ;
+		TemplateDependencies deps = dependencies(page) ;
+
+		BOOST_CHECK_EQUAL( deps.paths.count("rows[].id"), 1u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_leaked_loop_variable)
+	{
+		Template page("{% for p in people %}{% endfor %}{$p.name}{% if ok %}{% for c in p.kids %}{% endfor %}{% endif %}"
+			"{% if c.age %}{$loop.index}{% endif %}") ;
+		TemplateDependencies deps = dependencies(page) ;
+
+		BOOST_CHECK_EQUAL( deps.paths.count("people[].name"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("people[].kids[].age"), 1u ) ;
+		BOOST_CHECK_EQUAL( deps.paths.count("p.name"), 0u ) ;
+		BOOST_CHECK_EQUAL( deps.roots.count("p"), 0u ) ;
+		BOOST_CHECK_EQUAL( deps.roots.count("c"), 0u ) ;
+		BOOST_CHECK_EQUAL( deps.roots.count("loop"), 0u ) ;
+		BOOST_CHECK_EQUAL( deps.roots.size(), 2u ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppLazyData )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_lazy_only_when_read)
+	{
+		int calls = 0 ;
+		data_map data ;
+		data["show"] = make_data("") ;
+		data["price"] = make_lazy([&calls]() { ++calls ; return make_data("9.99") ; }) ;
+
+		BOOST_CHECK_EQUAL( parse("{% if show %}{$price}{% endif %}", data), "" ) ;
+		BOOST_CHECK_EQUAL( calls, 0 ) ;
+		BOOST_CHECK_EQUAL( parse("{$price} {% if price %}{$price}{% endif %}", data), "9.99 9.99" ) ;
+		BOOST_CHECK_EQUAL( calls, 1 ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_lazy_list_and_map)
+	{
+		data_map data ;
+		data["people"] = make_lazy([]() {
+			data_map bob ;
+			bob["name"] = make_data("Bob") ;
+			data_list people ;
+			people.push_back(make_data(bob)) ;
+			return make_data(people) ;
+		}) ;
+		data["user"] = make_lazy([]() {
+			data_map user ;
+			user["name"] = make_data("Ann") ;
+			return make_data(user) ;
+		}) ;
+		BOOST_CHECK_EQUAL( parse("{$user.name}:{% for p in people %}{$p.name}{% endfor %}", data), "Ann:Bob" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_lazy_null_result)
+	{
+		data_map data ;
+		data["bad"] = make_lazy([]() { return data_ptr() ; }) ;
+		BOOST_CHECK_THROW( parse("{$bad}", data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_shared_lazy_runs_once)
+	{
+		std::atomic<int> calls(0) ;
+		data_map data ;
+		data["total"] = make_shared_lazy([&calls]() {
+			++calls ;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10)) ;
+			return make_data("42") ;
+		}) ;
+		Template page("{$total}") ;
+		vector<string> results(8) ;
+		vector<std::thread> workers ;
+		for (size_t i = 0 ; i < results.size() ; ++i)
+		{
+			workers.push_back(std::thread([&, i]() { results[i] = page.render(data) ; })) ;
+		}
+		for (size_t i = 0 ; i < workers.size() ; ++i)
+		{
+			workers[i].join() ;
+		}
+		BOOST_CHECK_EQUAL( calls.load(), 1 ) ;
+		for (size_t i = 0 ; i < results.size() ; ++i)
+		{
+			BOOST_CHECK_EQUAL( results[i], "42" ) ;
+		}
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppFragmentCache )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_replays_by_key)
+	{
+		CompileOptions options ;
+		options.fragment_cache = std::make_shared<FragmentCache>() ;
+		Template page("[{% cache id %}{$id}:{$name}{% endcache %}]", options) ;
+		data_map data ;
+		data["id"] = make_data("1") ;
+		data["name"] = make_data("Alice") ;
+		BOOST_CHECK_EQUAL( page.render(data), "[1:Alice]" ) ;
+		data["name"] = make_data("Bob") ;
+		BOOST_CHECK_EQUAL( page.render(data), "[1:Alice]" ) ;
+		data["id"] = make_data("2") ;
+		BOOST_CHECK_EQUAL( page.render(data), "[2:Bob]" ) ;
+		BOOST_CHECK_EQUAL( options.fragment_cache->count(), 2u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_blocks_do_not_share_keys)
+	{
+		CompileOptions options ;
+		options.fragment_cache = std::make_shared<FragmentCache>() ;
+		Template page("{% cache \"k\" %}a{$x}{% endcache %}{% cache \"k\" %}b{$x}{% endcache %}", options) ;
+		data_map data ;
+		data["x"] = make_data("1") ;
+		BOOST_CHECK_EQUAL( page.render(data), "a1b1" ) ;
+		data["x"] = make_data("2") ;
+		BOOST_CHECK_EQUAL( page.render(data), "a1b1" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_keys_do_not_collide)
+	{
+		CompileOptions options ;
+		options.fragment_cache = std::make_shared<FragmentCache>() ;
+		Template page("{% cache user tab %}{$user}/{$tab}{% endcache %}", options) ;
+		data_map data ;
+		// missing and empty
+		data["user"] = make_data("") ;
+		BOOST_CHECK_EQUAL( page.render(data), "/{$tab}" ) ;
+		data_map missing ;
+		BOOST_CHECK_EQUAL( page.render(missing), "{$user}/{$tab}" ) ;
+		// a separator inside a value
+		data["user"] = make_data("a\x1F" "b") ;
+		data["tab"] = make_data("c") ;
+		BOOST_CHECK_EQUAL( page.render(data), "a\x1F" "b/c" ) ;
+		data["user"] = make_data("a") ;
+		data["tab"] = make_data("b\x1F" "c") ;
+		BOOST_CHECK_EQUAL( page.render(data), "a/b\x1F" "c" ) ;
+		BOOST_CHECK_EQUAL( options.fragment_cache->count(), 4u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_no_cache_renders)
+	{
+		Template page("{% cache id %}{$name}{% endcache %}") ;
+		data_map data ;
+		data["name"] = make_data("Alice") ;
+		BOOST_CHECK_EQUAL( page.render(data), "Alice" ) ;
+		data["name"] = make_data("Bob") ;
+		BOOST_CHECK_EQUAL( page.render(data), "Bob" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_bad_ttl_throws)
+	{
+		BOOST_CHECK_THROW( Template("{% cache ttl=soon %}x{% endcache %}"), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_evicts_least_recent)
+	{
+		FragmentCache cache(20) ;
+		cache.put("a", std::make_shared<const std::string>("123456789")) ;
+		cache.put("b", std::make_shared<const std::string>("123456789")) ;
+		BOOST_CHECK( cache.get("a") ) ;
+		cache.put("c", std::make_shared<const std::string>("123456789")) ;
+		BOOST_CHECK( cache.get("a") ) ;
+		BOOST_CHECK( ! cache.get("b") ) ;
+		BOOST_CHECK( cache.get("c") ) ;
+		BOOST_CHECK_EQUAL( cache.bytes(), 20u ) ;
+		cache.put("d", std::make_shared<const std::string>(std::string(50, 'x'))) ;
+		BOOST_CHECK( ! cache.get("d") ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_counts_hits)
+	{
+		CompileOptions options ;
+		options.fragment_cache = std::make_shared<FragmentCache>() ;
+		Template page("{% cache %}x{% endcache %}", options) ;
+		data_map data ;
+		EngineStats before = stats() ;
+		page.render(data) ;
+		page.render(data) ;
+		page.render(data) ;
+		EngineStats after = stats() ;
+		BOOST_CHECK_EQUAL( after.fragment_misses - before.fragment_misses, 1u ) ;
+		BOOST_CHECK_EQUAL( after.fragment_hits - before.fragment_hits, 2u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_round_trip_and_dependencies)
+	{
+		CompileOptions options ;
+		options.fragment_cache = std::make_shared<FragmentCache>() ;
+		Template page("{% cache user.id %}{$user.name}{% endcache %}", options) ;
+		std::ostringstream image ;
+		save_template(image, page) ;
+		const std::string bytes = image.str() ;
+		Template loaded = load_template(bytes.data(), bytes.size(), options) ;
+		data_map user ;
+		user["id"] = make_data("7") ;
+		user["name"] = make_data("Ann") ;
+		data_map data ;
+		data["user"] = make_data(user) ;
+		BOOST_CHECK_EQUAL( loaded.render(data), "Ann" ) ;
+
+		TemplateDependencies deps = dependencies(page) ;
+		BOOST_CHECK( deps.paths.count("user.id") ) ;
+		BOOST_CHECK( deps.paths.count("user.name") ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppIncremental )
+
+	using namespace cpptempl ;
+
+	std::string apply_patches(std::string text, const vector<SegmentPatch> &patches)
+	{
+		for (size_t i = 0 ; i < patches.size() ; ++i)
+		{
+			text.replace(patches[i].offset, patches[i].old_length, patches[i].text) ;
+		}
+		return text ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_initial_document)
+	{
+		Template page("a={$a} b={$b}") ;
+		data_map data ;
+		data["a"] = make_data("1") ;
+		data["b"] = make_data("2") ;
+		IncrementalRender incremental(page, data) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "a=1 b=2" ) ;
+		BOOST_CHECK_EQUAL( incremental.segments(), 4u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_patches_changed_segments)
+	{
+		Template page("a={$a} b={$b} c={$a}") ;
+		data_map data ;
+		data["a"] = make_data("1") ;
+		data["b"] = make_data("2") ;
+		IncrementalRender incremental(page, data) ;
+		const std::string before = incremental.document() ;
+		data["a"] = make_data("100") ;
+		data["b"] = make_data("200") ;
+		vector<SegmentPatch> patches = incremental.update(data, vector<std::string>(1, "a")) ;
+		BOOST_CHECK_EQUAL( patches.size(), 2u ) ;
+		BOOST_CHECK_EQUAL( patches[0].offset, 2u ) ;
+		BOOST_CHECK_EQUAL( patches[0].old_length, 1u ) ;
+		BOOST_CHECK_EQUAL( patches[0].text, "100" ) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "a=100 b=2 c=100" ) ;
+		BOOST_CHECK_EQUAL( apply_patches(before, patches), incremental.document() ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_unchanged_output_no_patch)
+	{
+		Template page("{$a}") ;
+		data_map data ;
+		data["a"] = make_data("1") ;
+		IncrementalRender incremental(page, data) ;
+		BOOST_CHECK( incremental.update(data, vector<std::string>(1, "a")).empty() ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_leaked_loop_variable)
+	{
+		Template page("{% for p in people %}{% endfor %}|{$p}|{$loop.index}") ;
+		data_map data ;
+		data_list people ;
+		people.push_back(make_data("a")) ;
+		people.push_back(make_data("b")) ;
+		data["people"] = make_data(people) ;
+		IncrementalRender incremental(page, data) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "|b|2" ) ;
+		data_list changed ;
+		changed.push_back(make_data("c")) ;
+		data["people"] = make_data(changed) ;
+		incremental.update(data, vector<std::string>(1, "people")) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "|c|1" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_parent_and_child_paths)
+	{
+		Template page("{$user.name}|{% for p in people %}{$p.name}{% endfor %}") ;
+		data_map user ;
+		user["name"] = make_data("Ann") ;
+		data_map person ;
+		person["name"] = make_data("Bo") ;
+		data_list people ;
+		people.push_back(make_data(person)) ;
+		data_map data ;
+		data["user"] = make_data(user) ;
+		data["people"] = make_data(people) ;
+		IncrementalRender incremental(page, data) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "Ann|Bo" ) ;
+
+		data["user"]->getmap()["name"] = make_data("Cy") ;
+		incremental.update(data, vector<std::string>(1, "user")) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "Cy|Bo" ) ;
+
+		people.push_back(make_data(person)) ;
+		data["people"] = make_data(people) ;
+		incremental.update(data, vector<std::string>(1, "people")) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "Cy|BoBo" ) ;
+
+		data["user"] = make_data("ignored") ;
+		incremental.update(data, vector<std::string>(1, "other")) ;
+		BOOST_CHECK_EQUAL( incremental.document(), "Cy|BoBo" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+struct BoundAddress
+{
+	std::string city ;
+};
+struct BoundPerson
+{
+	std::string name ;
+	int age ;
+	bool admin ;
+	BoundAddress address ;
+};
+struct BoundCounted
+{
+	static int visits ;
+	std::string a ;
+	std::string b ;
+};
+int BoundCounted::visits = 0 ;
+namespace cpptempl
+{
+	template<> struct fields<BoundCounted>
+	{
+		template <typename Visitor> static void visit(Visitor &visit)
+		{
+			++BoundCounted::visits ;
+			visit("a", &BoundCounted::a) ;
+			visit("b", &BoundCounted::b) ;
+		}
+	};
+	template<> struct fields<BoundAddress>
+	{
+		template <typename Visitor> static void visit(Visitor &visit)
+		{
+			visit("city", &BoundAddress::city) ;
+		}
+	};
+	template<> struct fields<BoundPerson>
+	{
+		template <typename Visitor> static void visit(Visitor &visit)
+		{
+			visit("name", &BoundPerson::name) ;
+			visit("age", &BoundPerson::age) ;
+			visit("admin", &BoundPerson::admin) ;
+			visit("address", &BoundPerson::address) ;
+		}
+	};
+}
+
+BOOST_AUTO_TEST_SUITE( TestCppBinding )
+
+	using namespace cpptempl ;
+
+	BoundPerson make_person(std::string name, int age, bool admin, std::string city)
+	{
+		BoundPerson person ;
+		person.name = name ;
+		person.age = age ;
+		person.admin = admin ;
+		person.address.city = city ;
+		return person ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_struct_fields)
+	{
+		BoundPerson person = make_person("Ann", 31, true, "Oslo") ;
+		data_map data ;
+		data["person"] = bind_data(person) ;
+		BOOST_CHECK_EQUAL( parse("{$person.name} {$person.age} {$person.address.city}", data), "Ann 31 Oslo" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_reads_in_place)
+	{
+		BoundPerson person = make_person("Ann", 31, true, "Oslo") ;
+		data_map data ;
+		data["person"] = bind_data(person) ;
+		Template page("{$person.name}") ;
+		BOOST_CHECK_EQUAL( page.render(data), "Ann" ) ;
+		person.name = "Bo" ;
+		BOOST_CHECK_EQUAL( page.render(data), "Bo" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_vector_of_structs)
+	{
+		vector<BoundPerson> people ;
+		people.push_back(make_person("Ann", 31, true, "Oslo")) ;
+		people.push_back(make_person("Bo", 42, false, "Rome")) ;
+		data_map data ;
+		data["people"] = bind_data(people) ;
+		std::string text = "{% for p in people %}{$loop.index}:{$p.name}{% if p.admin %}*{% endif %} {% endfor %}" ;
+		BOOST_CHECK_EQUAL( parse(text, data), "1:Ann* 2:Bo " ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_list_and_map)
+	{
+		std::list<int> numbers ;
+		numbers.push_back(1) ;
+		numbers.push_back(2) ;
+		numbers.push_back(3) ;
+		std::map<std::string, std::string> labels ;
+		labels["title"] = "Totals" ;
+		data_map data ;
+		data["numbers"] = bind_data(numbers) ;
+		data["labels"] = bind_data(labels) ;
+		BOOST_CHECK_EQUAL( parse("{$labels.title}:{% for n in numbers %}{$n}{% endfor %}", data), "Totals:123" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_list_in_any_order)
+	{
+		std::list<int> numbers ;
+		for (int i = 0 ; i < 10 ; ++i)
+		{
+			numbers.push_back(i) ;
+		}
+		data_map data ;
+		data["numbers"] = bind_data(numbers) ;
+		Template page("{% for n in numbers reversed %}{$n}{% endfor %}|"
+			"{% for n in numbers offset:1 step:3 reversed %}{$n}{% endfor %}|"
+			"{% for n in numbers limit:2 %}{$n}{% endfor %}") ;
+		BOOST_CHECK_EQUAL( page.render(data), "9876543210|741|01" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_members_bound_once)
+	{
+		BoundPerson person = make_person("Ann", 31, true, "Oslo") ;
+		data_map data ;
+		data["person"] = bind_data(person) ;
+		Template page("{$person.name}{$person.address.city}{% if person.name == person.name %}={% endif %}") ;
+		BOOST_CHECK_EQUAL( page.render(data), "AnnOslo=" ) ;
+		EngineStats before = stats() ;
+		BOOST_CHECK_EQUAL( page.render(data), "AnnOslo=" ) ;
+		EngineStats after = stats() ;
+		BOOST_CHECK_EQUAL( after.allocations - before.allocations, 0u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_missing_field)
+	{
+		BoundPerson person = make_person("Ann", 31, true, "Oslo") ;
+		data_map data ;
+		data["person"] = bind_data(person) ;
+		BOOST_CHECK_EQUAL( parse("{$person.email}", data), "{$person.email}" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_fields_described_once)
+	{
+		BoundCounted first ;
+		first.a = "1" ;
+		first.b = "2" ;
+		BoundCounted second = first ;
+		data_map data ;
+		data["first"] = bind_data(first) ;
+		data["second"] = bind_data(second) ;
+		BOOST_CHECK_EQUAL( parse("{$first.a}{$first.b}{$second.b}{$second.c}", data), "122{$second.c}" ) ;
+		BOOST_CHECK_EQUAL( parse("{$first.b}", data), "2" ) ;
+		BOOST_CHECK_EQUAL( BoundCounted::visits, 1 ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_mixed_with_data_map)
+	{
+		BoundPerson person = make_person("Ann", 31, true, "Oslo") ;
+		data_map wrapper ;
+		wrapper["person"] = bind_data(person) ;
+		data_map data ;
+		data["page"] = make_data(wrapper) ;
+		BOOST_CHECK_EQUAL( parse("{$page.person.address.city}", data), "Oslo" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppJson )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_load_object)
+	{
+		data_map data ;
+		load_json("{\"title\": \"Hi\", \"count\": 3, \"user\": {\"name\": \"Ann\"}}", data) ;
+		BOOST_CHECK_EQUAL( parse("{$title} {$count} {$user.name}", data), "Hi 3 Ann" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_loop_over_array)
+	{
+		data_map data ;
+		load_json("{\"people\": [{\"name\": \"Ann\"}, {\"name\": \"Bo\"}], \"nums\": [1, -2.5, 3e2]}", data) ;
+		BOOST_CHECK_EQUAL( parse("{% for p in people %}{$p.name},{% endfor %}", data), "Ann,Bo," ) ;
+		BOOST_CHECK_EQUAL( parse("{% for n in nums %}[{$n}]{% endfor %}", data), "[1][-2.5][3e2]" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_literals_and_truth)
+	{
+		data_map data ;
+		load_json("{\"yes\": true, \"no\": false, \"none\": null, \"empty\": [], \"blank\": \"\"}", data) ;
+		BOOST_CHECK_EQUAL( parse("{$yes}{$no}[{$none}]", data), "truefalse[]" ) ;
+		BOOST_CHECK_EQUAL( parse("{% if yes %}y{% endif %}{% if no %}n{% endif %}{% if none %}0{% endif %}{% if empty %}e{% endif %}{% if blank %}b{% endif %}", data), "y" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_escapes)
+	{
+		data_ptr value = parse_json("\"a\\\"b\\\\c\\nd\\u00e9\\ud83d\\ude00 and a long tail to scan\"") ;
+		BOOST_CHECK_EQUAL( value->getvalue(), "a\"b\\c\nd\xC3\xA9\xF0\x9F\x98\x80 and a long tail to scan" ) ;
+		data_map data ;
+		load_json("{\"k\\u0065y\": \"v\"}", data) ;
+		BOOST_CHECK_EQUAL( parse("{$key}", data), "v" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_duplicate_keys_last_wins)
+	{
+		data_ptr value = parse_json("{\"a\": 1, \"a\": 2}") ;
+		data_ptr a ;
+		BOOST_CHECK( value->getmember("a", a) ) ;
+		BOOST_CHECK_EQUAL( a->getvalue(), "2" ) ;
+		BOOST_CHECK( ! value->getmember("b", a) ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_outlives_document)
+	{
+		data_ptr name ;
+		{
+			data_map data ;
+			load_json("{\"user\": {\"name\": \"Ann\"}}", data) ;
+			BOOST_CHECK( data["user"]->getmember("name", name) ) ;
+		}
+		BOOST_CHECK_EQUAL( name->getvalue(), "Ann" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_malformed)
+	{
+		data_map data ;
+		BOOST_CHECK_THROW( load_json("[1, 2]", data), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json("{\"a\": }"), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json("[1, 2"), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json("\"open"), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json("\"bad \\x escape\""), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json("01"), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json("tru"), TemplateException ) ;
+		BOOST_CHECK_THROW( parse_json(std::string(1000, '[') + std::string(1000, ']')), TemplateException ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppRegistry )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_set_get_remove)
+	{
+		TemplateRegistry registry ;
+		BOOST_CHECK( ! registry.get("page") ) ;
+		registry.set("page", "Hello {$name}") ;
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		BOOST_CHECK_EQUAL( registry.get("page")->render(data), "Hello Ann" ) ;
+		registry.set("page", "Bye {$name}") ;
+		BOOST_CHECK_EQUAL( registry.get("page")->render(data), "Bye Ann" ) ;
+		BOOST_CHECK_EQUAL( registry.size(), 1u ) ;
+		BOOST_CHECK( registry.remove("page") ) ;
+		BOOST_CHECK( ! registry.remove("page") ) ;
+		BOOST_CHECK( ! registry.get("page") ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_held_template_survives_replace)
+	{
+		TemplateRegistry registry ;
+		registry.set("page", "old") ;
+		std::shared_ptr<Template> held = registry.get("page") ;
+		registry.set("page", "new") ;
+		data_map data ;
+		BOOST_CHECK_EQUAL( held->render(data), "old" ) ;
+		BOOST_CHECK_EQUAL( registry.get("page")->render(data), "new" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_reader_frees_replaced_on_next_read)
+	{
+		TemplateRegistry registry ;
+		registry.set("page", "old") ;
+		std::weak_ptr<Template> old ;
+		std::atomic<int> stage(0) ;
+		// this thread reads the old table, idles, then reads again
+		std::thread reader([&]() {
+			old = registry.get("page") ;
+			stage = 1 ;
+			while (stage.load() != 2)
+			{
+				std::this_thread::yield() ;
+			}
+			registry.get("page") ;
+			stage = 3 ;
+		}) ;
+		while (stage.load() != 1)
+		{
+			std::this_thread::yield() ;
+		}
+		registry.set("page", "new") ;
+		registry.get("page") ;
+		// the idle reader still holds the table it read
+		BOOST_CHECK( ! old.expired() ) ;
+		stage = 2 ;
+		while (stage.load() != 3)
+		{
+			std::this_thread::yield() ;
+		}
+		BOOST_CHECK( old.expired() ) ;
+		reader.join() ;
+	}
+	BOOST_AUTO_TEST_CASE(test_get_returns_held_reference)
+	{
+		TemplateRegistry registry ;
+		registry.set("page", "one") ;
+		const std::shared_ptr<Template> &page = registry.get("page") ;
+		// only the table holds the template; get() made no copy
+		BOOST_CHECK_EQUAL( page.use_count(), 1 ) ;
+		BOOST_CHECK( &registry.get("page") == &page ) ;
+		BOOST_CHECK( ! registry.get("absent") ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_registries_are_separate)
+	{
+		TemplateRegistry first ;
+		TemplateRegistry second ;
+		first.set("page", "1") ;
+		second.set("page", "2") ;
+		data_map data ;
+		BOOST_CHECK_EQUAL( first.get("page")->render(data), "1" ) ;
+		BOOST_CHECK_EQUAL( second.get("page")->render(data), "2" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_concurrent_reload)
+	{
+		TemplateRegistry registry ;
+		registry.set("page", "v0:{$name}") ;
+		std::atomic<bool> done(false) ;
+		std::atomic<int> bad(0) ;
+		std::atomic<long> renders(0) ;
+		vector<std::thread> readers ;
+		for (int t = 0 ; t < 16 ; ++t)
+		{
+			readers.push_back(std::thread([&]() {
+				data_map data ;
+				data["name"] = make_data("Ann") ;
+				int last = 0 ;
+				while (! done.load())
+				{
+					std::shared_ptr<Template> page = registry.get("page") ;
+					if (! page)
+					{
+						++bad ;
+						continue ;
+					}
+					const std::string text = page->render(data) ;
+					const size_t colon = text.find(':') ;
+					const int version = atoi(text.c_str() + 1) ;
+					// versions seen by one thread never go backwards
+					if (text[0] != 'v' || colon == std::string::npos || text.substr(colon) != ":Ann" || version < last)
+					{
+						++bad ;
+					}
+					last = version ;
+					++renders ;
+				}
+			})) ;
+		}
+		std::thread writer([&]() {
+			for (int v = 1 ; v <= 200 ; ++v)
+			{
+				registry.set("page", "v" + boost::lexical_cast<std::string>(v) + ":{$name}") ;
+				registry.set("other" + boost::lexical_cast<std::string>(v % 5), "x") ;
+				std::this_thread::yield() ;
+			}
+		}) ;
+		writer.join() ;
+		done = true ;
+		for (size_t i = 0 ; i < readers.size() ; ++i)
+		{
+			readers[i].join() ;
+		}
+		BOOST_CHECK_EQUAL( bad.load(), 0 ) ;
+		BOOST_CHECK( renders.load() > 0 ) ;
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		BOOST_CHECK_EQUAL( registry.get("page")->render(data), "v200:Ann" ) ;
+		BOOST_CHECK_EQUAL( registry.size(), 6u ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppOutputBuffer )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_estimate_starts_at_static_text)
+	{
+		Template page("<p>{$name}</p>{% for x in xs %}<i>{$x}</i>{% endfor %}") ;
+		BOOST_CHECK_EQUAL( page.size_estimate(), 14u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_estimate_follows_renders)
+	{
+		Template page("{$body}") ;
+		data_map data ;
+		data["body"] = make_data(std::string(1000, 'x')) ;
+		page.render(data) ;
+		BOOST_CHECK_EQUAL( page.size_estimate(), 1000u ) ;
+		data["body"] = make_data(std::string(200, 'x')) ;
+		page.render(data) ;
+		BOOST_CHECK_EQUAL( page.size_estimate(), 900u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_render_appends_to_string)
+	{
+		Template page("Hello {$name}!") ;
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		std::string out = "> " ;
+		page.render(out, data) ;
+		BOOST_CHECK_EQUAL( out, "> Hello Ann!" ) ;
+		BOOST_CHECK_EQUAL( page.render(data), "Hello Ann!" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_reserves_estimate)
+	{
+		Template page("{$body}") ;
+		data_map data ;
+		data["body"] = make_data(std::string(5000, 'x')) ;
+		page.render(data) ;
+		std::string out ;
+		page.render(out, data) ;
+		BOOST_CHECK_EQUAL( out.size(), 5000u ) ;
+		BOOST_CHECK( out.capacity() >= 5000u + 5000u / 16 ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_reused_buffers_start_empty)
+	{
+		data_map data ;
+		data["body"] = make_data(std::string(100000, 'x')) ;
+		BOOST_CHECK_EQUAL( parse("{$body}", data).size(), 100000u ) ;
+		data["body"] = make_data(std::string(1000, 'y')) ;
+		BOOST_CHECK_EQUAL( parse("{$body}", data), std::string(1000, 'y') ) ;
+		data["body"] = make_data("z") ;
+		for (int i = 0 ; i < 10 ; ++i)
+		{
+			BOOST_CHECK_EQUAL( parse("[{$body}]", data), "[z]" ) ;
+		}
+	}
+	class ParseFilter : public Filter
+	{
+	public:
+		void apply(const std::string &value, std::ostream &stream, RenderContext &context)
+		{
+			data_map data ;
+			data["value"] = make_data(value) ;
+			context.write(stream, parse("<{$value}>", data)) ;
+		}
+	};
+	BOOST_AUTO_TEST_CASE(test_nested_buffers)
+	{
+		register_filter("wrap", filter_ptr(new ParseFilter)) ;
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		BOOST_CHECK_EQUAL( parse("{$name|wrap|wrap|html}!", data), "&lt;&lt;Ann&gt;&gt;!" ) ;
+		BOOST_CHECK_EQUAL( parse("{$name|wrap|wrap}", data), "<<Ann>>" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppGatherOutput )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_static_text_referenced)
+	{
+		const std::string header(100, 'h') ;
+		const std::string footer(80, 'f') ;
+		Template page(header + "{$name}" + footer) ;
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		GatherOutput out ;
+		page.render(out, data) ;
+		BOOST_CHECK_EQUAL( out.str(), header + "Ann" + footer ) ;
+		BOOST_CHECK_EQUAL( out.bytes(), 183u ) ;
+		BOOST_REQUIRE_EQUAL( out.segments().size(), 3u ) ;
+		const char *text = static_cast<const char*>(out.segments()[0].base) ;
+		BOOST_CHECK( text != out.buffer().data() ) ;
+		BOOST_CHECK_EQUAL( std::string(text, out.segments()[0].size), header ) ;
+		BOOST_CHECK_EQUAL( out.buffer(), "Ann" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_short_text_copied)
+	{
+		Template page("<b>{$name}</b>") ;
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		GatherOutput out ;
+		page.render(out, data) ;
+		BOOST_CHECK_EQUAL( out.segments().size(), 1u ) ;
+		BOOST_CHECK_EQUAL( out.str(), "<b>Ann</b>" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_matches_string_render)
+	{
+		CompileOptions options ;
+		options.fragment_cache = std::make_shared<FragmentCache>() ;
+		Template page("{% for x in xs %}{$x}:" + std::string(70, '-') + "{% endfor %}"
+			"{% cache %}" + std::string(70, '=') + "{$name}{% endcache %}", options) ;
+		data_list xs ;
+		xs.push_back(make_data("1")) ;
+		xs.push_back(make_data("2")) ;
+		data_map data ;
+		data["xs"] = make_data(xs) ;
+		data["name"] = make_data("Ann") ;
+		GatherOutput out(1) ;
+		page.render(out, data) ;
+		BOOST_CHECK_EQUAL( out.str(), page.render(data) ) ;
+		page.render(out, data) ;
+		BOOST_CHECK_EQUAL( out.str(), page.render(data) ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppFileSink )
+
+	using namespace cpptempl ;
+
+	std::string read_file(const std::string &filename)
+	{
+		std::ifstream in(filename.c_str(), std::ios::binary) ;
+		std::ostringstream text ;
+		text << in.rdbuf() ;
+		return text.str() ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_writes_across_buffers)
+	{
+		const std::string filename = "cpptempl_test_sink.txt" ;
+		Template page("{% for x in xs %}row {$x}\n{% endfor %}") ;
+		data_list xs ;
+		for (int i = 0 ; i < 5000 ; ++i)
+		{
+			xs.push_back(make_data(boost::lexical_cast<std::string>(i))) ;
+		}
+		data_map data ;
+		data["xs"] = make_data(xs) ;
+		const std::string expected = page.render(data) ;
+		{
+			FileSink sink(filename, 4096) ;
+			std::ostream out(&sink) ;
+			page.render(out, data) ;
+			BOOST_CHECK( out.good() ) ;
+			sink.close() ;
+			BOOST_CHECK_EQUAL( sink.bytes_written(), expected.size() ) ;
+		}
+		BOOST_CHECK_EQUAL( read_file(filename), expected ) ;
+		std::remove(filename.c_str()) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_direct_falls_back)
+	{
+		const std::string filename = "cpptempl_test_sink_direct.txt" ;
+		const std::string text = std::string(10000, 'x') + "tail" ;
+		{
+			FileSink sink(filename, 4096, true) ;
+			std::ostream out(&sink) ;
+			out << text ;
+			out.flush() ;
+			out << text ;
+		}
+		BOOST_CHECK_EQUAL( read_file(filename), text + text ) ;
+		std::remove(filename.c_str()) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_bad_path_throws)
+	{
+		BOOST_CHECK_THROW( FileSink("no/such/directory/out.txt"), TemplateException ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppLoopOptions )
+
+	using namespace cpptempl ;
+
+	data_map numbers(int count)
+	{
+		data_list items ;
+		for (int i = 0 ; i < count ; ++i)
+		{
+			items.push_back(make_data(boost::lexical_cast<std::string>(i))) ;
+		}
+		data_map data ;
+		data["xs"] = make_data(items) ;
+		return data ;
+	}
+	std::string render_loop(const std::string &options, data_map data)
+	{
+		return parse("{% for x in xs " + options + " %}{$x}{% endfor %}", data) ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_limit_offset)
+	{
+		data_map data = numbers(10) ;
+		BOOST_CHECK_EQUAL( render_loop("limit:3", data), "012" ) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:7", data), "789" ) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:2 limit:3", data), "234" ) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:8 limit:5", data), "89" ) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:20", data), "" ) ;
+		BOOST_CHECK_EQUAL( render_loop("limit:0", data), "" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_reversed_and_step)
+	{
+		data_map data = numbers(10) ;
+		BOOST_CHECK_EQUAL( render_loop("reversed", data), "9876543210" ) ;
+		BOOST_CHECK_EQUAL( render_loop("step:3", data), "0369" ) ;
+		BOOST_CHECK_EQUAL( render_loop("step:3 reversed", data), "9630" ) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:1 limit:5 step:2 reversed", data), "531" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_step_past_end)
+	{
+		data_map data = numbers(10) ;
+		data["big"] = make_data(format_number(std::numeric_limits<size_t>::max())) ;
+		BOOST_CHECK_EQUAL( render_loop("step:big", data), "0" ) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:9 step:big", data), "9" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_loop_index_counts_visited)
+	{
+		data_map data = numbers(10) ;
+		BOOST_CHECK_EQUAL( parse("{% for x in xs offset:5 limit:2 %}{$loop.index}={$x} {% endfor %}", data), "1=5 2=6 " ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_options_from_data)
+	{
+		data_map data = numbers(10) ;
+		data["page"] = make_data("4") ;
+		data["size"] = make_data("2") ;
+		BOOST_CHECK_EQUAL( render_loop("offset:page limit:size", data), "45" ) ;
+		BOOST_CHECK_EQUAL( render_loop("limit:missing", data), "0123456789" ) ;
+		data["size"] = make_data("lots") ;
+		BOOST_CHECK_THROW( render_loop("limit:size", data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_signed_options_from_data)
+	{
+		data_map data = numbers(10) ;
+		const char *values[] = { "-1", "-2", "+3", " 3", "" } ;
+		for (size_t i = 0 ; i < sizeof(values) / sizeof(values[0]) ; ++i)
+		{
+			data["n"] = make_data(values[i]) ;
+			BOOST_CHECK_THROW( render_loop("limit:n", data), TemplateException ) ;
+			BOOST_CHECK_THROW( render_loop("offset:n", data), TemplateException ) ;
+			BOOST_CHECK_THROW( render_loop("step:n", data), TemplateException ) ;
+		}
+	}
+	BOOST_AUTO_TEST_CASE(test_visits_only_selected)
+	{
+		int reads = 0 ;
+		data_list items ;
+		for (int i = 0 ; i < 100 ; ++i)
+		{
+			items.push_back(make_lazy([&reads, i]() {
+				++reads ;
+				return make_data(boost::lexical_cast<std::string>(i)) ;
+			})) ;
+		}
+		data_map data ;
+		data["xs"] = make_data(items) ;
+		BOOST_CHECK_EQUAL( render_loop("offset:50 limit:3 reversed", data), "525150" ) ;
+		BOOST_CHECK_EQUAL( reads, 3 ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_bad_options)
+	{
+		BOOST_CHECK_THROW( Template("{% for x in xs top:3 %}{% endfor %}"), TemplateException ) ;
+		BOOST_CHECK_THROW( Template("{% for x in xs limit: %}{% endfor %}"), TemplateException ) ;
+		BOOST_CHECK_THROW( Template("{% for x in xs step:0 %}{% endfor %}"), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_round_trip_and_dependencies)
+	{
+		Template page("{% for x in xs limit:n reversed %}{$x}{% endfor %}") ;
+		std::ostringstream image ;
+		save_template(image, page) ;
+		const std::string bytes = image.str() ;
+		Template loaded = load_template(bytes.data(), bytes.size()) ;
+		data_map data = numbers(5) ;
+		data["n"] = make_data("2") ;
+		BOOST_CHECK_EQUAL( loaded.render(data), "10" ) ;
+		BOOST_CHECK( dependencies(page).roots.count("n") ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppNumbers )
+
+	using namespace cpptempl ;
+
+	BOOST_AUTO_TEST_CASE(test_integers)
+	{
+		BOOST_CHECK_EQUAL( format_number(0), "0" ) ;
+		BOOST_CHECK_EQUAL( format_number(-42), "-42" ) ;
+		BOOST_CHECK_EQUAL( format_number(std::numeric_limits<long long>::min()), "-9223372036854775808" ) ;
+		BOOST_CHECK_EQUAL( format_number(std::numeric_limits<unsigned long long>::max()), "18446744073709551615" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_shortest_doubles)
+	{
+		BOOST_CHECK_EQUAL( format_number(0.1), "0.1" ) ;
+		BOOST_CHECK_EQUAL( format_number(1.5), "1.5" ) ;
+		BOOST_CHECK_EQUAL( format_number(100.0), "100" ) ;
+		BOOST_CHECK_EQUAL( format_number(0.1f), "0.1" ) ;
+		const double third = 1.0 / 3.0 ;
+		BOOST_CHECK_EQUAL( std::strtod(format_number(third).c_str(), NULL), third ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_fixed)
+	{
+		BOOST_CHECK_EQUAL( format_fixed(3.14159, 2), "3.14" ) ;
+		BOOST_CHECK_EQUAL( format_fixed(2.5, 0), "2" ) ;
+		BOOST_CHECK_EQUAL( format_fixed(-1.0, 3), "-1.000" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_data_assignment)
+	{
+		data_map data ;
+		data["count"] = 42 ;
+		data["ratio"] = 0.25 ;
+		data["flag"] = true ;
+		data["letter"] = 'a' ;
+		BOOST_CHECK_EQUAL( parse("{$count} {$ratio} {$flag} {$letter}", data), "42 0.25 1 a" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_number_filters)
+	{
+		data_map data ;
+		data["price"] = make_data("12.5") ;
+		data["big"] = make_data("-1234567.891") ;
+		data["small"] = make_data("999") ;
+		data["name"] = make_data("Ann") ;
+		BOOST_CHECK_EQUAL( parse("{$price|fixed:2} {$price|fixed} {$price|fixed:0}", data), "12.50 12.50 12" ) ;
+		BOOST_CHECK_EQUAL( parse("{$big|thousands} {$small|thousands} {$big|fixed:1|thousands:_}", data), 
+			"-1,234,567.891 999 -1_234_567.9" ) ;
+		BOOST_CHECK_EQUAL( parse("{$name|fixed:2}{$name|thousands}", data), "AnnAnn" ) ;
+		BOOST_CHECK_THROW( Template("{$price|fixed:x}"), TemplateException ) ;
+		BOOST_CHECK_THROW( Template("{$price|nosuch:1}"), TemplateException ) ;
+	}
+	class RepeatFilter : public Filter
+	{
+		int m_times ;
+	public:
+		RepeatFilter(int times) : m_times(times){}
+		void apply(const std::string &value, std::ostream &stream, RenderContext &context)
+		{
+			for (int i = 0 ; i < m_times ; ++i)
+			{
+				context.write(stream, value) ;
+			}
+		}
+	};
+
+	BOOST_AUTO_TEST_CASE(test_filter_factory)
+	{
+		register_filter_factory("repeat", [](const std::string &argument) {
+			return filter_ptr(new RepeatFilter(atoi(argument.c_str()))) ;
+		}) ;
+		data_map data ;
+		data["x"] = make_data("ab") ;
+		BOOST_CHECK_EQUAL( parse("{$x|repeat:3}", data), "ababab" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+// generated into cpptempl_test_generated.cpp by cpptempl_codegen from the
+// templates in TestCppCodegen, including those of TestCppParse as
+// render_legacy_*; regenerate it when they change
+void render_codegen_text(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_missing(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_loop(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_loop_options(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_conditions(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_filters(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_nested(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_include(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_empty(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_no_vars(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_var(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_var_surrounded(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_for(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_if(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_nested_for(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_nested_if(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_usage_example(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_syntax_if(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_syntax_dotted(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_okinawa(std::ostream &stream, cpptempl::data_map &data) ;
+void render_legacy_ul(std::ostream &stream, cpptempl::data_map &data) ;
+void render_codegen_loop(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context) ;
+
+BOOST_AUTO_TEST_SUITE( TestCppCodegen )
+
+	using namespace cpptempl ;
+
+	struct GeneratedTemplate
+	{
+		void (*render)(std::ostream &stream, data_map &data) ;
+		const char *text ;
+	};
+
+	const GeneratedTemplate generated_templates[] = 
+	{
+		{ render_codegen_text, "Hello {$name}!\n\tWelcome \"back\", \\\\ ok\?\? \303\234ber\n" },
+		{ render_codegen_missing, "{$foo} {$missing} {$user.missing}" },
+		{ render_codegen_loop, "{% for p in people %}{$loop.index}:{$p.name}{% if p.admin == \"yes\" %}*{% endif %} {% endfor %}" },
+		{ render_codegen_loop_options, "{% for x in xs offset:2 limit:3 %}{$loop.index0}={$x} {% endfor %}|{% for x in xs limit:n reversed %}{$x}{% endfor %}|{% for x in xs step:3 %}{$x}{% endfor %}|{% for x in nothing %}{$x}{% endfor %}" },
+		{ render_codegen_conditions, "{$title|html} {$user.name}{% if user.admin == \"yes\" %}{$\"literal\"}{% endif %}{% if not missing %}!{% endif %}{% if title != user.name %} ne{% endif %}{% if missing %}m{% endif %}" },
+		{ render_codegen_filters, "{$price|fixed:2} {$big|thousands} {$big|fixed:1|thousands:_} {$title|url} {$absent|url}" },
+		{ render_codegen_nested, "<table>\n{% for row in rows %}<tr>{% for cell in row %}<td>{$loop.index}.{$cell}</td>{% endfor %}</tr>\n{% endfor %}</table>" },
+		// TestCppParse
+		{ render_legacy_empty, "" },
+		{ render_legacy_no_vars, "foo" },
+		{ render_legacy_var, "{$foo}" },
+		{ render_legacy_var_surrounded, "aaa{$foo}bbb" },
+		{ render_legacy_for, "{% for item in items %}{$item}{% endfor %}" },
+		{ render_legacy_if, "{% if item %}{$item}{% endif %}" },
+		{ render_legacy_nested_for, "{% for item in items %}{% for thing in things %}{$item}{$thing}{% endfor %}{% endfor %}" },
+		{ render_legacy_nested_if, "{% if item %}{% if thing %}{$item}{$thing}{% endif %}{% endif %}" },
+		{ render_legacy_usage_example, "{% if item %}{$item}{% endif %}\n{% if thing %}{$thing}{% endif %}" },
+		{ render_legacy_syntax_if, "{% if person.name == \"Bob\" %}Full name: Robert{% endif %}" },
+		{ render_legacy_syntax_dotted, "{% for friend in person.friends %}{$loop.index}. {$friend.name} {% endfor %}" },
+		{ render_legacy_okinawa, "I heart {$place}!" },
+		{ render_legacy_ul, "<h3>Locations</h3><ul>{% for place in places %}<li>{$place}</li>{% endfor %}</ul>" },
+	};
+
+	data_map codegen_data()
+	{
+		data_map data ;
+		data["name"] = make_data("Ann") ;
+		data["foo"] = make_data("bar") ;
+		data["n"] = make_data("3") ;
+		data["title"] = make_data("<b>Tom & \"Jerry\"</b>") ;
+		data["price"] = make_data("12.5") ;
+		data["big"] = make_data("1234567.891") ;
+		data_map user ;
+		user["name"] = make_data("Ann") ;
+		user["admin"] = make_data("yes") ;
+		data["user"] = make_data(user) ;
+		data_list people ;
+		const char *names[] = { "Ann", "Bo", "Cy" } ;
+		for (int i = 0 ; i < 3 ; ++i)
+		{
+			data_map person ;
+			person["name"] = make_data(names[i]) ;
+			person["admin"] = make_data(i == 1 ? "yes" : "no") ;
+			people.push_back(make_data(person)) ;
+		}
+		data["people"] = make_data(people) ;
+		data_list xs ;
+		for (int i = 0 ; i < 10 ; ++i)
+		{
+			xs.push_back(make_data(format_number(i))) ;
+		}
+		data["xs"] = make_data(xs) ;
+		data_list rows ;
+		for (int r = 0 ; r < 3 ; ++r)
+		{
+			data_list row ;
+			for (int c = 0 ; c <= r ; ++c)
+			{
+				row.push_back(make_data(format_number(r * 10 + c))) ;
+			}
+			rows.push_back(make_data(row)) ;
+		}
+		data["rows"] = make_data(rows) ;
+		data["items"] = make_data(xs) ;
+		data["item"] = make_data("aaa") ;
+		data["thing"] = make_data("bbb") ;
+		data_list things ;
+		things.push_back(make_data("a")) ;
+		things.push_back(make_data("b")) ;
+		data["things"] = make_data(things) ;
+		data_map person ;
+		person["name"] = make_data("Bob") ;
+		person["occupation"] = make_data("Plumber") ;
+		data_list friends ;
+		const char *friend_names[] = { "Bob", "Betty" } ;
+		for (int i = 0 ; i < 2 ; ++i)
+		{
+			data_map buddy ;
+			buddy["name"] = make_data(friend_names[i]) ;
+			friends.push_back(make_data(buddy)) ;
+		}
+		person["friends"] = make_data(friends) ;
+		data["person"] = make_data(person) ;
+		data["place"] = make_data("Okinawa") ;
+		data_list places ;
+		places.push_back(make_data("Okinawa")) ;
+		places.push_back(make_data("San Francisco")) ;
+		data["places"] = make_data(places) ;
+		return data ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_generated_matches_parse)
+	{
+		const size_t count = sizeof(generated_templates) / sizeof(generated_templates[0]) ;
+		for (size_t i = 0 ; i < count ; ++i)
+		{
+			data_map expected_data = codegen_data() ;
+			const std::string expected = parse(generated_templates[i].text, expected_data) ;
+			data_map data = codegen_data() ;
+			std::ostringstream out ;
+			generated_templates[i].render(out, data) ;
+			BOOST_CHECK_EQUAL( out.str(), expected ) ;
+		}
+	}
+	BOOST_AUTO_TEST_CASE(test_generated_include)
+	{
+		CompileOptions options ;
+		options.loader.reset(new TemplateLoader([](const std::string &) {
+			return std::string("<li>{$item}</li>") ;
+		})) ;
+		Template page("<ul>{% for item in items %}{% include \"row\" %}{% endfor %}</ul>", options) ;
+		data_map data = codegen_data() ;
+		std::ostringstream out ;
+		render_codegen_include(out, data) ;
+		BOOST_CHECK_EQUAL( out.str(), page.render(data) ) ;
+		BOOST_CHECK_EQUAL( out.str(), "<ul><li>0</li><li>1</li><li>2</li><li>3</li><li>4</li>"
+			"<li>5</li><li>6</li><li>7</li><li>8</li><li>9</li></ul>" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_generate_straight_line)
+	{
+		Template page("a\"b\n{% if x %}{$x|html}{% endif %}{% for p in user.people %}{$p.name}{% endfor %}") ;
+		std::ostringstream code ;
+		generate_cpp(code, "render_page", page) ;
+		const std::string text = code.str() ;
+		BOOST_CHECK( text.find("void render_page(std::ostream &stream, cpptempl::data_map &data)") != std::string::npos ) ;
+		BOOST_CHECK( text.find("context.write(stream, \"a\\\"b\\n\", 4) ;") != std::string::npos ) ;
+		BOOST_CHECK( text.find("if (! operand(path_1, 1, \"x\", placeholder_2, data, MISSING_KEY_ECHO)->empty())") != std::string::npos ) ;
+		BOOST_CHECK( text.find("get_filter(\"html\")") != std::string::npos ) ;
+		// paths are split when generating, not at render time
+		BOOST_CHECK( text.find("static const std::string path_5[] = { \"user\", \"people\" } ;") != std::string::npos ) ;
+		BOOST_CHECK( text.find("static const std::string path_6[] = { \"p\", \"name\" } ;") != std::string::npos ) ;
+		BOOST_CHECK( text.find("find_val(\"") == std::string::npos ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_generate_names_used_parameters)
+	{
+		Template text_only("data, stream \"context\"") ;
+		std::ostringstream code ;
+		generate_cpp(code, "render_text_only", text_only) ;
+		BOOST_CHECK( code.str().find("void render_text_only(std::ostream &stream, cpptempl::data_map &, "
+			"cpptempl::RenderContext &context)") != std::string::npos ) ;
+		Template empty("") ;
+		generate_cpp(code, "render_empty", empty) ;
+		BOOST_CHECK( code.str().find("void render_empty(std::ostream &, cpptempl::data_map &, "
+			"cpptempl::RenderContext &)") != std::string::npos ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_generate_rejects)
+	{
+		std::ostringstream code ;
+		Template page("{$x}") ;
+		BOOST_CHECK_THROW( generate_cpp(code, "2fast", page), TemplateException ) ;
+		BOOST_CHECK_THROW( generate_cpp(code, "a-b", page), TemplateException ) ;
+		CompileOptions options ;
+		options.missing_key = MISSING_KEY_CALLBACK ;
+		Template callback("{$x}", options) ;
+		BOOST_CHECK_THROW( generate_cpp(code, "render_callback", callback), TemplateException ) ;
+		Template cached("{% cache x %}{$x}{% endcache %}") ;
+		BOOST_CHECK_THROW( generate_cpp(code, "render_cached", cached), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_generated_signed_bound)
+	{
+		data_map data = codegen_data() ;
+		data["n"] = make_data("-1") ;
+		std::ostringstream out ;
+		BOOST_CHECK_THROW( render_codegen_loop_options(out, data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_generated_missing_list)
+	{
+		data_map data ;
+		std::ostringstream out ;
+		render_codegen_loop(out, data) ;
+		BOOST_CHECK_EQUAL( out.str(), "" ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppWide )
+
+	using namespace cpptempl ;
+
+	typedef boost::mpl::list<wchar_t, char16_t> wide_types ;
+
+	template<typename CharT>
+	std::basic_string<CharT> text(const char *ascii)
+	{
+		return widen_ascii<CharT>(ascii) ;
+	}
+
+	void set_callback(CompileOptions &options, wmissing_key_callback callback)
+	{
+		options.on_missing_wkey = callback ;
+	}
+	void set_callback(CompileOptions &options, u16missing_key_callback callback)
+	{
+		options.on_missing_u16key = callback ;
+	}
+
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_loop_and_if, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		basic_data_list<CharT> items ;
+		items.push_back(make_data(text<CharT>("a"))) ;
+		items.push_back(make_data(text<CharT>("b"))) ;
+		items.push_back(make_data(text<CharT>("c"))) ;
+		data[text<CharT>("items")] = make_data(items) ;
+		data[text<CharT>("flag")] = make_data(text<CharT>("yes")) ;
+		data[text<CharT>("none")] = make_data(text<CharT>("")) ;
+		const std::basic_string<CharT> templ = text<CharT>(
+			"{% for x in items reversed limit:2 %}{$loop.index}{$x}{% endfor %}"
+			"{% if flag %}!{% endif %}{% if not none %}?{% endif %}{% if flag == \"yes\" %}={% endif %}") ;
+		BOOST_CHECK( parse(templ, data) == text<CharT>("1b2a!?=") ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_template_render, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		data[text<CharT>("name")] = make_data(text<CharT>("world")) ;
+		basic_Template<CharT> page(text<CharT>("hello {$name}, {$nobody}")) ;
+		BOOST_CHECK( page.render(data) == text<CharT>("hello world, {$nobody}") ) ;
+		std::basic_ostringstream<CharT> out ;
+		page.render(out, data) ;
+		BOOST_CHECK( out.str() == text<CharT>("hello world, {$nobody}") ) ;
+		std::basic_string<CharT> appended = text<CharT>(">") ;
+		page.render(appended, data) ;
+		BOOST_CHECK( appended == text<CharT>(">hello world, {$nobody}") ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_numbers, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		data[text<CharT>("count")] = 1234567 ;
+		data[text<CharT>("ratio")] = 2.5 ;
+		data[text<CharT>("limit")] = 1 ;
+		basic_data_list<CharT> items ;
+		items.push_back(make_data(text<CharT>("x"))) ;
+		items.push_back(make_data(text<CharT>("y"))) ;
+		data[text<CharT>("items")] = make_data(items) ;
+		BOOST_CHECK( parse(text<CharT>("{$count} {$ratio} {% for i in items limit:limit %}{$i}{% endfor %}"), data) 
+			== text<CharT>("1234567 2.5 x") ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_filters, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		data[text<CharT>("v")] = make_data(text<CharT>("<a href=\"x\">&'")) ;
+		BOOST_CHECK( parse(text<CharT>("{$v|html}"), data) == text<CharT>("&lt;a href=&quot;x&quot;&gt;&amp;&#39;") ) ;
+		BOOST_CHECK( parse(text<CharT>("{$v|url}"), data) == text<CharT>("%3Ca%20href%3D%22x%22%3E%26%27") ) ;
+		BOOST_CHECK( parse(text<CharT>("{$v|json}"), data) == text<CharT>("<a href=\\\"x\\\">&'") ) ;
+		CompileOptions options ;
+		options.autoescape = "html" ;
+		BOOST_CHECK( basic_Template<CharT>(text<CharT>("{$v}{$v|raw}"), options).render(data) 
+			== text<CharT>("&lt;a href=&quot;x&quot;&gt;&amp;&#39;<a href=\"x\">&'") ) ;
+		BOOST_CHECK_THROW( parse(text<CharT>("{$v|nosuchfilter}"), data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_missing_keys, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		CompileOptions options ;
+		options.missing_key = MISSING_KEY_EMPTY ;
+		BOOST_CHECK( basic_Template<CharT>(text<CharT>("[{$a.b}]"), options).render(data) == text<CharT>("[]") ) ;
+		options.missing_key = MISSING_KEY_THROW ;
+		BOOST_CHECK_THROW( basic_Template<CharT>(text<CharT>("{$a}"), options).render(data), TemplateException ) ;
+		options.missing_key = MISSING_KEY_CALLBACK ;
+		set_callback(options, basic_missing_key_callback<CharT>([](const std::basic_string<CharT> &key) 
+			{ return CharT('<') + key + CharT('>') ; })) ;
+		BOOST_CHECK( basic_Template<CharT>(text<CharT>("[{$a.b}]{% if a == \"<a>\" %}!{% endif %}"), options).render(data) 
+			== text<CharT>("[<a.b>]!") ) ;
+		// the char callback is not used
+		options.on_missing_key = [](const std::string &) { return std::string("char") ; } ;
+		set_callback(options, basic_missing_key_callback<CharT>()) ;
+		BOOST_CHECK( basic_Template<CharT>(text<CharT>("[{$a}]"), options).render(data) == text<CharT>("[]") ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_number_filters, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		data[text<CharT>("price")] = make_data(text<CharT>("12.5")) ;
+		data[text<CharT>("big")] = make_data(text<CharT>("-1234567.891")) ;
+		const std::basic_string<CharT> name(1, CharT(0x00e9)) ;
+		data[text<CharT>("name")] = make_data(name) ;
+		BOOST_CHECK( parse(text<CharT>("{$price|fixed:2} {$big|fixed:1|thousands:_} {$big|thousands}"), data) 
+			== text<CharT>("12.50 -1_234_567.9 -1,234,567.891") ) ;
+		// not a number: written as it is
+		BOOST_CHECK( parse(text<CharT>("{$name|fixed}{$name|thousands}"), data) == name + name ) ;
+		BOOST_CHECK_THROW( basic_Template<CharT>(text<CharT>("{$price|fixed:x}")), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_char_only_features, CharT, wide_types)
+	{
+		BOOST_CHECK_THROW( basic_Template<CharT>(text<CharT>("{% include \"x\" %}")), TemplateException ) ;
+		BOOST_CHECK_THROW( basic_Template<CharT>(text<CharT>("{% extends \"x\" %}")), TemplateException ) ;
+		BOOST_CHECK_THROW( basic_Template<CharT>(text<CharT>("{% cache key %}x{% endcache %}")), TemplateException ) ;
+		basic_data_map<CharT> data ;
+		GatherOutput out ;
+		BOOST_CHECK_THROW( basic_Template<CharT>(text<CharT>("x")).render(out, data), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE_TEMPLATE(test_limits_count_characters, CharT, wide_types)
+	{
+		basic_data_map<CharT> data ;
+		basic_Template<CharT> page(text<CharT>("0123456789")) ;
+		std::basic_ostringstream<CharT> out ;
+		RenderContext context ;
+		context.m_max_bytes = 10 ;
+		page.render(out, data, context) ;
+		BOOST_CHECK_EQUAL( context.m_bytes, 10u ) ;
+		BOOST_CHECK_THROW( page.render(out, data, context), TemplateException ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_wchar_t_text)
+	{
+		wdata_map data ;
+		data[L"name"] = make_data(L"J\u00fcrgen") ;
+		wdata_list cities ;
+		cities.push_back(make_data(L"K\u00f8benhavn")) ;
+		cities.push_back(make_data(L"\u6771\u4eac")) ;
+		data[L"cities"] = make_data(cities) ;
+		const std::wstring templ = L"Hej {$name}: {% for c in cities %}[{$c}]{% endfor %} \u2713" ;
+		BOOST_CHECK( parse(templ, data) == L"Hej J\u00fcrgen: [K\u00f8benhavn][\u6771\u4eac] \u2713" ) ;
+		data[L"v"] = std::wstring(L"<\u00e9\u20ac>") ;
+		BOOST_CHECK( parse(L"{$v|html}", data) == L"&lt;\u00e9\u20ac&gt;" ) ;
+		BOOST_CHECK( parse(L"{$v|url}", data) == L"%3C%C3%A9%E2%82%AC%3E" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_char16_t_text)
+	{
+		u16data_map data ;
+		data[u"caf\u00e9"] = make_data(u"cr\u00e8me \U0001F600") ;
+		BOOST_CHECK( parse(u"{$caf\u00e9}!", data) == u"cr\u00e8me \U0001F600!" ) ;
+		// a surrogate pair is one character to encode
+		BOOST_CHECK( parse(u"{$caf\u00e9|url}", data) == u"cr%C3%A8me%20%F0%9F%98%80" ) ;
+		CompileOptions options ;
+		options.missing_key = MISSING_KEY_THROW ;
+		u16Template page(u"{$na\u00efve}", options) ;
+		try
+		{
+			page.render(data) ;
+			BOOST_FAIL( "Expected a missing key" ) ;
+		}
+		catch (TemplateException &e)
+		{
+			BOOST_CHECK_EQUAL( std::string(e.what()), "Missing key: na\\u00EFve" ) ;
+		}
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppRenderLimits )
+
+	using namespace cpptempl ;
+
+	data_map numbers(size_t count)
+	{
+		data_map data ;
+		data_list xs ;
+		for (size_t i = 0 ; i < count ; ++i)
+		{
+			xs.push_back(make_data(format_number(i))) ;
+		}
+		data["xs"] = make_data(xs) ;
+		return data ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_iteration_limit)
+	{
+		data_map data = numbers(10) ;
+		Template page("{% for x in xs %}{% for y in xs %}.{% endfor %}{% endfor %}") ;
+		RenderContext context ;
+		context.m_max_iterations = 110 ;
+		std::ostringstream out ;
+		page.render(out, data, context) ;
+		BOOST_CHECK_EQUAL( out.str(), std::string(100, '.') ) ;
+		RenderContext strict ;
+		strict.m_max_iterations = 50 ;
+		std::ostringstream cut ;
+		try
+		{
+			page.render(cut, data, strict) ;
+			BOOST_FAIL( "expected RenderLimitException" ) ;
+		}
+		catch (RenderLimitException &e)
+		{
+			BOOST_CHECK_EQUAL( e.limit(), RENDER_LIMIT_ITERATIONS ) ;
+		}
+		BOOST_CHECK_EQUAL( strict.m_iterations, 51u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_byte_limit)
+	{
+		data_map data ;
+		data["body"] = make_data(std::string(20, 'x')) ;
+		Template page("<p>{$body}</p>") ;
+		RenderContext context ;
+		context.m_max_bytes = 27 ;
+		std::ostringstream out ;
+		page.render(out, data, context) ;
+		BOOST_CHECK_EQUAL( out.str().size(), 27u ) ;
+		RenderContext strict ;
+		strict.m_max_bytes = 22 ;
+		std::ostringstream cut ;
+		try
+		{
+			page.render(cut, data, strict) ;
+			BOOST_FAIL( "expected RenderLimitException" ) ;
+		}
+		catch (RenderLimitException &e)
+		{
+			BOOST_CHECK_EQUAL( e.limit(), RENDER_LIMIT_BYTES ) ;
+		}
+		// the value that would have passed the limit is not written
+		BOOST_CHECK_EQUAL( cut.str(), "<p>" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_deadline)
+	{
+		data_map data = numbers(1000) ;
+		Template page("{% for x in xs %}{$x}{% endfor %}") ;
+		RenderContext late ;
+		late.m_deadline = std::chrono::steady_clock::now() - std::chrono::seconds(1) ;
+		std::ostringstream out ;
+		try
+		{
+			page.render(out, data, late) ;
+			BOOST_FAIL( "expected RenderLimitException" ) ;
+		}
+		catch (RenderLimitException &e)
+		{
+			BOOST_CHECK_EQUAL( e.limit(), RENDER_LIMIT_DEADLINE ) ;
+		}
+		BOOST_CHECK_EQUAL( out.str(), "" ) ;
+		RenderContext context ;
+		context.set_timeout(std::chrono::hours(1)) ;
+		page.render(out, data, context) ;
+		BOOST_CHECK_EQUAL( context.m_iterations, 1000u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_deadline_without_loops)
+	{
+		register_filter("slow", [](const std::string &value)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(20)) ;
+			return value ;
+		}) ;
+		data_map data ;
+		data["big"] = make_data(std::string(100000, 'x')) ;
+		Template page("{$big|slow}{$big|slow}") ;
+		RenderContext context ;
+		context.set_timeout(std::chrono::milliseconds(5)) ;
+		std::ostringstream out ;
+		try
+		{
+			page.render(out, data, context) ;
+			BOOST_FAIL( "expected RenderLimitException" ) ;
+		}
+		catch (RenderLimitException &e)
+		{
+			BOOST_CHECK_EQUAL( e.limit(), RENDER_LIMIT_DEADLINE ) ;
+		}
+		BOOST_CHECK_EQUAL( out.str(), "" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_limits_span_renders)
+	{
+		data_map data = numbers(10) ;
+		Template page("{% for x in xs %}{$x}{% endfor %}") ;
+		RenderContext context ;
+		context.m_max_iterations = 15 ;
+		std::ostringstream out ;
+		page.render(out, data, context) ;
+		BOOST_CHECK_THROW( page.render(out, data, context), RenderLimitException ) ;
+		context.m_iterations = 0 ;
+		context.m_bytes = 0 ;
+		std::ostringstream again ;
+		page.render(again, data, context) ;
+		BOOST_CHECK_EQUAL( again.str(), "0123456789" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_limit_is_template_exception)
+	{
+		data_map data = numbers(3) ;
+		RenderContext context ;
+		context.m_max_iterations = 2 ;
+		std::ostringstream out ;
+		BOOST_CHECK_THROW( parse(out, "{% for x in xs %}{$x}{% endfor %}", data, context), TemplateException ) ;
+		BOOST_CHECK_EQUAL( out.str(), "01" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_generated_code_limits)
+	{
+		data_map data = TestCppCodegen::codegen_data() ;
+		RenderContext context ;
+		context.m_max_iterations = 1 ;
+		std::ostringstream out ;
+		BOOST_CHECK_THROW( render_codegen_loop(out, data, context), RenderLimitException ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( TestCppSpecialize )
+
+	using namespace cpptempl ;
+
+	void add_static(data_map &data)
+	{
+		data_map site ;
+		site["name"] = make_data("Acme") ;
+		data["site"] = make_data(site) ;
+		data_map flags ;
+		flags["beta"] = make_data("yes") ;
+		flags["legacy"] = make_data("") ;
+		data["flags"] = make_data(flags) ;
+		data_list langs ;
+		langs.push_back(make_data("en")) ;
+		langs.push_back(make_data("no")) ;
+		data["langs"] = make_data(langs) ;
+		data["greeting"] = make_data("Hello") ;
+		data["admin_role"] = make_data("root") ;
+		data["x"] = make_data("static x") ;
+	}
+
+	void add_dynamic(data_map &data)
+	{
+		data["name"] = make_data("Ann") ;
+		data_map user ;
+		user["role"] = make_data("root") ;
+		data["user"] = make_data(user) ;
+		data_list people ;
+		people.push_back(make_data("Bo")) ;
+		people.push_back(make_data("Cy")) ;
+		data["people"] = make_data(people) ;
+	}
+
+	// the residual template renders the same from render-time data alone
+	// as the original does from all of it
+	Template check_specialized(const std::string &text)
+	{
+		Template original(text) ;
+		data_map all ;
+		add_static(all) ;
+		add_dynamic(all) ;
+		const std::string expected = original.render(all) ;
+		data_map static_data ;
+		add_static(static_data) ;
+		Template residual = specialize(original, static_data) ;
+		data_map dynamic ;
+		add_dynamic(dynamic) ;
+		// static keys the residual template still reads
+		const std::set<std::string> roots = dependencies(residual).roots ;
+		for (std::set<std::string>::const_iterator it = roots.begin() ; it != roots.end() ; ++it)
+		{
+			if (static_data.has(*it) && ! dynamic.has(*it))
+			{
+				dynamic[*it] = static_data[*it] ;
+			}
+		}
+		BOOST_CHECK_EQUAL( residual.render(dynamic), expected ) ;
+		return residual ;
+	}
+
+	BOOST_AUTO_TEST_CASE(test_static_text_folded)
+	{
+		Template residual = check_specialized("{$site.name}: {% if flags.beta %}beta {% endif %}"
+			"{% if flags.legacy %}old {% endif %}{% for l in langs %}[{$l}]{% endfor %} Hi {$name}") ;
+		BOOST_CHECK_EQUAL( residual.get_tree().size(), 2u ) ;
+		data_map empty ;
+		BOOST_CHECK_EQUAL( gettext(residual.get_tree()[0], empty), "Acme: beta [en][no] Hi " ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_dynamic_loop_body_specialized)
+	{
+		Template residual = check_specialized("{% for p in people %}{$greeting}, {$p}! {% endfor %}") ;
+		BOOST_CHECK_EQUAL( residual.get_tree().size(), 1u ) ;
+		TokenFor *loop = dynamic_cast<TokenFor*>(residual.get_tree()[0].get()) ;
+		BOOST_REQUIRE( loop ) ;
+		BOOST_CHECK_EQUAL( loop->m_children.size(), 3u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_known_operand_written_in)
+	{
+		Template residual = check_specialized("{% if user.role == admin_role %}admin{% endif %}") ;
+		TokenIf *cond = dynamic_cast<TokenIf*>(residual.get_tree()[0].get()) ;
+		BOOST_REQUIRE( cond ) ;
+		BOOST_CHECK_EQUAL( cond->m_expr, "if user.role == \"root\"" ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_loop_variables)
+	{
+		// a render-time loop rebinds x; a static one leaves l and loop set
+		check_specialized("{$x}|{% for x in people %}{% endfor %}{$x}") ;
+		check_specialized("{% for l in langs %}{% endfor %}{$l}{$loop.index}") ;
+		// a static loop rebinds a name an earlier render-time loop bound
+		Template rebound = check_specialized("{% for l in people %}{% endfor %}{% for l in langs %}{$l}{% endfor %}{$l}") ;
+		BOOST_CHECK_EQUAL( dependencies(rebound).roots.count("langs"), 0u ) ;
+		BOOST_CHECK_EQUAL( rebound.get_tree().back()->gettype(), TOKEN_TYPE_TEXT ) ;
+		check_specialized("{% for p in people %}{% endfor %}{% for l in langs %}{$loop.index}{% endfor %}{$loop.index}") ;
+		Template kept = check_specialized("{% if name %}{% for l in langs %}{% endfor %}{% endif %}{$l}") ;
+		BOOST_CHECK_EQUAL( dependencies(kept).roots.count("langs"), 1u ) ;
+		Template unrolled = check_specialized("{% if name %}{% for l in langs %}{$l}{% endfor %}{% endif %}") ;
+		BOOST_CHECK_EQUAL( dependencies(unrolled).roots.count("langs"), 0u ) ;
+	}
+	BOOST_AUTO_TEST_CASE(test_missing_static_path_kept)
+	{
+		Template residual = check_specialized("{$site.missing}") ;
+		BOOST_CHECK_EQUAL( residual.get_tree()[0]->gettype(), TOKEN_TYPE_VAR ) ;
+	}
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif
@@ -0,0 +1,1122 @@
+// Generated by cpptempl_codegen; do not edit.
+
+#ifdef UNIT_TEST
+
+#include "cpptempl.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace
+{
+	using namespace cpptempl ;
+
+	// loop.index and loop.index0 for one iteration
+	class LoopData : public Data
+	{
+		data_ptr m_index ;
+		data_ptr m_index0 ;
+	public:
+		LoopData(data_ptr index, data_ptr index0) : m_index(index), m_index0(index0){}
+		bool empty()
+		{
+			return false ;
+		}
+		bool getmember(const std::string &key, data_ptr &value)
+		{
+			if (key == "index")
+			{
+				value = m_index ;
+				return true ;
+			}
+			if (key == "index0")
+			{
+				value = m_index0 ;
+				return true ;
+			}
+			return false ;
+		}
+	};
+
+	inline void set_loop(data_map &data, size_t i)
+	{
+		data["loop"] = data_ptr(std::shared_ptr<Data>(std::make_shared<LoopData>(
+			make_data(format_number(i+1)), make_data(format_number(i))))) ;
+	}
+
+	// a loop option given as a data path
+	inline size_t loop_bound(const std::string *path, size_t parts, const char *operand, 
+		data_map &data, size_t fallback, MissingKeyPolicy missing_key)
+	{
+		data_ptr value ;
+		if (! find_val(path, parts, data, value))
+		{
+			if (missing_key == MISSING_KEY_THROW)
+			{
+				throw TemplateException(std::string("Missing key: ") + operand) ;
+			}
+			return fallback ;
+		}
+		const std::string text = value->getvalue() ;
+		try
+		{
+			// lexical_cast would wrap a leading minus sign around
+			if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+			{
+				throw boost::bad_lexical_cast() ;
+			}
+			return boost::lexical_cast<size_t>(text) ;
+		}
+		catch (boost::bad_lexical_cast &)
+		{
+			throw TemplateException(std::string("Invalid number in for statement: ") + operand) ;
+		}
+	}
+
+	// one side of an if condition; placeholder is the {$key} text
+	// for MISSING_KEY_ECHO
+	inline data_ptr operand(const std::string *path, size_t parts, const char *key, 
+		const data_ptr &placeholder, data_map &data, MissingKeyPolicy missing_key)
+	{
+		data_ptr value ;
+		if (find_val(path, parts, data, value))
+		{
+			return value ;
+		}
+		switch (missing_key)
+		{
+		case MISSING_KEY_ECHO:
+			return placeholder ;
+		case MISSING_KEY_THROW:
+			throw TemplateException(std::string("Missing key: ") + key) ;
+		default:
+			{
+				static data_ptr empty_value = make_data("") ;
+				return empty_value ;
+			}
+		}
+	}
+
+	// the last filter writes to the output, the others to a scratch stream
+	inline void write_filtered(const filter_ptr *filters, size_t count, std::string text, 
+		std::ostream &stream, RenderContext &context)
+	{
+		for (size_t i = 0 ; i + 1 < count ; ++i)
+		{
+			std::ostringstream filtered ;
+			RenderContext scratch ;
+			filters[i]->apply(text, filtered, scratch) ;
+			text = filtered.str() ;
+		}
+		filters[count - 1]->apply(text, stream, context) ;
+	}
+}
+
+void render_codegen_text(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "Hello ", 6) ;
+	{
+		static const std::string path_1[] = { "name" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$name}", 7) ;
+		}
+	}
+	context.write(stream, "!\n"
+		"\tWelcome \"back\", \\\\ ok\?\? \303\234ber\n", 33) ;
+}
+
+void render_codegen_text(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_text(stream, data, context) ;
+}
+
+void render_codegen_missing(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_1[] = { "foo" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$foo}", 6) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const std::string path_2[] = { "missing" } ;
+		data_ptr value ;
+		if (find_val(path_2, 1, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$missing}", 10) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const std::string path_3[] = { "user", "missing" } ;
+		data_ptr value ;
+		if (find_val(path_3, 2, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$user.missing}", 15) ;
+		}
+	}
+}
+
+void render_codegen_missing(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_missing(stream, data, context) ;
+}
+
+void render_codegen_loop(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_2[] = { "people" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["p"] = list_1->getitem(i_1) ;
+				{
+					static const std::string path_3[] = { "loop", "index" } ;
+					data_ptr value ;
+					if (find_val(path_3, 2, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$loop.index}", 13) ;
+					}
+				}
+				context.write(stream, ":", 1) ;
+				{
+					static const std::string path_4[] = { "p", "name" } ;
+					data_ptr value ;
+					if (find_val(path_4, 2, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$p.name}", 9) ;
+					}
+				}
+				{
+					static const std::string path_5[] = { "p", "admin" } ;
+					static const data_ptr placeholder_6 = make_data("{$p.admin}") ;
+					static const std::string path_7[] = { "\"yes\"" } ;
+					data_ptr lhs_8 = operand(path_5, 2, "p.admin", placeholder_6, data, MISSING_KEY_ECHO) ;
+					data_ptr rhs_8 = operand(path_7, 1, "\"yes\"", data_ptr(), data, MISSING_KEY_ECHO) ;
+					if (lhs_8->getvalue() == rhs_8->getvalue())
+					{
+						context.write(stream, "*", 1) ;
+					}
+				}
+				context.write(stream, " ", 1) ;
+			}
+		}
+	}
+}
+
+void render_codegen_loop(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_loop(stream, data, context) ;
+}
+
+void render_codegen_loop_options(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_2[] = { "xs" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t size_1 = list_1->getsize() ;
+			const size_t first_1 = std::min(size_t(2u), size_1) ;
+			const size_t end_1 = first_1 + std::min(size_t(3u), size_1 - first_1) ;
+			const size_t step_1 = size_t(1) ;
+			const size_t count_1 = end_1 > first_1 ? (end_1 - first_1 - 1) / step_1 + 1 : 0 ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["x"] = list_1->getitem(first_1 + i_1 * step_1) ;
+				{
+					static const std::string path_3[] = { "loop", "index0" } ;
+					data_ptr value ;
+					if (find_val(path_3, 2, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$loop.index0}", 14) ;
+					}
+				}
+				context.write(stream, "=", 1) ;
+				{
+					static const std::string path_4[] = { "x" } ;
+					data_ptr value ;
+					if (find_val(path_4, 1, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$x}", 4) ;
+					}
+				}
+				context.write(stream, " ", 1) ;
+			}
+		}
+	}
+	context.write(stream, "|", 1) ;
+	{
+		static const std::string path_6[] = { "xs" } ;
+		data_ptr list_5 ;
+		if (find_val(path_6, 1, data, list_5))
+		{
+			static const std::string path_7[] = { "n" } ;
+			const size_t size_5 = list_5->getsize() ;
+			const size_t first_5 = std::min(size_t(0), size_5) ;
+			const size_t end_5 = first_5 + std::min(loop_bound(path_7, 1, "n", data, size_5, MISSING_KEY_ECHO), size_5 - first_5) ;
+			const size_t step_5 = size_t(1) ;
+			const size_t count_5 = end_5 > first_5 ? (end_5 - first_5 - 1) / step_5 + 1 : 0 ;
+			for (size_t i_5 = 0 ; i_5 < count_5 ; ++i_5)
+			{
+				context.iteration() ;
+				set_loop(data, i_5) ;
+				data["x"] = list_5->getitem(first_5 + (count_5 - 1 - i_5) * step_5) ;
+				{
+					static const std::string path_8[] = { "x" } ;
+					data_ptr value ;
+					if (find_val(path_8, 1, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$x}", 4) ;
+					}
+				}
+			}
+		}
+	}
+	context.write(stream, "|", 1) ;
+	{
+		static const std::string path_10[] = { "xs" } ;
+		data_ptr list_9 ;
+		if (find_val(path_10, 1, data, list_9))
+		{
+			const size_t size_9 = list_9->getsize() ;
+			const size_t first_9 = std::min(size_t(0), size_9) ;
+			const size_t end_9 = first_9 + std::min(size_9, size_9 - first_9) ;
+			const size_t step_9 = size_t(3u) ;
+			const size_t count_9 = end_9 > first_9 ? (end_9 - first_9 - 1) / step_9 + 1 : 0 ;
+			for (size_t i_9 = 0 ; i_9 < count_9 ; ++i_9)
+			{
+				context.iteration() ;
+				set_loop(data, i_9) ;
+				data["x"] = list_9->getitem(first_9 + i_9 * step_9) ;
+				{
+					static const std::string path_11[] = { "x" } ;
+					data_ptr value ;
+					if (find_val(path_11, 1, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$x}", 4) ;
+					}
+				}
+			}
+		}
+	}
+	context.write(stream, "|", 1) ;
+	{
+		static const std::string path_13[] = { "nothing" } ;
+		data_ptr list_12 ;
+		if (find_val(path_13, 1, data, list_12))
+		{
+			const size_t count_12 = list_12->getsize() ;
+			for (size_t i_12 = 0 ; i_12 < count_12 ; ++i_12)
+			{
+				context.iteration() ;
+				set_loop(data, i_12) ;
+				data["x"] = list_12->getitem(i_12) ;
+				{
+					static const std::string path_14[] = { "x" } ;
+					data_ptr value ;
+					if (find_val(path_14, 1, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$x}", 4) ;
+					}
+				}
+			}
+		}
+	}
+}
+
+void render_codegen_loop_options(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_loop_options(stream, data, context) ;
+}
+
+void render_codegen_conditions(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const filter_ptr filters[] = { get_filter("html") } ;
+		static const std::string path_1[] = { "title" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			write_filtered(filters, 1, value->getvalue(), stream, context) ;
+		}
+		else
+		{
+			write_filtered(filters, 1, "{$title|html}", stream, context) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const std::string path_2[] = { "user", "name" } ;
+		data_ptr value ;
+		if (find_val(path_2, 2, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$user.name}", 12) ;
+		}
+	}
+	{
+		static const std::string path_3[] = { "user", "admin" } ;
+		static const data_ptr placeholder_4 = make_data("{$user.admin}") ;
+		static const std::string path_5[] = { "\"yes\"" } ;
+		data_ptr lhs_6 = operand(path_3, 2, "user.admin", placeholder_4, data, MISSING_KEY_ECHO) ;
+		data_ptr rhs_6 = operand(path_5, 1, "\"yes\"", data_ptr(), data, MISSING_KEY_ECHO) ;
+		if (lhs_6->getvalue() == rhs_6->getvalue())
+		{
+			{
+				static const std::string path_7[] = { "\"literal\"" } ;
+				data_ptr value ;
+				if (find_val(path_7, 1, data, value))
+				{
+					context.write(stream, value->getvalue()) ;
+				}
+				else
+				{
+					context.write(stream, "{$\"literal\"}", 12) ;
+				}
+			}
+		}
+	}
+	{
+		static const std::string path_8[] = { "missing" } ;
+		static const data_ptr placeholder_9 = make_data("{$missing}") ;
+		if (operand(path_8, 1, "missing", placeholder_9, data, MISSING_KEY_ECHO)->empty())
+		{
+			context.write(stream, "!", 1) ;
+		}
+	}
+	{
+		static const std::string path_10[] = { "title" } ;
+		static const data_ptr placeholder_11 = make_data("{$title}") ;
+		static const std::string path_12[] = { "user", "name" } ;
+		static const data_ptr placeholder_13 = make_data("{$user.name}") ;
+		data_ptr lhs_14 = operand(path_10, 1, "title", placeholder_11, data, MISSING_KEY_ECHO) ;
+		data_ptr rhs_14 = operand(path_12, 2, "user.name", placeholder_13, data, MISSING_KEY_ECHO) ;
+		if (lhs_14->getvalue() != rhs_14->getvalue())
+		{
+			context.write(stream, " ne", 3) ;
+		}
+	}
+	{
+		static const std::string path_15[] = { "missing" } ;
+		static const data_ptr placeholder_16 = make_data("{$missing}") ;
+		if (! operand(path_15, 1, "missing", placeholder_16, data, MISSING_KEY_ECHO)->empty())
+		{
+			context.write(stream, "m", 1) ;
+		}
+	}
+}
+
+void render_codegen_conditions(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_conditions(stream, data, context) ;
+}
+
+void render_codegen_filters(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const filter_ptr filters[] = { get_filter("fixed:2") } ;
+		static const std::string path_1[] = { "price" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			write_filtered(filters, 1, value->getvalue(), stream, context) ;
+		}
+		else
+		{
+			write_filtered(filters, 1, "{$price|fixed:2}", stream, context) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const filter_ptr filters[] = { get_filter("thousands") } ;
+		static const std::string path_2[] = { "big" } ;
+		data_ptr value ;
+		if (find_val(path_2, 1, data, value))
+		{
+			write_filtered(filters, 1, value->getvalue(), stream, context) ;
+		}
+		else
+		{
+			write_filtered(filters, 1, "{$big|thousands}", stream, context) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const filter_ptr filters[] = { get_filter("fixed:1"), get_filter("thousands:_") } ;
+		static const std::string path_3[] = { "big" } ;
+		data_ptr value ;
+		if (find_val(path_3, 1, data, value))
+		{
+			write_filtered(filters, 2, value->getvalue(), stream, context) ;
+		}
+		else
+		{
+			write_filtered(filters, 2, "{$big|fixed:1|thousands:_}", stream, context) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const filter_ptr filters[] = { get_filter("url") } ;
+		static const std::string path_4[] = { "title" } ;
+		data_ptr value ;
+		if (find_val(path_4, 1, data, value))
+		{
+			write_filtered(filters, 1, value->getvalue(), stream, context) ;
+		}
+		else
+		{
+			write_filtered(filters, 1, "{$title|url}", stream, context) ;
+		}
+	}
+	context.write(stream, " ", 1) ;
+	{
+		static const filter_ptr filters[] = { get_filter("url") } ;
+		static const std::string path_5[] = { "absent" } ;
+		data_ptr value ;
+		if (find_val(path_5, 1, data, value))
+		{
+			write_filtered(filters, 1, value->getvalue(), stream, context) ;
+		}
+		else
+		{
+			write_filtered(filters, 1, "{$absent|url}", stream, context) ;
+		}
+	}
+}
+
+void render_codegen_filters(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_filters(stream, data, context) ;
+}
+
+void render_codegen_nested(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "<table>\n", 8) ;
+	{
+		static const std::string path_2[] = { "rows" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["row"] = list_1->getitem(i_1) ;
+				context.write(stream, "<tr>", 4) ;
+				{
+					static const std::string path_4[] = { "row" } ;
+					data_ptr list_3 ;
+					if (find_val(path_4, 1, data, list_3))
+					{
+						const size_t count_3 = list_3->getsize() ;
+						for (size_t i_3 = 0 ; i_3 < count_3 ; ++i_3)
+						{
+							context.iteration() ;
+							set_loop(data, i_3) ;
+							data["cell"] = list_3->getitem(i_3) ;
+							context.write(stream, "<td>", 4) ;
+							{
+								static const std::string path_5[] = { "loop", "index" } ;
+								data_ptr value ;
+								if (find_val(path_5, 2, data, value))
+								{
+									context.write(stream, value->getvalue()) ;
+								}
+								else
+								{
+									context.write(stream, "{$loop.index}", 13) ;
+								}
+							}
+							context.write(stream, ".", 1) ;
+							{
+								static const std::string path_6[] = { "cell" } ;
+								data_ptr value ;
+								if (find_val(path_6, 1, data, value))
+								{
+									context.write(stream, value->getvalue()) ;
+								}
+								else
+								{
+									context.write(stream, "{$cell}", 7) ;
+								}
+							}
+							context.write(stream, "</td>", 5) ;
+						}
+					}
+				}
+				context.write(stream, "</tr>\n", 6) ;
+			}
+		}
+	}
+	context.write(stream, "</table>", 8) ;
+}
+
+void render_codegen_nested(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_nested(stream, data, context) ;
+}
+
+namespace
+{
+	void render_codegen_include_partial_3(std::ostream &stream, data_map &data, RenderContext &context)
+	{
+		context.write(stream, "<li>", 4) ;
+		{
+			static const std::string path_4[] = { "item" } ;
+			data_ptr value ;
+			if (find_val(path_4, 1, data, value))
+			{
+				context.write(stream, value->getvalue()) ;
+			}
+			else
+			{
+				context.write(stream, "{$item}", 7) ;
+			}
+		}
+		context.write(stream, "</li>", 5) ;
+	}
+}
+
+void render_codegen_include(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "<ul>", 4) ;
+	{
+		static const std::string path_2[] = { "items" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["item"] = list_1->getitem(i_1) ;
+				render_codegen_include_partial_3(stream, data, context) ;
+			}
+		}
+	}
+	context.write(stream, "</ul>", 5) ;
+}
+
+void render_codegen_include(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_codegen_include(stream, data, context) ;
+}
+
+void render_legacy_empty(std::ostream &, cpptempl::data_map &, cpptempl::RenderContext &)
+{
+	using namespace cpptempl ;
+}
+
+void render_legacy_empty(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_empty(stream, data, context) ;
+}
+
+void render_legacy_no_vars(std::ostream &stream, cpptempl::data_map &, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "foo", 3) ;
+}
+
+void render_legacy_no_vars(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_no_vars(stream, data, context) ;
+}
+
+void render_legacy_var(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_1[] = { "foo" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$foo}", 6) ;
+		}
+	}
+}
+
+void render_legacy_var(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_var(stream, data, context) ;
+}
+
+void render_legacy_var_surrounded(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "aaa", 3) ;
+	{
+		static const std::string path_1[] = { "foo" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$foo}", 6) ;
+		}
+	}
+	context.write(stream, "bbb", 3) ;
+}
+
+void render_legacy_var_surrounded(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_var_surrounded(stream, data, context) ;
+}
+
+void render_legacy_for(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_2[] = { "items" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["item"] = list_1->getitem(i_1) ;
+				{
+					static const std::string path_3[] = { "item" } ;
+					data_ptr value ;
+					if (find_val(path_3, 1, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$item}", 7) ;
+					}
+				}
+			}
+		}
+	}
+}
+
+void render_legacy_for(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_for(stream, data, context) ;
+}
+
+void render_legacy_if(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_1[] = { "item" } ;
+		static const data_ptr placeholder_2 = make_data("{$item}") ;
+		if (! operand(path_1, 1, "item", placeholder_2, data, MISSING_KEY_ECHO)->empty())
+		{
+			{
+				static const std::string path_3[] = { "item" } ;
+				data_ptr value ;
+				if (find_val(path_3, 1, data, value))
+				{
+					context.write(stream, value->getvalue()) ;
+				}
+				else
+				{
+					context.write(stream, "{$item}", 7) ;
+				}
+			}
+		}
+	}
+}
+
+void render_legacy_if(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_if(stream, data, context) ;
+}
+
+void render_legacy_nested_for(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_2[] = { "items" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["item"] = list_1->getitem(i_1) ;
+				{
+					static const std::string path_4[] = { "things" } ;
+					data_ptr list_3 ;
+					if (find_val(path_4, 1, data, list_3))
+					{
+						const size_t count_3 = list_3->getsize() ;
+						for (size_t i_3 = 0 ; i_3 < count_3 ; ++i_3)
+						{
+							context.iteration() ;
+							set_loop(data, i_3) ;
+							data["thing"] = list_3->getitem(i_3) ;
+							{
+								static const std::string path_5[] = { "item" } ;
+								data_ptr value ;
+								if (find_val(path_5, 1, data, value))
+								{
+									context.write(stream, value->getvalue()) ;
+								}
+								else
+								{
+									context.write(stream, "{$item}", 7) ;
+								}
+							}
+							{
+								static const std::string path_6[] = { "thing" } ;
+								data_ptr value ;
+								if (find_val(path_6, 1, data, value))
+								{
+									context.write(stream, value->getvalue()) ;
+								}
+								else
+								{
+									context.write(stream, "{$thing}", 8) ;
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void render_legacy_nested_for(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_nested_for(stream, data, context) ;
+}
+
+void render_legacy_nested_if(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_1[] = { "item" } ;
+		static const data_ptr placeholder_2 = make_data("{$item}") ;
+		if (! operand(path_1, 1, "item", placeholder_2, data, MISSING_KEY_ECHO)->empty())
+		{
+			{
+				static const std::string path_3[] = { "thing" } ;
+				static const data_ptr placeholder_4 = make_data("{$thing}") ;
+				if (! operand(path_3, 1, "thing", placeholder_4, data, MISSING_KEY_ECHO)->empty())
+				{
+					{
+						static const std::string path_5[] = { "item" } ;
+						data_ptr value ;
+						if (find_val(path_5, 1, data, value))
+						{
+							context.write(stream, value->getvalue()) ;
+						}
+						else
+						{
+							context.write(stream, "{$item}", 7) ;
+						}
+					}
+					{
+						static const std::string path_6[] = { "thing" } ;
+						data_ptr value ;
+						if (find_val(path_6, 1, data, value))
+						{
+							context.write(stream, value->getvalue()) ;
+						}
+						else
+						{
+							context.write(stream, "{$thing}", 8) ;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void render_legacy_nested_if(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_nested_if(stream, data, context) ;
+}
+
+void render_legacy_usage_example(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_1[] = { "item" } ;
+		static const data_ptr placeholder_2 = make_data("{$item}") ;
+		if (! operand(path_1, 1, "item", placeholder_2, data, MISSING_KEY_ECHO)->empty())
+		{
+			{
+				static const std::string path_3[] = { "item" } ;
+				data_ptr value ;
+				if (find_val(path_3, 1, data, value))
+				{
+					context.write(stream, value->getvalue()) ;
+				}
+				else
+				{
+					context.write(stream, "{$item}", 7) ;
+				}
+			}
+		}
+	}
+	context.write(stream, "\n", 1) ;
+	{
+		static const std::string path_4[] = { "thing" } ;
+		static const data_ptr placeholder_5 = make_data("{$thing}") ;
+		if (! operand(path_4, 1, "thing", placeholder_5, data, MISSING_KEY_ECHO)->empty())
+		{
+			{
+				static const std::string path_6[] = { "thing" } ;
+				data_ptr value ;
+				if (find_val(path_6, 1, data, value))
+				{
+					context.write(stream, value->getvalue()) ;
+				}
+				else
+				{
+					context.write(stream, "{$thing}", 8) ;
+				}
+			}
+		}
+	}
+}
+
+void render_legacy_usage_example(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_usage_example(stream, data, context) ;
+}
+
+void render_legacy_syntax_if(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_1[] = { "person", "name" } ;
+		static const data_ptr placeholder_2 = make_data("{$person.name}") ;
+		static const std::string path_3[] = { "\"Bob\"" } ;
+		data_ptr lhs_4 = operand(path_1, 2, "person.name", placeholder_2, data, MISSING_KEY_ECHO) ;
+		data_ptr rhs_4 = operand(path_3, 1, "\"Bob\"", data_ptr(), data, MISSING_KEY_ECHO) ;
+		if (lhs_4->getvalue() == rhs_4->getvalue())
+		{
+			context.write(stream, "Full name: Robert", 17) ;
+		}
+	}
+}
+
+void render_legacy_syntax_if(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_syntax_if(stream, data, context) ;
+}
+
+void render_legacy_syntax_dotted(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	{
+		static const std::string path_2[] = { "person", "friends" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 2, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["friend"] = list_1->getitem(i_1) ;
+				{
+					static const std::string path_3[] = { "loop", "index" } ;
+					data_ptr value ;
+					if (find_val(path_3, 2, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$loop.index}", 13) ;
+					}
+				}
+				context.write(stream, ". ", 2) ;
+				{
+					static const std::string path_4[] = { "friend", "name" } ;
+					data_ptr value ;
+					if (find_val(path_4, 2, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$friend.name}", 14) ;
+					}
+				}
+				context.write(stream, " ", 1) ;
+			}
+		}
+	}
+}
+
+void render_legacy_syntax_dotted(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_syntax_dotted(stream, data, context) ;
+}
+
+void render_legacy_okinawa(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "I heart ", 8) ;
+	{
+		static const std::string path_1[] = { "place" } ;
+		data_ptr value ;
+		if (find_val(path_1, 1, data, value))
+		{
+			context.write(stream, value->getvalue()) ;
+		}
+		else
+		{
+			context.write(stream, "{$place}", 8) ;
+		}
+	}
+	context.write(stream, "!", 1) ;
+}
+
+void render_legacy_okinawa(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_okinawa(stream, data, context) ;
+}
+
+void render_legacy_ul(std::ostream &stream, cpptempl::data_map &data, cpptempl::RenderContext &context)
+{
+	using namespace cpptempl ;
+	context.write(stream, "<h3>Locations</h3><ul>", 22) ;
+	{
+		static const std::string path_2[] = { "places" } ;
+		data_ptr list_1 ;
+		if (find_val(path_2, 1, data, list_1))
+		{
+			const size_t count_1 = list_1->getsize() ;
+			for (size_t i_1 = 0 ; i_1 < count_1 ; ++i_1)
+			{
+				context.iteration() ;
+				set_loop(data, i_1) ;
+				data["place"] = list_1->getitem(i_1) ;
+				context.write(stream, "<li>", 4) ;
+				{
+					static const std::string path_3[] = { "place" } ;
+					data_ptr value ;
+					if (find_val(path_3, 1, data, value))
+					{
+						context.write(stream, value->getvalue()) ;
+					}
+					else
+					{
+						context.write(stream, "{$place}", 8) ;
+					}
+				}
+				context.write(stream, "</li>", 5) ;
+			}
+		}
+	}
+	context.write(stream, "</ul>", 5) ;
+}
+
+void render_legacy_ul(std::ostream &stream, cpptempl::data_map &data)
+{
+	cpptempl::RenderContext context ;
+	render_legacy_ul(stream, data, context) ;
+}
+
+#endif
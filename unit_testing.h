@@ -13,7 +13,7 @@
 
 inline std::string wide2utf8(const std::wstring& text) {
 #ifndef _MSC_VER
-	return boost::locale::conv::to_utf<wchar_t>(text, "UTF-8");
+	return boost::locale::conv::from_utf(text, "UTF-8");
 #else
 	const size_t len_needed = ::WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (UINT)(text.length()) , NULL, 0, NULL, NULL) ;
 	boost::scoped_array<char> buff(new char[len_needed+1]) ;